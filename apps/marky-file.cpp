@@ -18,9 +18,16 @@
 
 #include <getopt.h>
 #include <string.h>
+#include <unistd.h>//access()
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include <marky/config.h>
 #include <marky/build-config.h>
@@ -30,21 +37,31 @@
 #ifdef BUILD_BACKEND_SQLITE
 #include <marky/backend-cache.h>
 #include <marky/backend-sqlite.h>
+#include <marky/backend-sqlite-async.h>
 #endif
 
 namespace {
-    enum CMD { CMD_UNKNOWN, CMD_IMPORT, CMD_EXPORT, CMD_PRINT, CMD_HELP };
+    enum CMD { CMD_UNKNOWN, CMD_IMPORT, CMD_EXPORT, CMD_SNAPSHOT, CMD_COMPACT, CMD_PRINT, CMD_MERGE, CMD_HELP };
     CMD run_cmd = CMD_UNKNOWN;
 
     std::ifstream file_in;
     std::ofstream file_out;
     std::string db_path("marky.db");
+    std::string model_path;
+    std::string merge_path;
+    std::string snapshot_path;
     marky::words_t search;
 
     size_t count = 1, max_chars = 1000, max_words = 100;
     size_t look_size = 1;
     uint8_t score_weight = 128;
     size_t score_decrement = 0;
+    size_t max_memory_mb = 0;
+    size_t jobs = 1;
+#ifdef BUILD_BACKEND_SQLITE
+    marky::Backend_SQLite::options_t sqlite_options;
+    bool async_writes = false;
+#endif
 }
 
 #define IS_STDIN(file) (strlen(file) == 1 && file[0] == '-')
@@ -62,15 +79,28 @@ static void syntax(char* appname) {
 #ifdef BUILD_BACKEND_SQLITE
     PRINT_HELP("  -i/--import <file>  Adds data into --db-file from <file>, or '-' for stdin.");
     PRINT_HELP("  -e/--export         Produces -n chains from previously imported --db-file.");
+    PRINT_HELP("  --snapshot <file>   Copies --db-file to <file>, eg for a backup, without");
+    PRINT_HELP("                      stopping anything which is importing into it.");
+    PRINT_HELP("  --compact           Rebuilds --db-file without its unused space. Needs the db");
+    PRINT_HELP("                      to itself.");
 #endif
     PRINT_HELP("  -p/--print <file>   Produces -n chains from <file>, or '-' for stdin.");
+    PRINT_HELP("  --merge <file>      Adds the model in <file> into --model-file, eg to combine");
+    PRINT_HELP("                      models built on separate machines.");
     PRINT_HELP("  -h/--help           This help text.");
     PRINT_HELP("");
     PRINT_HELP("File Options:");
 #ifdef BUILD_BACKEND_SQLITE
-    PRINT_HELP("  -d/--db-file <file>  The marky db to access. [default=%s]", db_path.c_str());
+    PRINT_HELP("  -d/--db-file <file>     The marky db to access. [default=%s]", db_path.c_str());
 #endif
-    PRINT_HELP("  -l/--log <file>      Append any output to <file> instead of stdout.");
+    PRINT_HELP("  -m/--model-file <file>  With --print: Load the model from <file> instead of reading");
+    PRINT_HELP("                          input, or save the model to <file> if it doesn't exist yet.");
+    PRINT_HELP("  -l/--log <file>         Append any output to <file> instead of stdout.");
+    PRINT_HELP("  --max-memory <MB>       With --print: Evict rarely seen links to keep the model");
+    PRINT_HELP("                          within roughly <MB> megabytes, 0=unlimited. [default=%lu]", max_memory_mb);
+    PRINT_HELP("  -j/--jobs <n>           With --import/--print: Split the input across <n> threads,");
+    PRINT_HELP("                          each building a partial model, then merge the models.");
+    PRINT_HELP("                          The input is handed out in batches of lines. [default=%lu]", jobs);
     PRINT_HELP("");
     PRINT_HELP("Output Options:");
     PRINT_HELP("  -n/--count <n>     The number of chains to produce. [default=%d]", count);
@@ -86,6 +116,19 @@ static void syntax(char* appname) {
     PRINT_HELP("  --score-decrement <n>   How frequently to decrease link scores, in number of links.");
     PRINT_HELP("                          High=slow, low=quick, 0=none. [default=%lu]", score_decrement);
     PRINT_HELP("");
+#ifdef BUILD_BACKEND_SQLITE
+    PRINT_HELP("SQLite Settings (for --db-file, 0=SQLite's default):");
+    PRINT_HELP("  --adjacency-lists       Also store each context's links in one row, for quicker");
+    PRINT_HELP("                          lookups but slower writes. Kept from then on.");
+    PRINT_HELP("  --page-size <bytes>     The page size of a new db, a power of 2 within 512-65536.");
+    PRINT_HELP("  --cache-size <KiB>      The page cache size.");
+    PRINT_HELP("  --mmap-size <MB>        How much of the db to read through mmap().");
+    PRINT_HELP("  --temp-store <where>    Where to keep temporary data: 'file' or 'memory'.");
+    PRINT_HELP("  --prune-chunk <n>       Prune <n> snippets per transaction, scoring them outside SQL.");
+    PRINT_HELP("  --async-writes          When importing, write to the db on a background thread");
+    PRINT_HELP("                          while further lines are read. Not with -j/--jobs.");
+    PRINT_HELP("");
+#endif
 }
 
 static bool parse_config(int argc, char* argv[]) {
@@ -97,16 +140,23 @@ static bool parse_config(int argc, char* argv[]) {
     while (1) {
         static struct option long_options[] = {
 #ifdef BUILD_BACKEND_SQLITE
+            {"import", required_argument, NULL, 'i'},
             {"input", required_argument, NULL, 'i'},
             {"export", no_argument, NULL, 'e'},
+            {"snapshot", required_argument, NULL, 'B'},
+            {"compact", no_argument, NULL, 'V'},
 #endif
             {"print", required_argument, NULL, 'p'},
+            {"merge", required_argument, NULL, 'g'},
             {"help", no_argument, NULL, 'h'},
 
 #ifdef BUILD_BACKEND_SQLITE
             {"db-file", required_argument, NULL, 'd'},
 #endif
+            {"model-file", required_argument, NULL, 'm'},
             {"log", required_argument, NULL, 'l'},
+            {"max-memory", required_argument, NULL, 'M'},
+            {"jobs", required_argument, NULL, 'j'},
 
             {"count", required_argument, NULL, 'n'},
             {"search", required_argument, NULL, 's'},
@@ -117,11 +167,21 @@ static bool parse_config(int argc, char* argv[]) {
             {"score-weight", required_argument, NULL, 'y'},
             {"score-decrement", required_argument, NULL, 'z'},
 
+#ifdef BUILD_BACKEND_SQLITE
+            {"adjacency-lists", no_argument, NULL, 'A'},
+            {"page-size", required_argument, NULL, 'P'},
+            {"cache-size", required_argument, NULL, 'C'},
+            {"mmap-size", required_argument, NULL, 'S'},
+            {"temp-store", required_argument, NULL, 'T'},
+            {"prune-chunk", required_argument, NULL, 'K'},
+            {"async-writes", no_argument, NULL, 'W'},
+#endif
+
             {0,0,0,0}
         };
 
         int option_index = 0;
-        c = getopt_long(argc, argv, "i:ep:hd:l:n:s:w:",
+        c = getopt_long(argc, argv, "i:ep:hd:m:l:j:n:s:w:",
                 long_options, &option_index);
         if (c == -1) {//unknown arg (doesnt match -x/--x format)
             if (optind >= argc) {
@@ -149,6 +209,15 @@ static bool parse_config(int argc, char* argv[]) {
         case 'e':
             run_cmd = CMD_EXPORT;
             break;
+#ifdef BUILD_BACKEND_SQLITE
+        case 'B':
+            run_cmd = CMD_SNAPSHOT;
+            snapshot_path = optarg;
+            break;
+        case 'V':
+            run_cmd = CMD_COMPACT;
+            break;
+#endif
         case 'p':
             run_cmd = CMD_PRINT;
             if (!IS_STDIN(optarg)) {
@@ -161,6 +230,10 @@ static bool parse_config(int argc, char* argv[]) {
                 }
             }
             break;
+        case 'g':
+            run_cmd = CMD_MERGE;
+            merge_path = optarg;
+            break;
         case 'h':
             run_cmd = CMD_HELP;
             break;
@@ -169,6 +242,31 @@ static bool parse_config(int argc, char* argv[]) {
         case 'd':
             db_path = optarg;
             break;
+        case 'm':
+            model_path = optarg;
+            break;
+        case 'M':
+            {
+                char* err = NULL;
+                long int tmp = strtol(optarg, &err, 10);
+                if (*err != 0 || tmp < 0) {
+                    ERROR("Invalid argument: --max-memory must be a 0+ integer: %s", optarg);
+                    return false;
+                }
+                max_memory_mb = (size_t)tmp;
+            }
+            break;
+        case 'j':
+            {
+                char* err = NULL;
+                long int tmp = strtol(optarg, &err, 10);
+                if (*err != 0 || tmp <= 0) {
+                    ERROR("Invalid argument: -j/--jobs must be a positive integer: %s", optarg);
+                    return false;
+                }
+                jobs = (size_t)tmp;
+            }
+            break;
         case 'l':
             file_out.exceptions(std::ofstream::failbit | std::ofstream::badbit);
             try {
@@ -259,19 +357,89 @@ static bool parse_config(int argc, char* argv[]) {
                 score_decrement = (size_t)tmp;
             }
             break;
+
+#ifdef BUILD_BACKEND_SQLITE
+        case 'A':
+            sqlite_options.adjacency_lists = true;
+            break;
+        case 'P':
+            {
+                char* err = NULL;
+                long int tmp = strtol(optarg, &err, 10);
+                if (*err != 0 || (tmp != 0 && (tmp < 512 || tmp > 65536 || (tmp & (tmp - 1)) != 0))) {
+                    ERROR("Invalid argument: --page-size must be a power of 2 within 512-65536: %s", optarg);
+                    return false;
+                }
+                sqlite_options.page_size = (int)tmp;
+            }
+            break;
+        case 'C':
+            {
+                char* err = NULL;
+                long int tmp = strtol(optarg, &err, 10);
+                if (*err != 0 || tmp < 0) {
+                    ERROR("Invalid argument: --cache-size must be a 0+ integer: %s", optarg);
+                    return false;
+                }
+                sqlite_options.cache_size = -tmp;/* negative: in KiB */
+            }
+            break;
+        case 'S':
+            {
+                char* err = NULL;
+                long int tmp = strtol(optarg, &err, 10);
+                if (*err != 0 || tmp < 0) {
+                    ERROR("Invalid argument: --mmap-size must be a 0+ integer: %s", optarg);
+                    return false;
+                }
+                sqlite_options.mmap_size = (int64_t)tmp * 1024 * 1024;
+            }
+            break;
+        case 'T':
+            if (strcmp(optarg, "file") == 0) {
+                sqlite_options.temp_store = marky::Backend_SQLite::TEMP_STORE_FILE;
+            } else if (strcmp(optarg, "memory") == 0) {
+                sqlite_options.temp_store = marky::Backend_SQLite::TEMP_STORE_MEMORY;
+            } else {
+                ERROR("Invalid argument: --temp-store must be 'file' or 'memory': %s", optarg);
+                return false;
+            }
+            break;
+        case 'K':
+            {
+                char* err = NULL;
+                long int tmp = strtol(optarg, &err, 10);
+                if (*err != 0 || tmp < 0) {
+                    ERROR("Invalid argument: --prune-chunk must be a 0+ integer: %s", optarg);
+                    return false;
+                }
+                sqlite_options.prune_chunk_size = (size_t)tmp;
+            }
+            break;
+        case 'W':
+            async_writes = true;
+            break;
+#endif
         default:
             syntax(argv[0]);
             return false;
         }
     }
 
+#ifdef BUILD_BACKEND_SQLITE
+    if (async_writes && jobs > 1) {
+        ERROR("Invalid argument: --async-writes can't be combined with -j/--jobs");
+        return false;
+    }
+#endif
+
     return true;
 }
 
-static void read_file(std::istream& in, marky::Marky& out, size_t prunefreq) {
+/* Reads the words of the next non-empty line from 'in' into 'words'.
+ * Returns false once there are no more lines. */
+static bool read_line(std::istream& in, marky::words_t& words) {
     std::string line_s;
-    marky::words_t insertme;
-    size_t count = 0;
     while (in.good()) {
         try {
             std::getline(in, line_s);
@@ -284,15 +452,22 @@ static void read_file(std::istream& in, marky::Marky& out, size_t prunefreq) {
         }
         std::istringstream iss(line_s);
 
-        /* for each word in line_s, append to insertme */
+        /* for each word in line_s, append to words */
         do {
-            insertme.push_back(marky::word_t());
-        } while (iss >> insertme.back());
-        insertme.pop_back();/* remove the empty word we just added */
-        if (insertme.empty()) {
-            continue;
+            words.push_back(marky::word_t());
+        } while (iss >> words.back());
+        words.pop_back();/* remove the empty word we just added */
+        if (!words.empty()) {
+            return true;
         }
+    }
+    return false;
+}
 
+static void read_file(std::istream& in, marky::Marky& out, size_t prunefreq) {
+    marky::words_t insertme;
+    size_t count = 0;
+    while (read_line(in, insertme)) {
         /* send insertme to marky */
         if (!out.insert(insertme)) {
             break;
@@ -309,6 +484,149 @@ static void read_file(std::istream& in, marky::Marky& out, size_t prunefreq) {
     }
 }
 
+namespace {
+    /* A run of consecutive lines for one job of read_file_parallel(). */
+    struct batch_t {
+        size_t first;/* the line number of the first line */
+        std::vector<marky::words_t> lines;
+    };
+
+    /* The batches waiting for one job of read_file_parallel(). */
+    struct job_queue_t {
+        job_queue_t() : done(false), ok(true) { }
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::deque<batch_t> batches;
+        bool done;/* no more batches are coming */
+        bool ok;/* set by the job when it stops: whether all its lines went in */
+    };
+}
+
+/* Reads 'in' in batches of lines, handing the batches out in turn to 'jobs'
+ * threads which each build a private Backend_Map from theirs, with no locking
+ * between them. Only a few batches per thread are held at a time, so the
+ * input is never read into memory all at once. Once the input is used up,
+ * the partial models are merged into 'out'. Each partial model gets an even
+ * share of the memory limit of 'out', if any.
+ *
+ * Each batch starts its line count at the batch's position in the input, so
+ * lines are counted as if they'd been read in one pass starting from 'start'.
+ * Returns the state following the last line in 'end', or false if any of the
+ * jobs failed, in which case nothing is merged into 'out'. */
+static bool read_file_parallel(std::istream& in, size_t jobs,
+        marky::selector_t selector, marky::scorer_t scorer, size_t prunefreq,
+        const marky::State& start, marky::Backend_Map& out, marky::State& end) {
+    static const size_t BATCH_LINES = 10000;
+    /* batches which may wait for each job, beyond the one it's working on */
+    static const size_t QUEUED_BATCHES = 2;
+
+    const size_t job_memory = out.memory_limit() / jobs;
+    std::vector<std::shared_ptr<marky::Backend_Map> > partials;
+    std::vector<std::unique_ptr<job_queue_t> > queues;
+    std::vector<std::thread> threads;
+    for (size_t job = 0; job < jobs; ++job) {
+        partials.push_back(std::shared_ptr<marky::Backend_Map>(
+                        new marky::Backend_Map(job_memory)));
+        queues.push_back(std::unique_ptr<job_queue_t>(new job_queue_t));
+        threads.push_back(std::thread([&start, prunefreq, selector, scorer](
+                                marky::backend_t backend, job_queue_t* queue) {
+                    size_t count = 0;
+                    bool ok = true;
+                    for (;;) {
+                        batch_t batch;
+                        {
+                            std::unique_lock<std::mutex> lock(queue->mutex);
+                            while (queue->batches.empty() && !queue->done) {
+                                queue->cond.wait(lock);
+                            }
+                            if (queue->batches.empty()) {
+                                queue->ok = ok;
+                                return;
+                            }
+                            batch.first = queue->batches.front().first;
+                            batch.lines.swap(queue->batches.front().lines);
+                            queue->batches.pop_front();
+                        }
+                        queue->cond.notify_all();/* room for the reader */
+                        if (!ok) {
+                            continue;/* keep the reader from waiting on us */
+                        }
+
+                        /* picked up by the Marky as its starting state */
+                        backend->store_state(marky::State(start.time,
+                                        start.count + batch.first), scorer);
+                        marky::Marky marky(backend, selector, scorer, look_size);
+                        for (size_t i = 0; ok && i < batch.lines.size(); ++i) {
+                            ok = marky.insert(batch.lines[i]);
+                            if (ok && ++count == prunefreq) {
+                                count = 0;
+                                ok = marky.prune_backend();
+                            }
+                        }
+                    }
+                }, partials.back(), queues.back().get()));
+    }
+
+    /* each job gets every 'jobs'th batch, so its lines are still in order */
+    size_t line_count = 0;
+    batch_t batch;
+    batch.first = 0;
+    for (size_t job = 0; ; job = (job + 1) % jobs) {
+        bool more = true;
+        while (batch.lines.size() < BATCH_LINES) {
+            batch.lines.push_back(marky::words_t());
+            if (!read_line(in, batch.lines.back())) {
+                batch.lines.pop_back();/* remove the empty line we just added */
+                more = false;
+                break;
+            }
+        }
+        if (batch.lines.empty()) {
+            break;
+        }
+        line_count += batch.lines.size();
+        job_queue_t& queue = *queues[job];
+        {
+            std::unique_lock<std::mutex> lock(queue.mutex);
+            while (queue.batches.size() >= QUEUED_BATCHES) {
+                queue.cond.wait(lock);
+            }
+            queue.batches.push_back(batch_t());
+            queue.batches.back().first = batch.first;
+            queue.batches.back().lines.swap(batch.lines);
+        }
+        queue.cond.notify_all();
+        batch.first = line_count;
+        if (!more) {
+            break;
+        }
+    }
+
+    for (size_t job = 0; job < jobs; ++job) {
+        {
+            std::lock_guard<std::mutex> lock(queues[job]->mutex);
+            queues[job]->done = true;
+        }
+        queues[job]->cond.notify_all();
+    }
+    for (size_t job = 0; job < jobs; ++job) {
+        threads[job].join();
+    }
+    for (size_t job = 0; job < jobs; ++job) {
+        if (!queues[job]->ok) {
+            ERROR("Job %lu of %lu failed to add its lines", job + 1, jobs);
+            return false;
+        }
+    }
+    out.store_state(start, scorer);
+    for (size_t job = 0; job < jobs; ++job) {
+        out.merge(*partials[job], scorer);
+        partials[job].reset();
+    }
+    end = out.create_state();
+    return true;
+}
+
 static void print_random(marky::Marky& in, std::ostream& out,
         size_t count, size_t max_words, size_t max_chars,
         const marky::words_t& search) {
@@ -361,20 +679,49 @@ int main(int argc, char* argv[]) {
 #ifdef BUILD_BACKEND_SQLITE
     case CMD_IMPORT:
         {
-            marky::cacheable_t sqlite =
-                marky::Backend_SQLite::create_cacheable(db_path);
+            /* bulk load if the db is empty */
+            marky::Backend_SQLite::options_t options = sqlite_options;
+            options.bulk_load = true;
+            std::shared_ptr<marky::Backend_SQLiteAsync> async;
+            marky::cacheable_t sqlite;
+            if (async_writes) {
+                async = marky::Backend_SQLiteAsync::create(db_path, 4, options);
+                sqlite = async;
+            } else {
+                sqlite = marky::Backend_SQLite::create_cacheable(db_path, options);
+            }
             if (!sqlite) {
                 return EXIT_FAILURE;
             }
-            marky::backend_t backend(new marky::Backend_Cache(sqlite));
-            marky::Marky out(backend, selector, scorer, look_size);
-            read_file(fin, out, score_decrement);
+            if (jobs > 1) {
+                marky::Backend_Map merged;
+                marky::State end(0, 0);
+                /* the db's existing snippets are pruned as of the new lines too */
+                if (!read_file_parallel(fin, jobs, selector, scorer, score_decrement,
+                                sqlite->create_state(), merged, end) ||
+                        !merged.prune(end, scorer) ||
+                        !merged.merge_into(*sqlite, end, scorer) ||
+                        !sqlite->prune(end, scorer) ||
+                        !sqlite->store_state(end, scorer)) {
+                    return EXIT_FAILURE;
+                }
+                return EXIT_SUCCESS;
+            }
+            {
+                marky::backend_t backend(new marky::Backend_Cache(sqlite));
+                marky::Marky out(backend, selector, scorer, look_size);
+                read_file(fin, out, score_decrement);
+            }
+            /* wait for the last of the queued writes */
+            if (async && !async->sync()) {
+                return EXIT_FAILURE;
+            }
         }
         return EXIT_SUCCESS;
     case CMD_EXPORT:
         {
             marky::cacheable_t sqlite =
-                marky::Backend_SQLite::create_cacheable(db_path);
+                marky::Backend_SQLite::create_cacheable(db_path, sqlite_options);
             if (!sqlite) {
                 return EXIT_FAILURE;
             }
@@ -383,13 +730,83 @@ int main(int argc, char* argv[]) {
             print_random(in, fout, count, max_words, max_chars, search);
         }
         return EXIT_SUCCESS;
+    case CMD_SNAPSHOT:
+        if (access(db_path.c_str(), F_OK) != 0) {
+            ERROR("%s: --db-file %s doesn't exist", argv[0], db_path.c_str());
+            return EXIT_FAILURE;
+        }
+        if (!marky::Backend_SQLite::snapshot_file(db_path, snapshot_path)) {
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    case CMD_COMPACT:
+        {
+            if (access(db_path.c_str(), F_OK) != 0) {
+                ERROR("%s: --db-file %s doesn't exist", argv[0], db_path.c_str());
+                return EXIT_FAILURE;
+            }
+            std::shared_ptr<marky::Backend_SQLite> sqlite =
+                std::dynamic_pointer_cast<marky::Backend_SQLite>(
+                        marky::Backend_SQLite::create_backend(db_path, sqlite_options));
+            if (!sqlite || !sqlite->compact()) {
+                return EXIT_FAILURE;
+            }
+        }
+        return EXIT_SUCCESS;
 #endif
     case CMD_PRINT:
         {
-            marky::backend_t backend(new marky::Backend_Map);
-            marky::Marky marky(backend, selector, scorer, look_size);
-            read_file(fin, marky, score_decrement);
-            print_random(marky, fout, count, max_words, max_chars, search);
+            std::shared_ptr<marky::Backend_Map> backend(
+                    new marky::Backend_Map(max_memory_mb * 1024 * 1024));
+            bool loaded = false;
+            if (!model_path.empty() && access(model_path.c_str(), F_OK) == 0) {
+                if (!backend->load(model_path, scorer)) {
+                    return EXIT_FAILURE;
+                }
+                loaded = true;
+            }
+            if (!loaded && jobs > 1) {
+                marky::State end(0, 0);
+                if (!read_file_parallel(fin, jobs, selector, scorer, score_decrement,
+                                backend->create_state(), *backend, end)) {
+                    return EXIT_FAILURE;
+                }
+                backend->prune(end, scorer);
+                backend->store_state(end, scorer);
+                loaded = true;/* nothing left to read */
+                if (!model_path.empty() && !backend->save(model_path)) {
+                    return EXIT_FAILURE;
+                }
+            }
+            {
+                marky::Marky marky(backend, selector, scorer, look_size);
+                if (!loaded) {
+                    read_file(fin, marky, score_decrement);
+                }
+                print_random(marky, fout, count, max_words, max_chars, search);
+            }/* marky passes its final state to the backend on destruction */
+            if (!loaded && !model_path.empty() && !backend->save(model_path)) {
+                return EXIT_FAILURE;
+            }
+        }
+        return EXIT_SUCCESS;
+    case CMD_MERGE:
+        {
+            if (model_path.empty()) {
+                ERROR("%s: --merge requires a --model-file to merge into", argv[0]);
+                return EXIT_FAILURE;
+            }
+            marky::Backend_Map backend, other;
+            if (access(model_path.c_str(), F_OK) == 0 && !backend.load(model_path, scorer)) {
+                return EXIT_FAILURE;
+            }
+            if (!other.load(merge_path, scorer)) {
+                return EXIT_FAILURE;
+            }
+            backend.merge(other, scorer);
+            if (!backend.save(model_path)) {
+                return EXIT_FAILURE;
+            }
         }
         return EXIT_SUCCESS;
     case CMD_HELP:
@@ -433,3 +433,23 @@ bool marky::Backend_Cache::prune(const State& state, scorer_t scorer) {
 
     return wrapme->prune(state, scorer);
 }
+
+bool marky::Backend_Cache::visit_snippets(snippet_visitor_t visitor) {
+    /* wrapme's snippets, except for those which we've changed but not yet
+       flushed. then our changed snippets. */
+    bool stopped = false;
+    if (!wrapme->visit_snippets([this, &visitor, &stopped](const Snippet& snippet) {
+                if (changed_words.find(snippet.words) != changed_words.end()) {
+                    return true;
+                }
+                stopped = !visitor(snippet);
+                return !stopped;
+            })) {
+        return false;
+    }
+    for (window_to_snippet_t::const_iterator iter = changed_words.begin();
+         !stopped && iter != changed_words.end(); ++iter) {
+        stopped = !visitor(*iter->second);
+    }
+    return true;
+}
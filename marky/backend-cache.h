@@ -45,6 +45,8 @@ namespace marky {
 
         bool prune(const State& state, scorer_t scorer);
 
+        bool visit_snippets(snippet_visitor_t visitor);
+
     private:
         typedef std::unordered_map<words_t, snippets_ptr_t> words_to_snippets_t;
         typedef std::unordered_map<words_t, snippet_t> window_to_snippet_t;
@@ -0,0 +1,577 @@
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "backend-frozen.h"
+#include "config.h"
+#include "rand-util.h"
+
+/*
+  compile() file layout. Everything is in native byte order, and each section
+  starts on an 8-byte boundary so that it may be read in place from the
+  mapping:
+
+  header       : frozen_file_header_t
+  word offsets : uint64_t[word_count + 1], where word N is pool[off[N], off[N+1])
+  word pool    : char[pool_size], all distinct words sorted bytewise, so that a
+                 word's id may be found with a binary search
+  then for each table (nexts, then prevs):
+    context offsets   : uint64_t[context_count + 1] into context ids
+    context ids       : uint32_t[context_id_count], the word ids of each
+                        context, with contexts sorted by their id sequences
+    candidate offsets : uint64_t[context_count + 1] into candidates
+    candidates        : candidate_t[candidate_count]
+
+  A nexts context is a snippet's words except the last, and its candidate is
+  the last word. A prevs context is a snippet's words except the first, and
+  its candidate is the first word.
+*/
+#define FROZEN_FILE_MAGIC "MARKYFRZ"
+#define FROZEN_FILE_VERSION 1
+#define FROZEN_FILE_BYTE_ORDER 0x01020304
+
+#define TABLE_NEXTS 0
+#define TABLE_PREVS 1
+#define TABLE_COUNT 2
+
+using namespace marky::mapped;
+
+struct marky::Backend_Frozen::candidate_t {
+    uint32_t word;
+    uint32_t pad;
+    uint64_t score;
+    int64_t time;
+    uint64_t count;
+};
+
+namespace {
+    struct frozen_file_table_t {
+        uint64_t context_count;
+        uint64_t context_id_count;
+        uint64_t candidate_count;
+    };
+
+    struct frozen_file_header_t {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        int64_t state_time;
+        uint64_t state_count;
+        uint64_t word_count;
+        uint64_t pool_size;
+        frozen_file_table_t tables[TABLE_COUNT];
+    };
+
+    /* a snippet collected by compile(), whose words are in a shared id list */
+    struct compiled_snippet_t {
+        uint64_t first_id;
+        uint64_t id_count;
+        uint64_t score;
+        int64_t time;
+        uint64_t count;
+    };
+
+    /* a snippet's context and candidate for one of the tables */
+    struct compiled_entry_t {
+        const uint32_t* context;
+        uint64_t context_size;
+        uint32_t word;
+        const compiled_snippet_t* snippet;
+
+        bool operator<(const compiled_entry_t& other) const {
+            if (std::lexicographical_compare(context, context + context_size,
+                            other.context, other.context + other.context_size)) {
+                return true;
+            }
+            if (std::lexicographical_compare(other.context, other.context + other.context_size,
+                            context, context + context_size)) {
+                return false;
+            }
+            return word < other.word;
+        }
+        bool same_context(const compiled_entry_t& other) const {
+            return context_size == other.context_size &&
+                std::equal(context, context + context_size, other.context);
+        }
+    };
+
+    template <typename T>
+    bool write_section(FILE* file, const std::vector<T>& section) {
+        return write_all(file, section.data(), section.size() * sizeof(T)) &&
+            write_padding(file, section.size() * sizeof(T));
+    }
+
+    /* compares 'word' against the 'size' bytes at 'pool_word', bytewise */
+    int compare_word(const char* pool_word, size_t size, const marky::word_t& word) {
+        int ret = memcmp(pool_word, word.data(), std::min(size, word.size()));
+        if (ret != 0) {
+            return ret;
+        }
+        return (size < word.size()) ? -1 : ((size > word.size()) ? 1 : 0);
+    }
+
+    /* checks that 'offsets' counts upward from zero to 'total' */
+    bool valid_offsets(const uint64_t* offsets, uint64_t count, uint64_t total) {
+        if (offsets[0] != 0 || offsets[count] != total) {
+            return false;
+        }
+        for (uint64_t i = 0; i < count; ++i) {
+            if (offsets[i] > offsets[i + 1]) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+bool marky::Backend_Frozen::compile(IBackend& source, const State& state,
+        const std::string& path) {
+    /* gather all snippets, assigning temporary ids to words as they're seen */
+    typedef std::unordered_map<word_t, uint32_t> word_to_id_t;
+    word_to_id_t word_ids;
+    std::vector<const word_t*> id_words;
+    std::vector<uint32_t> ids;
+    std::vector<compiled_snippet_t> snippets;
+    bool too_many_words = false;
+    if (!source.visit_snippets([&](const Snippet& snippet) {
+                if (snippet.words.empty()) {
+                    return true;
+                }
+                compiled_snippet_t compiled;
+                compiled.first_id = ids.size();
+                compiled.id_count = snippet.words.size();
+                compiled.score = snippet.cur_score();
+                compiled.time = snippet.cur_state().time;
+                compiled.count = snippet.cur_state().count;
+                for (words_t::const_iterator iter = snippet.words.begin();
+                     iter != snippet.words.end(); ++iter) {
+                    std::pair<word_to_id_t::iterator, bool> inserted =
+                        word_ids.insert(std::make_pair(*iter, (uint32_t)id_words.size()));
+                    if (inserted.second) {
+                        id_words.push_back(&inserted.first->first);
+                    }
+                    ids.push_back(inserted.first->second);
+                }
+                snippets.push_back(compiled);
+                too_many_words = id_words.size() >= UINT32_MAX;
+                return !too_many_words;
+            })) {
+        ERROR("Unable to retrieve snippets to compile into %s", path.c_str());
+        return false;
+    }
+    if (too_many_words) {
+        ERROR("Too many distinct words to compile: %lu", id_words.size());
+        return false;
+    }
+
+    /* sort the words, then switch all ids over to their sorted positions */
+    std::vector<uint32_t> sorted_ids(id_words.size());
+    for (uint32_t i = 0; i < sorted_ids.size(); ++i) {
+        sorted_ids[i] = i;
+    }
+    std::sort(sorted_ids.begin(), sorted_ids.end(),
+            [&id_words](uint32_t a, uint32_t b) { return *id_words[a] < *id_words[b]; });
+    std::vector<uint32_t> remap(id_words.size());
+    std::vector<uint64_t> word_offsets(1, 0);
+    std::vector<char> word_pool;
+    for (uint32_t i = 0; i < sorted_ids.size(); ++i) {
+        remap[sorted_ids[i]] = i;
+        const word_t& word = *id_words[sorted_ids[i]];
+        word_pool.insert(word_pool.end(), word.begin(), word.end());
+        word_offsets.push_back(word_pool.size());
+    }
+    for (std::vector<uint32_t>::iterator iter = ids.begin(); iter != ids.end(); ++iter) {
+        *iter = remap[*iter];
+    }
+
+    frozen_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FROZEN_FILE_MAGIC, sizeof(header.magic));
+    header.version = FROZEN_FILE_VERSION;
+    header.byte_order = FROZEN_FILE_BYTE_ORDER;
+    header.state_time = state.time;
+    header.state_count = state.count;
+    header.word_count = sorted_ids.size();
+    header.pool_size = word_pool.size();
+
+    /* build each table as a sorted list of (context, candidate) entries,
+       grouped by context */
+    std::vector<uint64_t> context_offsets[TABLE_COUNT], candidate_offsets[TABLE_COUNT];
+    std::vector<uint32_t> context_ids[TABLE_COUNT];
+    std::vector<candidate_t> candidates[TABLE_COUNT];
+    for (int table = 0; table < TABLE_COUNT; ++table) {
+        std::vector<compiled_entry_t> entries;
+        entries.reserve(snippets.size());
+        for (std::vector<compiled_snippet_t>::const_iterator iter = snippets.begin();
+             iter != snippets.end(); ++iter) {
+            compiled_entry_t entry;
+            const uint32_t* words = &ids[iter->first_id];
+            entry.context_size = iter->id_count - 1;
+            if (table == TABLE_NEXTS) {
+                entry.context = words;
+                entry.word = words[iter->id_count - 1];
+            } else {
+                entry.context = words + 1;
+                entry.word = words[0];
+            }
+            entry.snippet = &*iter;
+            entries.push_back(entry);
+        }
+        std::sort(entries.begin(), entries.end());
+
+        context_offsets[table].push_back(0);
+        candidate_offsets[table].push_back(0);
+        candidates[table].reserve(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const compiled_entry_t& entry = entries[i];
+            if (i != 0 && !entry.same_context(entries[i - 1])) {
+                /* close out the previous context */
+                context_offsets[table].push_back(context_ids[table].size());
+                candidate_offsets[table].push_back(candidates[table].size());
+            }
+            if (i == 0 || !entry.same_context(entries[i - 1])) {
+                context_ids[table].insert(context_ids[table].end(),
+                        entry.context, entry.context + entry.context_size);
+            }
+            candidate_t candidate;
+            memset(&candidate, 0, sizeof(candidate));
+            candidate.word = entry.word;
+            candidate.score = entry.snippet->score;
+            candidate.time = entry.snippet->time;
+            candidate.count = entry.snippet->count;
+            candidates[table].push_back(candidate);
+        }
+        if (!entries.empty()) {
+            context_offsets[table].push_back(context_ids[table].size());
+            candidate_offsets[table].push_back(candidates[table].size());
+        }
+
+        header.tables[table].context_count = context_offsets[table].size() - 1;
+        header.tables[table].context_id_count = context_ids[table].size();
+        header.tables[table].candidate_count = candidates[table].size();
+    }
+
+    const std::string tmp_path = path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (file == NULL) {
+        ERROR("Failed to open %s for writing", tmp_path.c_str());
+        return false;
+    }
+    bool ok = write_all(file, &header, sizeof(header)) &&
+        write_padding(file, sizeof(header)) &&
+        write_section(file, word_offsets) &&
+        write_section(file, word_pool);
+    for (int table = 0; ok && table < TABLE_COUNT; ++table) {
+        ok = write_section(file, context_offsets[table]) &&
+            write_section(file, context_ids[table]) &&
+            write_section(file, candidate_offsets[table]) &&
+            write_section(file, candidates[table]);
+    }
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+    return commit(tmp_path, path, ok);
+}
+
+marky::backend_t marky::Backend_Frozen::create_backend(const std::string& path) {
+    Backend_Frozen* backend = new Backend_Frozen();
+    if (!backend->open(path)) {
+        delete backend;
+        return backend_t();
+    }
+    return backend_t(backend);
+}
+
+marky::Backend_Frozen::Backend_Frozen()
+    : file(), word_count(0), word_offsets(NULL), word_pool(NULL), state(0, 0) {
+    memset(&nexts, 0, sizeof(nexts));
+    memset(&prevs, 0, sizeof(prevs));
+}
+
+marky::Backend_Frozen::~Backend_Frozen() { }
+
+bool marky::Backend_Frozen::open(const std::string& path) {
+    if (!file.open(path)) {
+        return false;
+    }
+    const uint64_t file_size = file.size();
+    if (file_size < sizeof(frozen_file_header_t)) {
+        ERROR("%s is too small to be a compiled marky file", path.c_str());
+        return false;
+    }
+    const frozen_file_header_t& header = *(const frozen_file_header_t*)file.data();
+    if (memcmp(header.magic, FROZEN_FILE_MAGIC, sizeof(header.magic)) != 0) {
+        ERROR("%s is not a compiled marky file", path.c_str());
+        return false;
+    }
+    if (header.version != FROZEN_FILE_VERSION) {
+        ERROR("%s has unsupported version %u (expected %u)",
+                path.c_str(), header.version, FROZEN_FILE_VERSION);
+        return false;
+    }
+    if (header.byte_order != FROZEN_FILE_BYTE_ORDER) {
+        ERROR("%s was written on a machine with a different byte order", path.c_str());
+        return false;
+    }
+
+    /* locate each section, making sure it's all within the file. only the
+       offset sections are scanned here, the rest is paged in on demand. */
+    uint64_t pos = align8(sizeof(frozen_file_header_t));
+    const uint64_t word_offsets_pos = pos;
+    if (header.word_count == UINT64_MAX ||
+            !fits(pos, header.word_count + 1, sizeof(uint64_t), file_size)) {
+        ERROR("%s is truncated (word offsets)", path.c_str());
+        return false;
+    }
+    const uint64_t word_pool_pos = pos;
+    if (!fits(pos, header.pool_size, 1, file_size)) {
+        ERROR("%s is truncated (word pool)", path.c_str());
+        return false;
+    }
+    word_count = header.word_count;
+    word_offsets = (const uint64_t*)(file.data() + word_offsets_pos);
+    word_pool = file.data() + word_pool_pos;
+    if (!valid_offsets(word_offsets, word_count, header.pool_size)) {
+        ERROR("%s has corrupt word offsets", path.c_str());
+        return false;
+    }
+
+    table_t* tables[TABLE_COUNT] = { &nexts, &prevs };
+    for (int i = 0; i < TABLE_COUNT; ++i) {
+        const frozen_file_table_t& counts = header.tables[i];
+        table_t& table = *tables[i];
+        table.context_count = counts.context_count;
+
+        const uint64_t context_offsets_pos = pos;
+        if (counts.context_count == UINT64_MAX ||
+                !fits(pos, counts.context_count + 1, sizeof(uint64_t), file_size)) {
+            ERROR("%s is truncated (context offsets)", path.c_str());
+            return false;
+        }
+        const uint64_t context_ids_pos = pos;
+        if (!fits(pos, counts.context_id_count, sizeof(uint32_t), file_size)) {
+            ERROR("%s is truncated (context ids)", path.c_str());
+            return false;
+        }
+        const uint64_t candidate_offsets_pos = pos;
+        if (!fits(pos, counts.context_count + 1, sizeof(uint64_t), file_size)) {
+            ERROR("%s is truncated (candidate offsets)", path.c_str());
+            return false;
+        }
+        const uint64_t candidates_pos = pos;
+        if (!fits(pos, counts.candidate_count, sizeof(candidate_t), file_size)) {
+            ERROR("%s is truncated (candidates)", path.c_str());
+            return false;
+        }
+
+        table.context_offsets = (const uint64_t*)(file.data() + context_offsets_pos);
+        table.context_ids = (const uint32_t*)(file.data() + context_ids_pos);
+        table.candidate_offsets = (const uint64_t*)(file.data() + candidate_offsets_pos);
+        table.candidates = (const candidate_t*)(file.data() + candidates_pos);
+        if (!valid_offsets(table.context_offsets, table.context_count, counts.context_id_count) ||
+                !valid_offsets(table.candidate_offsets, table.context_count, counts.candidate_count)) {
+            ERROR("%s has corrupt context offsets", path.c_str());
+            return false;
+        }
+    }
+
+    state = State(header.state_time, header.state_count);
+    return true;
+}
+
+marky::State marky::Backend_Frozen::create_state() {
+    return state;
+}
+
+bool marky::Backend_Frozen::store_state(const State& /*state*/, scorer_t /*scorer*/) {
+    /* nowhere to store it, and nothing in the file has changed */
+    return true;
+}
+
+bool marky::Backend_Frozen::get_random(const State& /*state*/, scorer_t /*scorer*/, word_t& word) {
+    const uint64_t candidate_count = nexts.candidate_offsets[nexts.context_count];
+    if (candidate_count == 0) {
+        word = IBackend::LINE_END;
+        return true;
+    }
+
+    /* pick a random snippet, then find the context which owns it */
+    const uint64_t candidate = pick_rand(candidate_count);
+    const uint64_t context = std::upper_bound(nexts.candidate_offsets,
+            nexts.candidate_offsets + nexts.context_count + 1, candidate)
+        - nexts.candidate_offsets - 1;
+
+    /* put a little effort into finding a non-end/start word */
+    if (nexts.context_offsets[context] != nexts.context_offsets[context + 1]) {
+        word = get_word(nexts.context_ids[nexts.context_offsets[context]]);
+    } else {
+        word = IBackend::LINE_START;
+    }
+    if (word == IBackend::LINE_START) {
+        word = get_word(nexts.candidates[candidate].word);
+    }
+    return true;
+}
+
+bool marky::Backend_Frozen::get_prev(const State& state, selector_t selector,
+        scorer_t scorer, const words_t& search_words, word_t& prev) {
+    if (!lookup(prevs, false, state, selector, scorer, search_words, prev)) {
+        prev = IBackend::LINE_START;
+    }
+    return true;
+}
+
+bool marky::Backend_Frozen::get_next(const State& state, selector_t selector,
+        scorer_t scorer, const words_t& search_words, word_t& next) {
+    if (!lookup(nexts, true, state, selector, scorer, search_words, next)) {
+        next = IBackend::LINE_END;
+    }
+    return true;
+}
+
+bool marky::Backend_Frozen::update_snippets(const State& /*state*/, scorer_t /*scorer*/,
+        const words_to_counts::map_t& /*line_windows*/) {
+    ERROR("Unable to update snippets: compiled backends are read-only");
+    return false;
+}
+
+bool marky::Backend_Frozen::prune(const State& /*state*/, scorer_t /*scorer*/) {
+    /* nothing can be removed, but zero-scored snippets are still selectable
+       in the same way as an unpruned backend */
+    return true;
+}
+
+bool marky::Backend_Frozen::visit_snippets(snippet_visitor_t visitor) {
+    for (uint64_t context = 0; context < nexts.context_count; ++context) {
+        words_t words;
+        for (uint64_t i = nexts.context_offsets[context];
+             i < nexts.context_offsets[context + 1]; ++i) {
+            words.push_back(get_word(nexts.context_ids[i]));
+        }
+        for (uint64_t i = nexts.candidate_offsets[context];
+             i < nexts.candidate_offsets[context + 1]; ++i) {
+            const candidate_t& candidate = nexts.candidates[i];
+            words.push_back(get_word(candidate.word));
+            if (!visitor(Snippet(words, candidate.time, candidate.count, candidate.score))) {
+                return true;
+            }
+            words.pop_back();
+        }
+    }
+    return true;
+}
+
+marky::word_t marky::Backend_Frozen::get_word(uint32_t id) const {
+    if (id >= word_count) {
+        ERROR("Corrupt word id %u (max %lu)", id, word_count);
+        return word_t();
+    }
+    return word_t(word_pool + word_offsets[id], word_offsets[id + 1] - word_offsets[id]);
+}
+
+uint32_t marky::Backend_Frozen::find_word(const word_t& word) const {
+    uint64_t low = 0, high = word_count;
+    while (low < high) {
+        const uint64_t mid = low + (high - low) / 2;
+        int cmp = compare_word(word_pool + word_offsets[mid],
+                word_offsets[mid + 1] - word_offsets[mid], word);
+        if (cmp == 0) {
+            return mid;
+        } else if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return UINT32_MAX;
+}
+
+bool marky::Backend_Frozen::find_context(const table_t& table, const ids_t& ids,
+        uint64_t& context) const {
+    uint64_t low = 0, high = table.context_count;
+    while (low < high) {
+        const uint64_t mid = low + (high - low) / 2;
+        const uint32_t* mid_begin = table.context_ids + table.context_offsets[mid];
+        const uint32_t* mid_end = table.context_ids + table.context_offsets[mid + 1];
+        if (std::lexicographical_compare(mid_begin, mid_end, ids.begin(), ids.end())) {
+            low = mid + 1;
+        } else if (std::lexicographical_compare(ids.begin(), ids.end(), mid_begin, mid_end)) {
+            high = mid;
+        } else {
+            context = mid;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool marky::Backend_Frozen::select(const table_t& table, uint64_t context,
+        const State& state, selector_t selector, scorer_t scorer, word_t& word) const {
+    /* the selector works with snippets, so give it one-word snippets holding
+       each candidate. only the selected candidate's word is looked up. */
+    typedef std::unordered_map<snippet_t, uint32_t> snippet_to_id_t;
+    snippet_to_id_t snippet_ids;
+    snippet_ptr_set_t snippets;
+    for (uint64_t i = table.candidate_offsets[context];
+         i < table.candidate_offsets[context + 1]; ++i) {
+        const candidate_t& candidate = table.candidates[i];
+        snippet_t snippet(new Snippet(words_t(), candidate.time, candidate.count, candidate.score));
+        snippets.insert(snippet);
+        snippet_ids[snippet] = candidate.word;
+    }
+    snippet_t selected = selector(snippets, scorer, state);
+    if (!selected) {
+        return false;
+    }
+    word = get_word(snippet_ids[selected]);
+    return true;
+}
+
+bool marky::Backend_Frozen::lookup(const table_t& table, bool backoff_front,
+        const State& state, selector_t selector, scorer_t scorer,
+        const words_t& search_words, word_t& word) const {
+    /* unknown words get an id which won't match any context */
+    ids_t ids;
+    ids.reserve(search_words.size());
+    for (words_t::const_iterator iter = search_words.begin();
+         iter != search_words.end(); ++iter) {
+        ids.push_back(find_word(*iter));
+    }
+
+    for (;;) {
+        uint64_t context;
+        if (find_context(table, ids, context)) {
+            return select(table, context, state, selector, scorer, word);
+        }
+        if (ids.size() < 2) {
+            return false;
+        }
+        /* retry with shorter search, dropping the word furthest from the
+           word being looked up */
+        if (backoff_front) {
+            ids.erase(ids.begin());
+        } else {
+            ids.pop_back();
+        }
+    }
+}
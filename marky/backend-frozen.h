@@ -0,0 +1,115 @@
+#ifndef MARKY_BACKEND_FROZEN_H
+#define MARKY_BACKEND_FROZEN_H
+
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "backend.h"
+#include "mapped-file.h"
+
+namespace marky {
+    /* A read-only backend which serves lookups directly out of a memory-mapped
+     * file produced by compile(). Nothing is copied out of the file except
+     * for the candidates of a given lookup, so a large model may be opened
+     * instantly and shared between processes through the page cache.
+     *
+     * Any attempt to update the snippets fails. To modify a frozen model,
+     * copy it into a writable backend via visit_snippets(), then recompile. */
+    class Backend_Frozen : public IBackend {
+    public:
+        /* Writes the full content of 'source', along with 'state', to a
+         * compiled file at 'path'. The file is written to a temporary path and
+         * then renamed into place, so an existing file (including one which is
+         * currently mapped by a Backend_Frozen) is never modified.
+         * Returns false in the event of an error. */
+        static bool compile(IBackend& source, const State& state,
+                const std::string& path);
+
+        /* Returns a backend which maps the compiled file at 'path', or an
+         * empty ptr if there was an error when opening it. */
+        static backend_t create_backend(const std::string& path);
+
+        virtual ~Backend_Frozen();
+
+        State create_state();
+        bool store_state(const State& state, scorer_t scorer);
+
+        bool get_random(const State& state, scorer_t scorer, word_t& word);
+
+        bool get_prev(const State& state, selector_t selector, scorer_t scorer,
+                const words_t& search_words, word_t& prev);
+        bool get_next(const State& state, selector_t selector, scorer_t scorer,
+                const words_t& search_words, word_t& next);
+
+        bool update_snippets(const State& state, scorer_t scorer,
+                const words_to_counts::map_t& line_windows);
+
+        bool prune(const State& state, scorer_t scorer);
+
+        bool visit_snippets(snippet_visitor_t visitor);
+
+    private:
+        Backend_Frozen();
+        bool open(const std::string& path);
+
+        /* on-disk candidate record, defined alongside the file layout */
+        struct candidate_t;
+
+        /* One lookup direction: a sorted table of contexts (word id
+         * sequences), each owning a range of candidate words. */
+        struct table_t {
+            uint64_t context_count;
+            const uint64_t* context_offsets;/* [context_count + 1] into context_ids */
+            const uint32_t* context_ids;
+            const uint64_t* candidate_offsets;/* [context_count + 1] into candidates */
+            const candidate_t* candidates;
+        };
+
+        typedef std::vector<uint32_t> ids_t;
+
+        /* Returns the word for 'id', copied out of the string pool. */
+        word_t get_word(uint32_t id) const;
+        /* Returns the id for 'word', or UINT32_MAX if it's not in the pool. */
+        uint32_t find_word(const word_t& word) const;
+        /* Searches 'table' for a context matching 'ids', returning whether
+         * one was found. */
+        bool find_context(const table_t& table, const ids_t& ids,
+                uint64_t& context) const;
+        /* Passes the candidates of 'context' to 'selector', returning the
+         * word of the selected candidate. */
+        bool select(const table_t& table, uint64_t context, const State& state,
+                selector_t selector, scorer_t scorer, word_t& word) const;
+        bool lookup(const table_t& table, bool backoff_front, const State& state,
+                selector_t selector, scorer_t scorer, const words_t& search_words,
+                word_t& word) const;
+
+        MappedFile file;
+        uint64_t word_count;
+        const uint64_t* word_offsets;/* [word_count + 1] into word_pool */
+        const char* word_pool;
+        table_t nexts;/* prefix words -> next word */
+        table_t prevs;/* suffix words -> previous word */
+        State state;
+    };
+}
+
+#endif
@@ -16,16 +16,23 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
 
+#include <vector>
+
 #include "backend-map.h"
+#include "config.h"
+#include "mapped-file.h"
 #include "rand-util.h"
 
 //#define READ_DEBUG_ENABLED
 //#define WRITE_DEBUG_ENABLED
 
 #if (defined(READ_DEBUG_ENABLED) || defined(WRITE_DEBUG_ENABLED))
-#include "config.h"
 #include <sstream>
 
 static std::string str(const marky::words_t& words) {
@@ -43,41 +50,190 @@ static std::string str(const marky::words_t& words) {
 }
 #endif
 
-marky::Backend_Map::Backend_Map()
-    : prevs(), nexts(), snippets(), random_snippet(snippets.end()) { }
+/*
+  save()/load() file layout. Everything is in native byte order, and each
+  section starts on an 8-byte boundary so that load() can read its arrays
+  straight out of a memory mapping while rebuilding the maps:
+
+  header        : map_file_header_t
+  word offsets  : uint64_t[word_count + 1], where word N is pool[off[N], off[N+1])
+  word pool     : char[pool_size], all distinct words without terminators
+  snippets      : map_file_snippet_t[snippet_count]
+  snippet words : uint32_t[id_count], the word ids referenced by the snippets
+*/
+#define MAP_FILE_MAGIC "MARKYMAP"
+#define MAP_FILE_VERSION 1
+#define MAP_FILE_BYTE_ORDER 0x01020304
+
+using namespace marky::mapped;
+
+namespace {
+    struct map_file_header_t {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        int64_t state_time;
+        uint64_t state_count;
+        uint64_t word_count;
+        uint64_t pool_size;
+        uint64_t snippet_count;
+        uint64_t id_count;
+    };
+
+    struct map_file_snippet_t {
+        uint64_t score;
+        int64_t time;
+        uint64_t count;
+        uint64_t first_id;/* index into the snippet words section */
+        uint64_t id_count;
+    };
+}
+
+/* How many of the least recently seen snippets are compared by score when
+   picking one to evict. */
+#define EVICT_CANDIDATES 8
+
+/* How many weighted picks get_random() makes before settling for a uniform
+   pick, when rejecting picks whose score has decayed since it was stored. */
+#define RANDOM_WEIGHTED_ATTEMPTS 8
+
+/* How many snippets in a forked map's base are checked by each prune(). */
+#define BASE_PRUNE_BATCH 4096
+
+namespace {
+    /* Estimates of the memory used by the standard containers, following
+       their node layouts but ignoring any allocator overhead. */
+
+    size_t word_heap_bytes(const marky::word_t& word) {
+        /* short strings are stored inline */
+        const char* data = word.data();
+        if (data >= (const char*)&word && data < (const char*)(&word + 1)) {
+            return 0;
+        }
+        return word.capacity() + 1;
+    }
+
+    size_t list_node_bytes(size_t value_size) {
+        return 2 * sizeof(void*) + value_size;
+    }
+
+    size_t words_bytes(const marky::words_t& words) {
+        size_t bytes = 0;
+        for (marky::words_t::const_iterator iter = words.begin();
+             iter != words.end(); ++iter) {
+            bytes += list_node_bytes(sizeof(marky::word_t)) + word_heap_bytes(*iter);
+        }
+        return bytes;
+    }
+
+    size_t hash_node_bytes(size_t value_size) {
+        /* next ptr, cached hash, and a bucket ptr at the default load factor */
+        return sizeof(void*) + sizeof(size_t) + value_size + sizeof(void*);
+    }
+
+    /* a shared_ptr's separately allocated control block */
+    const size_t SHARED_PTR_BLOCK_BYTES = 2 * sizeof(void*) + 2 * sizeof(int);
+    /* an entry in each of the expiry wheels */
+    const size_t WHEEL_ENTRIES_BYTES = 2 * (sizeof(uint64_t) + sizeof(std::weak_ptr<marky::Snippet>));
+}
+
+marky::Backend_Map::Backend_Map(size_t memory_limit, bool weighted_random)
+    : prevs(), nexts(), snippets(),
+      random_snippets(), weighted_random(weighted_random), random_weights(),
+      recency(), memory_limit_(memory_limit), memory_usage_(0),
+      count_wheel(), time_wheel(), state(0, 0), has_state(false),
+      base(), hidden(), base_prune_cursor(0) { }
+
+std::shared_ptr<marky::Backend_Map> marky::Backend_Map::fork() {
+    /* move everything into a layer which neither map modifies again */
+    std::shared_ptr<Backend_Map> shared(new Backend_Map(memory_limit_, weighted_random));
+    shared->swap_content(*this);
+    shared->count_wheel.clear();/* never pruned */
+    shared->time_wheel.clear();
+    shared->state = state;
+    shared->has_state = has_state;
+    base = shared;
+    base_prune_cursor = 0;
+
+    std::shared_ptr<Backend_Map> child(new Backend_Map(memory_limit_, weighted_random));
+    child->base = shared;
+    child->state = state;
+    child->has_state = has_state;
+    return child;
+}
 
 marky::State marky::Backend_Map::create_state() {
+    if (has_state) {
+        /* resume from a loaded/stored state */
+        return state;
+    }
     return State(time(NULL), 0);
 }
 
-bool marky::Backend_Map::store_state(const State& /*state*/, scorer_t /*scorer*/) {
-    /* not applicable */
+bool marky::Backend_Map::store_state(const State& state, scorer_t /*scorer*/) {
+    /* only kept in memory, for use by save() */
+    this->state = state;
+    has_state = true;
     return true;
 }
 
-bool marky::Backend_Map::get_random(const State& /*state*/, scorer_t /*scorer*/, word_t& word) {
-    if (prevs.empty()) {
+bool marky::Backend_Map::get_random(const State& state, scorer_t scorer, word_t& word) {
+    bool empty = true;
+    for (const Backend_Map* layer = this; layer != NULL; layer = layer->base.get()) {
+        if (!layer->random_snippets.empty()) {
+            empty = false;
+            break;
+        }
+    }
+    if (empty) {
         word = IBackend::LINE_END;
         return true;
     }
 
-    if (random_snippet == snippets.end()) {
-        /* seek words_iter to a random location in words */
-        unsigned int offset = pick_rand(snippets.size());
-        random_snippet = snippets.begin();
-        for (unsigned int i = 0; i < offset; ++i) {
-            ++random_snippet;
+    const Backend_Map* layer;
+    size_t index;
+    if (weighted_random) {
+        /* picks are weighted by the score as of the snippet's last update.
+           the score may have decayed since then, so accept the pick with
+           a probability of (current score / stored score), and store the
+           decayed score for future picks. */
+        for (int attempt = 0; ; ++attempt) {
+            if (attempt >= RANDOM_WEIGHTED_ATTEMPTS || !pick_weighted(layer, index)) {
+                /* everything's decayed a lot, settle for any snippet */
+                if (!pick_visible(layer, index)) {
+                    word = IBackend::LINE_END;
+                    return true;
+                }
+                break;
+            }
+            const score_t stored = layer->random_weights.get(index);
+            const snippet_t& snippet = layer->random_snippets[index]->second.snippet;
+            score_t cur = snippet->score(scorer, state);
+            if (layer != this) {
+                /* the base isn't updated, reject anything since removed */
+                const snippet_t* visible = find_snippet(snippet->words);
+                if (visible == NULL || visible->get() != snippet.get()) {
+                    cur = 0;
+                }
+            } else if (cur < stored) {
+                random_weights.set(index, cur);
+            }
+            if (pick_rand(stored) < cur) {
+                break;
+            }
         }
+    } else if (!pick_visible(layer, index)) {
+        /* everything in the base has been removed */
+        word = IBackend::LINE_END;
+        return true;
     }
 
     /* put a little effort into finding a non-end/start word */
-    word = random_snippet->second->words.front();
+    const words_t& words = layer->random_snippets[index]->second.snippet->words;
+    word = words.front();
     if (word == IBackend::LINE_START) {
-        word = random_snippet->second->words.back();
+        word = words.back();
     }
-
-    /* increment for a future get_random() call. */
-    ++random_snippet;
     return true;
 }
 
@@ -97,8 +253,8 @@ bool marky::Backend_Map::get_prev(const State& state, selector_t selector,
         }
     }
 #endif
-    words_to_snippets_t::const_iterator iter = prevs.find(search_words);
-    if (iter == prevs.end()) {
+    const snippet_ptr_set_t* found = find_context(&Backend_Map::prevs, search_words);
+    if (found == NULL) {
         if (search_words.size() >= 2) {
             words_t search_words_shortened(search_words);
             search_words_shortened.pop_back();
@@ -114,9 +270,9 @@ bool marky::Backend_Map::get_prev(const State& state, selector_t selector,
             prev = IBackend::LINE_START;
         }
     } else {
-        const words_t& prev_snippet = selector(*iter->second, scorer, state)->words;
+        const words_t& prev_snippet = selector(*found, scorer, state)->words;
 #ifdef READ_DEBUG_ENABLED
-        const snippet_ptr_set_t& snippets = *iter->second;
+        const snippet_ptr_set_t& snippets = *found;
         for (snippet_ptr_set_t::const_iterator siter = snippets.begin();
              siter != snippets.end(); ++siter) {
             DEBUG("  prevs%s = snippet(%s, %lu)", str(search_words).c_str(),
@@ -145,8 +301,8 @@ bool marky::Backend_Map::get_next(const State& state, selector_t selector,
         }
     }
 #endif
-    words_to_snippets_t::const_iterator iter = nexts.find(search_words);
-    if (iter == nexts.end()) {
+    const snippet_ptr_set_t* found = find_context(&Backend_Map::nexts, search_words);
+    if (found == NULL) {
         if (search_words.size() >= 2) {
             words_t search_words_shortened(++search_words.begin(), search_words.end());
 #ifdef READ_DEBUG_ENABLED
@@ -161,9 +317,9 @@ bool marky::Backend_Map::get_next(const State& state, selector_t selector,
             next = IBackend::LINE_END;
         }
     } else {
-        const words_t& next_snippet = selector(*iter->second, scorer, state)->words;
+        const words_t& next_snippet = selector(*found, scorer, state)->words;
 #ifdef READ_DEBUG_ENABLED
-        const snippet_ptr_set_t& snippets = *iter->second;
+        const snippet_ptr_set_t& snippets = *found;
         for (snippet_ptr_set_t::const_iterator siter = snippets.begin();
              siter != snippets.end(); ++siter) {
             DEBUG("  nexts%s = snippet(%s, %lu)", str(search_words).c_str(),
@@ -183,95 +339,311 @@ bool marky::Backend_Map::update_snippets(const State& state, scorer_t scorer,
 #endif
     for (words_to_counts::map_t::const_iterator line_window_iter = line_windows.begin();
          line_window_iter != line_windows.end(); ++line_window_iter) {
-        window_to_snippet_t::iterator cur_snippet_iter = snippets.find(line_window_iter->first);
+        bool copied;
+        window_to_snippet_t::iterator cur_snippet_iter = find_own(line_window_iter->first, copied);
         if (cur_snippet_iter != snippets.end()) {
             /* readjust/increment scores */
-            cur_snippet_iter->second->increment(scorer, state, line_window_iter->second);
+            score_t score = cur_snippet_iter->second.snippet->increment(
+                    scorer, state, line_window_iter->second);
+            if (copied) {
+                schedule_count(cur_snippet_iter->second.snippet, scorer, state);
+                schedule_time(cur_snippet_iter->second.snippet, scorer, state);
+            }
+            if (weighted_random) {
+                random_weights.set(cur_snippet_iter->second.random_index, score);
+            }
+            if (memory_limit_ != 0) {
+                /* mark as most recently seen */
+                recency.splice(recency.begin(), recency, cur_snippet_iter->second.recency);
+            }
 #ifdef WRITE_DEBUG_ENABLED
-            DEBUG("  EXISTS: score increment %s", cur_snippet_iter->second->str().c_str());
+            DEBUG("  EXISTS: score increment %s", cur_snippet_iter->second.snippet->str().c_str());
 #endif
             continue;
         }
 
         /* window is new, create and add to maps */
-        snippet_t snippet(new Snippet(line_window_iter->first, state.time, state.count, line_window_iter->second));
+        snippet_t snippet(new Snippet(line_window_iter->first,
+                        state.time, state.count, line_window_iter->second));
+        insert_snippet(snippet);
+        schedule_count(snippet, scorer, state);
+        schedule_time(snippet, scorer, state);
+    }
+
+    if (memory_limit_ != 0 && memory_usage_ > memory_limit_) {
+        evict(state, scorer);
+    }
+    return true;
+}
+
+void marky::Backend_Map::merge(const Backend_Map& other, scorer_t scorer) {
+    if (other.has_state) {
+        if (has_state) {
+            state = State((state.time > other.state.time) ? state.time : other.state.time,
+                    (state.count > other.state.count) ? state.count : other.state.count);
+        } else {
+            state = other.state;
+            has_state = true;
+        }
+    }
+
+    other.visit_all([&](const snippet_t& other_snippet) {
+                bool copied;
+                window_to_snippet_t::iterator cur_snippet_iter =
+                    find_own(other_snippet->words, copied);
+                if (cur_snippet_iter != snippets.end()) {
+                    const snippet_t& snippet = cur_snippet_iter->second.snippet;
+                    score_t score = snippet->merge(scorer, *other_snippet);
+                    if (weighted_random) {
+                        random_weights.set(cur_snippet_iter->second.random_index, score);
+                    }
+                    if (copied) {
+                        schedule_count(snippet, scorer, snippet->cur_state());
+                        schedule_time(snippet, scorer, snippet->cur_state());
+                    }
+                    return true;
+                }
+
+                /* copy, since 'other' may keep updating its own snippets */
+                snippet_t snippet(new Snippet(*other_snippet));
+                insert_snippet(snippet);
+                schedule_count(snippet, scorer, snippet->cur_state());
+                schedule_time(snippet, scorer, snippet->cur_state());
+                return true;
+            });
+
+    if (memory_limit_ != 0 && memory_usage_ > memory_limit_) {
+        evict(state, scorer);
+    }
+}
+
+bool marky::Backend_Map::merge_into(ICacheable& out, const State& state,
+        scorer_t scorer) const {
+    /* look up existing snippets in batches, to keep each query a sane size */
+    static const size_t LOOKUP_BATCH_SIZE = 500;
+
+    snippet_ptr_set_t merged, batch;
+    words_to_counts::map_t windows;
+    auto lookup_batch = [&]() {
+        ICacheable::words_to_snippet_t existing;
+        if (!out.get_snippets(windows, existing)) {
+            return false;
+        }
+        for (snippet_ptr_set_t::const_iterator iter = batch.begin();
+             iter != batch.end(); ++iter) {
+            ICacheable::words_to_snippet_t::const_iterator existing_iter =
+                existing.find((*iter)->words);
+            if (existing_iter == existing.end()) {
+                merged.insert(*iter);
+                continue;
+            }
+            /* copy, since our own snippet stays as it is */
+            snippet_t snippet(new Snippet(**iter));
+            snippet->merge(scorer, *existing_iter->second);
+            merged.insert(snippet);
+        }
+        batch.clear();
+        windows.clear();
+        return true;
+    };
+
+    bool ok = true;
+    visit_all([&](const snippet_t& snippet) {
+                batch.insert(snippet);
+                windows[snippet->words] = 1;
+                if (batch.size() == LOOKUP_BATCH_SIZE) {
+                    ok = lookup_batch();
+                }
+                return ok;
+            });
+    return ok && (batch.empty() || lookup_batch()) &&
+        out.flush(state, scorer, merged);
+}
+
+void marky::Backend_Map::insert_snippet(const snippet_t& snippet,
+        const snippet_t& replaced/*=snippet_t()*/) {
 #ifdef WRITE_DEBUG_ENABLED
-        DEBUG("  NEW: %s", snippet->str().c_str());
+    DEBUG("  NEW: %s", snippet->str().c_str());
 #endif
-        snippets[line_window_iter->first] = snippet;
-        random_snippet = snippets.end();/* invalidate after map modification */
+    window_to_snippet_t::iterator snippets_iter =
+        snippets.insert(std::make_pair(snippet->words, snippet_entry_t())).first;
+    snippet_entry_t& entry = snippets_iter->second;
+    entry.snippet = snippet;
+    entry.random_index = random_snippets.size();
+    random_snippets.push_back(&*snippets_iter);
+    if (weighted_random) {
+        random_weights.push_back(snippet->cur_score());
+    }
+    /* the map's key and the snippet each have a copy of the words, and
+       the snippet is in one of each of nexts and prevs */
+    entry.bytes = hash_node_bytes(sizeof(window_to_snippet_t::value_type)) +
+        words_bytes(snippets_iter->first) + words_bytes(snippet->words) +
+        sizeof(Snippet) + SHARED_PTR_BLOCK_BYTES +
+        2 * hash_node_bytes(sizeof(snippet_t)) + WHEEL_ENTRIES_BYTES +
+        sizeof(window_to_snippet_t::value_type*) +
+        (weighted_random ? 2 * sizeof(uint64_t) : 0);
+    if (memory_limit_ != 0) {
+        recency.push_front(&snippets_iter->first);
+        entry.recency = recency.begin();
+        entry.bytes += list_node_bytes(sizeof(recency_t::value_type));
+    }
+    memory_usage_ += entry.bytes;
 
-        /* nexts table: window[:-1] -> window[-1] */
-        words_t words_subset = line_window_iter->first;
-        words_subset.pop_back();// all except back
+    /* nexts table: window[:-1] -> window[-1] */
+    words_t words_subset = snippet->words;
+    words_subset.pop_back();// all except back
 #ifdef WRITE_DEBUG_ENABLED
-        DEBUG("  NEW: nexts %s -> %s", str(words_subset).c_str(), str(snippet->words).c_str());
+    DEBUG("  NEW: nexts %s -> %s", str(words_subset).c_str(), str(snippet->words).c_str());
 #endif
-        words_to_snippets_t::iterator nexts_iter = nexts.find(words_subset);
-        if (nexts_iter == nexts.end()) {
-            nexts_iter = nexts.insert(std::make_pair(words_subset, snippets_ptr_t(new snippet_ptr_set_t))).first;
-        }
-        nexts_iter->second->insert(snippet);
+    snippet_ptr_set_t& next_snippets = own_context(&Backend_Map::nexts, words_subset);
+    next_snippets.insert(snippet);
+    if (replaced) {
+        next_snippets.erase(replaced);
+    }
 
-        /* prevs table: window[1:] -> window[0] */
-        words_subset.push_back(line_window_iter->first.back());
-        words_subset.pop_front();// all except front (from all except back)
+    /* prevs table: window[1:] -> window[0] */
+    words_subset.push_back(snippet->words.back());
+    words_subset.pop_front();// all except front (from all except back)
 #ifdef WRITE_DEBUG_ENABLED
-        DEBUG("  NEW: prevs %s -> %s", str(words_subset).c_str(), str(snippet->words).c_str());
+    DEBUG("  NEW: prevs %s -> %s", str(words_subset).c_str(), str(snippet->words).c_str());
 #endif
-        words_to_snippets_t::iterator prevs_iter = prevs.find(words_subset);
-        if (prevs_iter == prevs.end()) {
-            prevs_iter = prevs.insert(std::make_pair(words_subset, snippets_ptr_t(new snippet_ptr_set_t))).first;
-        }
-        prevs_iter->second->insert(snippet);
+    snippet_ptr_set_t& prev_snippets = own_context(&Backend_Map::prevs, words_subset);
+    prev_snippets.insert(snippet);
+    if (replaced) {
+        prev_snippets.erase(replaced);
     }
+}
 
-    return true;
+size_t marky::Backend_Map::context_bytes(const words_t& words) {
+    return hash_node_bytes(sizeof(words_to_snippets_t::value_type)) + words_bytes(words) +
+        sizeof(snippet_ptr_set_t) + SHARED_PTR_BLOCK_BYTES;
 }
 
-bool marky::Backend_Map::prune(const State& state, scorer_t scorer) {
-    std::list<window_to_snippet_t::iterator> to_erase;
-    for (window_to_snippet_t::iterator snippets_iter = snippets.begin();
-         snippets_iter != snippets.end(); ++snippets_iter) {
-        snippet_t snippet = snippets_iter->second;
-        if (snippet->score(scorer, state) > 0) {
-            /* this snippet still has a score, doesn't need pruning */
-            continue;
+void marky::Backend_Map::erase_snippet(window_to_snippet_t::iterator snippets_iter) {
+    snippet_t snippet = snippets_iter->second.snippet;
+    const words_t& words = snippet->words;
+
+    /* remove from nexts (find matching prev) */
+    words_t words_subset = words;
+    words_subset.pop_back();// all except back
+    words_to_snippets_t::iterator nexts_iter = nexts.find(words_subset);
+    if (nexts_iter != nexts.end()) {
+        nexts_iter->second->erase(snippet);
+        /* keep an empty entry if it's hiding the base's entry */
+        if (nexts_iter->second->empty() &&
+                (!base || base->find_context(&Backend_Map::nexts, nexts_iter->first) == NULL)) {
+            memory_usage_ -= context_bytes(nexts_iter->first);
+            nexts.erase(nexts_iter);
+        }
+    }
+
+    /* remove from prevs (find matching next) */
+    words_subset.push_back(words.back());
+    words_subset.pop_front();// all except front (from all except back)
+    words_to_snippets_t::iterator prevs_iter = prevs.find(words_subset);
+    if (prevs_iter != prevs.end()) {
+        prevs_iter->second->erase(snippet);
+        if (prevs_iter->second->empty() &&
+                (!base || base->find_context(&Backend_Map::prevs, prevs_iter->first) == NULL)) {
+            memory_usage_ -= context_bytes(prevs_iter->first);
+            prevs.erase(prevs_iter);
         }
+    }
 
-        /* mark for removal from snippets */
-        to_erase.push_back(snippets_iter);
+    if (memory_limit_ != 0) {
+        recency.erase(snippets_iter->second.recency);
+    }
+    /* swap the last random entry into this one's place */
+    const size_t random_index = snippets_iter->second.random_index;
+    random_snippets[random_index] = random_snippets.back();
+    random_snippets[random_index]->second.random_index = random_index;
+    random_snippets.pop_back();
+    if (weighted_random) {
+        random_weights.swap_remove(random_index);
+    }
 
-        const words_t& words = snippets_iter->second->words;
+    memory_usage_ -= snippets_iter->second.bytes;
+    snippets.erase(snippets_iter);
+    if (base && base->find_snippet(words) != NULL) {
+        /* don't fall back to the base's copy */
+        hidden.insert(words);
+    }
+}
 
-        /* remove from nexts (find matching prev) */
-        words_t words_subset = words;
-        words_subset.pop_back();// all except back
-        words_to_snippets_t::iterator nexts_iter = nexts.find(words_subset);
-        if (nexts_iter != nexts.end()) {
-            nexts_iter->second->erase(snippet);
-            if (nexts_iter->second->empty()) {
-                nexts.erase(nexts_iter);
+void marky::Backend_Map::evict(const State& state, scorer_t scorer) {
+    while (memory_usage_ > memory_limit_ && !recency.empty()) {
+        /* among the least recently seen snippets, evict the lowest scoring */
+        window_to_snippet_t::iterator victim = snippets.end();
+        score_t victim_score = 0;
+        recency_t::iterator recency_iter = recency.end();
+        for (size_t i = 0; i < EVICT_CANDIDATES && recency_iter != recency.begin(); ++i) {
+            --recency_iter;
+            window_to_snippet_t::iterator snippets_iter = snippets.find(**recency_iter);
+            score_t score = snippets_iter->second.snippet->score(scorer, state);
+            if (victim == snippets.end() || score < victim_score) {
+                victim = snippets_iter;
+                victim_score = score;
             }
         }
+#ifdef WRITE_DEBUG_ENABLED
+        DEBUG("  EVICT: %s", victim->second.snippet->str().c_str());
+#endif
+        erase_snippet(victim);
+    }
+}
+
+void marky::Backend_Map::schedule_count(const snippet_t& snippet, scorer_t scorer,
+        const State& state) {
+    uint64_t expiry;
+    if (expiry::predict_count(*snippet, scorer, state, expiry)) {
+        count_wheel.insert(expiry, snippet);
+    }
+}
+
+void marky::Backend_Map::schedule_time(const snippet_t& snippet, scorer_t scorer,
+        const State& state) {
+    uint64_t expiry;
+    if (expiry::predict_time(*snippet, scorer, state, expiry)) {
+        time_wheel.insert(expiry, snippet);
+    }
+}
+
+bool marky::Backend_Map::prune(const State& state, scorer_t scorer) {
+    /* only check the snippets which were predicted to expire by now. a
+       snippet whose score was bumped since it was scheduled is still alive,
+       so it's rescheduled from here. */
+    std::vector<snippet_t> due;
+    for (int i = 0; i < 2; ++i) {
+        due.clear();
+        bool count_dimension = (i == 0);
+        if (count_dimension) {
+            count_wheel.advance(state.count, due);
+        } else {
+            time_wheel.advance((state.time < 0) ? 0 : state.time, due);
+        }
 
-        /* remove from prevs (find matching next) */
-        words_subset.push_back(words.back());
-        words_subset.pop_front();// all except front (from all except back)
-        words_to_snippets_t::iterator prevs_iter = prevs.find(words_subset);
-        if (prevs_iter != prevs.end()) {
-            prevs_iter->second->erase(snippet);
-            if (prevs_iter->second->empty()) {
-                prevs.erase(prevs_iter);
+        for (std::vector<snippet_t>::const_iterator due_iter = due.begin();
+             due_iter != due.end(); ++due_iter) {
+            const snippet_t& snippet = *due_iter;
+            window_to_snippet_t::iterator snippets_iter = snippets.find(snippet->words);
+            if (snippets_iter == snippets.end() || snippets_iter->second.snippet != snippet) {
+                /* already pruned via the other wheel */
+                continue;
+            }
+            if (snippet->score(scorer, state) > 0) {
+                /* this snippet still has a score, doesn't need pruning */
+                if (count_dimension) {
+                    schedule_count(snippet, scorer, state);
+                } else {
+                    schedule_time(snippet, scorer, state);
+                }
+                continue;
             }
+            erase_snippet(snippets_iter);
         }
     }
-    if (!to_erase.empty()) {
-        for (std::list<window_to_snippet_t::iterator>::const_iterator to_erase_iter = to_erase.begin();
-             to_erase_iter != to_erase.end(); ++to_erase_iter) {
-            snippets.erase(*to_erase_iter);
-        }
-        random_snippet = snippets.end();/* invalidate iter after modification */
+    if (base) {
+        prune_base(state, scorer);
     }
 
 #ifdef WRITE_DEBUG_ENABLED
@@ -279,7 +651,7 @@ bool marky::Backend_Map::prune(const State& state, scorer_t scorer) {
     for (window_to_snippet_t::const_iterator witer = snippets.begin();
          witer != snippets.end(); ++witer) {
         DEBUG("  snippets%s = snippet(%s, %lu)", str(witer->first).c_str(),
-                str(witer->second->words).c_str(), witer->second->score(scorer, state));
+                str(witer->second.snippet->words).c_str(), witer->second.snippet->score(scorer, state));
     }
     for (words_to_snippets_t::const_iterator witer = prevs.begin();
          witer != prevs.end(); ++witer) {
@@ -302,3 +674,419 @@ bool marky::Backend_Map::prune(const State& state, scorer_t scorer) {
 #endif
     return true;
 }
+
+bool marky::Backend_Map::save(const std::string& path) const {
+    /* assign an id to each distinct word. the pointers refer to the map's
+       keys, which are stable across inserts. */
+    typedef std::unordered_map<word_t, uint32_t> word_to_id_t;
+    std::vector<const Snippet*> all_snippets;
+    all_snippets.reserve(snippets.size());
+    visit_all([&all_snippets](const snippet_t& snippet) {
+                all_snippets.push_back(snippet.get());
+                return true;
+            });
+    word_to_id_t word_ids;
+    std::vector<const word_t*> id_words;
+    uint64_t pool_size = 0, id_count = 0;
+    for (std::vector<const Snippet*>::const_iterator snippets_iter = all_snippets.begin();
+         snippets_iter != all_snippets.end(); ++snippets_iter) {
+        const words_t& words = (*snippets_iter)->words;
+        for (words_t::const_iterator words_iter = words.begin();
+             words_iter != words.end(); ++words_iter) {
+            std::pair<word_to_id_t::iterator, bool> inserted =
+                word_ids.insert(std::make_pair(*words_iter, (uint32_t)id_words.size()));
+            if (inserted.second) {
+                id_words.push_back(&inserted.first->first);
+                pool_size += words_iter->size();
+            }
+        }
+        id_count += words.size();
+    }
+    if (id_words.size() > UINT32_MAX) {
+        ERROR("Too many distinct words to save: %lu", id_words.size());
+        return false;
+    }
+
+    map_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAP_FILE_MAGIC, sizeof(header.magic));
+    header.version = MAP_FILE_VERSION;
+    header.byte_order = MAP_FILE_BYTE_ORDER;
+    header.state_time = state.time;
+    header.state_count = state.count;
+    header.word_count = id_words.size();
+    header.pool_size = pool_size;
+    header.snippet_count = all_snippets.size();
+    header.id_count = id_count;
+
+    const std::string tmp_path = path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (file == NULL) {
+        ERROR("Failed to open %s for writing: %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool ok = write_all(file, &header, sizeof(header)) &&
+        write_padding(file, sizeof(header));
+
+    /* word offsets, then the pool itself */
+    uint64_t offset = 0;
+    for (size_t i = 0; ok && i < id_words.size(); ++i) {
+        ok = write_all(file, &offset, sizeof(offset));
+        offset += id_words[i]->size();
+    }
+    ok = ok && write_all(file, &offset, sizeof(offset));
+    for (size_t i = 0; ok && i < id_words.size(); ++i) {
+        ok = write_all(file, id_words[i]->data(), id_words[i]->size());
+    }
+    ok = ok && write_padding(file, pool_size);
+
+    /* snippet records. iteration order is stable since nothing is modified. */
+    uint64_t first_id = 0;
+    for (std::vector<const Snippet*>::const_iterator snippets_iter = all_snippets.begin();
+         ok && snippets_iter != all_snippets.end(); ++snippets_iter) {
+        const Snippet& snippet = **snippets_iter;
+        map_file_snippet_t record;
+        record.score = snippet.cur_score();
+        record.time = snippet.cur_state().time;
+        record.count = snippet.cur_state().count;
+        record.first_id = first_id;
+        record.id_count = snippet.words.size();
+        ok = write_all(file, &record, sizeof(record));
+        first_id += record.id_count;
+    }
+
+    /* snippet words */
+    for (std::vector<const Snippet*>::const_iterator snippets_iter = all_snippets.begin();
+         ok && snippets_iter != all_snippets.end(); ++snippets_iter) {
+        const words_t& words = (*snippets_iter)->words;
+        for (words_t::const_iterator words_iter = words.begin();
+             ok && words_iter != words.end(); ++words_iter) {
+            uint32_t id = word_ids.find(*words_iter)->second;
+            ok = write_all(file, &id, sizeof(id));
+        }
+    }
+    ok = ok && write_padding(file, id_count * sizeof(uint32_t));
+
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+    return commit(tmp_path, path, ok);
+}
+
+bool marky::Backend_Map::visit_snippets(snippet_visitor_t visitor) {
+    visit_all([&visitor](const snippet_t& snippet) {
+                return visitor(*snippet);
+            });
+    return true;
+}
+
+void marky::Backend_Map::clear() {
+    prevs.clear();
+    nexts.clear();
+    snippets.clear();
+    random_snippets.clear();
+    random_weights.clear();
+    recency.clear();
+    memory_usage_ = 0;
+    count_wheel.clear();
+    time_wheel.clear();
+    base.reset();
+    hidden.clear();
+    base_prune_cursor = 0;
+}
+
+const marky::snippet_t* marky::Backend_Map::find_snippet(const words_t& window) const {
+    for (const Backend_Map* layer = this; layer != NULL; layer = layer->base.get()) {
+        window_to_snippet_t::const_iterator iter = layer->snippets.find(window);
+        if (iter != layer->snippets.end()) {
+            return &iter->second.snippet;
+        }
+        if (layer->hidden.count(window) != 0) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+const marky::snippet_ptr_set_t* marky::Backend_Map::find_context(
+        words_to_snippets_t Backend_Map::* contexts, const words_t& context) const {
+    for (const Backend_Map* layer = this; layer != NULL; layer = layer->base.get()) {
+        const words_to_snippets_t& layer_contexts = layer->*contexts;
+        words_to_snippets_t::const_iterator iter = layer_contexts.find(context);
+        if (iter != layer_contexts.end()) {
+            return (iter->second->empty()) ? NULL : iter->second.get();
+        }
+    }
+    return NULL;
+}
+
+marky::Backend_Map::window_to_snippet_t::iterator marky::Backend_Map::find_own(
+        const words_t& window, bool& copied) {
+    copied = false;
+    window_to_snippet_t::iterator iter = snippets.find(window);
+    if (iter != snippets.end() || !base || hidden.count(window) != 0) {
+        return iter;
+    }
+    const snippet_t* shared = base->find_snippet(window);
+    if (shared == NULL) {
+        return snippets.end();
+    }
+    /* the base's copy may be in use by other forks, so make our own */
+    insert_snippet(snippet_t(new Snippet(**shared)), *shared);
+    copied = true;
+    return snippets.find(window);
+}
+
+marky::snippet_ptr_set_t& marky::Backend_Map::own_context(
+        words_to_snippets_t Backend_Map::* contexts, const words_t& context) {
+    words_to_snippets_t& own_contexts = this->*contexts;
+    words_to_snippets_t::iterator iter = own_contexts.find(context);
+    if (iter == own_contexts.end()) {
+        iter = own_contexts.insert(std::make_pair(context, snippets_ptr_t(new snippet_ptr_set_t))).first;
+        memory_usage_ += context_bytes(iter->first);
+        if (base) {
+            const snippet_ptr_set_t* shared = base->find_context(contexts, context);
+            if (shared != NULL) {
+                *iter->second = *shared;
+            }
+        }
+    }
+    return *iter->second;
+}
+
+void marky::Backend_Map::hide(const snippet_t& snippet) {
+    words_t words_subset = snippet->words;
+    words_subset.pop_back();// all except back
+    own_context(&Backend_Map::nexts, words_subset).erase(snippet);
+    words_subset.push_back(snippet->words.back());
+    words_subset.pop_front();// all except front (from all except back)
+    own_context(&Backend_Map::prevs, words_subset).erase(snippet);
+    hidden.insert(snippet->words);
+}
+
+void marky::Backend_Map::prune_base(const State& state, scorer_t scorer) {
+    /* the base has no expiry wheels of its own to go by, so work through
+       it a batch at a time, starting over once the end is reached */
+    for (size_t checked = 0; checked < BASE_PRUNE_BATCH; ++checked) {
+        const Backend_Map* layer = base.get();
+        size_t index = base_prune_cursor;
+        while (layer != NULL && index >= layer->random_snippets.size()) {
+            index -= layer->random_snippets.size();
+            layer = layer->base.get();
+        }
+        if (layer == NULL) {
+            base_prune_cursor = 0;
+            break;
+        }
+        ++base_prune_cursor;
+
+        const snippet_t& snippet = layer->random_snippets[index]->second.snippet;
+        const snippet_t* visible = find_snippet(snippet->words);
+        if (visible != NULL && visible->get() == snippet.get() &&
+                snippet->score(scorer, state) == 0) {
+            hide(snippet);
+        }
+    }
+}
+
+bool marky::Backend_Map::visit_all(
+        const std::function<bool (const snippet_t&)>& visitor) const {
+    for (const Backend_Map* layer = this; layer != NULL; layer = layer->base.get()) {
+        for (window_to_snippet_t::const_iterator snippets_iter = layer->snippets.begin();
+             snippets_iter != layer->snippets.end(); ++snippets_iter) {
+            const snippet_t& snippet = snippets_iter->second.snippet;
+            if (layer != this) {
+                /* skip anything that's been replaced or removed since */
+                const snippet_t* visible = find_snippet(snippet->words);
+                if (visible == NULL || visible->get() != snippet.get()) {
+                    continue;
+                }
+            }
+            if (!visitor(snippet)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void marky::Backend_Map::pick_uniform(const Backend_Map*& layer, size_t& index) const {
+    size_t total = 0;
+    for (layer = this; layer != NULL; layer = layer->base.get()) {
+        total += layer->random_snippets.size();
+    }
+    index = pick_rand(total);
+    for (layer = this; index >= layer->random_snippets.size(); layer = layer->base.get()) {
+        index -= layer->random_snippets.size();
+    }
+}
+
+bool marky::Backend_Map::pick_visible(const Backend_Map*& layer, size_t& index) const {
+    for (int attempt = 0; attempt < RANDOM_WEIGHTED_ATTEMPTS; ++attempt) {
+        pick_uniform(layer, index);
+        if (visible(layer, index)) {
+            return true;
+        }
+    }
+    /* most of the base is hidden: look onwards from a random entry instead,
+       visiting each entry at most once */
+    size_t total = 0;
+    for (layer = this; layer != NULL; layer = layer->base.get()) {
+        total += layer->random_snippets.size();
+    }
+    const size_t start = pick_rand(total);
+    for (size_t i = 0; i < total; ++i) {
+        index = (start + i) % total;
+        for (layer = this; index >= layer->random_snippets.size(); layer = layer->base.get()) {
+            index -= layer->random_snippets.size();
+        }
+        if (visible(layer, index)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool marky::Backend_Map::visible(const Backend_Map* layer, size_t index) const {
+    if (layer == this) {
+        return true;
+    }
+    const snippet_t& snippet = layer->random_snippets[index]->second.snippet;
+    const snippet_t* found = find_snippet(snippet->words);
+    return found != NULL && found->get() == snippet.get();
+}
+
+bool marky::Backend_Map::pick_weighted(const Backend_Map*& layer, size_t& index) const {
+    uint64_t total = 0;
+    for (layer = this; layer != NULL; layer = layer->base.get()) {
+        total += layer->random_weights.total();
+    }
+    if (total == 0) {
+        return false;
+    }
+    uint64_t target = pick_rand(total);
+    for (layer = this; target >= layer->random_weights.total(); layer = layer->base.get()) {
+        target -= layer->random_weights.total();
+    }
+    index = layer->random_weights.find(target);
+    return true;
+}
+
+void marky::Backend_Map::swap_content(Backend_Map& other) {
+    prevs.swap(other.prevs);
+    nexts.swap(other.nexts);
+    snippets.swap(other.snippets);
+    random_snippets.swap(other.random_snippets);
+    std::swap(random_weights, other.random_weights);
+    recency.swap(other.recency);
+    std::swap(memory_usage_, other.memory_usage_);
+    std::swap(count_wheel, other.count_wheel);
+    std::swap(time_wheel, other.time_wheel);
+    base.swap(other.base);
+    hidden.swap(other.hidden);
+    std::swap(base_prune_cursor, other.base_prune_cursor);
+}
+
+bool marky::Backend_Map::load(const std::string& path, scorer_t scorer) {
+    clear();
+    has_state = false;
+
+    MappedFile file;
+    if (!file.open(path)) {
+        return false;
+    }
+    const uint64_t file_size = file.size();
+    if (file_size < sizeof(map_file_header_t)) {
+        ERROR("%s is too small to be a marky map file", path.c_str());
+        return false;
+    }
+    const map_file_header_t& header = *(const map_file_header_t*)file.data();
+    if (memcmp(header.magic, MAP_FILE_MAGIC, sizeof(header.magic)) != 0) {
+        ERROR("%s is not a marky map file", path.c_str());
+        return false;
+    }
+    if (header.version != MAP_FILE_VERSION) {
+        ERROR("%s has unsupported version %u (expected %u)",
+                path.c_str(), header.version, MAP_FILE_VERSION);
+        return false;
+    }
+    if (header.byte_order != MAP_FILE_BYTE_ORDER) {
+        ERROR("%s was written on a machine with a different byte order", path.c_str());
+        return false;
+    }
+
+    /* locate each section, making sure it's all within the file */
+    uint64_t pos = align8(sizeof(map_file_header_t));
+    const uint64_t offsets_pos = pos;
+    if (header.word_count == UINT64_MAX ||
+            !fits(pos, header.word_count + 1, sizeof(uint64_t), file_size)) {
+        ERROR("%s is truncated (word offsets)", path.c_str());
+        return false;
+    }
+    const uint64_t pool_pos = pos;
+    if (!fits(pos, header.pool_size, 1, file_size)) {
+        ERROR("%s is truncated (word pool)", path.c_str());
+        return false;
+    }
+    const uint64_t snippets_pos = pos;
+    if (!fits(pos, header.snippet_count, sizeof(map_file_snippet_t), file_size)) {
+        ERROR("%s is truncated (snippets)", path.c_str());
+        return false;
+    }
+    const uint64_t ids_pos = pos;
+    if (!fits(pos, header.id_count, sizeof(uint32_t), file_size)) {
+        ERROR("%s is truncated (snippet words)", path.c_str());
+        return false;
+    }
+
+    const uint64_t* offsets = (const uint64_t*)(file.data() + offsets_pos);
+    const char* pool = file.data() + pool_pos;
+    const map_file_snippet_t* records =
+        (const map_file_snippet_t*)(file.data() + snippets_pos);
+    const uint32_t* ids = (const uint32_t*)(file.data() + ids_pos);
+
+    std::vector<word_t> words;
+    words.reserve(header.word_count);
+    for (uint64_t i = 0; i < header.word_count; ++i) {
+        if (offsets[i] > offsets[i + 1] || offsets[i + 1] > header.pool_size) {
+            ERROR("%s has a corrupt word offset at %lu", path.c_str(), i);
+            return false;
+        }
+        words.push_back(word_t(pool + offsets[i], offsets[i + 1] - offsets[i]));
+    }
+
+    /* evicting as we go needs the saved state */
+    state = State(header.state_time, header.state_count);
+    snippets.reserve(header.snippet_count);
+    for (uint64_t i = 0; i < header.snippet_count; ++i) {
+        const map_file_snippet_t& record = records[i];
+        if (record.id_count == 0 || record.first_id > header.id_count ||
+                record.id_count > header.id_count - record.first_id) {
+            ERROR("%s has a corrupt snippet at %lu", path.c_str(), i);
+            clear();
+            return false;
+        }
+        words_t snippet_words;
+        for (uint64_t id = record.first_id; id < record.first_id + record.id_count; ++id) {
+            if (ids[id] >= words.size()) {
+                ERROR("%s has a corrupt word id in snippet %lu", path.c_str(), i);
+                clear();
+                return false;
+            }
+            snippet_words.push_back(words[ids[id]]);
+        }
+        snippet_t snippet(new Snippet(snippet_words,
+                        record.time, record.count, record.score));
+        insert_snippet(snippet);
+        /* checked at the next prune(), which schedules it from then on */
+        count_wheel.insert(0, snippet);
+        time_wheel.insert(0, snippet);
+        if (memory_limit_ != 0 && memory_usage_ > memory_limit_) {
+            evict(state, scorer);
+        }
+    }
+
+    has_state = true;
+    return true;
+}
@@ -19,15 +19,90 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <list>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "backend.h"
+#include "expiry-wheel.h"
+#include "rand-util.h"
 
 namespace marky {
-    /* A simple one-off backend which loses all state upon destruction. */
+    /* A simple one-off backend which loses all state upon destruction, unless
+     * it's explicitly written to a file with save().
+     *
+     * Each snippet is scheduled by the line count and time at which its score
+     * is predicted to reach zero, so that prune() only checks the snippets
+     * which are due rather than every snippet. */
     class Backend_Map : public IBackend {
     public:
-        Backend_Map();
+        /* 'memory_limit' is an approximate budget in bytes for the snippets
+         * and their indexes, or 0 for no limit. When an update brings the
+         * usage over the limit, low-scoring snippets which haven't been seen
+         * recently are evicted until the usage is back under the limit.
+         *
+         * get_random() picks a snippet uniformly by default. If
+         * 'weighted_random' is set, snippets are instead picked in proportion
+         * to their score, so that common words are more likely to start a
+         * line. */
+        Backend_Map(size_t memory_limit = 0, bool weighted_random = false);
+
+        /* Returns a new backend with the same content as this one, which may
+         * then be updated independently of this one, eg to try out several
+         * different streams of updates on top of one model.
+         *
+         * This backend's content is moved into a read-only layer which is
+         * shared by both backends, so forking costs the same regardless of
+         * the size of the model. Afterwards each backend copies a snippet or
+         * a context out of the shared layer the first time it modifies it.
+         * Snippets in the shared layer are checked for pruning a batch at a
+         * time with each prune(), rather than by their predicted expiry.
+         *
+         * The shared layer is never modified, so the two backends may be
+         * used from different threads. */
+        std::shared_ptr<Backend_Map> fork();
+
+        /* Returns the estimated number of bytes used by the snippets and
+         * their indexes, not counting any layer shared by fork(). */
+        inline size_t memory_usage() const {
+            return memory_usage_;
+        }
+        inline size_t memory_limit() const {
+            return memory_limit_;
+        }
+
+        /* Writes all snippets, along with the last state passed to
+         * store_state(), to a versioned binary file at 'path'. The file is
+         * written to a temporary path and then renamed into place, so an
+         * existing file is never left half-written.
+         * Returns false in the event of an error. */
+        bool save(const std::string& path) const;
+
+        /* Replaces this backend's content with a file written by save(). This
+         * skips the tokenizing and windowing of reading the original input
+         * again, but the snippets and their indexes are still rebuilt in
+         * memory, so it takes time and memory in proportion to the model.
+         * For a read-only model which is served straight from a mapped file,
+         * see Backend_Frozen.
+         *
+         * If the model is over the memory limit, snippets are evicted as
+         * they're loaded, using 'scorer' with the saved state. Returns false
+         * in the event of an error, in which case the backend is left empty. */
+        bool load(const std::string& path, scorer_t scorer);
+
+        /* Adds the content of 'other' into this backend, eg to combine
+         * models which were built separately from parts of the same input.
+         * Snippets found in both have their scores summed, after adjusting
+         * each to the later of their two states with 'scorer'. The stored
+         * state becomes the later of the two backends' states. */
+        void merge(const Backend_Map& other, scorer_t scorer);
+
+        /* Writes the content of this backend into 'out' in a single flush(),
+         * so that eg an empty SQLite db takes it as one bulk load. Snippets
+         * which 'out' already has are merged as with merge(), looking them
+         * up a batch at a time to keep each lookup a sane size. Returns
+         * false in the event of an error. */
+        bool merge_into(ICacheable& out, const State& state, scorer_t scorer) const;
 
         State create_state();
         bool store_state(const State& state, scorer_t scorer);
@@ -44,14 +119,112 @@ namespace marky {
 
         bool prune(const State& state, scorer_t scorer);
 
+        bool visit_snippets(snippet_visitor_t visitor);
+
     private:
+        /* least recently seen at the back, keys point into 'snippets' */
+        typedef std::list<const words_t*> recency_t;
+
+        struct snippet_entry_t {
+            snippet_t snippet;
+            recency_t::iterator recency;/* only set if there's a memory limit */
+            size_t bytes;/* memory counted for this snippet */
+            size_t random_index;/* position in random_snippets */
+        };
+
         typedef std::unordered_map<words_t, snippets_ptr_t> words_to_snippets_t;
+        typedef std::unordered_map<words_t, snippet_entry_t> window_to_snippet_t;
+
+        /* Adds a new snippet to the snippets/prevs/nexts maps, in place of
+         * 'replaced' if it's a copy of a snippet from 'base'. */
+        void insert_snippet(const snippet_t& snippet,
+                const snippet_t& replaced = snippet_t());
+        /* Removes a snippet from the snippets/prevs/nexts maps. */
+        void erase_snippet(window_to_snippet_t::iterator snippets_iter);
+        /* Adds a snippet to the expiry wheels, predicting its expiry from
+         * 'state' onwards. Leaves it out of a wheel if it never expires in
+         * that dimension. */
+        void schedule_count(const snippet_t& snippet, scorer_t scorer,
+                const State& state);
+        void schedule_time(const snippet_t& snippet, scorer_t scorer,
+                const State& state);
+        /* Returns the memory counted for an entry in nexts or prevs. */
+        static size_t context_bytes(const words_t& words);
+        /* Evicts snippets until the memory usage is within the limit. */
+        void evict(const State& state, scorer_t scorer);
+        /* Removes all snippets. */
+        void clear();
+
+        /* Functions for looking through 'base': */
+
+        /* Returns the snippet for 'window' in this map or its base, or NULL
+         * if there isn't one. */
+        const snippet_t* find_snippet(const words_t& window) const;
+        /* Returns the snippets for 'context' in the nexts or prevs of this
+         * map or its base, or NULL if there aren't any. */
+        const snippet_ptr_set_t* find_context(words_to_snippets_t Backend_Map::* contexts,
+                const words_t& context) const;
+        /* Returns this map's entry for 'window', copying the snippet out of
+         * 'base' if it's only found there, in which case 'copied' is set and
+         * the copy still needs to be scheduled. Returns snippets.end() if the
+         * window isn't found at all. */
+        window_to_snippet_t::iterator find_own(const words_t& window, bool& copied);
+        /* Returns this map's own snippets for 'context', copying them out of
+         * 'base' if needed. */
+        snippet_ptr_set_t& own_context(words_to_snippets_t Backend_Map::* contexts,
+                const words_t& context);
+        /* Removes a snippet which is only found in 'base'. */
+        void hide(const snippet_t& snippet);
+        /* Checks the next batch of snippets in 'base' for pruning. */
+        void prune_base(const State& state, scorer_t scorer);
+        /* Calls 'visitor' with each snippet in this map and its base. */
+        bool visit_all(const std::function<bool (const snippet_t&)>& visitor) const;
+        /* Picks an entry from the random_snippets of this map or its base,
+         * uniformly or by weight. pick_weighted() returns false if nothing
+         * has any weight. */
+        void pick_uniform(const Backend_Map*& layer, size_t& index) const;
+        bool pick_weighted(const Backend_Map*& layer, size_t& index) const;
+        /* Same as pick_uniform(), but skips anything in 'base' which has
+         * been removed from this map. Returns false if nothing is left. */
+        bool pick_visible(const Backend_Map*& layer, size_t& index) const;
+        /* Returns whether an entry of 'layer' hasn't been replaced or
+         * removed by this map. */
+        bool visible(const Backend_Map* layer, size_t index) const;
+        /* Moves all of the snippets and indexes between this map and 'other'. */
+        void swap_content(Backend_Map& other);
+
         words_to_snippets_t prevs;/* suffix words -> snippet containing previous word */
         words_to_snippets_t nexts;/* prefix words -> snippet containing next word */
 
-        typedef std::unordered_map<words_t, snippet_t> window_to_snippet_t;
         window_to_snippet_t snippets;/* window -> snippet */
-        window_to_snippet_t::const_iterator random_snippet;
+
+        /* every entry in 'snippets', for picking one at random. entries are
+           swapped into the place of removed entries, so this stays dense. */
+        std::vector<window_to_snippet_t::value_type*> random_snippets;
+        /* stored scores of 'random_snippets', if picking by weight */
+        const bool weighted_random;
+        SamplingTree random_weights;
+
+        recency_t recency;
+        const size_t memory_limit_;
+        size_t memory_usage_;
+
+        /* snippets keyed by predicted expiry, see prune() */
+        ExpiryWheel count_wheel;
+        ExpiryWheel time_wheel;
+
+        /* the last state passed to store_state() or retrieved by load() */
+        State state;
+        bool has_state;
+
+        /* content shared with other forks, see fork(). contexts in nexts and
+           prevs take precedence over those in the base, and are left empty
+           if all of their snippets were removed. */
+        std::shared_ptr<const Backend_Map> base;
+        /* windows in the base which have been removed from this map */
+        std::unordered_set<words_t> hidden;
+        /* position of the next prune_base() within the base's random_snippets */
+        size_t base_prune_cursor;
     };
 }
 
@@ -0,0 +1,379 @@
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <time.h>
+
+#include <mutex>
+#include <unordered_map>
+
+#include "backend-sharded-map.h"
+#include "config.h"
+#include "expiry-wheel.h"
+#include "rand-util.h"
+
+namespace {
+    /* std::hash<words_t> only looks at the first and last words, which would
+       put eg all contexts starting with LINE_START into the same few shards */
+    size_t hash_words(const marky::words_t& words) {
+        std::hash<marky::word_t> hasher;
+        size_t hash = words.size();
+        for (marky::words_t::const_iterator iter = words.begin();
+             iter != words.end(); ++iter) {
+            hash = hash * 31 + hasher(*iter);
+        }
+        return hash;
+    }
+
+    /* Updates from different threads may arrive out of order. Scorers can't
+       handle going back in time, so treat an older update as happening at
+       the same time as the snippet's last update. */
+    marky::State latest(const marky::State& a, const marky::State& b) {
+        return marky::State((a.time > b.time) ? a.time : b.time,
+                (a.count > b.count) ? a.count : b.count);
+    }
+}
+
+/* One partition of the snippets, indexed by their context in one direction.
+   A next shard owns its snippets, scheduling and pruning them. A prev shard
+   only lists the snippets of the next shards under their suffixes. */
+class marky::Backend_ShardedMap::Shard {
+  public:
+    Shard()
+        : mutex(), contexts(), snippets(), random_snippets(),
+          count_wheel(), time_wheel() { }
+
+    /* Increments the snippet for 'window', returning false if this shard
+     * doesn't have it. */
+    bool increment(const words_t& window, const State& state, scorer_t scorer,
+            size_t count) {
+        window_to_snippet_t::iterator iter = snippets.find(window);
+        if (iter == snippets.end()) {
+            return false;
+        }
+        snippet_t& snippet = iter->second.snippet;
+        snippet->increment(scorer, latest(state, snippet->cur_state()), count);
+        return true;
+    }
+
+    /* Adds a new snippet for 'window' under 'context', owned by this shard. */
+    snippet_t insert(const words_t& window, const words_t& context,
+            const State& state, scorer_t scorer, size_t count) {
+        snippet_t snippet(new Snippet(window, state.time, state.count, count));
+        window_to_snippet_t::iterator iter =
+            snippets.insert(std::make_pair(window, snippet_entry_t())).first;
+        iter->second.snippet = snippet;
+        iter->second.random_index = random_snippets.size();
+        random_snippets.push_back(&*iter);
+        link(context, snippet);
+
+        schedule(snippet, scorer, state, true);
+        schedule(snippet, scorer, state, false);
+        return snippet;
+    }
+
+    /* Lists 'snippet' under 'context', or stops listing it there. */
+    void link(const words_t& context, const snippet_t& snippet) {
+        contexts[context].insert(snippet);
+    }
+    void unlink(const words_t& context, const snippet_t& snippet) {
+        contexts_t::iterator iter = contexts.find(context);
+        if (iter == contexts.end()) {
+            return;
+        }
+        iter->second.erase(snippet);
+        if (iter->second.empty()) {
+            contexts.erase(iter);
+        }
+    }
+
+    /* Returns whether 'context' was found, and if so, the selected snippet. */
+    snippet_t select(const words_t& context, const State& state,
+            selector_t selector, scorer_t scorer) const {
+        contexts_t::const_iterator iter = contexts.find(context);
+        if (iter == contexts.end()) {
+            return snippet_t();
+        }
+        return selector(iter->second, scorer, state);
+    }
+
+    /* Returns a random snippet, or an empty ptr if the shard is empty. */
+    snippet_t random() const {
+        if (random_snippets.empty()) {
+            return snippet_t();
+        }
+        return random_snippets[pick_rand(random_snippets.size())]->second.snippet;
+    }
+
+    /* Removes any due snippets with a zero score, rescheduling the rest.
+     * The removed snippets are added to 'pruned', for the caller to unlink
+     * from the prev shards. */
+    void prune(const State& state, scorer_t scorer, std::vector<snippet_t>& pruned) {
+        std::vector<snippet_t> due;
+        for (int i = 0; i < 2; ++i) {
+            due.clear();
+            bool count_dimension = (i == 0);
+            if (count_dimension) {
+                count_wheel.advance(state.count, due);
+            } else {
+                time_wheel.advance((state.time < 0) ? 0 : state.time, due);
+            }
+            for (std::vector<snippet_t>::const_iterator due_iter = due.begin();
+                 due_iter != due.end(); ++due_iter) {
+                const snippet_t& snippet = *due_iter;
+                window_to_snippet_t::iterator iter = snippets.find(snippet->words);
+                if (iter == snippets.end() || iter->second.snippet != snippet) {
+                    continue;
+                }
+                if (snippet->score(scorer, state) > 0) {
+                    schedule(snippet, scorer, state, count_dimension);
+                } else {
+                    words_t prefix(snippet->words);
+                    prefix.pop_back();
+                    unlink(prefix, snippet);
+                    erase(iter);
+                    pruned.push_back(snippet);
+                }
+            }
+        }
+    }
+
+    bool visit(snippet_visitor_t& visitor) const {
+        for (window_to_snippet_t::const_iterator iter = snippets.begin();
+             iter != snippets.end(); ++iter) {
+            if (!visitor(*iter->second.snippet)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::mutex mutex;
+
+  private:
+    typedef std::unordered_map<words_t, snippet_ptr_set_t> contexts_t;
+    struct snippet_entry_t {
+        snippet_t snippet;
+        size_t random_index;/* position in random_snippets */
+    };
+    typedef std::unordered_map<words_t, snippet_entry_t> window_to_snippet_t;
+
+    void schedule(const snippet_t& snippet, scorer_t scorer, const State& state,
+            bool count_dimension) {
+        uint64_t expiry;
+        if (count_dimension) {
+            if (expiry::predict_count(*snippet, scorer, state, expiry)) {
+                count_wheel.insert(expiry, snippet);
+            }
+        } else if (expiry::predict_time(*snippet, scorer, state, expiry)) {
+            time_wheel.insert(expiry, snippet);
+        }
+    }
+
+    void erase(window_to_snippet_t::iterator iter) {
+        const size_t random_index = iter->second.random_index;
+        random_snippets[random_index] = random_snippets.back();
+        random_snippets[random_index]->second.random_index = random_index;
+        random_snippets.pop_back();
+
+        snippets.erase(iter);
+    }
+
+    contexts_t contexts;
+    window_to_snippet_t snippets;/* only in next shards */
+    std::vector<window_to_snippet_t::value_type*> random_snippets;
+    ExpiryWheel count_wheel;
+    ExpiryWheel time_wheel;
+};
+
+marky::Backend_ShardedMap::Backend_ShardedMap(size_t shard_count/*=64*/)
+    : next_shards(), prev_shards() {
+    if (shard_count == 0) {
+        shard_count = 1;
+    }
+    for (size_t i = 0; i < shard_count; ++i) {
+        next_shards.push_back(new Shard);
+        prev_shards.push_back(new Shard);
+    }
+}
+
+marky::Backend_ShardedMap::~Backend_ShardedMap() {
+    for (size_t i = 0; i < next_shards.size(); ++i) {
+        delete next_shards[i];
+        delete prev_shards[i];
+    }
+}
+
+marky::State marky::Backend_ShardedMap::create_state() {
+    return State(time(NULL), 0);
+}
+
+bool marky::Backend_ShardedMap::store_state(const State& /*state*/, scorer_t /*scorer*/) {
+    /* no persistent storage */
+    return true;
+}
+
+bool marky::Backend_ShardedMap::get_random(const State& /*state*/, scorer_t /*scorer*/, word_t& word) {
+    /* start at a random shard, moving on if it's empty */
+    const size_t start = pick_rand(next_shards.size());
+    for (size_t i = 0; i < next_shards.size(); ++i) {
+        Shard& shard = *next_shards[(start + i) % next_shards.size()];
+        snippet_t snippet;
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            snippet = shard.random();
+        }
+        if (snippet) {
+            /* put a little effort into finding a non-end/start word */
+            word = snippet->words.front();
+            if (word == IBackend::LINE_START) {
+                word = snippet->words.back();
+            }
+            return true;
+        }
+    }
+    word = IBackend::LINE_END;
+    return true;
+}
+
+bool marky::Backend_ShardedMap::get_prev(const State& state, selector_t selector,
+        scorer_t scorer, const words_t& search_words, word_t& prev) {
+    /* shorter searches are in other shards, so back off out here */
+    words_t search(search_words);
+    for (;;) {
+        Shard& prev_shard = shard(prev_shards, search);
+        snippet_t snippet;
+        {
+            std::lock_guard<std::mutex> lock(prev_shard.mutex);
+            snippet = prev_shard.select(search, state, selector, scorer);
+        }
+        if (snippet) {
+            prev = snippet->words.front();
+            return true;
+        }
+        if (search.size() < 2) {
+            prev = IBackend::LINE_START;
+            return true;
+        }
+        search.pop_back();
+    }
+}
+
+bool marky::Backend_ShardedMap::get_next(const State& state, selector_t selector,
+        scorer_t scorer, const words_t& search_words, word_t& next) {
+    /* shorter searches are in other shards, so back off out here */
+    words_t search(search_words);
+    for (;;) {
+        Shard& next_shard = shard(next_shards, search);
+        snippet_t snippet;
+        {
+            std::lock_guard<std::mutex> lock(next_shard.mutex);
+            snippet = next_shard.select(search, state, selector, scorer);
+        }
+        if (snippet) {
+            next = snippet->words.back();
+            return true;
+        }
+        if (search.size() < 2) {
+            next = IBackend::LINE_END;
+            return true;
+        }
+        search.pop_front();
+    }
+}
+
+bool marky::Backend_ShardedMap::update_snippets(const State& state, scorer_t scorer,
+        const words_to_counts::map_t& line_windows) {
+    /* group the windows by their next shard, then by their prev shard, so
+       that each pair of shards is only locked once */
+    struct window_t {
+        const words_to_counts::map_t::value_type* window;
+        words_t prefix, suffix;
+    };
+    typedef std::unordered_map<Shard*, std::vector<window_t> > by_prev_t;
+    std::unordered_map<Shard*, by_prev_t> by_shard;
+    for (words_to_counts::map_t::const_iterator iter = line_windows.begin();
+         iter != line_windows.end(); ++iter) {
+        if (iter->first.empty()) {
+            continue;
+        }
+        words_t prefix(iter->first), suffix(iter->first);
+        prefix.pop_back();// all except back
+        suffix.pop_front();// all except front
+        std::vector<window_t>& dest =
+            by_shard[&shard(next_shards, prefix)][&shard(prev_shards, suffix)];
+        dest.push_back(window_t());
+        dest.back().window = &*iter;
+        dest.back().prefix.swap(prefix);
+        dest.back().suffix.swap(suffix);
+    }
+
+    for (std::unordered_map<Shard*, by_prev_t>::const_iterator next_iter = by_shard.begin();
+         next_iter != by_shard.end(); ++next_iter) {
+        Shard& next = *next_iter->first;
+        std::lock_guard<std::mutex> next_lock(next.mutex);
+        for (by_prev_t::const_iterator prev_iter = next_iter->second.begin();
+             prev_iter != next_iter->second.end(); ++prev_iter) {
+            Shard& prev = *prev_iter->first;
+            std::lock_guard<std::mutex> prev_lock(prev.mutex);
+            for (std::vector<window_t>::const_iterator iter = prev_iter->second.begin();
+                 iter != prev_iter->second.end(); ++iter) {
+                const words_t& words = iter->window->first;
+                const size_t count = iter->window->second;
+                if (!next.increment(words, state, scorer, count)) {
+                    prev.link(iter->suffix,
+                            next.insert(words, iter->prefix, state, scorer, count));
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool marky::Backend_ShardedMap::prune(const State& state, scorer_t scorer) {
+    std::vector<snippet_t> pruned;
+    for (size_t i = 0; i < next_shards.size(); ++i) {
+        std::lock_guard<std::mutex> next_lock(next_shards[i]->mutex);
+        pruned.clear();
+        next_shards[i]->prune(state, scorer, pruned);
+        for (std::vector<snippet_t>::const_iterator iter = pruned.begin();
+             iter != pruned.end(); ++iter) {
+            words_t suffix((*iter)->words);
+            suffix.pop_front();
+            Shard& prev = shard(prev_shards, suffix);
+            std::lock_guard<std::mutex> prev_lock(prev.mutex);
+            prev.unlink(suffix, *iter);
+        }
+    }
+    return true;
+}
+
+bool marky::Backend_ShardedMap::visit_snippets(snippet_visitor_t visitor) {
+    /* each snippet is in exactly one of the next shards */
+    for (size_t i = 0; i < next_shards.size(); ++i) {
+        std::lock_guard<std::mutex> lock(next_shards[i]->mutex);
+        if (!next_shards[i]->visit(visitor)) {
+            break;
+        }
+    }
+    return true;
+}
+
+marky::Backend_ShardedMap::Shard& marky::Backend_ShardedMap::shard(
+        shards_t& shards, const words_t& words) {
+    return *shards[hash_words(words) % shards.size()];
+}
@@ -0,0 +1,74 @@
+#ifndef MARKY_BACKEND_SHARDED_MAP_H
+#define MARKY_BACKEND_SHARDED_MAP_H
+
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <vector>
+
+#include "backend.h"
+
+namespace marky {
+    /* An in-memory backend like Backend_Map, except that all of its functions
+     * may be called concurrently from multiple threads, eg to run several
+     * Marky::insert()s in parallel.
+     *
+     * Snippets are partitioned across shards by the hash of their context,
+     * and each shard has its own lock. Each snippet is owned by the shard
+     * chosen by its prefix (for get_next()), and is also listed in a shard
+     * chosen by its suffix (for get_prev()). A snippet is only changed or
+     * pruned while both of its shards are locked, always taking the prefix
+     * shard's lock first, so that lookups only need the one lock. */
+    class Backend_ShardedMap : public IBackend {
+    public:
+        /* 'shard_count' should be comfortably larger than the number of
+         * threads which will be using the backend, to keep them from
+         * contending for the same shards. */
+        Backend_ShardedMap(size_t shard_count = 64);
+        virtual ~Backend_ShardedMap();
+
+        State create_state();
+        bool store_state(const State& state, scorer_t scorer);
+
+        bool get_random(const State& state, scorer_t scorer, word_t& word);
+
+        bool get_prev(const State& state, selector_t selector, scorer_t scorer,
+                const words_t& search_words, word_t& prev);
+        bool get_next(const State& state, selector_t selector, scorer_t scorer,
+                const words_t& search_words, word_t& next);
+
+        bool update_snippets(const State& state, scorer_t scorer,
+                const words_to_counts::map_t& line_windows);
+
+        bool prune(const State& state, scorer_t scorer);
+
+        bool visit_snippets(snippet_visitor_t visitor);
+
+    private:
+        class Shard;
+        typedef std::vector<Shard*> shards_t;
+
+        /* Finds the shard for a context of 'words'. */
+        Shard& shard(shards_t& shards, const words_t& words);
+
+        shards_t next_shards;/* prefix words -> snippet containing next word */
+        shards_t prev_shards;/* suffix words -> the same snippets, not owned */
+    };
+}
+
+#endif
@@ -0,0 +1,436 @@
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <time.h>
+
+#include <iterator>
+
+#include "backend-snapshot-map.h"
+#include "config.h"
+#include "rand-util.h"
+
+namespace {
+    /* grow a table once it averages this many nodes per bucket */
+    const size_t MAX_LOAD = 2;
+    const size_t INITIAL_BUCKETS = 64;
+    /* updates wait for readers once this much data has been retired, rather
+       than after every update */
+    const size_t RECLAIM_THRESHOLD = 1024;
+
+    /* std::hash<words_t> only looks at the first and last words, which would
+       make for long bucket chains of eg contexts starting with LINE_START */
+    size_t hash_words(const marky::words_t& words) {
+        std::hash<marky::word_t> hasher;
+        size_t hash = words.size();
+        for (marky::words_t::const_iterator iter = words.begin();
+             iter != words.end(); ++iter) {
+            hash = hash * 31 + hasher(*iter);
+        }
+        return hash;
+    }
+
+    /* Updates from different threads may arrive out of order. Scorers can't
+       handle going back in time, so treat an older update as happening at
+       the same time as the snippet's last update. */
+    marky::State latest(const marky::State& a, const marky::State& b) {
+        return marky::State((a.time > b.time) ? a.time : b.time,
+                (a.count > b.count) ? a.count : b.count);
+    }
+}
+
+/* A context and the snippets which follow (or precede) it. Never modified
+   once published. */
+struct marky::Backend_SnapshotMap::Node {
+    Node(const words_t& context)
+        : context(context), snippets() { }
+
+    const words_t context;
+    snippet_ptr_set_t snippets;
+};
+
+/* The nodes whose contexts share a hash slot. Never modified once published. */
+struct marky::Backend_SnapshotMap::Bucket {
+    std::vector<const Node*> nodes;
+};
+
+/* A fixed-size array of buckets, each published separately. The table is
+   replaced with a larger one (sharing the same nodes) as it fills up. */
+class marky::Backend_SnapshotMap::Table {
+  public:
+    Table(size_t size)
+        : size(size), node_count(0), buckets(new std::atomic<const Bucket*>[size]) {
+        for (size_t i = 0; i < size; ++i) {
+            buckets[i] = NULL;
+        }
+    }
+
+    inline std::atomic<const Bucket*>& bucket(const words_t& context) {
+        return buckets[hash_words(context) % size];
+    }
+    inline const std::atomic<const Bucket*>& bucket(const words_t& context) const {
+        return buckets[hash_words(context) % size];
+    }
+
+    const size_t size;
+    size_t node_count;/* only accessed by writers */
+    std::unique_ptr<std::atomic<const Bucket*>[]> buckets;
+};
+
+marky::Backend_SnapshotMap::Backend_SnapshotMap()
+    : next_table(new Table(INITIAL_BUCKETS)), prev_table(new Table(INITIAL_BUCKETS)),
+      epochs(), write_mutex(), snippets(), count_wheel(), time_wheel(),
+      retired_nodes(), retired_buckets(), retired_tables() { }
+
+marky::Backend_SnapshotMap::~Backend_SnapshotMap() {
+    reclaim();
+    Table* tables[] = { next_table.load(), prev_table.load() };
+    for (size_t t = 0; t < 2; ++t) {
+        for (size_t i = 0; i < tables[t]->size; ++i) {
+            const Bucket* bucket = tables[t]->buckets[i].load();
+            if (bucket == NULL) {
+                continue;
+            }
+            for (std::vector<const Node*>::const_iterator iter = bucket->nodes.begin();
+                 iter != bucket->nodes.end(); ++iter) {
+                delete *iter;
+            }
+            delete bucket;
+        }
+        delete tables[t];
+    }
+}
+
+marky::State marky::Backend_SnapshotMap::create_state() {
+    return State(time(NULL), 0);
+}
+
+bool marky::Backend_SnapshotMap::store_state(const State& /*state*/, scorer_t /*scorer*/) {
+    /* no persistent storage */
+    return true;
+}
+
+bool marky::Backend_SnapshotMap::get_random(const State& /*state*/, scorer_t /*scorer*/, word_t& word) {
+    EpochGuard guard(epochs);
+    const Table& table = *next_table.load();
+    /* start at a random bucket, moving on if it's empty */
+    const size_t start = pick_rand(table.size);
+    for (size_t i = 0; i < table.size; ++i) {
+        const Bucket* bucket = table.buckets[(start + i) % table.size].load();
+        if (bucket == NULL) {
+            continue;
+        }
+        const Node& node = *bucket->nodes[pick_rand(bucket->nodes.size())];
+        snippet_ptr_set_t::const_iterator iter = node.snippets.begin();
+        std::advance(iter, pick_rand(node.snippets.size()));
+        /* put a little effort into finding a non-end/start word */
+        word = (*iter)->words.front();
+        if (word == IBackend::LINE_START) {
+            word = (*iter)->words.back();
+        }
+        return true;
+    }
+    word = IBackend::LINE_END;
+    return true;
+}
+
+bool marky::Backend_SnapshotMap::get_prev(const State& state, selector_t selector,
+        scorer_t scorer, const words_t& search_words, word_t& prev) {
+    EpochGuard guard(epochs);
+    const Table& table = *prev_table.load();
+    words_t search(search_words);
+    for (;;) {
+        snippet_t snippet = select(table, search, state, selector, scorer);
+        if (snippet) {
+            prev = snippet->words.front();
+            return true;
+        }
+        if (search.size() < 2) {
+            prev = IBackend::LINE_START;
+            return true;
+        }
+        search.pop_back();
+    }
+}
+
+bool marky::Backend_SnapshotMap::get_next(const State& state, selector_t selector,
+        scorer_t scorer, const words_t& search_words, word_t& next) {
+    EpochGuard guard(epochs);
+    const Table& table = *next_table.load();
+    words_t search(search_words);
+    for (;;) {
+        snippet_t snippet = select(table, search, state, selector, scorer);
+        if (snippet) {
+            next = snippet->words.back();
+            return true;
+        }
+        if (search.size() < 2) {
+            next = IBackend::LINE_END;
+            return true;
+        }
+        search.pop_front();
+    }
+}
+
+bool marky::Backend_SnapshotMap::update_snippets(const State& state, scorer_t scorer,
+        const words_to_counts::map_t& line_windows) {
+    std::lock_guard<std::mutex> lock(write_mutex);
+
+    changes_t next_changes, prev_changes;
+    for (words_to_counts::map_t::const_iterator window_iter = line_windows.begin();
+         window_iter != line_windows.end(); ++window_iter) {
+        const words_t& window = window_iter->first;
+        if (window.empty()) {
+            continue;
+        }
+
+        /* published snippets are never modified, so update a copy */
+        snippet_t old_snippet, new_snippet;
+        std::unordered_map<words_t, snippet_t>::iterator iter = snippets.find(window);
+        if (iter == snippets.end()) {
+            new_snippet.reset(new Snippet(window, state.time, state.count,
+                            window_iter->second));
+            snippets.insert(std::make_pair(window, new_snippet));
+        } else {
+            old_snippet = iter->second;
+            new_snippet.reset(new Snippet(*old_snippet));
+            new_snippet->increment(scorer, latest(state, old_snippet->cur_state()),
+                    window_iter->second);
+            iter->second = new_snippet;
+        }
+        /* the old copy's entries are skipped once it's been replaced */
+        schedule(new_snippet, scorer, state, true);
+        schedule(new_snippet, scorer, state, false);
+
+        words_t prefix(window);
+        prefix.pop_back();// all except back
+        change_t& next_change = next_changes[prefix];
+        words_t suffix(window);
+        suffix.pop_front();// all except front
+        change_t& prev_change = prev_changes[suffix];
+        if (old_snippet) {
+            next_change.removed.push_back(old_snippet);
+            prev_change.removed.push_back(old_snippet);
+        }
+        next_change.added.push_back(new_snippet);
+        prev_change.added.push_back(new_snippet);
+    }
+
+    apply(next_table, next_changes);
+    apply(prev_table, prev_changes);
+    if (retired_nodes.size() + retired_buckets.size() >= RECLAIM_THRESHOLD) {
+        reclaim();
+    }
+    return true;
+}
+
+bool marky::Backend_SnapshotMap::prune(const State& state, scorer_t scorer) {
+    std::lock_guard<std::mutex> lock(write_mutex);
+
+    changes_t next_changes, prev_changes;
+    std::vector<snippet_t> due;
+    for (int i = 0; i < 2; ++i) {
+        due.clear();
+        bool count_dimension = (i == 0);
+        if (count_dimension) {
+            count_wheel.advance(state.count, due);
+        } else {
+            time_wheel.advance((state.time < 0) ? 0 : state.time, due);
+        }
+        for (std::vector<snippet_t>::const_iterator due_iter = due.begin();
+             due_iter != due.end(); ++due_iter) {
+            const snippet_t& snippet = *due_iter;
+            std::unordered_map<words_t, snippet_t>::iterator iter =
+                snippets.find(snippet->words);
+            if (iter == snippets.end() || iter->second != snippet) {
+                continue;
+            }
+            if (snippet->score(scorer, state) > 0) {
+                schedule(snippet, scorer, state, count_dimension);
+                continue;
+            }
+            words_t prefix(snippet->words);
+            prefix.pop_back();
+            next_changes[prefix].removed.push_back(snippet);
+            words_t suffix(snippet->words);
+            suffix.pop_front();
+            prev_changes[suffix].removed.push_back(snippet);
+            snippets.erase(iter);
+        }
+    }
+
+    apply(next_table, next_changes);
+    apply(prev_table, prev_changes);
+    reclaim();
+    return true;
+}
+
+bool marky::Backend_SnapshotMap::visit_snippets(snippet_visitor_t visitor) {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    for (std::unordered_map<words_t, snippet_t>::const_iterator iter = snippets.begin();
+         iter != snippets.end(); ++iter) {
+        if (!visitor(*iter->second)) {
+            break;
+        }
+    }
+    return true;
+}
+
+marky::snippet_t marky::Backend_SnapshotMap::select(const Table& table,
+        const words_t& context, const State& state, selector_t selector, scorer_t scorer) {
+    const Bucket* bucket = table.bucket(context).load();
+    if (bucket == NULL) {
+        return snippet_t();
+    }
+    for (std::vector<const Node*>::const_iterator iter = bucket->nodes.begin();
+         iter != bucket->nodes.end(); ++iter) {
+        if ((*iter)->context == context) {
+            return selector((*iter)->snippets, scorer, state);
+        }
+    }
+    return snippet_t();
+}
+
+void marky::Backend_SnapshotMap::apply(std::atomic<Table*>& table_ptr,
+        const changes_t& changes) {
+    Table& table = *table_ptr.load();
+    for (changes_t::const_iterator change_iter = changes.begin();
+         change_iter != changes.end(); ++change_iter) {
+        const words_t& context = change_iter->first;
+        const change_t& change = change_iter->second;
+
+        /* copy the bucket and the node, then swap the copies in */
+        std::atomic<const Bucket*>& slot = table.bucket(context);
+        const Bucket* old_bucket = slot.load();
+        const Node* old_node = NULL;
+        Bucket* new_bucket = new Bucket;
+        if (old_bucket != NULL) {
+            for (std::vector<const Node*>::const_iterator iter = old_bucket->nodes.begin();
+                 iter != old_bucket->nodes.end(); ++iter) {
+                if ((*iter)->context == context) {
+                    old_node = *iter;
+                } else {
+                    new_bucket->nodes.push_back(*iter);
+                }
+            }
+        }
+
+        Node* new_node = new Node(context);
+        if (old_node != NULL) {
+            new_node->snippets = old_node->snippets;
+        }
+        for (std::vector<snippet_t>::const_iterator iter = change.removed.begin();
+             iter != change.removed.end(); ++iter) {
+            new_node->snippets.erase(*iter);
+        }
+        new_node->snippets.insert(change.added.begin(), change.added.end());
+
+        if (new_node->snippets.empty()) {
+            delete new_node;
+            if (old_node != NULL) {
+                --table.node_count;
+            }
+        } else {
+            new_bucket->nodes.push_back(new_node);
+            if (old_node == NULL) {
+                ++table.node_count;
+            }
+        }
+        if (new_bucket->nodes.empty()) {
+            delete new_bucket;
+            new_bucket = NULL;
+        }
+
+        slot.store(new_bucket);
+        if (old_node != NULL) {
+            retired_nodes.push_back(old_node);
+        }
+        if (old_bucket != NULL) {
+            retired_buckets.push_back(old_bucket);
+        }
+    }
+
+    if (table.node_count > table.size * MAX_LOAD) {
+        grow(table_ptr);
+    }
+}
+
+void marky::Backend_SnapshotMap::grow(std::atomic<Table*>& table_ptr) {
+    Table* old_table = table_ptr.load();
+    Table* new_table = new Table(old_table->size * 4);
+    DEBUG("Growing table from %lu to %lu buckets", old_table->size, new_table->size);
+
+    /* the nodes themselves are carried over as-is */
+    std::vector<Bucket*> new_buckets(new_table->size, NULL);
+    for (size_t i = 0; i < old_table->size; ++i) {
+        const Bucket* old_bucket = old_table->buckets[i].load();
+        if (old_bucket == NULL) {
+            continue;
+        }
+        for (std::vector<const Node*>::const_iterator iter = old_bucket->nodes.begin();
+             iter != old_bucket->nodes.end(); ++iter) {
+            Bucket*& dest = new_buckets[hash_words((*iter)->context) % new_table->size];
+            if (dest == NULL) {
+                dest = new Bucket;
+            }
+            dest->nodes.push_back(*iter);
+        }
+        retired_buckets.push_back(old_bucket);
+    }
+    for (size_t i = 0; i < new_table->size; ++i) {
+        new_table->buckets[i] = new_buckets[i];
+    }
+    new_table->node_count = old_table->node_count;
+
+    table_ptr.store(new_table);
+    retired_tables.push_back(old_table);
+}
+
+void marky::Backend_SnapshotMap::schedule(const snippet_t& snippet, scorer_t scorer,
+        const State& state, bool count_dimension) {
+    uint64_t expiry;
+    if (count_dimension) {
+        if (expiry::predict_count(*snippet, scorer, state, expiry)) {
+            count_wheel.insert(expiry, snippet);
+        }
+    } else if (expiry::predict_time(*snippet, scorer, state, expiry)) {
+        time_wheel.insert(expiry, snippet);
+    }
+}
+
+void marky::Backend_SnapshotMap::reclaim() {
+    if (retired_nodes.empty() && retired_buckets.empty() && retired_tables.empty()) {
+        return;
+    }
+    /* wait for any readers which may still see the retired data */
+    epochs.synchronize();
+    for (std::vector<const Node*>::const_iterator iter = retired_nodes.begin();
+         iter != retired_nodes.end(); ++iter) {
+        delete *iter;
+    }
+    for (std::vector<const Bucket*>::const_iterator iter = retired_buckets.begin();
+         iter != retired_buckets.end(); ++iter) {
+        delete *iter;
+    }
+    for (std::vector<Table*>::const_iterator iter = retired_tables.begin();
+         iter != retired_tables.end(); ++iter) {
+        delete *iter;
+    }
+    retired_nodes.clear();
+    retired_buckets.clear();
+    retired_tables.clear();
+}
@@ -0,0 +1,105 @@
+#ifndef MARKY_BACKEND_SNAPSHOT_MAP_H
+#define MARKY_BACKEND_SNAPSHOT_MAP_H
+
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "backend.h"
+#include "epoch.h"
+#include "expiry-wheel.h"
+
+namespace marky {
+    /* An in-memory backend for one or more writer threads running alongside
+     * many reader threads, eg a bot which ingests lines while producing
+     * replies.
+     *
+     * get_next(), get_prev() and get_random() never take a lock: they read
+     * from immutable context nodes which are published through atomic
+     * pointers. Writers serialize on a mutex, build new copies of the nodes
+     * they touch, publish them, and free the old copies once no reader can
+     * still be looking at them (see EpochDomain). Each read sees every
+     * context either entirely before or entirely after a given update.
+     *
+     * The cost is paid by writers: updating a context copies its list of
+     * snippets, so this suits data where reads outnumber writes. */
+    class Backend_SnapshotMap : public IBackend {
+    public:
+        Backend_SnapshotMap();
+        virtual ~Backend_SnapshotMap();
+
+        State create_state();
+        bool store_state(const State& state, scorer_t scorer);
+
+        bool get_random(const State& state, scorer_t scorer, word_t& word);
+
+        bool get_prev(const State& state, selector_t selector, scorer_t scorer,
+                const words_t& search_words, word_t& prev);
+        bool get_next(const State& state, selector_t selector, scorer_t scorer,
+                const words_t& search_words, word_t& next);
+
+        bool update_snippets(const State& state, scorer_t scorer,
+                const words_to_counts::map_t& line_windows);
+
+        bool prune(const State& state, scorer_t scorer);
+
+        bool visit_snippets(snippet_visitor_t visitor);
+
+    private:
+        struct Node;
+        struct Bucket;
+        class Table;
+
+        /* snippets to be removed from and added to a context's node */
+        struct change_t {
+            std::vector<snippet_t> removed;
+            std::vector<snippet_t> added;
+        };
+        typedef std::unordered_map<words_t, change_t> changes_t;
+
+        /* Reader-side lookup, to be called within an EpochGuard. */
+        static snippet_t select(const Table& table, const words_t& context,
+                const State& state, selector_t selector, scorer_t scorer);
+
+        /* Writer-side functions, to be called with write_mutex held. */
+        void apply(std::atomic<Table*>& table, const changes_t& changes);
+        void grow(std::atomic<Table*>& table);
+        void schedule(const snippet_t& snippet, scorer_t scorer, const State& state,
+                bool count_dimension);
+        void reclaim();
+
+        std::atomic<Table*> next_table;/* prefix words -> snippets */
+        std::atomic<Table*> prev_table;/* suffix words -> snippets */
+        EpochDomain epochs;
+
+        std::mutex write_mutex;
+        /* the latest copy of each snippet, only accessed by writers */
+        std::unordered_map<words_t, snippet_t> snippets;
+        ExpiryWheel count_wheel;
+        ExpiryWheel time_wheel;
+        /* unpublished data, to be freed once readers are done with it */
+        std::vector<const Node*> retired_nodes;
+        std::vector<const Bucket*> retired_buckets;
+        std::vector<Table*> retired_tables;
+    };
+}
+
+#endif
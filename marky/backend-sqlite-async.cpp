@@ -0,0 +1,360 @@
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "backend-sqlite-async.h"
+#include "config.h"
+#include "rand-util.h"
+
+/*static*/ std::shared_ptr<marky::Backend_SQLiteAsync> marky::Backend_SQLiteAsync::create(
+        const std::string& db_file_path, size_t max_queued/*=4*/,
+        const Backend_SQLite::options_t& options/*=Backend_SQLite::options_t()*/) {
+    if (max_queued == 0) {
+        ERROR("Need room for at least one queued write for sqlite db at %s",
+                db_file_path.c_str());
+        return std::shared_ptr<Backend_SQLiteAsync>();
+    }
+    std::shared_ptr<Backend_SQLiteAsync> ret(new Backend_SQLiteAsync(max_queued));
+
+    /* the writer goes first, to create or migrate the db and switch it to WAL */
+    ret->writer = new Backend_SQLite(db_file_path, options,
+            Backend_SQLite::CONN_WRITER);
+    if (!ret->writer->init() ||
+            (options.bulk_load && !ret->writer->init_bulk_load())) {
+        return std::shared_ptr<Backend_SQLiteAsync>();
+    }
+    ret->reader = new Backend_SQLite(db_file_path, options,
+            Backend_SQLite::CONN_READER);
+    if (!ret->reader->init()) {
+        return std::shared_ptr<Backend_SQLiteAsync>();
+    }
+    ret->thread = std::thread(&Backend_SQLiteAsync::run, ret.get());
+    return ret;
+}
+
+marky::Backend_SQLiteAsync::Backend_SQLiteAsync(size_t max_queued)
+    : max_queued(max_queued), writer(NULL),
+      queue_mutex(), queue_cond(), done_cond(), jobs(),
+      queued_seq(0), done_seq(0), failed(false), stopping(false), thread(),
+      read_mutex(), reader(NULL),
+      pending(), pending_nexts(), pending_prevs(), pending_batches() { }
+
+marky::Backend_SQLiteAsync::~Backend_SQLiteAsync() {
+    if (thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        queue_cond.notify_one();
+        thread.join();
+        if (failed) {
+            ERROR("Some queued writes to the sqlite db failed");
+        }
+    }
+    delete reader;
+    delete writer;
+}
+
+bool marky::Backend_SQLiteAsync::sync() {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    while (!jobs.empty()) {
+        done_cond.wait(lock);
+    }
+    bool ok = !failed;
+    failed = false;
+    return ok;
+}
+
+marky::State marky::Backend_SQLiteAsync::create_state() {
+    sync();
+    std::lock_guard<std::mutex> lock(read_mutex);
+    return reader->create_state();
+}
+
+bool marky::Backend_SQLiteAsync::store_state(const State& state, scorer_t scorer) {
+    enqueue([state, scorer](Backend_SQLite& writer) {
+                return writer.store_state(state, scorer);
+            });
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    return !failed;
+}
+
+bool marky::Backend_SQLiteAsync::get_random(const State& state, scorer_t scorer,
+        word_t& random) {
+    std::lock_guard<std::mutex> lock(read_mutex);
+    if (!read([&](Backend_SQLite& reader) {
+                return reader.get_random(state, scorer, random);
+            })) {
+        return false;
+    }
+    if (random != IBackend::LINE_END || pending.empty()) {
+        return true;
+    }
+
+    /* nothing's been committed yet, so pick from what's on its way */
+    pending_map_t::const_iterator pick = pending.begin();
+    std::advance(pick, pick_rand(pending.size()));
+    const words_t& words = pick->second.snippet->words;
+    for (words_t::const_iterator iter = words.begin();
+         iter != words.end(); ++iter) {
+        if (*iter != IBackend::LINE_END) {
+            random = *iter;
+        }
+    }
+    return true;
+}
+
+bool marky::Backend_SQLiteAsync::get_prev(const State& state, selector_t selector,
+        scorer_t scorer, const words_t& search_words, word_t& prev) {
+    sync();
+    std::lock_guard<std::mutex> lock(read_mutex);
+    return read([&](Backend_SQLite& reader) {
+                return reader.get_prev(state, selector, scorer, search_words, prev);
+            });
+}
+
+bool marky::Backend_SQLiteAsync::get_next(const State& state, selector_t selector,
+        scorer_t scorer, const words_t& search_words, word_t& next) {
+    sync();
+    std::lock_guard<std::mutex> lock(read_mutex);
+    return read([&](Backend_SQLite& reader) {
+                return reader.get_next(state, selector, scorer, search_words, next);
+            });
+}
+
+bool marky::Backend_SQLiteAsync::update_snippets(const State& state, scorer_t scorer,
+        const words_to_counts::map_t& line_windows) {
+    enqueue([state, scorer, line_windows](Backend_SQLite& writer) {
+                return writer.begin_transaction() &&
+                    writer.end_transaction(
+                            writer.update_snippets(state, scorer, line_windows));
+            });
+    return sync();
+}
+
+bool marky::Backend_SQLiteAsync::prune(const State& state, scorer_t scorer) {
+    enqueue([state, scorer](Backend_SQLite& writer) {
+                return writer.prune(state, scorer);
+            });
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    return !failed;
+}
+
+bool marky::Backend_SQLiteAsync::compact() {
+    enqueue([](Backend_SQLite& writer) {
+                return writer.compact();
+            });
+    return sync();
+}
+
+bool marky::Backend_SQLiteAsync::visit_snippets(snippet_visitor_t visitor) {
+    sync();
+    std::lock_guard<std::mutex> lock(read_mutex);
+    return read([&](Backend_SQLite& reader) {
+                return reader.visit_snippets(visitor);
+            });
+}
+
+bool marky::Backend_SQLiteAsync::snapshot(const std::string& dest_path) {
+    sync();
+    std::lock_guard<std::mutex> lock(read_mutex);
+    return reader->snapshot(dest_path);
+}
+
+bool marky::Backend_SQLiteAsync::get_prevs(const words_t& words, snippet_ptr_set_t& out) {
+    std::lock_guard<std::mutex> lock(read_mutex);
+    if (!read([&](Backend_SQLite& reader) {
+                return reader.get_prevs(words, out);
+            })) {
+        return false;
+    }
+    overlay(pending_prevs, words, out);
+    return true;
+}
+
+bool marky::Backend_SQLiteAsync::get_nexts(const words_t& words, snippet_ptr_set_t& out) {
+    std::lock_guard<std::mutex> lock(read_mutex);
+    if (!read([&](Backend_SQLite& reader) {
+                return reader.get_nexts(words, out);
+            })) {
+        return false;
+    }
+    overlay(pending_nexts, words, out);
+    return true;
+}
+
+bool marky::Backend_SQLiteAsync::get_snippets(const words_to_counts::map_t& windows,
+        words_to_snippet_t& out) {
+    std::lock_guard<std::mutex> lock(read_mutex);
+    if (!read([&](Backend_SQLite& reader) {
+                return reader.get_snippets(windows, out);
+            })) {
+        return false;
+    }
+    if (pending.empty()) {
+        return true;
+    }
+    for (words_to_counts::map_t::const_iterator iter = windows.begin();
+         iter != windows.end(); ++iter) {
+        pending_map_t::const_iterator found = pending.find(iter->first);
+        if (found != pending.end()) {
+            /* callers may modify what we return, so hand out a copy */
+            out[iter->first] = snippet_t(new Snippet(*found->second.snippet));
+        }
+    }
+    return true;
+}
+
+bool marky::Backend_SQLiteAsync::flush(const State& state, scorer_t scorer,
+        const snippet_ptr_set_t& snippets) {
+    /* the caller may keep modifying its snippets, so the writer gets a copy */
+    std::shared_ptr<snippet_ptr_set_t> batch(new snippet_ptr_set_t);
+    for (snippet_ptr_set_t::const_iterator iter = snippets.begin();
+         iter != snippets.end(); ++iter) {
+        batch->insert(snippet_t(new Snippet(**iter)));
+    }
+
+    uint64_t seq = enqueue([state, scorer, batch](Backend_SQLite& writer) {
+                return writer.flush(state, scorer, *batch);
+            });
+
+    {
+        std::lock_guard<std::mutex> lock(read_mutex);
+        std::vector<words_t> batch_words;
+        batch_words.reserve(batch->size());
+        for (snippet_ptr_set_t::const_iterator iter = batch->begin();
+             iter != batch->end(); ++iter) {
+            const words_t& words = (*iter)->words;
+            pending_t& entry = pending[words];
+            entry.snippet = *iter;
+            entry.seq = seq;
+            batch_words.push_back(words);
+
+            words_t prefix(words), suffix(words);
+            prefix.pop_back();
+            suffix.pop_front();
+            pending_nexts[prefix].insert(words);
+            pending_prevs[suffix].insert(words);
+        }
+        pending_batches.push_back(std::make_pair(seq, batch_words));
+    }
+
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    return !failed;
+}
+
+uint64_t marky::Backend_SQLiteAsync::enqueue(job_t job) {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    while (jobs.size() >= max_queued) {
+        done_cond.wait(lock);
+    }
+    jobs.push_back(job);
+    uint64_t seq = ++queued_seq;
+    lock.unlock();
+    queue_cond.notify_one();
+    return seq;
+}
+
+void marky::Backend_SQLiteAsync::run() {
+    for (;;) {
+        job_t job;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            while (jobs.empty() && !stopping) {
+                queue_cond.wait(lock);
+            }
+            if (jobs.empty()) {
+                return;
+            }
+            /* left in the queue while it runs, so that sync() waits for it */
+            job = jobs.front();
+        }
+
+        bool ok = job(*writer);
+
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            jobs.pop_front();
+            ++done_seq;
+            if (!ok) {
+                failed = true;
+            }
+        }
+        done_cond.notify_all();
+    }
+}
+
+bool marky::Backend_SQLiteAsync::read(read_t read) {
+    purge();
+    return reader->begin_transaction() &&
+        reader->end_transaction(read(*reader));
+}
+
+void marky::Backend_SQLiteAsync::purge() {
+    const uint64_t done = done_seq;
+    while (!pending_batches.empty() && pending_batches.front().first <= done) {
+        const std::vector<words_t>& batch_words = pending_batches.front().second;
+        for (std::vector<words_t>::const_iterator iter = batch_words.begin();
+             iter != batch_words.end(); ++iter) {
+            pending_map_t::iterator found = pending.find(*iter);
+            if (found == pending.end() || found->second.seq > done) {
+                /* a later flush has a newer copy which is still on its way */
+                continue;
+            }
+            pending.erase(found);
+
+            words_t prefix(*iter), suffix(*iter);
+            prefix.pop_back();
+            suffix.pop_front();
+            pending_index_t::iterator nexts = pending_nexts.find(prefix);
+            nexts->second.erase(*iter);
+            if (nexts->second.empty()) {
+                pending_nexts.erase(nexts);
+            }
+            pending_index_t::iterator prevs = pending_prevs.find(suffix);
+            prevs->second.erase(*iter);
+            if (prevs->second.empty()) {
+                pending_prevs.erase(prevs);
+            }
+        }
+        pending_batches.pop_front();
+    }
+}
+
+void marky::Backend_SQLiteAsync::overlay(const pending_index_t& index,
+        const words_t& words, snippet_ptr_set_t& out) const {
+    if (pending.empty()) {
+        return;
+    }
+    /* the db's copies are older than any pending ones */
+    for (snippet_ptr_set_t::iterator iter = out.begin(); iter != out.end(); ) {
+        if (pending.find((*iter)->words) != pending.end()) {
+            iter = out.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+    pending_index_t::const_iterator found = index.find(words);
+    if (found == index.end()) {
+        return;
+    }
+    for (std::unordered_set<words_t>::const_iterator iter = found->second.begin();
+         iter != found->second.end(); ++iter) {
+        /* callers may modify what we return, so hand out a copy */
+        out.insert(snippet_t(new Snippet(*pending.find(*iter)->second.snippet)));
+    }
+}
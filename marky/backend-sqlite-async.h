@@ -0,0 +1,157 @@
+#ifndef MARKY_BACKEND_SQLITE_ASYNC_H
+#define MARKY_BACKEND_SQLITE_ASYNC_H
+
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "backend.h"
+#include "backend-sqlite.h"
+
+namespace marky {
+    /* A sqlite3 backend which writes to the db on a background thread, so
+     * that a Backend_Cache in front of it can go back to collecting lines
+     * while its last batch is being flushed.
+     *
+     * flush() copies the batch, queues it for the writer thread, and returns
+     * right away. If 'max_queued' batches (or prunes, etc) are already
+     * waiting, it blocks until one has been written. Until a batch has been
+     * committed, get_prevs(), get_nexts(), get_snippets() and get_random()
+     * read it from memory, layered over what a read-only connection sees in
+     * the db, so the caller always sees its own writes.
+     *
+     * Errors on the writer thread are reported by the next flush() or by
+     * sync(). As with Backend_SQLitePool, the db is kept in WAL mode. */
+    class Backend_SQLiteAsync : public ICacheable {
+    public:
+        /* Returns an async SQLite backend which queues at most 'max_queued'
+         * writes, or an empty ptr if there was an error when creating it.
+         * 'options' are as with Backend_SQLite. */
+        static std::shared_ptr<Backend_SQLiteAsync> create(
+                const std::string& db_file_path, size_t max_queued = 4,
+                const Backend_SQLite::options_t& options = Backend_SQLite::options_t());
+
+        /* Waits for any queued writes to finish. */
+        virtual ~Backend_SQLiteAsync();
+
+        /* Waits until every queued write has been committed. Returns false
+         * if any of them failed since the last call to sync(). */
+        bool sync();
+
+        /* for IBackend: create_state(), get_prev(), get_next() and
+         * visit_snippets() sync() before reading, while the rest are queued
+         * behind any pending flushes. update_snippets() waits for its own
+         * result. */
+        State create_state();
+        bool store_state(const State& state, scorer_t scorer);
+
+        bool get_random(const State& state, scorer_t scorer, word_t& word);
+
+        bool get_prev(const State& state, selector_t selector, scorer_t scorer,
+                const words_t& search_words, word_t& prev);
+        bool get_next(const State& state, selector_t selector, scorer_t scorer,
+                const words_t& search_words, word_t& next);
+
+        bool update_snippets(const State& state, scorer_t scorer,
+                const words_to_counts::map_t& line_windows);
+
+        bool prune(const State& state, scorer_t scorer);
+
+        bool visit_snippets(snippet_visitor_t visitor);
+
+        /* As Backend_SQLite::compact(), queued behind any pending writes
+         * and then waited for. */
+        bool compact();
+        /* As Backend_SQLite::snapshot(), after any queued writes. */
+        bool snapshot(const std::string& dest_path);
+
+        /* for ICacheable: */
+        bool get_prevs(const words_t& words, snippet_ptr_set_t& out);
+        bool get_nexts(const words_t& words, snippet_ptr_set_t& out);
+        bool get_snippets(const words_to_counts::map_t& windows,
+                words_to_snippet_t& out);
+
+        bool flush(const State& state, scorer_t scorer,
+                const snippet_ptr_set_t& links);
+
+    private:
+        typedef std::function<bool(Backend_SQLite&)> job_t;
+        typedef std::function<bool(Backend_SQLite&)> read_t;
+
+        /* a flushed snippet which may not have been committed yet */
+        struct pending_t {
+            snippet_t snippet;
+            uint64_t seq;/* of the flush job which writes it */
+        };
+        typedef std::unordered_map<words_t, pending_t> pending_map_t;
+        typedef std::unordered_map<words_t, std::unordered_set<words_t> > pending_index_t;
+
+        Backend_SQLiteAsync(size_t max_queued);
+
+        /* Queues 'job' for the writer thread, waiting for room in the queue.
+         * Returns the job's sequence number. */
+        uint64_t enqueue(job_t job);
+        /* The writer thread's loop, which runs until 'stopping' is set and
+         * the queue is empty. */
+        void run();
+
+        /* Runs 'read' with the reader, within a read transaction. Must be
+         * called with read_mutex held. */
+        bool read(read_t read);
+        /* Drops pending snippets whose flushes have been committed. Must be
+         * called with read_mutex held. */
+        void purge();
+        /* Replaces any snippets in 'out' which have pending copies, and adds
+         * pending snippets found under 'words' in 'index'. Must be called
+         * with read_mutex held. */
+        void overlay(const pending_index_t& index, const words_t& words,
+                snippet_ptr_set_t& out) const;
+
+        const size_t max_queued;
+        Backend_SQLite* writer;/* only used by the writer thread */
+
+        std::mutex queue_mutex;
+        std::condition_variable queue_cond;/* signals the writer thread */
+        std::condition_variable done_cond;/* signals callers waiting on jobs */
+        std::deque<job_t> jobs;/* the front is the job being run, if any */
+        uint64_t queued_seq;
+        std::atomic<uint64_t> done_seq;
+        bool failed;
+        bool stopping;
+        std::thread thread;
+
+        std::mutex read_mutex;
+        Backend_SQLite* reader;
+        /* flushed snippets, with indexes by prefix/suffix */
+        pending_map_t pending;
+        pending_index_t pending_nexts, pending_prevs;
+        /* the words in each flush, in the order they were queued */
+        std::deque<std::pair<uint64_t, std::vector<words_t> > > pending_batches;
+    };
+}
+
+#endif
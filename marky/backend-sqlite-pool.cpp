@@ -0,0 +1,146 @@
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "backend-sqlite-pool.h"
+#include "config.h"
+
+/*static*/ marky::backend_t marky::Backend_SQLitePool::create(const std::string& db_file_path,
+        size_t reader_count/*=4*/,
+        const Backend_SQLite::options_t& options/*=Backend_SQLite::options_t()*/) {
+    if (reader_count == 0) {
+        ERROR("Need at least one reader for sqlite db at %s", db_file_path.c_str());
+        return backend_t();
+    }
+    Backend_SQLitePool* ret = new Backend_SQLitePool;
+
+    /* the writer goes first, to create or migrate the db and switch it to WAL */
+    ret->writer = new Backend_SQLite(db_file_path, options,
+            Backend_SQLite::CONN_WRITER);
+    if (!ret->writer->init()) {
+        delete ret;
+        return backend_t();
+    }
+    for (size_t i = 0; i < reader_count; ++i) {
+        Backend_SQLite* reader = new Backend_SQLite(db_file_path, options,
+                Backend_SQLite::CONN_READER);
+        ret->readers.push_back(reader);
+        if (!reader->init()) {
+            delete ret;
+            return backend_t();
+        }
+    }
+    ret->free_readers = ret->readers;
+    return backend_t(ret);
+}
+
+marky::Backend_SQLitePool::Backend_SQLitePool()
+    : write_mutex(), writer(NULL),
+      pool_mutex(), pool_cond(), readers(), free_readers() { }
+
+marky::Backend_SQLitePool::~Backend_SQLitePool() {
+    for (std::vector<Backend_SQLite*>::const_iterator iter = readers.begin();
+         iter != readers.end(); ++iter) {
+        delete *iter;
+    }
+    delete writer;
+}
+
+marky::State marky::Backend_SQLitePool::create_state() {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    return writer->create_state();
+}
+
+bool marky::Backend_SQLitePool::store_state(const State& state, scorer_t scorer) {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    return writer->store_state(state, scorer);
+}
+
+bool marky::Backend_SQLitePool::get_random(const State& state, scorer_t scorer, word_t& word) {
+    return read([&](Backend_SQLite& reader) {
+                return reader.get_random(state, scorer, word);
+            });
+}
+
+bool marky::Backend_SQLitePool::get_prev(const State& state, selector_t selector,
+        scorer_t scorer, const words_t& search_words, word_t& prev) {
+    return read([&](Backend_SQLite& reader) {
+                return reader.get_prev(state, selector, scorer, search_words, prev);
+            });
+}
+
+bool marky::Backend_SQLitePool::get_next(const State& state, selector_t selector,
+        scorer_t scorer, const words_t& search_words, word_t& next) {
+    return read([&](Backend_SQLite& reader) {
+                return reader.get_next(state, selector, scorer, search_words, next);
+            });
+}
+
+bool marky::Backend_SQLitePool::update_snippets(const State& state, scorer_t scorer,
+        const words_to_counts::map_t& line_windows) {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    /* readers see all of the line's windows or none of them */
+    if (!writer->begin_transaction()) {
+        return false;
+    }
+    return writer->end_transaction(writer->update_snippets(state, scorer, line_windows));
+}
+
+bool marky::Backend_SQLitePool::prune(const State& state, scorer_t scorer) {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    return writer->prune(state, scorer);
+}
+
+bool marky::Backend_SQLitePool::compact() {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    return writer->compact();
+}
+
+bool marky::Backend_SQLitePool::visit_snippets(snippet_visitor_t visitor) {
+    return read([&](Backend_SQLite& reader) {
+                return reader.visit_snippets(visitor);
+            });
+}
+
+bool marky::Backend_SQLitePool::snapshot(const std::string& dest_path) {
+    /* within the read transaction, the copy sees a single version of the db */
+    return read([&](Backend_SQLite& reader) {
+                return reader.snapshot(dest_path);
+            });
+}
+
+bool marky::Backend_SQLitePool::read(read_t read) {
+    Backend_SQLite* reader;
+    {
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        while (free_readers.empty()) {
+            pool_cond.wait(lock);
+        }
+        reader = free_readers.back();
+        free_readers.pop_back();
+    }
+
+    bool ok = reader->begin_transaction() &&
+        reader->end_transaction(read(*reader));
+
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        free_readers.push_back(reader);
+    }
+    pool_cond.notify_one();
+    return ok;
+}
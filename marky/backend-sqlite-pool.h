@@ -0,0 +1,95 @@
+#ifndef MARKY_BACKEND_SQLITE_POOL_H
+#define MARKY_BACKEND_SQLITE_POOL_H
+
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "backend.h"
+#include "backend-sqlite.h"
+
+namespace marky {
+    /* A sqlite3 backend whose functions may be called concurrently from
+     * multiple threads, eg to produce() replies while an import is running.
+     *
+     * The db is kept in WAL mode, and has one writer connection plus a pool
+     * of read-only connections, each with its own prepared statements.
+     * Updates and prunes take turns on the writer, while each get_*() or
+     * visit_snippets() call borrows a reader and sees a consistent snapshot
+     * of the db, as of the last commit before the call started. If every
+     * reader is busy, the call waits for one to be returned.
+     *
+     * Unlike Backend_SQLite on its own, the db isn't left corruptible by a
+     * crash, at some cost to write speed. */
+    class Backend_SQLitePool : public IBackend {
+    public:
+        /* Returns a pooled SQLite backend with 'reader_count' read-only
+         * connections, or an empty ptr if there was an error when creating
+         * it. 'options' are as with Backend_SQLite, and apply to each
+         * connection, except for 'bulk_load' which is ignored. */
+        static backend_t create(const std::string& db_file_path,
+                size_t reader_count = 4,
+                const Backend_SQLite::options_t& options = Backend_SQLite::options_t());
+
+        virtual ~Backend_SQLitePool();
+
+        State create_state();
+        bool store_state(const State& state, scorer_t scorer);
+
+        bool get_random(const State& state, scorer_t scorer, word_t& word);
+
+        bool get_prev(const State& state, selector_t selector, scorer_t scorer,
+                const words_t& search_words, word_t& prev);
+        bool get_next(const State& state, selector_t selector, scorer_t scorer,
+                const words_t& search_words, word_t& next);
+
+        bool update_snippets(const State& state, scorer_t scorer,
+                const words_to_counts::map_t& line_windows);
+
+        bool prune(const State& state, scorer_t scorer);
+
+        bool visit_snippets(snippet_visitor_t visitor);
+
+        /* As Backend_SQLite::compact(), using the writer. */
+        bool compact();
+        /* As Backend_SQLite::snapshot(), using a reader from the pool. */
+        bool snapshot(const std::string& dest_path);
+
+    private:
+        typedef std::function<bool(Backend_SQLite&)> read_t;
+
+        Backend_SQLitePool();
+
+        /* Runs 'read' with a reader from the pool, within a read transaction. */
+        bool read(read_t read);
+
+        std::mutex write_mutex;
+        Backend_SQLite* writer;
+
+        std::mutex pool_mutex;
+        std::condition_variable pool_cond;
+        std::vector<Backend_SQLite*> readers;/* all readers, for cleanup */
+        std::vector<Backend_SQLite*> free_readers;
+    };
+}
+
+#endif
@@ -16,12 +16,20 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <errno.h>
+#include <stdio.h>//rename
 #include <string.h>//strlen
+#include <unistd.h>//unlink
 #include <sqlite3.h>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <vector>
 
 #include "backend-sqlite.h"
 #include "backend-map.h"
 #include "config.h"
+#include "rand-util.h"
 #include "string-pack.h"
 
 //#define READ_DEBUG_ENABLED
@@ -52,62 +60,230 @@ static std::string str(const marky::words_t& words) {
 
 #define STATE_KEY_TIME "time"
 #define STATE_KEY_COUNT "count"
+/* an upper bound on the stored scores, for weighting get_random() */
+#define STATE_KEY_MAX_SCORE "max_score"
+
+/* Schema versions are tracked with PRAGMA user_version:
+   0/1: snippets stored as pack()ed TEXT, with pack()ed prevs/nexts searches
+   2: words stored once in a dictionary, snippets keyed by integer IDs
+   3: snippets clustered by (prefix_id, next_word), with a covering prevs index */
+#define SCHEMA_VERSION 3
+#define QUERY_SET_SCHEMA_VERSION "PRAGMA user_version = 3"
+#define QUERY_GET_SCHEMA_VERSION "PRAGMA user_version"
+
+#define WORDS_TABLE "marky_words"
+#define WORDS_COL_WORD_ID "word_id"
+#define WORDS_COL_WORD "word"
+
+/* contexts are the prefixes/suffixes which snippets are searched by */
+#define CONTEXT_TABLE "marky_context"
+#define CONTEXT_COL_CONTEXT_ID "context_id"
+#define CONTEXT_COL_WORDS "words"
 
 #define SNIPPET_TABLE "marky_snippet"
 #define SNIPPETS_COL_SNIPPET_ID "snippet_id"
-#define SNIPPETS_COL_WORDS "words"
+#define SNIPPETS_COL_PREFIX_ID "prefix_id"
+#define SNIPPETS_COL_NEXT_WORD "next_word"
+#define SNIPPETS_COL_SUFFIX_ID "suffix_id"
+#define SNIPPETS_COL_PREV_WORD "prev_word"
 #define SNIPPETS_COL_SCORE "score"
 #define SNIPPETS_COL_TIME "time"
 #define SNIPPETS_COL_COUNT "count"
 
-#define NEXTS_TABLE "marky_nexts"
-#define PREVS_TABLE "marky_prevs"
-#define SNIPPETS_COL_SEARCH "search"
+#define PREVS_INDEX "marky_prevs_index"
+#define RANDOM_INDEX "marky_random_index"
 
-#define SNIPPET_WORDS_INDEX "marky_snippet_words_index"
-#define PREVS_SEARCH_INDEX "marky_prevs_search_index"
-#define NEXTS_SEARCH_INDEX "marky_nexts_search_index"
+/* optional adjacency lists: each context's candidates, packed into one BLOB */
+#define NEXTS_LIST_TABLE "marky_nexts_list"
+#define PREVS_LIST_TABLE "marky_prevs_list"
+#define LIST_COL_CONTEXT_ID "context_id"
+#define LIST_COL_CANDIDATES "candidates"
 
-#define PRAGMA_ENABLE_FOREIGN_KEYS \
-    "PRAGMA foreign_keys = ON"
+/* version 1 tables, only used for migration */
+#define SNIPPET_TABLE_V1 "marky_snippet_v1"
+#define SNIPPETS_COL_WORDS_V1 "words"
+#define NEXTS_TABLE_V1 "marky_nexts"
+#define PREVS_TABLE_V1 "marky_prevs"
+/* version 2 table and index, only used for migration */
+#define SNIPPET_TABLE_V2 "marky_snippet_v2"
+#define NEXTS_INDEX_V2 "marky_nexts_index"
 
 #define UNSAFE_PRAGMA_OPTIMIZATIONS \
     "PRAGMA synchronous = OFF;" \
     "PRAGMA journal_mode = MEMORY"
+/* used by Backend_SQLitePool: readers get a consistent snapshot while the
+   writer commits, and a crash can't corrupt the db. NORMAL only syncs at
+   checkpoints, so a power loss may still lose the most recent commits. */
+#define QUERY_SET_WAL "PRAGMA journal_mode = WAL"
+#define QUERY_SET_WAL_SYNC "PRAGMA synchronous = NORMAL"
+#define WAL_MODE "wal"
+/* how long connections wait on each other's locks, eg during recovery or while
+   snapshot_file() reads the db from another process */
+#define BUSY_TIMEOUT_MS 5000
+/* see Backend_SQLite::options_t, each followed by the value */
+#define QUERY_SET_PAGE_SIZE "PRAGMA page_size = "
+#define QUERY_SET_CACHE_SIZE "PRAGMA cache_size = "
+#define QUERY_SET_MMAP_SIZE "PRAGMA mmap_size = "
+#define QUERY_SET_TEMP_STORE "PRAGMA temp_store = "
+/* New dbs keep track of their free pages, so that they can be handed back to
+   the filesystem a few at a time after a prune, rather than the file staying
+   at its peak size. This can only be set before any tables are created, after
+   which it takes a VACUUM to change, see compact(). */
+#define QUERY_SET_AUTO_VACUUM "PRAGMA auto_vacuum = INCREMENTAL"
+#define QUERY_GET_AUTO_VACUUM "PRAGMA auto_vacuum"
+#define AUTO_VACUUM_INCREMENTAL 2
+#define QUERY_GET_FREELIST_COUNT "PRAGMA freelist_count"
+#define QUERY_INCREMENTAL_VACUUM "PRAGMA incremental_vacuum = "/* followed by the page count */
+/* rebuilds the db without any free pages, switching it to auto_vacuum on the way */
+#define QUERY_COMPACT QUERY_SET_AUTO_VACUUM "; VACUUM"
+/* snapshot() copies this many pages at a time, pausing in between so that
+   writers on other connections can get in. If those writes keep making the
+   copy start over, it gives up on pausing and copies the rest in one go. In
+   WAL mode, readers don't hold up the writer, so it's all copied at once. */
+#define SNAPSHOT_STEP_PAGES 1024
+#define SNAPSHOT_STEP_PAUSE_MS 5
+#define SNAPSHOT_MAX_RESTARTS 8
+/* the copy is written here, then renamed over the destination once complete */
+#define SNAPSHOT_TMP_SUFFIX "-snapshot"
+#define QUERY_GET_JOURNAL_MODE "PRAGMA journal_mode"
+/* changes whenever another connection commits to the db */
+#define QUERY_GET_DATA_VERSION "PRAGMA data_version"
+
+/* the prevs index also carries the columns read by get_prevs(), along with
+   the (prefix_id, next_word) key which every index on the table includes */
+#define QUERY_CREATE_PREVS_INDEX \
+    "CREATE INDEX IF NOT EXISTS " PREVS_INDEX " ON " SNIPPET_TABLE " (" \
+    SNIPPETS_COL_SUFFIX_ID ", " SNIPPETS_COL_PREV_WORD ", " \
+    SNIPPETS_COL_SCORE ", " SNIPPETS_COL_TIME ", " SNIPPETS_COL_COUNT ")"
+#define QUERY_CREATE_INDEXES \
+    "CREATE UNIQUE INDEX IF NOT EXISTS " RANDOM_INDEX " ON " SNIPPET_TABLE " (" \
+    SNIPPETS_COL_SNIPPET_ID "); " \
+    QUERY_CREATE_PREVS_INDEX
 
 /* Notes:
    state table: Don't worry about indexing: small table + not often accessed
-   snippets table: Could be split into two tables with shared primary snippetid, but I doubt that'd help performance */
+   context table: each context is a BLOB of its word IDs, see pack_id()
+   snippets table: each snippet is stored as its prefix + last word (for get_nexts), along
+     with its suffix + first word (for get_prevs). (prefix_id, next_word) identifies the
+     snippet, so both indexes are over integers, and each context is only stored once.
+     The table is clustered on (prefix_id, next_word), so that a context's nexts are
+     one range scan, and the prevs index covers get_prevs() the same way. snippet_id
+     is only used to pick random snippets, see QUERY_GET_RANDOM. */
 #define QUERY_CREATE_TABLES \
-    "BEGIN TRANSACTION;" \
     "CREATE TABLE IF NOT EXISTS " STATE_TABLE " (" \
     STATE_COL_KEY " TEXT NOT NULL PRIMARY KEY ON CONFLICT REPLACE, " \
     STATE_COL_VALUE " INTEGER NOT NULL); " \
+\
+    "CREATE TABLE IF NOT EXISTS " WORDS_TABLE " (" \
+    WORDS_COL_WORD_ID " INTEGER NOT NULL PRIMARY KEY, " \
+    WORDS_COL_WORD " TEXT NOT NULL UNIQUE); " \
+\
+    "CREATE TABLE IF NOT EXISTS " CONTEXT_TABLE " (" \
+    CONTEXT_COL_CONTEXT_ID " INTEGER NOT NULL PRIMARY KEY, " \
+    CONTEXT_COL_WORDS " BLOB NOT NULL UNIQUE); " \
 \
     "CREATE TABLE IF NOT EXISTS " SNIPPET_TABLE " (" \
-    SNIPPETS_COL_SNIPPET_ID " INTEGER NOT NULL PRIMARY KEY ON CONFLICT REPLACE, " \
-    SNIPPETS_COL_WORDS " TEXT NOT NULL UNIQUE, " \
+    SNIPPETS_COL_PREFIX_ID " INTEGER NOT NULL, " \
+    SNIPPETS_COL_NEXT_WORD " INTEGER NOT NULL, " \
+    SNIPPETS_COL_SUFFIX_ID " INTEGER NOT NULL, " \
+    SNIPPETS_COL_PREV_WORD " INTEGER NOT NULL, " \
     SNIPPETS_COL_SCORE " INTEGER NOT NULL, " \
     SNIPPETS_COL_TIME " INTEGER NOT NULL, " \
-    SNIPPETS_COL_COUNT " INTEGER NOT NULL); " \
-    "CREATE UNIQUE INDEX IF NOT EXISTS " SNIPPET_WORDS_INDEX " ON " SNIPPET_TABLE " (" SNIPPETS_COL_WORDS "); " \
-\
-    "CREATE TABLE IF NOT EXISTS " PREVS_TABLE " (" \
-    SNIPPETS_COL_SNIPPET_ID " INTEGER NOT NULL PRIMARY KEY ON CONFLICT REPLACE, " \
-    SNIPPETS_COL_SEARCH " TEXT NOT NULL, " \
-    "FOREIGN KEY (" SNIPPETS_COL_SNIPPET_ID ") REFERENCES " SNIPPET_TABLE "(" SNIPPETS_COL_SNIPPET_ID ") ON DELETE CASCADE); " \
-    "CREATE INDEX IF NOT EXISTS " PREVS_SEARCH_INDEX " ON " PREVS_TABLE " (" SNIPPETS_COL_SEARCH "); " \
-\
-    "CREATE TABLE IF NOT EXISTS " NEXTS_TABLE " (" \
-    SNIPPETS_COL_SNIPPET_ID " INTEGER NOT NULL PRIMARY KEY ON CONFLICT REPLACE, " \
-    SNIPPETS_COL_SEARCH " TEXT NOT NULL, " \
-    "FOREIGN KEY (" SNIPPETS_COL_SNIPPET_ID ") REFERENCES " SNIPPET_TABLE "(" SNIPPETS_COL_SNIPPET_ID ") ON DELETE CASCADE); " \
-    "CREATE INDEX IF NOT EXISTS " NEXTS_SEARCH_INDEX " ON " NEXTS_TABLE " (" SNIPPETS_COL_SEARCH "); " \
-\
-    "COMMIT TRANSACTION"
+    SNIPPETS_COL_COUNT " INTEGER NOT NULL, " \
+    SNIPPETS_COL_SNIPPET_ID " INTEGER NOT NULL, " \
+    "PRIMARY KEY (" SNIPPETS_COL_PREFIX_ID ", " SNIPPETS_COL_NEXT_WORD ")" \
+    ") WITHOUT ROWID; " \
+    QUERY_CREATE_INDEXES
+
+#define QUERY_FIND_TABLE_V1 \
+    "SELECT COUNT(*) FROM sqlite_master WHERE type='table' AND name='" SNIPPET_TABLE "'"
+/* move the old snippets aside, to be reinserted into the new tables */
+#define QUERY_MIGRATE_V1_BEGIN \
+    "DROP TABLE IF EXISTS " PREVS_TABLE_V1 "; " \
+    "DROP TABLE IF EXISTS " NEXTS_TABLE_V1 "; " \
+    "ALTER TABLE " SNIPPET_TABLE " RENAME TO " SNIPPET_TABLE_V1
+#define QUERY_GET_ALL_V1 \
+    "SELECT " SNIPPETS_COL_WORDS_V1 ", " SNIPPETS_COL_TIME ", " \
+    SNIPPETS_COL_COUNT ", " SNIPPETS_COL_SCORE " FROM " SNIPPET_TABLE_V1
+#define QUERY_MIGRATE_V1_END \
+    "DROP TABLE " SNIPPET_TABLE_V1
+
+/* move the version 2 snippets aside, then copy them into the new table in
+   key order. contexts and words are unchanged. */
+#define QUERY_MIGRATE_V2_BEGIN \
+    "DROP INDEX IF EXISTS " NEXTS_INDEX_V2 "; " \
+    "DROP INDEX IF EXISTS " PREVS_INDEX "; " \
+    "ALTER TABLE " SNIPPET_TABLE " RENAME TO " SNIPPET_TABLE_V2
+#define QUERY_MIGRATE_V2_END \
+    "INSERT INTO " SNIPPET_TABLE " SELECT " \
+    SNIPPETS_COL_PREFIX_ID ", " SNIPPETS_COL_NEXT_WORD ", " \
+    SNIPPETS_COL_SUFFIX_ID ", " SNIPPETS_COL_PREV_WORD ", " \
+    SNIPPETS_COL_SCORE ", " SNIPPETS_COL_TIME ", " SNIPPETS_COL_COUNT ", " \
+    SNIPPETS_COL_SNIPPET_ID " FROM " SNIPPET_TABLE_V2 " ORDER BY " \
+    SNIPPETS_COL_PREFIX_ID ", " SNIPPETS_COL_NEXT_WORD "; " \
+    "DROP TABLE " SNIPPET_TABLE_V2
+
+/* Adjacency lists hold a copy of the candidates of each context, as a varint
+   (see pack_id()) word ID, score, time and count per candidate. They're
+   rebuilt from the snippets table whenever a context's snippets change.
+   Once created, any writer keeps them up to date. */
+#define QUERY_FIND_LISTS \
+    "SELECT COUNT(*) FROM sqlite_master WHERE type='table' AND " \
+    "name IN ('" NEXTS_LIST_TABLE "', '" PREVS_LIST_TABLE "')"
+#define QUERY_CREATE_LISTS \
+    "CREATE TABLE IF NOT EXISTS " NEXTS_LIST_TABLE " (" \
+    LIST_COL_CONTEXT_ID " INTEGER NOT NULL PRIMARY KEY, " \
+    LIST_COL_CANDIDATES " BLOB NOT NULL); " \
+    "CREATE TABLE IF NOT EXISTS " PREVS_LIST_TABLE " (" \
+    LIST_COL_CONTEXT_ID " INTEGER NOT NULL PRIMARY KEY, " \
+    LIST_COL_CANDIDATES " BLOB NOT NULL)"
+#define QUERY_GET_NEXTS_LIST \
+    "SELECT " LIST_COL_CANDIDATES " FROM " NEXTS_LIST_TABLE " WHERE " LIST_COL_CONTEXT_ID "=?1"
+#define QUERY_GET_PREVS_LIST \
+    "SELECT " LIST_COL_CANDIDATES " FROM " PREVS_LIST_TABLE " WHERE " LIST_COL_CONTEXT_ID "=?1"
+#define QUERY_SET_NEXTS_LIST \
+    "INSERT OR REPLACE INTO " NEXTS_LIST_TABLE " (" \
+    LIST_COL_CONTEXT_ID ", " LIST_COL_CANDIDATES ") VALUES (?1,?2)"
+#define QUERY_SET_PREVS_LIST \
+    "INSERT OR REPLACE INTO " PREVS_LIST_TABLE " (" \
+    LIST_COL_CONTEXT_ID ", " LIST_COL_CANDIDATES ") VALUES (?1,?2)"
+#define QUERY_DELETE_NEXTS_LIST \
+    "DELETE FROM " NEXTS_LIST_TABLE " WHERE " LIST_COL_CONTEXT_ID "=?1"
+#define QUERY_DELETE_PREVS_LIST \
+    "DELETE FROM " PREVS_LIST_TABLE " WHERE " LIST_COL_CONTEXT_ID "=?1"
+#define QUERY_GET_CONTEXT_IDS \
+    "SELECT " CONTEXT_COL_CONTEXT_ID " FROM " CONTEXT_TABLE
+/* prune() deletes snippets within SQL, so have SQL note where they were */
+#define DIRTY_TABLE "marky_dirty"
+#define QUERY_CREATE_DIRTY \
+    "CREATE TEMP TABLE IF NOT EXISTS " DIRTY_TABLE " (" \
+    "context_id INTEGER NOT NULL, prevs INTEGER NOT NULL); " \
+    "CREATE TEMP TRIGGER IF NOT EXISTS " DIRTY_TABLE "_trigger " \
+    "AFTER DELETE ON main." SNIPPET_TABLE " BEGIN " \
+    "INSERT INTO " DIRTY_TABLE " VALUES " \
+    "(old." SNIPPETS_COL_PREFIX_ID ", 0), (old." SNIPPETS_COL_SUFFIX_ID ", 1); END"
+#define QUERY_GET_DIRTY \
+    "SELECT DISTINCT context_id, prevs FROM temp." DIRTY_TABLE
+#define QUERY_CLEAR_DIRTY \
+    "DELETE FROM temp." DIRTY_TABLE
+
+/* a bulk load writes the snippets into an empty table without the prevs index,
+   across any number of flushes, then builds it in one pass. the first flush is
+   written in key order (see insert_snippets_impl()), and the random index is
+   appended to in id order. lookups by (prefix_id, next_word) use the table
+   itself, so get_snippets() doesn't need the prevs index along the way.
+   ANALYZE samples rather than reading every row, to keep it cheap on big imports. */
+#define QUERY_FIND_SNIPPET \
+    "SELECT COUNT(*) FROM (SELECT 1 FROM " SNIPPET_TABLE " LIMIT 1)"
+#define QUERY_BULK_LOAD_BEGIN \
+    "DROP INDEX IF EXISTS " PREVS_INDEX
+#define QUERY_BULK_LOAD_END \
+    "PRAGMA analysis_limit = 1000; " \
+    "ANALYZE"
 
 #define QUERY_BEGIN_TRANSACTION "BEGIN TRANSACTION"
 #define QUERY_END_TRANSACTION "COMMIT TRANSACTION"
+#define QUERY_ROLLBACK_TRANSACTION "ROLLBACK TRANSACTION"
 
 #define QUERY_GET_STATE \
     "SELECT " STATE_COL_VALUE " FROM " STATE_TABLE " WHERE " STATE_COL_KEY "=?1"
@@ -115,59 +291,171 @@ static std::string str(const marky::words_t& words) {
 #define QUERY_SET_STATE \
     "INSERT INTO " STATE_TABLE " (" STATE_COL_KEY "," STATE_COL_VALUE ") VALUES (?1,?2)"
 
-//TODO is this going to get one entry randomly, or sort things randomly and get one entry?
+#define QUERY_GET_WORD_ID \
+    "SELECT " WORDS_COL_WORD_ID " FROM " WORDS_TABLE " WHERE " WORDS_COL_WORD "=?1"
+#define QUERY_GET_WORD \
+    "SELECT " WORDS_COL_WORD " FROM " WORDS_TABLE " WHERE " WORDS_COL_WORD_ID "=?1"
+#define QUERY_INSERT_WORD \
+    "INSERT INTO " WORDS_TABLE " (" WORDS_COL_WORD ") VALUES (?1)"
+
+#define QUERY_GET_CONTEXT_ID \
+    "SELECT " CONTEXT_COL_CONTEXT_ID " FROM " CONTEXT_TABLE " WHERE " CONTEXT_COL_WORDS "=?1"
+#define QUERY_INSERT_CONTEXT \
+    "INSERT INTO " CONTEXT_TABLE " (" CONTEXT_COL_WORDS ") VALUES (?1)"
+/* contexts are left behind when their snippets are deleted */
+#define CONTEXT_UNUSED \
+    "NOT EXISTS (SELECT 1 FROM " SNIPPET_TABLE " WHERE " \
+    SNIPPETS_COL_PREFIX_ID "=" CONTEXT_TABLE "." CONTEXT_COL_CONTEXT_ID ") AND " \
+    "NOT EXISTS (SELECT 1 FROM " SNIPPET_TABLE " WHERE " \
+    SNIPPETS_COL_SUFFIX_ID "=" CONTEXT_TABLE "." CONTEXT_COL_CONTEXT_ID ")"
+#define QUERY_DELETE_UNUSED_CONTEXTS \
+    "DELETE FROM " CONTEXT_TABLE " WHERE " CONTEXT_UNUSED
+
+/* get_random() picks a random id in the range, then seeks to the first row
+   at or after it. CROSS JOIN keeps the seek on the snippets table. */
+#define QUERY_GET_ID_RANGE \
+    "SELECT (SELECT MIN(" SNIPPETS_COL_SNIPPET_ID ") FROM " SNIPPET_TABLE "), " \
+    "(SELECT MAX(" SNIPPETS_COL_SNIPPET_ID ") FROM " SNIPPET_TABLE ")"
 #define QUERY_GET_RANDOM \
-    "SELECT " SNIPPETS_COL_WORDS " FROM " SNIPPET_TABLE " ORDER BY RANDOM() LIMIT 1"
+    "SELECT " CONTEXT_TABLE "." CONTEXT_COL_WORDS ", " SNIPPET_TABLE "." SNIPPETS_COL_NEXT_WORD ", " \
+    SNIPPETS_COL_TIME ", " SNIPPETS_COL_COUNT ", " SNIPPETS_COL_SCORE \
+    " FROM " SNIPPET_TABLE " CROSS JOIN " CONTEXT_TABLE " ON " \
+    CONTEXT_TABLE "." CONTEXT_COL_CONTEXT_ID " = " SNIPPET_TABLE "." SNIPPETS_COL_PREFIX_ID \
+    " WHERE " SNIPPET_TABLE "." SNIPPETS_COL_SNIPPET_ID ">=?1 ORDER BY " \
+    SNIPPET_TABLE "." SNIPPETS_COL_SNIPPET_ID " LIMIT 1"
+#define QUERY_GET_MAX_SCORE \
+    "SELECT MAX(" SNIPPETS_COL_SCORE ") FROM " SNIPPET_TABLE
 
 #define QUERY_GET_PREVS \
-    "SELECT " SNIPPETS_COL_WORDS ", " SNIPPETS_COL_TIME ", " SNIPPETS_COL_COUNT ", " \
-    SNIPPETS_COL_SCORE " FROM " SNIPPET_TABLE " JOIN " PREVS_TABLE " ON " \
-    SNIPPET_TABLE "." SNIPPETS_COL_SNIPPET_ID " = " PREVS_TABLE "." SNIPPETS_COL_SNIPPET_ID \
-    " WHERE " PREVS_TABLE "." SNIPPETS_COL_SEARCH "=?1"
+    "SELECT " SNIPPETS_COL_PREV_WORD ", " SNIPPETS_COL_TIME ", " SNIPPETS_COL_COUNT ", " \
+    SNIPPETS_COL_SCORE " FROM " SNIPPET_TABLE " WHERE " SNIPPETS_COL_SUFFIX_ID "=?1"
 #define QUERY_GET_NEXTS \
-    "SELECT " SNIPPETS_COL_WORDS ", " SNIPPETS_COL_TIME ", " SNIPPETS_COL_COUNT ", " \
-    SNIPPETS_COL_SCORE " FROM " SNIPPET_TABLE " JOIN " NEXTS_TABLE " ON " \
-    SNIPPET_TABLE "." SNIPPETS_COL_SNIPPET_ID " = " NEXTS_TABLE "." SNIPPETS_COL_SNIPPET_ID \
-    " WHERE " NEXTS_TABLE "." SNIPPETS_COL_SEARCH "=?1"
-
-#define QUERY_GET_SNIPPET \
-    "SELECT " SNIPPETS_COL_TIME ", " SNIPPETS_COL_COUNT ", " SNIPPETS_COL_SCORE \
-    " FROM " SNIPPET_TABLE " WHERE " SNIPPETS_COL_WORDS "=?1"
+    "SELECT " SNIPPETS_COL_NEXT_WORD ", " SNIPPETS_COL_TIME ", " SNIPPETS_COL_COUNT ", " \
+    SNIPPETS_COL_SCORE " FROM " SNIPPET_TABLE " WHERE " SNIPPETS_COL_PREFIX_ID "=?1"
+
+/* get_next() and get_prev() back off through every order of the search in one
+   statement, followed by "(?1,?2),(?3,?4),...) AS k ..." with (order, packed
+   context) pairs, longest context first. The VALUES are scanned in that order,
+   so rows for the longest context come first, see get_backoff(). */
+#define QUERY_GET_NEXTS_BACKOFF_PREFIX \
+    "SELECT k.column1, " SNIPPETS_COL_NEXT_WORD ", " SNIPPETS_COL_TIME ", " \
+    SNIPPETS_COL_COUNT ", " SNIPPETS_COL_SCORE " FROM (VALUES "
+#define QUERY_GET_NEXTS_BACKOFF_SUFFIX \
+    ") AS k CROSS JOIN " CONTEXT_TABLE " ON " CONTEXT_COL_WORDS "=k.column2 " \
+    "CROSS JOIN " SNIPPET_TABLE " ON " SNIPPETS_COL_PREFIX_ID "=" CONTEXT_COL_CONTEXT_ID
+#define QUERY_GET_PREVS_BACKOFF_PREFIX \
+    "SELECT k.column1, " SNIPPETS_COL_PREV_WORD ", " SNIPPETS_COL_TIME ", " \
+    SNIPPETS_COL_COUNT ", " SNIPPETS_COL_SCORE " FROM (VALUES "
+#define QUERY_GET_PREVS_BACKOFF_SUFFIX \
+    ") AS k CROSS JOIN " CONTEXT_TABLE " ON " CONTEXT_COL_WORDS "=k.column2 " \
+    "CROSS JOIN " SNIPPET_TABLE " ON " SNIPPETS_COL_SUFFIX_ID "=" CONTEXT_COL_CONTEXT_ID
+
+/* followed by "(?1,?2),(?3,?4),...) AS k ON ..." with (prefix_id, next_word) pairs.
+   CROSS JOIN keeps the planner from scanning the snippets table for each pair. */
 #define QUERY_GET_SNIPPETS_PREFIX \
-    "SELECT " SNIPPETS_COL_WORDS ", " SNIPPETS_COL_TIME ", " SNIPPETS_COL_COUNT ", " \
-    SNIPPETS_COL_SCORE " FROM " SNIPPET_TABLE " WHERE " SNIPPETS_COL_WORDS " IN "
+    "SELECT " SNIPPET_TABLE "." SNIPPETS_COL_PREFIX_ID ", " SNIPPET_TABLE "." SNIPPETS_COL_NEXT_WORD ", " \
+    SNIPPETS_COL_TIME ", " SNIPPETS_COL_COUNT ", " SNIPPETS_COL_SCORE " FROM (VALUES "
+#define QUERY_GET_SNIPPETS_SUFFIX \
+    ") AS k CROSS JOIN " SNIPPET_TABLE " ON " SNIPPETS_COL_PREFIX_ID "=k.column1 AND " \
+    SNIPPETS_COL_NEXT_WORD "=k.column2"
+
+/* larger lookups are loaded into a temporary table instead, which avoids
+   SQLite's limit on the number of parameters */
+#define LOOKUP_TABLE "marky_lookup"
+#define QUERY_CREATE_LOOKUP \
+    "CREATE TEMP TABLE IF NOT EXISTS " LOOKUP_TABLE " (" \
+    "column1 INTEGER NOT NULL, column2 INTEGER NOT NULL)"
+#define QUERY_INSERT_LOOKUP \
+    "INSERT INTO temp." LOOKUP_TABLE " (column1, column2) VALUES (?1,?2)"
+#define QUERY_CLEAR_LOOKUP \
+    "DELETE FROM temp." LOOKUP_TABLE
+#define QUERY_GET_SNIPPETS_LOOKUP \
+    "SELECT " SNIPPET_TABLE "." SNIPPETS_COL_PREFIX_ID ", " SNIPPET_TABLE "." SNIPPETS_COL_NEXT_WORD ", " \
+    SNIPPETS_COL_TIME ", " SNIPPETS_COL_COUNT ", " SNIPPETS_COL_SCORE \
+    " FROM temp." LOOKUP_TABLE " AS k CROSS JOIN " SNIPPET_TABLE " ON " \
+    SNIPPETS_COL_PREFIX_ID "=k.column1 AND " SNIPPETS_COL_NEXT_WORD "=k.column2"
+#define QUERY_BEGIN_LOOKUP "SAVEPOINT " LOOKUP_TABLE
+#define QUERY_END_LOOKUP "RELEASE " LOOKUP_TABLE
 
 #define QUERY_UPDATE_SNIPPET \
     "UPDATE " SNIPPET_TABLE " SET " SNIPPETS_COL_SCORE "=?1, " \
     SNIPPETS_COL_TIME "=?2, " SNIPPETS_COL_COUNT "=?3 WHERE "  \
-    SNIPPETS_COL_WORDS "=?4"
-//note the ON CONFLICT REPLACE above. rowid/snippet_id is created automatically:
+    SNIPPETS_COL_PREFIX_ID "=?4 AND " SNIPPETS_COL_NEXT_WORD "=?5"
+/* WITHOUT ROWID tables don't number their rows, so new snippets get the
+   next snippet_id by hand, which is a seek to the end of the random index */
+#define QUERY_NEXT_SNIPPET_ID \
+    "(SELECT IFNULL(MAX(" SNIPPETS_COL_SNIPPET_ID "), 0) + 1 FROM " SNIPPET_TABLE ")"
 #define QUERY_INSERT_SNIPPET \
     "INSERT INTO " SNIPPET_TABLE " (" \
-    SNIPPETS_COL_WORDS "," SNIPPETS_COL_SCORE "," SNIPPETS_COL_TIME "," SNIPPETS_COL_COUNT \
-    ") VALUES (?1,?2,?3,?4)"
-//similar to INSERT_SNIPPET, except for when we may be updating an existing field.
-//when a snippet is updated, the prevs/nexts are automatically deleted and need to be reinserted.
+    SNIPPETS_COL_PREFIX_ID "," SNIPPETS_COL_NEXT_WORD "," \
+    SNIPPETS_COL_SUFFIX_ID "," SNIPPETS_COL_PREV_WORD "," \
+    SNIPPETS_COL_SCORE "," SNIPPETS_COL_TIME "," SNIPPETS_COL_COUNT "," \
+    SNIPPETS_COL_SNIPPET_ID ") VALUES (?1,?2,?3,?4,?5,?6,?7," QUERY_NEXT_SNIPPET_ID ")"
+/* similar to INSERT_SNIPPET, except for when we may be updating an existing field.
+   an existing row is updated in place rather than REPLACEd: its key and
+   snippet_id are left alone, so only its prevs index entry is rewritten. */
 #define QUERY_UPSERT_SNIPPET \
-    "INSERT OR REPLACE INTO " SNIPPET_TABLE " (" \
-    SNIPPETS_COL_WORDS "," SNIPPETS_COL_SCORE "," SNIPPETS_COL_TIME "," SNIPPETS_COL_COUNT \
-    ") VALUES (?1,?2,?3,?4)"
-#define QUERY_INSERT_PREV \
-    "INSERT INTO " PREVS_TABLE " (" \
-    SNIPPETS_COL_SEARCH "," SNIPPETS_COL_SNIPPET_ID \
-    ") VALUES (?1,?2)"
-#define QUERY_INSERT_NEXT \
-    "INSERT INTO " NEXTS_TABLE " (" \
-    SNIPPETS_COL_SEARCH "," SNIPPETS_COL_SNIPPET_ID \
-    ") VALUES (?1,?2)"
+    "INSERT INTO " SNIPPET_TABLE " (" \
+    SNIPPETS_COL_PREFIX_ID "," SNIPPETS_COL_NEXT_WORD "," \
+    SNIPPETS_COL_SUFFIX_ID "," SNIPPETS_COL_PREV_WORD "," \
+    SNIPPETS_COL_SCORE "," SNIPPETS_COL_TIME "," SNIPPETS_COL_COUNT "," \
+    SNIPPETS_COL_SNIPPET_ID ") VALUES (?1,?2,?3,?4,?5,?6,?7," QUERY_NEXT_SNIPPET_ID \
+    ") ON CONFLICT (" \
+    SNIPPETS_COL_PREFIX_ID "," SNIPPETS_COL_NEXT_WORD ") DO UPDATE SET " \
+    SNIPPETS_COL_SCORE "=excluded." SNIPPETS_COL_SCORE ", " \
+    SNIPPETS_COL_TIME "=excluded." SNIPPETS_COL_TIME ", " \
+    SNIPPETS_COL_COUNT "=excluded." SNIPPETS_COL_COUNT
 
 #define QUERY_GET_ALL \
-    "SELECT " SNIPPETS_COL_WORDS ", " SNIPPETS_COL_TIME ", " \
-    SNIPPETS_COL_COUNT ", " SNIPPETS_COL_SCORE \
-    " FROM " SNIPPET_TABLE
-
-#define QUERY_DELETE_SNIPPET \
-    "DELETE FROM " SNIPPET_TABLE " WHERE " SNIPPETS_COL_WORDS "=?1"
+    "SELECT " CONTEXT_TABLE "." CONTEXT_COL_WORDS ", " SNIPPET_TABLE "." SNIPPETS_COL_NEXT_WORD ", " \
+    SNIPPETS_COL_TIME ", " SNIPPETS_COL_COUNT ", " SNIPPETS_COL_SCORE ", " SNIPPETS_COL_SNIPPET_ID \
+    " FROM " SNIPPET_TABLE " JOIN " CONTEXT_TABLE " ON " \
+    CONTEXT_TABLE "." CONTEXT_COL_CONTEXT_ID " = " SNIPPET_TABLE "." SNIPPETS_COL_PREFIX_ID
+
+/* the scorer passed to prune() is made available to SQL as SCORE_FUNC */
+#define SCORE_FUNC "marky_score"
+#define QUERY_PRUNE \
+    "DELETE FROM " SNIPPET_TABLE " WHERE " SCORE_FUNC "(" \
+    SNIPPETS_COL_SCORE ", " SNIPPETS_COL_TIME ", " SNIPPETS_COL_COUNT ") = 0"
+
+/* a chunked prune scores each chunk of snippets in C++ instead, deleting the
+   chunk's zero-scored snippets and then any of their contexts left unused.
+   both DELETEs are followed by "(id,id,...)" */
+#define QUERY_GET_PRUNE_CHUNK \
+    "SELECT " SNIPPETS_COL_SNIPPET_ID ", " SNIPPETS_COL_PREFIX_ID ", " SNIPPETS_COL_SUFFIX_ID ", " \
+    SNIPPETS_COL_SCORE ", " SNIPPETS_COL_TIME ", " SNIPPETS_COL_COUNT " FROM " SNIPPET_TABLE \
+    " WHERE " SNIPPETS_COL_SNIPPET_ID ">=?1 ORDER BY " SNIPPETS_COL_SNIPPET_ID " LIMIT ?2"
+#define QUERY_PRUNE_CHUNK_PREFIX \
+    "DELETE FROM " SNIPPET_TABLE " WHERE " SNIPPETS_COL_SNIPPET_ID " IN "
+#define QUERY_PRUNE_CHUNK_CONTEXTS_PREFIX \
+    "DELETE FROM " CONTEXT_TABLE " WHERE " CONTEXT_UNUSED " AND " CONTEXT_COL_CONTEXT_ID " IN "
+
+/* How many picks get_random() makes when weighting by score, before
+   settling for the last one. */
+#define RANDOM_WEIGHTED_ATTEMPTS 64
+
+/* get_snippets() keeps a statement for each number of windows up to
+   GET_SNIPPETS_EXACT_MAX, then for each multiple of GET_SNIPPETS_EXACT_MAX
+   up to GET_SNIPPETS_STMT_MAX, leaving any extra parameters as 0s which
+   match nothing. Padding every size to a power of two was measurably slower,
+   since most lookups are for a single line's windows. */
+#define GET_SNIPPETS_EXACT_MAX 64
+#define GET_SNIPPETS_STMT_MAX 256
+
+/* How many snippets prune_chunks() scores in each transaction, unless
+   options_t::prune_chunk_size says otherwise. */
+#define PRUNE_CHUNK_SIZE 10000
+/* How many free pages each step of vacuum() hands back, each step in its own
+   transaction. A prune() takes up to VACUUM_MAX_STEPS steps, and each chunk
+   of prune_chunks() takes one. Whatever is left over is reused by later
+   writes, or handed back after the next prune. */
+#define VACUUM_STEP_PAGES 1024
+#define VACUUM_MAX_STEPS 16
+
+/* How many word/context IDs to keep in memory before starting over. */
+#define ID_CACHE_MAX 1048576
+/* How many snippets to reinsert at a time when migrating. */
+#define MIGRATE_BATCH_SIZE 10000
 
 namespace {
     inline bool exec(sqlite3* db, const char* cmd) {
@@ -201,10 +489,13 @@ namespace {
         return true;
     }
 
-    inline bool bind_words(sqlite3_stmt* query, int index, const marky::words_t& words) {
-        std::ostringstream oss;
-        marky::pack(words, oss);
-        return bind_str(query, index, oss.str());
+    inline bool bind_blob(sqlite3_stmt* query, int index, const std::string& val) {
+        int ret = sqlite3_bind_blob(query, index, val.data(), val.size(), SQLITE_TRANSIENT);
+        if (ret != SQLITE_OK) {
+            ERROR("Error when binding %d/blob[%lu]: %d", index, val.size(), ret);
+            return false;
+        }
+        return true;
     }
 
     inline bool bind_int64(sqlite3_stmt* query, int index, int64_t val) {
@@ -215,19 +506,101 @@ namespace {
         }
         return true;
     }
+
+    /* A snippet to be written, with its words looked up. Ordered by
+     * (prefix_id, next_word), as in the nexts index. */
+    struct row_t {
+        int64_t prefix_id, next_id, suffix_id, prev_id;
+        const marky::Snippet* snippet;
+        bool operator<(const row_t& other) const {
+            return (prefix_id != other.prefix_id) ?
+                prefix_id < other.prefix_id : next_id < other.next_id;
+        }
+    };
+
+    /* Word IDs are packed into context BLOBs as varints: 7 bits per byte,
+     * with the high bit set on all but the last byte of each ID. */
+    inline void pack_id(int64_t id, std::string& out) {
+        uint64_t val = id;
+        while (val >= 0x80) {
+            out.push_back((char)(0x80 | (val & 0x7f)));
+            val >>= 7;
+        }
+        out.push_back((char)val);
+    }
+
+    inline bool unpack_id(const unsigned char*& iter, const unsigned char* end, int64_t& id) {
+        uint64_t val = 0;
+        for (size_t shift = 0; iter != end && shift < 64; shift += 7) {
+            const unsigned char byte = *iter++;
+            val |= (uint64_t)(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                id = val;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* Runs a query which returns zero or one integer, leaving 'val' at 0
+     * if nothing is found. Resets the query when done. */
+    bool step_int64(sqlite3* db, sqlite3_stmt* stmt, const char* query, int64_t& val) {
+        val = 0;
+        bool ok = true;
+        int step = sqlite3_step(stmt);
+        switch (step) {
+            case SQLITE_ROW:/* row found, parse */
+                val = sqlite3_column_int64(stmt, 0);
+                break;
+            case SQLITE_DONE:/* nothing found, do nothing */
+                break;
+            default:
+                ok = false;
+                ERROR("Error when parsing response to '%s': %d/%s",
+                        query, step, sqlite3_errmsg(db));
+                break;
+        }
+        sqlite3_clear_bindings(stmt);
+        sqlite3_reset(stmt);
+        return ok;
+    }
+
+    /* Runs an INSERT, returning the rowid of the new row. Resets the query
+     * when done. */
+    bool step_insert(sqlite3* db, sqlite3_stmt* stmt, const char* query, int64_t& rowid) {
+        bool ok = true;
+        int step = sqlite3_step(stmt);
+        if (step == SQLITE_DONE) {
+            rowid = sqlite3_last_insert_rowid(db);
+        } else {
+            ok = false;
+            ERROR("Error when parsing response to '%s': %d/%s",
+                    query, step, sqlite3_errmsg(db));
+        }
+        sqlite3_clear_bindings(stmt);
+        sqlite3_reset(stmt);
+        return ok;
+    }
 }
 
-/*static*/ marky::cacheable_t marky::Backend_SQLite::create_cacheable(const std::string& db_file_path) {
-    Backend_SQLite* ret = new Backend_SQLite(db_file_path);
-    if (!ret->init()) {
+marky::Backend_SQLite::options_t::options_t()
+    : weighted_random(false), bulk_load(false), adjacency_lists(false),
+      page_size(0), cache_size(0), mmap_size(0), temp_store(TEMP_STORE_DEFAULT),
+      prune_chunk_size(0) { }
+
+/*static*/ marky::cacheable_t marky::Backend_SQLite::create_cacheable(const std::string& db_file_path,
+        const options_t& options/*=options_t()*/) {
+    Backend_SQLite* ret = new Backend_SQLite(db_file_path, options, CONN_STANDALONE);
+    if (!ret->init() || (options.bulk_load && !ret->init_bulk_load())) {
         delete ret;
         return cacheable_t();
     }
     return cacheable_t(ret);
 }
-/*static*/ marky::backend_t marky::Backend_SQLite::create_backend(const std::string& db_file_path) {
-    Backend_SQLite* ret = new Backend_SQLite(db_file_path);
-    if (!ret->init()) {
+/*static*/ marky::backend_t marky::Backend_SQLite::create_backend(const std::string& db_file_path,
+        const options_t& options/*=options_t()*/) {
+    Backend_SQLite* ret = new Backend_SQLite(db_file_path, options, CONN_STANDALONE);
+    if (!ret->init() || (options.bulk_load && !ret->init_bulk_load())) {
         delete ret;
         return backend_t();
     }
@@ -253,6 +626,73 @@ namespace {
         sqlite3_reset(stmt);
     }
 
+    /* Copies the 'main' db of 'src' into a new db at 'dest_path', replacing
+     * any file there only once the copy is complete. */
+    bool backup_db(sqlite3* src, const std::string& dest_path) {
+        bool wal = false;
+        sqlite3_stmt* stmt = NULL;
+        if (prepare(src, QUERY_GET_JOURNAL_MODE, stmt) && sqlite3_step(stmt) == SQLITE_ROW) {
+            wal = (strcmp((const char*)sqlite3_column_text(stmt, 0), WAL_MODE) == 0);
+        }
+        sqlite3_finalize(stmt);
+
+        const std::string tmp_path = dest_path + SNAPSHOT_TMP_SUFFIX;
+        unlink(tmp_path.c_str());
+        sqlite3* dest = NULL;
+        int ret = sqlite3_open_v2(tmp_path.c_str(), &dest,
+                SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+        if (ret != SQLITE_OK) {
+            ERROR("Failed to open sqlite db at %s: %d/%s",
+                    tmp_path.c_str(), ret, sqlite3_errmsg(dest));
+            sqlite3_close(dest);
+            return false;
+        }
+        sqlite3_backup* backup = sqlite3_backup_init(dest, "main", src, "main");
+        if (backup == NULL) {
+            ERROR("Failed to start snapshot to %s: %s",
+                    tmp_path.c_str(), sqlite3_errmsg(dest));
+            sqlite3_close(dest);
+            unlink(tmp_path.c_str());
+            return false;
+        }
+
+        int restarts = 0, last_remaining = -1;
+        for (;;) {
+            const int pages = (wal || restarts > SNAPSHOT_MAX_RESTARTS) ? -1 : SNAPSHOT_STEP_PAGES;
+            ret = sqlite3_backup_step(backup, pages);
+            if (ret == SQLITE_DONE) {
+                break;
+            }
+            if (ret != SQLITE_OK && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
+                break;
+            }
+            /* another connection wrote to the db, so the copy started over */
+            const int remaining = sqlite3_backup_remaining(backup);
+            if (last_remaining >= 0 && remaining > last_remaining) {
+                ++restarts;
+            }
+            last_remaining = remaining;
+            sqlite3_sleep(SNAPSHOT_STEP_PAUSE_MS);
+        }
+        sqlite3_backup_finish(backup);
+        bool ok = (ret == SQLITE_DONE);
+        if (!ok) {
+            ERROR("Failed to write snapshot to %s: %d/%s",
+                    tmp_path.c_str(), ret, sqlite3_errmsg(dest));
+        }
+        sqlite3_close(dest);
+
+        if (ok && rename(tmp_path.c_str(), dest_path.c_str()) != 0) {
+            ERROR("Failed to move snapshot from %s to %s: %s",
+                    tmp_path.c_str(), dest_path.c_str(), strerror(errno));
+            ok = false;
+        }
+        if (!ok) {
+            unlink(tmp_path.c_str());
+        }
+        return ok;
+    }
+
     /* If 'key' is found, val is updated and true is returned.
      * If 'key' is not found, val is left untouched and true is returned.
      * If there's an error, false is returned. */
@@ -285,24 +725,89 @@ namespace {
     }
 }
 
-marky::Backend_SQLite::Backend_SQLite(const std::string& db_file_path)
-    : path(db_file_path), db(NULL), state_changed(false) {
+/*static*/ bool marky::Backend_SQLite::snapshot_file(const std::string& db_file_path,
+        const std::string& dest_path) {
+    sqlite3* db = NULL;
+    int ret = sqlite3_open_v2(db_file_path.c_str(), &db, SQLITE_OPEN_READONLY, NULL);
+    if (ret != SQLITE_OK) {
+        ERROR("Failed to open sqlite db at %s: %d/%s",
+                db_file_path.c_str(), ret, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return false;
+    }
+    sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+    bool ok = backup_db(db, dest_path);
+    sqlite3_close(db);
+    return ok;
+}
+
+bool marky::Backend_SQLite::snapshot(const std::string& dest_path) {
+    return backup_db(db, dest_path);
+}
+
+marky::Backend_SQLite::Backend_SQLite(const std::string& db_file_path,
+        const options_t& options, connection_t connection)
+    : stmt_set_state(NULL), stmt_get_state(NULL),
+      stmt_get_word_id(NULL), stmt_get_word(NULL), stmt_insert_word(NULL),
+      stmt_get_context_id(NULL), stmt_insert_context(NULL),
+      stmt_get_id_range(NULL), stmt_get_random(NULL),
+      stmt_get_prevs(NULL), stmt_get_nexts(NULL),
+      stmt_update_snippet(NULL), stmt_upsert_snippet(NULL), stmt_insert_snippet(NULL),
+      stmt_get_all(NULL), stmt_prune(NULL), stmt_get_prune_chunk(NULL),
+      stmt_get_snippets(), stmt_get_nexts_backoff(), stmt_get_prevs_backoff(),
+      stmt_insert_lookup(NULL), stmt_get_snippets_lookup(NULL),
+      stmt_get_data_version(NULL),
+      stmt_get_nexts_list(NULL), stmt_get_prevs_list(NULL),
+      stmt_set_nexts_list(NULL), stmt_set_prevs_list(NULL),
+      stmt_delete_nexts_list(NULL), stmt_delete_prevs_list(NULL),
+      path(db_file_path), connection(connection), db(NULL), state_changed(false),
+      options(options), max_score(0),
+      prune_state(NULL), prune_scorer(NULL), prune_cursor(0), data_version(-1), bulk_load(false),
+      bulk_written(false), bulk_pruned(false), lists(options.adjacency_lists), auto_vacuum(false), dirty_nexts(), dirty_prevs() {
 }
 
 marky::Backend_SQLite::~Backend_SQLite() {
     if (db != NULL) {
+        finish_bulk_load();
+
         sqlite3_finalize(stmt_set_state);
         sqlite3_finalize(stmt_get_state);
+        sqlite3_finalize(stmt_get_word_id);
+        sqlite3_finalize(stmt_get_word);
+        sqlite3_finalize(stmt_insert_word);
+        sqlite3_finalize(stmt_get_context_id);
+        sqlite3_finalize(stmt_insert_context);
+        sqlite3_finalize(stmt_get_id_range);
         sqlite3_finalize(stmt_get_random);
         sqlite3_finalize(stmt_get_prevs);
         sqlite3_finalize(stmt_get_nexts);
         sqlite3_finalize(stmt_update_snippet);
         sqlite3_finalize(stmt_upsert_snippet);
         sqlite3_finalize(stmt_insert_snippet);
-        sqlite3_finalize(stmt_insert_next);
-        sqlite3_finalize(stmt_insert_prev);
         sqlite3_finalize(stmt_get_all);
-        sqlite3_finalize(stmt_delete_snippet);
+        sqlite3_finalize(stmt_prune);
+        sqlite3_finalize(stmt_get_prune_chunk);
+        for (stmts_t::const_iterator iter = stmt_get_snippets.begin();
+             iter != stmt_get_snippets.end(); ++iter) {
+            sqlite3_finalize(iter->second);
+        }
+        for (stmts_t::const_iterator iter = stmt_get_nexts_backoff.begin();
+             iter != stmt_get_nexts_backoff.end(); ++iter) {
+            sqlite3_finalize(iter->second);
+        }
+        for (stmts_t::const_iterator iter = stmt_get_prevs_backoff.begin();
+             iter != stmt_get_prevs_backoff.end(); ++iter) {
+            sqlite3_finalize(iter->second);
+        }
+        sqlite3_finalize(stmt_insert_lookup);
+        sqlite3_finalize(stmt_get_snippets_lookup);
+        sqlite3_finalize(stmt_get_data_version);
+        sqlite3_finalize(stmt_get_nexts_list);
+        sqlite3_finalize(stmt_get_prevs_list);
+        sqlite3_finalize(stmt_set_nexts_list);
+        sqlite3_finalize(stmt_set_prevs_list);
+        sqlite3_finalize(stmt_delete_nexts_list);
+        sqlite3_finalize(stmt_delete_prevs_list);
 
         int ret = sqlite3_close(db);
         if (ret != SQLITE_OK) {
@@ -322,10 +827,14 @@ marky::State marky::Backend_SQLite::create_state() {
 }
 
 bool marky::Backend_SQLite::store_state(const State& state, scorer_t /*scorer*/) {
+    if (db != NULL && !finish_bulk_load()) {
+        return false;
+    }
     if (db != NULL && state_changed) {
         /* update db state */
         set_state(db, stmt_set_state, STATE_KEY_TIME, state.time);
         set_state(db, stmt_set_state, STATE_KEY_COUNT, state.count);
+        set_state(db, stmt_set_state, STATE_KEY_MAX_SCORE, max_score);
     }
     return true;
 }
@@ -336,7 +845,9 @@ bool marky::Backend_SQLite::init() {
         return false;
     }
 
-    int ret = sqlite3_open(path.c_str(), &db);/* rw + create */
+    const int flags = (connection == CONN_READER) ?
+        SQLITE_OPEN_READONLY : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    int ret = sqlite3_open_v2(path.c_str(), &db, flags, NULL);
     if (ret != SQLITE_OK) {
         ERROR("Failed to open sqlite db at %s: %d/%s",
                 path.c_str(), ret, sqlite3_errmsg(db));
@@ -347,85 +858,425 @@ bool marky::Backend_SQLite::init() {
     sqlite3_trace(db, trace_callback, NULL);
 #endif
 
-    if (!exec(db, PRAGMA_ENABLE_FOREIGN_KEYS)) {
-        ERROR("Unable to enable SQLite Foreign Key support. "
-                "Please rebuild SQLite with SQLITE_OMIT_FORIGN_KEY and SQLITE_OMIT_TRIGGER turned OFF!");
+    if (!init_pragmas()) {
+        return false;
+    }
+
+    switch (connection) {
+        case CONN_STANDALONE:
+            if (!exec(db, UNSAFE_PRAGMA_OPTIMIZATIONS)) {
+                LOG("Failed to enable unsafe SQLite speed optimizations. Continuing anyway...");
+            }
+            sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+            break;
+        case CONN_WRITER:
+            {
+                /* journal_mode reports the mode it ended up in, rather than failing */
+                sqlite3_stmt* stmt = NULL;
+                bool ok = prepare(db, QUERY_SET_WAL, stmt) &&
+                    sqlite3_step(stmt) == SQLITE_ROW &&
+                    strcmp((const char*)sqlite3_column_text(stmt, 0), WAL_MODE) == 0;
+                sqlite3_finalize(stmt);
+                if (!ok || !exec(db, QUERY_SET_WAL_SYNC)) {
+                    ERROR("Failed to enable WAL mode for sqlite db at %s", path.c_str());
+                    return false;
+                }
+            }
+            sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+            break;
+        case CONN_READER:
+            /* WAL mode is persistent, and was already set up by the writer */
+            sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+            break;
+    }
+
+    if (options.prune_chunk_size == 0) {
+        ret = sqlite3_create_function(db, SCORE_FUNC, 3, SQLITE_UTF8 | SQLITE_DIRECTONLY,
+                this, score_func, NULL, NULL);
+        if (ret != SQLITE_OK) {
+            ERROR("Failed to register %s function: %d/%s",
+                    SCORE_FUNC, ret, sqlite3_errmsg(db));
+            return false;
+        }
+    }
+
+    /* check whether this is a new db, a current one, or one to be migrated */
+    sqlite3_stmt* stmt = NULL;
+    int64_t version = 0, found_v1 = 0;
+    bool ok = prepare(db, QUERY_GET_SCHEMA_VERSION, stmt) &&
+        step_int64(db, stmt, QUERY_GET_SCHEMA_VERSION, version);
+    sqlite3_finalize(stmt);
+    if (!ok) {
+        return false;
+    }
+    if (version > SCHEMA_VERSION) {
+        ERROR("sqlite db at %s has schema version %ld, but only up to %d is supported.",
+                path.c_str(), version, SCHEMA_VERSION);
+        return false;
+    }
+    if (version < 2) {
+        stmt = NULL;
+        ok = prepare(db, QUERY_FIND_TABLE_V1, stmt) &&
+            step_int64(db, stmt, QUERY_FIND_TABLE_V1, found_v1);
+        sqlite3_finalize(stmt);
+        if (!ok) {
+            return false;
+        }
+    }
+    /* a db without a version but with a snippets table is from version 1 */
+    const bool migrate = (version < 2 && found_v1 != 0);
+    const bool migrate_v2 = (version == 2);
+
+    if (connection == CONN_READER) {
+        /* the writer has already created or migrated the tables */
+        if (version != SCHEMA_VERSION) {
+            ERROR("sqlite db at %s has schema version %ld, expected %d.",
+                    path.c_str(), version, SCHEMA_VERSION);
+            return false;
+        }
+        return exec(db, QUERY_CREATE_LOOKUP) && prepare_stmts() &&
+            prepare(db, QUERY_GET_DATA_VERSION, stmt_get_data_version) &&
+            init_lists() && init_max_score();
+    }
+
+    /* create/migrate in one transaction, so that it's all or nothing */
+    if (!exec(db, QUERY_BEGIN_TRANSACTION)) {
         return false;
     }
-    if (!exec(db, UNSAFE_PRAGMA_OPTIMIZATIONS)) {
-        LOG("Failed to enable unsafe SQLite speed optimizations. Continuing anyway...");
+    if (migrate || migrate_v2) {
+        LOG("Migrating sqlite db at %s to schema version %d...", path.c_str(), SCHEMA_VERSION);
+        ok = exec(db, (migrate) ? QUERY_MIGRATE_V1_BEGIN : QUERY_MIGRATE_V2_BEGIN);
+    }
+    ok = ok && exec(db, QUERY_CREATE_TABLES) && exec(db, QUERY_CREATE_LOOKUP);
+    ok = ok && prepare_stmts();
+    if (migrate) {
+        ok = ok && migrate_v1() && exec(db, QUERY_MIGRATE_V1_END);
+    }
+    if (migrate_v2) {
+        ok = ok && exec(db, QUERY_MIGRATE_V2_END);
+    }
+    ok = ok && init_lists() && exec(db, QUERY_SET_SCHEMA_VERSION) && init_max_score();
+    if (!ok) {
+        exec(db, QUERY_ROLLBACK_TRANSACTION);
+        return false;
+    }
+    return exec(db, QUERY_END_TRANSACTION) && init_auto_vacuum();
+}
+
+bool marky::Backend_SQLite::init_auto_vacuum() {
+    /* dbs created before auto_vacuum was set won't have it until compact() */
+    sqlite3_stmt* stmt = NULL;
+    int64_t mode = 0;
+    bool ok = prepare(db, QUERY_GET_AUTO_VACUUM, stmt) &&
+        step_int64(db, stmt, QUERY_GET_AUTO_VACUUM, mode);
+    sqlite3_finalize(stmt);
+    auto_vacuum = (mode == AUTO_VACUUM_INCREMENTAL);
+    return ok;
+}
+
+bool marky::Backend_SQLite::init_pragmas() {
+    /* auto_vacuum and page_size must come before anything is written,
+       including the switch to WAL, and can't be changed by a reader */
+    std::string pragmas;
+    if (options.page_size != 0 && connection != CONN_READER) {
+        pragmas += QUERY_SET_PAGE_SIZE + std::to_string(options.page_size) + ";";
+    }
+    if (connection != CONN_READER) {
+        /* after page_size, which it would otherwise lock in */
+        pragmas += QUERY_SET_AUTO_VACUUM ";";
     }
-    if (!exec(db, QUERY_CREATE_TABLES)) {
+    if (options.cache_size != 0) {
+        pragmas += QUERY_SET_CACHE_SIZE + std::to_string(options.cache_size) + ";";
+    }
+    if (options.mmap_size != 0) {
+        pragmas += QUERY_SET_MMAP_SIZE + std::to_string(options.mmap_size) + ";";
+    }
+    if (options.temp_store != TEMP_STORE_DEFAULT) {
+        pragmas += QUERY_SET_TEMP_STORE + std::to_string(options.temp_store) + ";";
+    }
+    if (!pragmas.empty() && !exec(db, pragmas.c_str())) {
+        ERROR("Failed to apply options to sqlite db at %s", path.c_str());
         return false;
     }
+    return true;
+}
 
+bool marky::Backend_SQLite::prepare_stmts() {
     if (!prepare(db, QUERY_SET_STATE, stmt_set_state) ||
             !prepare(db, QUERY_GET_STATE, stmt_get_state) ||
+            !prepare(db, QUERY_GET_WORD_ID, stmt_get_word_id) ||
+            !prepare(db, QUERY_GET_WORD, stmt_get_word) ||
+            !prepare(db, QUERY_INSERT_WORD, stmt_insert_word) ||
+            !prepare(db, QUERY_GET_CONTEXT_ID, stmt_get_context_id) ||
+            !prepare(db, QUERY_INSERT_CONTEXT, stmt_insert_context) ||
+            !prepare(db, QUERY_GET_ID_RANGE, stmt_get_id_range) ||
             !prepare(db, QUERY_GET_RANDOM, stmt_get_random) ||
             !prepare(db, QUERY_GET_PREVS, stmt_get_prevs) ||
             !prepare(db, QUERY_GET_NEXTS, stmt_get_nexts) ||
             !prepare(db, QUERY_UPDATE_SNIPPET, stmt_update_snippet) ||
             !prepare(db, QUERY_UPSERT_SNIPPET, stmt_upsert_snippet) ||
             !prepare(db, QUERY_INSERT_SNIPPET, stmt_insert_snippet) ||
-            !prepare(db, QUERY_INSERT_NEXT, stmt_insert_next) ||
-            !prepare(db, QUERY_INSERT_PREV, stmt_insert_prev) ||
             !prepare(db, QUERY_GET_ALL, stmt_get_all) ||
-            !prepare(db, QUERY_DELETE_SNIPPET, stmt_delete_snippet)) {
+            (options.prune_chunk_size == 0 && !prepare(db, QUERY_PRUNE, stmt_prune)) ||
+            !prepare(db, QUERY_GET_PRUNE_CHUNK, stmt_get_prune_chunk) ||
+            !prepare(db, QUERY_INSERT_LOOKUP, stmt_insert_lookup) ||
+            !prepare(db, QUERY_GET_SNIPPETS_LOOKUP, stmt_get_snippets_lookup)) {
         ERROR("Unable to prepare SQLite statements.");
         return false;
     }
     return true;
 }
 
-// IBACKEND STUFF (when used directly, PROBABLY SLOW)
+bool marky::Backend_SQLite::begin_transaction() {
+    if (!exec(db, QUERY_BEGIN_TRANSACTION)) {
+        return false;
+    }
+    if (connection != CONN_READER) {
+        return true;
+    }
+    /* this also starts the read, fixing the snapshot seen by the transaction */
+    int64_t version = 0;
+    if (!step_int64(db, stmt_get_data_version, QUERY_GET_DATA_VERSION, version)) {
+        exec(db, QUERY_ROLLBACK_TRANSACTION);
+        return false;
+    }
+    if (version != data_version) {
+        /* the writer may have pruned contexts, whose ids could then be reused.
+           word ids are never removed, so those stay valid. */
+        context_ids.clear();
+        if (data_version >= 0 && !init_max_score()) {
+            exec(db, QUERY_ROLLBACK_TRANSACTION);
+            return false;
+        }
+        data_version = version;
+    }
+    return true;
+}
 
-bool marky::Backend_SQLite::get_random(const State& /*state*/, scorer_t /*scorer*/,
-        word_t& random) {
+bool marky::Backend_SQLite::end_transaction(bool commit) {
+    if (commit) {
+        return exec(db, QUERY_END_TRANSACTION);
+    }
+    /* forget any ids which were added by the transaction */
+    word_ids.clear();
+    id_words.clear();
+    context_ids.clear();
+    dirty_nexts.clear();
+    dirty_prevs.clear();
+    exec(db, QUERY_ROLLBACK_TRANSACTION);
+    return false;
+}
+
+bool marky::Backend_SQLite::init_lists() {
+    sqlite3_stmt* stmt = NULL;
+    int64_t found = 0;
+    bool ok = prepare(db, QUERY_FIND_LISTS, stmt) &&
+        step_int64(db, stmt, QUERY_FIND_LISTS, found);
+    sqlite3_finalize(stmt);
+    if (!ok) {
+        return false;
+    }
+    if (found == 0 && (!lists || connection == CONN_READER)) {
+        /* not wanted, or not ours to add */
+        lists = false;
+        return true;
+    }
+    lists = true;
+
+    if (found == 0 && !exec(db, QUERY_CREATE_LISTS)) {
+        return false;
+    }
+    if (!prepare(db, QUERY_GET_NEXTS_LIST, stmt_get_nexts_list) ||
+            !prepare(db, QUERY_GET_PREVS_LIST, stmt_get_prevs_list) ||
+            !prepare(db, QUERY_SET_NEXTS_LIST, stmt_set_nexts_list) ||
+            !prepare(db, QUERY_SET_PREVS_LIST, stmt_set_prevs_list) ||
+            !prepare(db, QUERY_DELETE_NEXTS_LIST, stmt_delete_nexts_list) ||
+            !prepare(db, QUERY_DELETE_PREVS_LIST, stmt_delete_prevs_list)) {
+        return false;
+    }
+    if (connection != CONN_READER && !exec(db, QUERY_CREATE_DIRTY)) {
+        return false;
+    }
+    if (found != 0) {
+        return true;
+    }
+
+    /* new lists for an existing db: build one for every context */
+    LOG("Building adjacency lists for sqlite db at %s...", path.c_str());
+    return dirty_all_lists() && write_lists();
+}
+
+bool marky::Backend_SQLite::dirty_all_lists() {
+    sqlite3_stmt* stmt = NULL;
+    if (!prepare(db, QUERY_GET_CONTEXT_IDS, stmt)) {
+        return false;
+    }
     bool ok = true;
-    int step = sqlite3_step(stmt_get_random);
-    random = IBackend::LINE_END;
-    switch (step) {
-    case SQLITE_ROW:/* row found, parse */
-        {
-            words_t words;
-            unpack((const char*)sqlite3_column_text(stmt_get_random, 0), words);
-            for (words_t::const_iterator iter = words.begin();
-                 iter != words.end(); ++iter) {
-                if (*iter != IBackend::LINE_END) {
-                    random = *iter;
-                }
-            }
-            break;
-        }
-    case SQLITE_DONE:/* nothing found, do nothing */
-        break;
-    default:
+    int step;
+    while ((step = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const int64_t id = sqlite3_column_int64(stmt, 0);
+        dirty_nexts.insert(id);
+        dirty_prevs.insert(id);
+    }
+    if (step != SQLITE_DONE) {
+        ERROR("Error when parsing response to '%s': %d/%s",
+                QUERY_GET_CONTEXT_IDS, step, sqlite3_errmsg(db));
         ok = false;
+    }
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+bool marky::Backend_SQLite::write_lists() {
+    if (bulk_load) {
+        /* rebuilt in full by finish_bulk_load() */
+        dirty_nexts.clear();
+        dirty_prevs.clear();
+        return true;
+    }
+    bool ok = true;
+    for (ids_t::const_iterator iter = dirty_nexts.begin();
+         ok && iter != dirty_nexts.end(); ++iter) {
+        ok = write_list(false, *iter);
+    }
+    for (ids_t::const_iterator iter = dirty_prevs.begin();
+         ok && iter != dirty_prevs.end(); ++iter) {
+        ok = write_list(true, *iter);
+    }
+    dirty_nexts.clear();
+    dirty_prevs.clear();
+    return ok;
+}
+
+bool marky::Backend_SQLite::write_list(bool prevs, int64_t context_id) {
+    sqlite3_stmt* get_stmt = (prevs) ? stmt_get_prevs : stmt_get_nexts;
+    if (!bind_int64(get_stmt, 1, context_id)) {
+        sqlite3_clear_bindings(get_stmt);
+        sqlite3_reset(get_stmt);
+        return false;
+    }
+    /* columns: word, time, count, score */
+    std::string packed;
+    int step;
+    while ((step = sqlite3_step(get_stmt)) == SQLITE_ROW) {
+        pack_id(sqlite3_column_int64(get_stmt, 0), packed);
+        pack_id(sqlite3_column_int64(get_stmt, 3), packed);
+        pack_id(sqlite3_column_int64(get_stmt, 1), packed);
+        pack_id(sqlite3_column_int64(get_stmt, 2), packed);
+    }
+    sqlite3_clear_bindings(get_stmt);
+    sqlite3_reset(get_stmt);
+    if (step != SQLITE_DONE) {
         ERROR("Error when parsing response to '%s': %d/%s",
-                QUERY_GET_RANDOM, step, sqlite3_errmsg(db));
-        break;
+                sqlite3_sql(get_stmt), step, sqlite3_errmsg(db));
+        return false;
     }
 
-    sqlite3_clear_bindings(stmt_get_random);
-    sqlite3_reset(stmt_get_random);
+    /* contexts without any candidates left don't need a list */
+    sqlite3_stmt* set_stmt;
+    bool ok;
+    if (packed.empty()) {
+        set_stmt = (prevs) ? stmt_delete_prevs_list : stmt_delete_nexts_list;
+        ok = bind_int64(set_stmt, 1, context_id);
+    } else {
+        set_stmt = (prevs) ? stmt_set_prevs_list : stmt_set_nexts_list;
+        ok = bind_int64(set_stmt, 1, context_id) && bind_blob(set_stmt, 2, packed);
+    }
+    if (ok) {
+        step = sqlite3_step(set_stmt);
+        if (step != SQLITE_DONE) {
+            ERROR("Error when parsing response to '%s': %d/%s",
+                    sqlite3_sql(set_stmt), step, sqlite3_errmsg(db));
+            ok = false;
+        }
+    }
+    sqlite3_clear_bindings(set_stmt);
+    sqlite3_reset(set_stmt);
     return ok;
 }
 
-bool marky::Backend_SQLite::get_prev(const State& state, selector_t selector,
-        scorer_t scorer, const words_t& search_words, word_t& prev) {
-#ifdef READ_DEBUG_ENABLED
-    DEBUG("get_prev(%s)", str(search_words).c_str());
-#endif
-    if (!bind_words(stmt_get_prevs, 1, search_words)) {
-        sqlite3_clear_bindings(stmt_get_prevs);
-        sqlite3_reset(stmt_get_prevs);
+bool marky::Backend_SQLite::init_bulk_load() {
+    sqlite3_stmt* stmt = NULL;
+    int64_t found = 0;
+    bool ok = prepare(db, QUERY_FIND_SNIPPET, stmt) &&
+        step_int64(db, stmt, QUERY_FIND_SNIPPET, found);
+    sqlite3_finalize(stmt);
+    bulk_load = (ok && found == 0);
+    if (ok && !bulk_load) {
+        LOG("sqlite db at %s already has data, skipping bulk load.", path.c_str());
+    }
+    return ok;
+}
+
+bool marky::Backend_SQLite::start_bulk_load() {
+    if (!bulk_load || bulk_written) {
+        return true;
+    }
+    if (!exec(db, QUERY_BULK_LOAD_BEGIN)) {
+        return false;
+    }
+    bulk_written = true;
+    return true;
+}
+
+bool marky::Backend_SQLite::finish_bulk_load() {
+    if (!bulk_load) {
+        return true;
+    }
+    bulk_load = false;
+    if (!bulk_written) {
+        /* nothing was written, so the index was never dropped */
+        return true;
+    }
+
+    /* all or nothing, though a db left without the prevs index gets it back
+       when it's next opened, see QUERY_CREATE_TABLES */
+    if (!exec(db, QUERY_BEGIN_TRANSACTION)) {
+        return false;
+    }
+    bool ok = exec(db, QUERY_CREATE_PREVS_INDEX);
+    if (ok && bulk_pruned) {
+        /* deferred by prune(), which had no index to check the contexts with */
+        ok = exec(db, QUERY_DELETE_UNUSED_CONTEXTS);
+        context_ids.clear();
+    }
+    ok = ok && (!lists || (dirty_all_lists() && write_lists())) &&
+        exec(db, QUERY_BULK_LOAD_END);
+    bulk_pruned = false;
+    return end_transaction(ok);
+}
+
+bool marky::Backend_SQLite::init_max_score() {
+    int64_t stored = -1;
+    if (!get_state(db, stmt_get_state, STATE_KEY_MAX_SCORE, stored)) {
+        return false;
+    }
+    if (stored >= 0) {
+        max_score = stored;
+        return true;
+    }
+    /* not stored yet (eg migrated db), get it the slow way */
+    sqlite3_stmt* stmt = NULL;
+    int64_t found = 0;
+    bool ok = prepare(db, QUERY_GET_MAX_SCORE, stmt) &&
+        step_int64(db, stmt, QUERY_GET_MAX_SCORE, found);
+    sqlite3_finalize(stmt);
+    max_score = found;
+    return ok;
+}
+
+bool marky::Backend_SQLite::migrate_v1() {
+    sqlite3_stmt* stmt_get_all_v1 = NULL;
+    if (!prepare(db, QUERY_GET_ALL_V1, stmt_get_all_v1)) {
+        sqlite3_finalize(stmt_get_all_v1);
         return false;
     }
 
     bool ok = true;
-    snippets_ptr_t snippets(new snippet_ptr_set_t);
+    size_t count = 0;
+    snippet_ptr_set_t batch;
     for (;;) {
-        int step = sqlite3_step(stmt_get_prevs);
+        int step = sqlite3_step(stmt_get_all_v1);
         bool done = false;
         switch (step) {
             case SQLITE_DONE:
@@ -434,72 +1285,216 @@ bool marky::Backend_SQLite::get_prev(const State& state, selector_t selector,
             case SQLITE_ROW:
                 {
                     words_t words;
-                    unpack((const char*)sqlite3_column_text(stmt_get_prevs, 0), words);
+                    unpack((const char*)sqlite3_column_text(stmt_get_all_v1, 0), words);
                     snippet_t snippet(new Snippet(words,
-                                    sqlite3_column_int64(stmt_get_prevs, 1),
-                                    sqlite3_column_int64(stmt_get_prevs, 2),
-                                    sqlite3_column_int64(stmt_get_prevs, 3)));
-                    snippets->insert(snippet);
+                                    sqlite3_column_int64(stmt_get_all_v1, 1),
+                                    sqlite3_column_int64(stmt_get_all_v1, 2),
+                                    sqlite3_column_int64(stmt_get_all_v1, 3)));
+                    batch.insert(snippet);
                     break;
                 }
             default:
                 ok = false;
                 ERROR("Error when parsing response to '%s': %d/%s",
-                        QUERY_GET_PREVS, step, sqlite3_errmsg(db));
+                        QUERY_GET_ALL_V1, step, sqlite3_errmsg(db));
                 break;
         }
+        if (ok && (batch.size() >= MIGRATE_BATCH_SIZE || (done && !batch.empty()))) {
+            /* words were unique in version 1, so nothing needs updating */
+            ok = insert_snippets_impl(batch, false);
+            count += batch.size();
+            batch.clear();
+        }
         if (!ok || done) {
             break;
         }
     }
-    sqlite3_clear_bindings(stmt_get_prevs);
-    sqlite3_reset(stmt_get_prevs);
-
-    if (snippets->empty()) {
-        if (search_words.size() >= 2) {
-            words_t search_words_shortened(search_words);
-            search_words_shortened.pop_back();
-#ifdef READ_DEBUG_ENABLED
-            DEBUG("get_prev -> %s", str(search_words_shortened).c_str());
-#endif
-            /* recurse with shorter search */
-            return get_prev(state, selector, scorer, search_words_shortened, prev);
-        } else {
-#ifdef READ_DEBUG_ENABLED
-            DEBUG("    prev_snippet -> NOTFOUND");
-#endif
-            prev = IBackend::LINE_START;
-        }
-    } else {
-        const words_t& prev_snippet = selector(*snippets, scorer, state)->words;
-#ifdef READ_DEBUG_ENABLED
-        for (snippet_ptr_set_t::const_iterator siter = snippets->begin();
-             siter != snippets->end(); ++siter) {
-            DEBUG("  prevs%s = snippet(%s, %lu)", str(search_words).c_str(),
-                    str((*siter)->words).c_str(), (*siter)->score(scorer, state));
-        }
-        DEBUG("    prev_snippet -> %s", str(prev_snippet).c_str());
-#endif
-        prev = prev_snippet.front();
+    sqlite3_finalize(stmt_get_all_v1);
+    if (ok) {
+        LOG("Migrated %lu snippets.", count);
     }
     return ok;
 }
 
-bool marky::Backend_SQLite::get_next(const State& state, selector_t selector,
-        scorer_t scorer, const words_t& search_words, word_t& next) {
-#ifdef READ_DEBUG_ENABLED
-    DEBUG("get_next(%s)", str(search_words).c_str());
-#endif
-    if (!bind_words(stmt_get_nexts, 1, search_words)) {
-        sqlite3_clear_bindings(stmt_get_nexts);
-        sqlite3_reset(stmt_get_nexts);
-        return false;
+bool marky::Backend_SQLite::get_word_id(const word_t& word, bool create, int64_t& id) {
+    word_ids_t::const_iterator iter = word_ids.find(word);
+    if (iter != word_ids.end()) {
+        id = iter->second;
+        return true;
+    }
+
+    if (!bind_str(stmt_get_word_id, 1, word)) {
+        sqlite3_clear_bindings(stmt_get_word_id);
+        sqlite3_reset(stmt_get_word_id);
+        return false;
+    }
+    if (!step_int64(db, stmt_get_word_id, QUERY_GET_WORD_ID, id)) {
+        return false;
+    }
+    if (id == 0 && create) {
+        if (!bind_str(stmt_insert_word, 1, word)) {
+            sqlite3_clear_bindings(stmt_insert_word);
+            sqlite3_reset(stmt_insert_word);
+            return false;
+        }
+        if (!step_insert(db, stmt_insert_word, QUERY_INSERT_WORD, id)) {
+            return false;
+        }
+    }
+    if (id != 0) {
+        if (word_ids.size() >= ID_CACHE_MAX) {
+            word_ids.clear();
+            id_words.clear();
+        }
+        word_ids[word] = id;
+        id_words[id] = word;
+    }
+    return true;
+}
+
+bool marky::Backend_SQLite::get_word(int64_t id, word_t& word) {
+    id_words_t::const_iterator iter = id_words.find(id);
+    if (iter != id_words.end()) {
+        word = iter->second;
+        return true;
+    }
+
+    if (!bind_int64(stmt_get_word, 1, id)) {
+        sqlite3_clear_bindings(stmt_get_word);
+        sqlite3_reset(stmt_get_word);
+        return false;
+    }
+    bool ok = true;
+    int step = sqlite3_step(stmt_get_word);
+    switch (step) {
+        case SQLITE_ROW:
+            word = (const char*)sqlite3_column_text(stmt_get_word, 0);
+            break;
+        case SQLITE_DONE:
+            ok = false;
+            ERROR("Word %ld is missing from the dictionary!", id);
+            break;
+        default:
+            ok = false;
+            ERROR("Error when parsing response to '%s': %d/%s",
+                    QUERY_GET_WORD, step, sqlite3_errmsg(db));
+            break;
+    }
+    sqlite3_clear_bindings(stmt_get_word);
+    sqlite3_reset(stmt_get_word);
+
+    if (ok) {
+        if (word_ids.size() >= ID_CACHE_MAX) {
+            word_ids.clear();
+            id_words.clear();
+        }
+        word_ids[word] = id;
+        id_words[id] = word;
+    }
+    return ok;
+}
+
+bool marky::Backend_SQLite::get_context_id(const words_t& context, bool create, int64_t& id) {
+    std::string packed;
+    for (words_t::const_iterator iter = context.begin();
+         iter != context.end(); ++iter) {
+        int64_t word_id;
+        if (!get_word_id(*iter, create, word_id)) {
+            return false;
+        }
+        if (word_id == 0) {
+            /* word hasn't been seen, so neither has the context */
+            id = 0;
+            return true;
+        }
+        pack_id(word_id, packed);
+    }
+
+    context_ids_t::const_iterator iter = context_ids.find(packed);
+    if (iter != context_ids.end()) {
+        id = iter->second;
+        return true;
+    }
+
+    if (!bind_blob(stmt_get_context_id, 1, packed)) {
+        sqlite3_clear_bindings(stmt_get_context_id);
+        sqlite3_reset(stmt_get_context_id);
+        return false;
+    }
+    if (!step_int64(db, stmt_get_context_id, QUERY_GET_CONTEXT_ID, id)) {
+        return false;
+    }
+    if (id == 0 && create) {
+        if (!bind_blob(stmt_insert_context, 1, packed)) {
+            sqlite3_clear_bindings(stmt_insert_context);
+            sqlite3_reset(stmt_insert_context);
+            return false;
+        }
+        if (!step_insert(db, stmt_insert_context, QUERY_INSERT_CONTEXT, id)) {
+            return false;
+        }
+    }
+    if (id != 0) {
+        if (context_ids.size() >= ID_CACHE_MAX) {
+            context_ids.clear();
+        }
+        context_ids[packed] = id;
+    }
+    return true;
+}
+
+bool marky::Backend_SQLite::get_context_words(const void* packed, size_t size, words_t& out) {
+    out.clear();
+    const unsigned char* iter = (const unsigned char*)packed;
+    const unsigned char* end = iter + size;
+    while (iter != end) {
+        int64_t id;
+        if (!unpack_id(iter, end, id)) {
+            ERROR("Invalid context of %lu bytes", size);
+            return false;
+        }
+        word_t word;
+        if (!get_word(id, word)) {
+            return false;
+        }
+        out.push_back(word);
+    }
+    return true;
+}
+
+bool marky::Backend_SQLite::get_row_words(sqlite3_stmt* stmt, words_t& out) {
+    /* column 0 is the prefix, column 1 is the next word */
+    word_t next;
+    if (!get_context_words(sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0), out) ||
+            !get_word(sqlite3_column_int64(stmt, 1), next)) {
+        return false;
+    }
+    out.push_back(next);
+    return true;
+}
+
+bool marky::Backend_SQLite::get_adjacent(sqlite3_stmt* stmt, const char* query,
+        const words_t& context, bool prevs, snippet_ptr_set_t& out) {
+    out.clear();
+    int64_t context_id;
+    if (!get_context_id(context, false, context_id)) {
+        return false;
+    }
+    if (context_id == 0) {
+        return true;/* context hasn't been seen */
+    }
+    if (lists) {
+        return get_list(context, context_id, prevs, out);
+    }
+    if (!bind_int64(stmt, 1, context_id)) {
+        sqlite3_clear_bindings(stmt);
+        sqlite3_reset(stmt);
+        return false;
     }
 
     bool ok = true;
-    snippets_ptr_t snippets(new snippet_ptr_set_t);
     for (;;) {
-        int step = sqlite3_step(stmt_get_nexts);
+        int step = sqlite3_step(stmt);
         bool done = false;
         switch (step) {
             case SQLITE_DONE:
@@ -507,55 +1502,348 @@ bool marky::Backend_SQLite::get_next(const State& state, selector_t selector,
                 break;
             case SQLITE_ROW:
                 {
-                    words_t words;
-                    unpack((const char*)sqlite3_column_text(stmt_get_nexts, 0), words);
+                    word_t word;
+                    if (!get_word(sqlite3_column_int64(stmt, 0), word)) {
+                        ok = false;
+                        break;
+                    }
+                    words_t words(context);
+                    if (prevs) {
+                        words.push_front(word);
+                    } else {
+                        words.push_back(word);
+                    }
                     snippet_t snippet(new Snippet(words,
-                                    sqlite3_column_int64(stmt_get_nexts, 1),
-                                    sqlite3_column_int64(stmt_get_nexts, 2),
-                                    sqlite3_column_int64(stmt_get_nexts, 3)));
-                    snippets->insert(snippet);
+                                    sqlite3_column_int64(stmt, 1),
+                                    sqlite3_column_int64(stmt, 2),
+                                    sqlite3_column_int64(stmt, 3)));
+                    out.insert(snippet);
                     break;
                 }
             default:
                 ok = false;
                 ERROR("Error when parsing response to '%s': %d/%s",
-                        QUERY_GET_NEXTS, step, sqlite3_errmsg(db));
+                        query, step, sqlite3_errmsg(db));
                 break;
         }
         if (!ok || done) {
             break;
         }
     }
-    sqlite3_clear_bindings(stmt_get_nexts);
-    sqlite3_reset(stmt_get_nexts);
+    sqlite3_clear_bindings(stmt);
+    sqlite3_reset(stmt);
+    return ok;
+}
+
+bool marky::Backend_SQLite::get_list(const words_t& context, int64_t context_id,
+        bool prevs, snippet_ptr_set_t& out, snippet_to_id_t* lazy_ids/*=NULL*/) {
+    sqlite3_stmt* stmt = (prevs) ? stmt_get_prevs_list : stmt_get_nexts_list;
+    if (!bind_int64(stmt, 1, context_id)) {
+        sqlite3_clear_bindings(stmt);
+        sqlite3_reset(stmt);
+        return false;
+    }
+
+    bool ok = true;
+    int step = sqlite3_step(stmt);
+    if (step == SQLITE_ROW) {
+        const unsigned char* iter = (const unsigned char*)sqlite3_column_blob(stmt, 0);
+        const unsigned char* end = iter + sqlite3_column_bytes(stmt, 0);
+        while (iter != end) {
+            int64_t word_id, score, time, count;
+            word_t word;
+            if (!unpack_id(iter, end, word_id) || !unpack_id(iter, end, score) ||
+                    !unpack_id(iter, end, time) || !unpack_id(iter, end, count)) {
+                ERROR("Corrupt adjacency list for context %ld", context_id);
+                ok = false;
+                break;
+            }
+            if (lazy_ids != NULL) {
+                snippet_t snippet(new Snippet(words_t(), time, count, score));
+                out.insert(snippet);
+                (*lazy_ids)[snippet] = word_id;
+                continue;
+            }
+            if (!get_word(word_id, word)) {
+                ok = false;
+                break;
+            }
+            words_t words(context);
+            if (prevs) {
+                words.push_front(word);
+            } else {
+                words.push_back(word);
+            }
+            out.insert(snippet_t(new Snippet(words, time, count, score)));
+        }
+    } else if (step != SQLITE_DONE) {
+        ERROR("Error when parsing response to '%s': %d/%s",
+                sqlite3_sql(stmt), step, sqlite3_errmsg(db));
+        ok = false;
+    }
+    sqlite3_clear_bindings(stmt);
+    sqlite3_reset(stmt);
+    return ok;
+}
+
+bool marky::Backend_SQLite::get_backoff(const words_t& search_words, bool prevs,
+        snippet_ptr_set_t& out, snippet_to_id_t& candidate_ids) {
+    out.clear();
+    candidate_ids.clear();
+    /* the contexts to try, longest first. nexts follow the end of the search,
+       so drop words from the front. prevs precede the start, so drop from the back */
+    std::vector<words_t> contexts;
+    words_t context(search_words);
+    while (!context.empty()) {
+        contexts.push_back(context);
+        if (prevs) {
+            context.pop_back();
+        } else {
+            context.pop_front();
+        }
+    }
 
-    if (snippets->empty()) {
-        if (search_words.size() >= 2) {
-            words_t search_words_shortened(++search_words.begin(), search_words.end());
+    if (lists) {
+        /* each list is a single row anyway */
+        for (std::vector<words_t>::const_iterator iter = contexts.begin();
+             iter != contexts.end(); ++iter) {
+            int64_t context_id;
+            if (!get_context_id(*iter, false, context_id)) {
+                return false;
+            }
+            if (context_id == 0) {
+                continue;
+            }
+            if (!get_list(*iter, context_id, prevs, out, &candidate_ids)) {
+                return false;
+            }
+            if (!out.empty()) {
+                break;
+            }
+        }
+        return true;
+    }
+
+    /* contexts containing anything that hasn't been seen can't have been stored */
+    std::vector<std::pair<size_t, std::string> > keys;/* (order index, packed context) */
+    for (size_t i = 0; i < contexts.size(); ++i) {
+        std::string packed;
+        for (words_t::const_iterator iter = contexts[i].begin();
+             iter != contexts[i].end(); ++iter) {
+            int64_t word_id;
+            if (!get_word_id(*iter, false, word_id)) {
+                return false;
+            }
+            if (word_id == 0) {
+                packed.clear();
+                break;
+            }
+            pack_id(word_id, packed);
+        }
+        if (!packed.empty()) {
+            keys.push_back(std::make_pair(i, packed));
+        }
+    }
+    if (keys.empty()) {
+        return true;
+    }
+
+    sqlite3_stmt* stmt = get_backoff_stmt(keys.size(), prevs);
+    if (stmt == NULL) {
+        return false;
+    }
+    bool ok = true;
+    int bind_id = 1;
+    for (size_t i = 0; ok && i < keys.size(); ++i) {
+        ok = bind_int64(stmt, bind_id++, keys[i].first) &&
+            bind_blob(stmt, bind_id++, keys[i].second);
+    }
+
+    /* keep the rows of the longest context found. they come first, so stop at
+       the first row of a shorter one */
+    size_t best = contexts.size();
+    while (ok) {
+        int step = sqlite3_step(stmt);
+        if (step == SQLITE_DONE) {
+            break;
+        } else if (step != SQLITE_ROW) {
+            ERROR("Error when parsing response to '%s': %d/%s",
+                    sqlite3_sql(stmt), step, sqlite3_errmsg(db));
+            ok = false;
+            break;
+        }
+        size_t order = sqlite3_column_int64(stmt, 0);
+        if (order > best) {
+            break;
+        } else if (order < best) {
+            out.clear();
+            candidate_ids.clear();
+            best = order;
+        }
+        snippet_t snippet(new Snippet(words_t(),
+                        sqlite3_column_int64(stmt, 2),
+                        sqlite3_column_int64(stmt, 3),
+                        sqlite3_column_int64(stmt, 4)));
+        out.insert(snippet);
+        candidate_ids[snippet] = sqlite3_column_int64(stmt, 1);
+    }
+    sqlite3_clear_bindings(stmt);
+    sqlite3_reset(stmt);
+    return ok;
+}
+
+sqlite3_stmt* marky::Backend_SQLite::get_backoff_stmt(size_t size, bool prevs) {
+    sqlite3_stmt*& stmt = (prevs) ? stmt_get_prevs_backoff[size] : stmt_get_nexts_backoff[size];
+    if (stmt == NULL) {
+        /* prepare on first use: only sizes up to the search length are needed */
+        std::ostringstream query;
+        query << ((prevs) ? QUERY_GET_PREVS_BACKOFF_PREFIX : QUERY_GET_NEXTS_BACKOFF_PREFIX);
+        for (size_t i = 1; i <= size * 2; i += 2) {
+            if (i > 1) {
+                query << ',';
+            }
+            query << "(?" << i << ",?" << i + 1 << ')';
+        }
+        query << ((prevs) ? QUERY_GET_PREVS_BACKOFF_SUFFIX : QUERY_GET_NEXTS_BACKOFF_SUFFIX);
+        if (!prepare(db, query.str().c_str(), stmt)) {
+            sqlite3_finalize(stmt);
+            stmt = NULL;
+        }
+    }
+    return stmt;
+}
+
+// IBACKEND STUFF (when used directly, PROBABLY SLOW)
+
+bool marky::Backend_SQLite::get_random(const State& state, scorer_t scorer,
+        word_t& random) {
+    random = IBackend::LINE_END;
+    int64_t min_id = 0, max_id = 0;
+    bool ok = true;
+    int step = sqlite3_step(stmt_get_id_range);
+    if (step == SQLITE_ROW) {
+        min_id = sqlite3_column_int64(stmt_get_id_range, 0);
+        max_id = sqlite3_column_int64(stmt_get_id_range, 1);
+    } else {
+        ok = false;
+        ERROR("Error when parsing response to '%s': %d/%s",
+                QUERY_GET_ID_RANGE, step, sqlite3_errmsg(db));
+    }
+    sqlite3_reset(stmt_get_id_range);
+    if (!ok || max_id == 0) {
+        return ok;/* error or nothing stored */
+    }
+
+    /* ids left behind by deleted snippets make the snippet after them more
+       likely to be picked, but this avoids sorting the whole table.
+       when weighting by score, accept a pick with a probability of
+       (its current score / the highest stored score) */
+    words_t words;
+    for (int attempt = 0; ok && attempt < RANDOM_WEIGHTED_ATTEMPTS; ++attempt) {
+        if (!bind_int64(stmt_get_random, 1, min_id + pick_rand(max_id - min_id + 1))) {
+            ok = false;
+            break;
+        }
+        bool accept = true;
+        step = sqlite3_step(stmt_get_random);
+        switch (step) {
+        case SQLITE_ROW:/* row found, parse */
+            if (!get_row_words(stmt_get_random, words)) {
+                ok = false;
+            } else if (options.weighted_random && max_score != 0) {
+                Snippet snippet(words,
+                        sqlite3_column_int64(stmt_get_random, 2),
+                        sqlite3_column_int64(stmt_get_random, 3),
+                        sqlite3_column_int64(stmt_get_random, 4));
+                accept = pick_rand(max_score) < snippet.score(scorer, state);
+            }
+            break;
+        case SQLITE_DONE:/* nothing found, eg a concurrent delete: try again */
+            accept = false;
+            break;
+        default:
+            ok = false;
+            ERROR("Error when parsing response to '%s': %d/%s",
+                    QUERY_GET_RANDOM, step, sqlite3_errmsg(db));
+            break;
+        }
+        sqlite3_clear_bindings(stmt_get_random);
+        sqlite3_reset(stmt_get_random);
+        if (accept) {
+            break;
+        }
+    }
+    if (!ok) {
+        return false;
+    }
+
+    for (words_t::const_iterator iter = words.begin();
+         iter != words.end(); ++iter) {
+        if (*iter != IBackend::LINE_END) {
+            random = *iter;
+        }
+    }
+    return true;
+}
+
+bool marky::Backend_SQLite::get_prev(const State& state, selector_t selector,
+        scorer_t scorer, const words_t& search_words, word_t& prev) {
 #ifdef READ_DEBUG_ENABLED
-            DEBUG("  get_next -> %s", str(search_words_shortened).c_str());
+    DEBUG("get_prev(%s)", str(search_words).c_str());
 #endif
-            /* recurse with shorter search */
-            return get_next(state, selector, scorer, search_words_shortened, next);
-        } else {
+    /* backs off to shorter searches within the one query. the candidates
+       hold no words: only the selected one's word is looked up */
+    snippet_ptr_set_t snippets;
+    snippet_to_id_t candidate_ids;
+    if (!get_backoff(search_words, true, snippets, candidate_ids)) {
+        return false;
+    }
+
+    if (snippets.empty()) {
 #ifdef READ_DEBUG_ENABLED
-            DEBUG("    next_snippet -> NOTFOUND");
+        DEBUG("    prev_snippet -> NOTFOUND");
 #endif
-            next = IBackend::LINE_END;
-        }
-    } else {
-        const words_t& next_snippet = selector(*snippets, scorer, state)->words;
+        prev = IBackend::LINE_START;
+        return true;
+    }
+    snippet_t selected = selector(snippets, scorer, state);
+    if (!selected || !get_word(candidate_ids[selected], prev)) {
+        return false;
+    }
 #ifdef READ_DEBUG_ENABLED
-        for (snippet_ptr_set_t::const_iterator siter = snippets->begin();
-             siter != snippets->end(); ++siter) {
-            DEBUG("  nexts%s = snippet(%s, %lu)", str(search_words).c_str(),
-                    str((*siter)->words).c_str(), (*siter)->score(scorer, state));
-        }
-        DEBUG("    next_snippet -> %s", str(next_snippet).c_str());
+    DEBUG("    prev_snippet -> %s (of %lu)", prev.c_str(), snippets.size());
+#endif
+    return true;
+}
+
+bool marky::Backend_SQLite::get_next(const State& state, selector_t selector,
+        scorer_t scorer, const words_t& search_words, word_t& next) {
+#ifdef READ_DEBUG_ENABLED
+    DEBUG("get_next(%s)", str(search_words).c_str());
 #endif
-        next = next_snippet.back();
+    /* backs off to shorter searches within the one query. the candidates
+       hold no words: only the selected one's word is looked up */
+    snippet_ptr_set_t snippets;
+    snippet_to_id_t candidate_ids;
+    if (!get_backoff(search_words, false, snippets, candidate_ids)) {
+        return false;
     }
-    return ok;
+
+    if (snippets.empty()) {
+#ifdef READ_DEBUG_ENABLED
+        DEBUG("    next_snippet -> NOTFOUND");
+#endif
+        next = IBackend::LINE_END;
+        return true;
+    }
+    snippet_t selected = selector(snippets, scorer, state);
+    if (!selected || !get_word(candidate_ids[selected], next)) {
+        return false;
+    }
+#ifdef READ_DEBUG_ENABLED
+    DEBUG("    next_snippet -> %s (of %lu)", next.c_str(), snippets.size());
+#endif
+    return true;
 }
 
 bool marky::Backend_SQLite::update_snippets(const State& state, scorer_t scorer,
@@ -563,9 +1851,8 @@ bool marky::Backend_SQLite::update_snippets(const State& state, scorer_t scorer,
 #ifdef WRITE_DEBUG_ENABLED
     DEBUG("update_score -> %lu windows", line_windows.size());
 #endif
-
     words_to_snippet_t found_snippets;
-    if (!get_snippets(line_windows, found_snippets)) {
+    if (!get_snippets(line_windows, found_snippets) || !start_bulk_load()) {
         return false;
     }
 
@@ -598,55 +1885,22 @@ bool marky::Backend_SQLite::update_snippets(const State& state, scorer_t scorer,
                 !insert_snippets_impl(snippets_to_insert, true)) {
             ok = false;
         }
+        if (ok && lists && !write_lists()) {
+            ok = false;
+        }
     }
     return ok;
 }
 
 bool marky::Backend_SQLite::prune(const State& state, scorer_t scorer) {
-    bool ok = true;
-    snippet_ptr_set_t delme;
-
-    for (;;) {
-        int step = sqlite3_step(stmt_get_all);
-        bool done = false;
-        switch (step) {
-            case SQLITE_DONE:
-                done = true;
-                break;
-            case SQLITE_ROW:
-                {
-                    words_t words;
-                    unpack((const char*)sqlite3_column_text(stmt_get_all, 0), words);
-                    snippet_t snippet(new Snippet(words,
-                                    sqlite3_column_int64(stmt_get_all, 1),
-                                    sqlite3_column_int64(stmt_get_all, 2),
-                                    sqlite3_column_int64(stmt_get_all, 3)));
-                    if (snippet->score(scorer, state) == 0) {
-                        /* zero score; prune */
-                        delme.insert(snippet);
-                    }
-                    break;
-                }
-            default:
-                ok = false;
-                ERROR("Error when parsing response to '%s': %d/%s",
-                        QUERY_GET_ALL, step, sqlite3_errmsg(db));
-                break;
-        }
-        if (!ok || done) {
-            break;
-        }
+    if (options.prune_chunk_size != 0) {
+        /* cover the whole table, even if an earlier prune_chunks() stopped partway */
+        prune_cursor = 0;
+        bool finished;
+        return prune_chunks(state, scorer, 0, finished);
     }
-    sqlite3_clear_bindings(stmt_get_all);
-    sqlite3_reset(stmt_get_all);
 
-    if (!ok) {
-        return false;
-    }
-    DEBUG("%lu to prune", delme.size());
-    if (delme.empty()) {
-        return true;/* nothing to prune! */
-    }
+    bool ok = true;
 
     if (!exec(db, QUERY_BEGIN_TRANSACTION)) {
         ok = false;
@@ -654,88 +1908,185 @@ bool marky::Backend_SQLite::prune(const State& state, scorer_t scorer) {
 
     /* don't return false if !ok; really want to close the transaction */
 
-    /* delete snippets in delme */
-    for (snippet_ptr_set_t::const_iterator iter = delme.begin();
-         iter != delme.end(); ++iter) {
-        if (!bind_words(stmt_delete_snippet, 1, (*iter)->words)) {
-            ok = false;
-        }
-        int step = sqlite3_step(stmt_delete_snippet);
-        if (step != SQLITE_DONE) {
-            ERROR("Error when parsing response to '%s': %d\%s",
-                    QUERY_DELETE_SNIPPET, step, sqlite3_errmsg(db));
+    /* the scoring is done by score_func() as SQLite walks the table */
+    prune_state = &state;
+    prune_scorer = &scorer;
+    int step = sqlite3_step(stmt_prune);
+    prune_state = NULL;
+    prune_scorer = NULL;
+    if (step != SQLITE_DONE) {
+        ERROR("Error when parsing response to '%s': %d/%s",
+                QUERY_PRUNE, step, sqlite3_errmsg(db));
+        ok = false;
+    }
+    sqlite3_reset(stmt_prune);
+    const int pruned = (ok) ? sqlite3_changes(db) : 0;
+    DEBUG("%d pruned", pruned);
+
+    /* contexts may be reinserted under different ids, forget the old ones */
+    if (pruned != 0) {
+        if (lists && (!get_dirty() || !write_lists())) {
             ok = false;
         }
-        if (!ok) {
-            break;
+        if (bulk_load) {
+            /* finding unused contexts needs the prevs index */
+            bulk_pruned = true;
+        } else {
+            if (!exec(db, QUERY_DELETE_UNUSED_CONTEXTS)) {
+                ok = false;
+            }
+            context_ids.clear();
         }
     }
-    sqlite3_clear_bindings(stmt_delete_snippet);
-    sqlite3_reset(stmt_delete_snippet);
 
     if (!exec(db, QUERY_END_TRANSACTION)) {
         ok = false;
     }
 
+    if (ok && pruned != 0 && !vacuum(VACUUM_MAX_STEPS)) {
+        ok = false;
+    }
+
     return ok;
 }
 
-// ICACHEABLE STUFF (when wrapped in cache)
+bool marky::Backend_SQLite::prune_chunks(const State& state, scorer_t scorer,
+        size_t max_chunks, bool& finished) {
+    const size_t chunk_size = (options.prune_chunk_size != 0) ?
+        options.prune_chunk_size : PRUNE_CHUNK_SIZE;
+    finished = false;
+    size_t pruned = 0;
+    for (size_t chunk = 0; !finished && (max_chunks == 0 || chunk < max_chunks); ++chunk) {
+        if (!prune_chunk(state, scorer, chunk_size, finished, pruned)) {
+            return false;
+        }
+    }
+    DEBUG("%lu pruned, %s", pruned, (finished) ? "finished" : "not finished");
+    return true;
+}
 
-bool marky::Backend_SQLite::get_prevs(const words_t& words, snippet_ptr_set_t& out) {
-    if (!bind_words(stmt_get_prevs, 1, words)) {
-        sqlite3_clear_bindings(stmt_get_prevs);
-        sqlite3_reset(stmt_get_prevs);
+bool marky::Backend_SQLite::prune_chunk(const State& state, scorer_t scorer,
+        size_t chunk_size, bool& finished, size_t& pruned) {
+    if (!exec(db, QUERY_BEGIN_TRANSACTION)) {
         return false;
     }
 
-    bool ok = true;
-    out.clear();
-    for (;;) {
-        int step = sqlite3_step(stmt_get_prevs);
-        bool done = false;
-        switch (step) {
-            case SQLITE_DONE:
-                done = true;
-                break;
-            case SQLITE_ROW:
-                {
-                    words_t words;
-                    unpack((const char*)sqlite3_column_text(stmt_get_prevs, 0), words);
-                    snippet_t snippet(new Snippet(words,
-                                    sqlite3_column_int64(stmt_get_prevs, 1),
-                                    sqlite3_column_int64(stmt_get_prevs, 2),
-                                    sqlite3_column_int64(stmt_get_prevs, 3)));
-                    out.insert(snippet);
-                    break;
-                }
-            default:
-                ok = false;
-                ERROR("Error when parsing response to '%s': %d/%s",
-                        QUERY_GET_PREVS, step, sqlite3_errmsg(db));
-                break;
+    /* score the chunk, noting the zero-scored snippets and their contexts */
+    bool ok = bind_int64(stmt_get_prune_chunk, 1, prune_cursor) &&
+        bind_int64(stmt_get_prune_chunk, 2, chunk_size);
+    std::ostringstream delete_snippets, delete_contexts;
+    size_t rows = 0, found = 0;
+    int64_t last_id = prune_cursor - 1;
+    int step;
+    while (ok && (step = sqlite3_step(stmt_get_prune_chunk)) == SQLITE_ROW) {
+        ++rows;
+        last_id = sqlite3_column_int64(stmt_get_prune_chunk, 0);
+        const State snippet_state(sqlite3_column_int64(stmt_get_prune_chunk, 4),
+                sqlite3_column_int64(stmt_get_prune_chunk, 5));
+        if (scorer(sqlite3_column_int64(stmt_get_prune_chunk, 3), snippet_state, state) != 0) {
+            continue;
         }
-        if (!ok || done) {
+        const char sep = (found++ == 0) ? '(' : ',';
+        delete_snippets << sep << last_id;
+        delete_contexts << sep << sqlite3_column_int64(stmt_get_prune_chunk, 1)
+                    << ',' << sqlite3_column_int64(stmt_get_prune_chunk, 2);
+    }
+    if (ok && step != SQLITE_DONE) {
+        ERROR("Error when parsing response to '%s': %d/%s",
+                QUERY_GET_PRUNE_CHUNK, step, sqlite3_errmsg(db));
+        ok = false;
+    }
+    sqlite3_clear_bindings(stmt_get_prune_chunk);
+    sqlite3_reset(stmt_get_prune_chunk);
+
+    if (ok && found != 0) {
+        delete_snippets << ')';
+        delete_contexts << ')';
+        ok = exec(db, (QUERY_PRUNE_CHUNK_PREFIX + delete_snippets.str()).c_str()) &&
+            (!lists || (get_dirty() && write_lists()));
+        if (bulk_load) {
+            /* finding unused contexts needs the prevs index */
+            bulk_pruned = true;
+        } else {
+            ok = ok && exec(db, (QUERY_PRUNE_CHUNK_CONTEXTS_PREFIX + delete_contexts.str()).c_str());
+            /* contexts may be reinserted under different ids, forget the old ones */
+            context_ids.clear();
+        }
+    }
+    if (!end_transaction(ok)) {
+        return false;
+    }
+
+    pruned += found;
+    finished = (rows < chunk_size);
+    prune_cursor = (finished) ? 0 : last_id + 1;
+    return found == 0 || vacuum(1);
+}
+
+bool marky::Backend_SQLite::vacuum(size_t max_steps) {
+    if (!auto_vacuum) {
+        return true;
+    }
+    for (size_t i = 0; i < max_steps; ++i) {
+        sqlite3_stmt* stmt = NULL;
+        int64_t free_pages = 0;
+        bool ok = prepare(db, QUERY_GET_FREELIST_COUNT, stmt) &&
+            step_int64(db, stmt, QUERY_GET_FREELIST_COUNT, free_pages);
+        sqlite3_finalize(stmt);
+        if (!ok) {
+            return false;
+        }
+        if (free_pages == 0) {
             break;
         }
+        DEBUG("%ld free pages, vacuuming", free_pages);
+        if (!exec(db, (QUERY_INCREMENTAL_VACUUM + std::to_string(VACUUM_STEP_PAGES)).c_str())) {
+            return false;
+        }
     }
-    sqlite3_clear_bindings(stmt_get_prevs);
-    sqlite3_reset(stmt_get_prevs);
+    return true;
+}
 
-    return ok;
+bool marky::Backend_SQLite::compact() {
+    LOG("Compacting sqlite db at %s...", path.c_str());
+    return exec(db, QUERY_COMPACT) && init_auto_vacuum();
 }
 
-bool marky::Backend_SQLite::get_nexts(const words_t& words, snippet_ptr_set_t& out) {
-    if (!bind_words(stmt_get_nexts, 1, words)) {
-        sqlite3_clear_bindings(stmt_get_nexts);
-        sqlite3_reset(stmt_get_nexts);
+bool marky::Backend_SQLite::get_dirty() {
+    sqlite3_stmt* stmt = NULL;
+    if (!prepare(db, QUERY_GET_DIRTY, stmt)) {
         return false;
     }
+    int step;
+    while ((step = sqlite3_step(stmt)) == SQLITE_ROW) {
+        ids_t& dirty = (sqlite3_column_int64(stmt, 1) != 0) ? dirty_prevs : dirty_nexts;
+        dirty.insert(sqlite3_column_int64(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    if (step != SQLITE_DONE) {
+        ERROR("Error when parsing response to '%s': %d/%s",
+                QUERY_GET_DIRTY, step, sqlite3_errmsg(db));
+        return false;
+    }
+    return exec(db, QUERY_CLEAR_DIRTY);
+}
+
+void marky::Backend_SQLite::score_func(sqlite3_context* context,
+        int /*argc*/, sqlite3_value** argv) {
+    const Backend_SQLite* backend = (const Backend_SQLite*)sqlite3_user_data(context);
+    if (backend->prune_state == NULL) {
+        sqlite3_result_error(context, SCORE_FUNC " is only available within prune()", -1);
+        return;
+    }
+    const State snippet_state(sqlite3_value_int64(argv[1]), sqlite3_value_int64(argv[2]));
+    sqlite3_result_int64(context, (*backend->prune_scorer)(
+                    sqlite3_value_int64(argv[0]), snippet_state, *backend->prune_state));
+}
 
+bool marky::Backend_SQLite::visit_snippets(snippet_visitor_t visitor) {
     bool ok = true;
-    out.clear();
     for (;;) {
-        int step = sqlite3_step(stmt_get_nexts);
+        int step = sqlite3_step(stmt_get_all);
         bool done = false;
         switch (step) {
             case SQLITE_DONE:
@@ -744,61 +2095,115 @@ bool marky::Backend_SQLite::get_nexts(const words_t& words, snippet_ptr_set_t& o
             case SQLITE_ROW:
                 {
                     words_t words;
-                    unpack((const char*)sqlite3_column_text(stmt_get_nexts, 0), words);
-                    snippet_t snippet(new Snippet(words,
-                                    sqlite3_column_int64(stmt_get_nexts, 1),
-                                    sqlite3_column_int64(stmt_get_nexts, 2),
-                                    sqlite3_column_int64(stmt_get_nexts, 3)));
-                    out.insert(snippet);
+                    if (!get_row_words(stmt_get_all, words)) {
+                        ok = false;
+                        break;
+                    }
+                    Snippet snippet(words,
+                            sqlite3_column_int64(stmt_get_all, 2),
+                            sqlite3_column_int64(stmt_get_all, 3),
+                            sqlite3_column_int64(stmt_get_all, 4));
+                    done = !visitor(snippet);
                     break;
                 }
             default:
                 ok = false;
                 ERROR("Error when parsing response to '%s': %d/%s",
-                        QUERY_GET_NEXTS, step, sqlite3_errmsg(db));
+                        QUERY_GET_ALL, step, sqlite3_errmsg(db));
                 break;
         }
         if (!ok || done) {
             break;
         }
     }
-    sqlite3_clear_bindings(stmt_get_nexts);
-    sqlite3_reset(stmt_get_nexts);
-
+    sqlite3_clear_bindings(stmt_get_all);
+    sqlite3_reset(stmt_get_all);
     return ok;
 }
 
+// ICACHEABLE STUFF (when wrapped in cache)
+
+bool marky::Backend_SQLite::get_prevs(const words_t& words, snippet_ptr_set_t& out) {
+    return get_adjacent(stmt_get_prevs, QUERY_GET_PREVS, words, true, out);
+}
+
+bool marky::Backend_SQLite::get_nexts(const words_t& words, snippet_ptr_set_t& out) {
+    return get_adjacent(stmt_get_nexts, QUERY_GET_NEXTS, words, false, out);
+}
+
 bool marky::Backend_SQLite::get_snippets(const words_to_counts::map_t& windows,
         words_to_snippet_t& out) {
     out.clear();
-
-    sqlite3_stmt* get_response = NULL;
-    /* dynamically build a query with the correct number of params */
-    std::ostringstream query;
-    query << QUERY_GET_SNIPPETS_PREFIX << '(';
-    for (size_t i = 1; i <= windows.size(); ) {
-        query << '?' << i;
-        if (++i <= windows.size()) {
-            query << ',';
-        }
-    }
-    query << ')';// result: WHERE x IN (?1,?2,?3,...)
-    if (!prepare(db, query.str().c_str(), get_response)) {
-        sqlite3_finalize(get_response);
-        return false;
+    if (bulk_load && !bulk_written) {
+        /* nothing's been stored yet */
+        return true;
     }
-    /* bind the query params */
-    size_t cur_bind_id = 1;
+
+    /* look up each window by its (prefix_id, next_word). windows containing
+       anything that hasn't been seen can't have been stored */
+    typedef std::map<std::pair<int64_t, int64_t>, const words_t*> keys_t;
+    keys_t keys;
     for (words_to_counts::map_t::const_iterator iter = windows.begin();
          iter != windows.end(); ++iter) {
-        if (!bind_words(get_response, cur_bind_id++, iter->first)) {
-            sqlite3_finalize(get_response);
+        words_t prefix = iter->first;
+        prefix.pop_back();
+        int64_t prefix_id, next_id;
+        if (!get_context_id(prefix, false, prefix_id) ||
+                !get_word_id(iter->first.back(), false, next_id)) {
             return false;
         }
+        if (prefix_id != 0 && next_id != 0) {
+            keys[std::make_pair(prefix_id, next_id)] = &iter->first;
+        }
+    }
+    if (keys.empty()) {
+        return true;
     }
 
     bool ok = true;
+    sqlite3_stmt* get_response = NULL;
+    const bool use_lookup = (keys.size() > GET_SNIPPETS_STMT_MAX);
+    if (use_lookup) {
+        get_response = stmt_get_snippets_lookup;
+        if (!exec(db, QUERY_BEGIN_LOOKUP)) {
+            return false;
+        }
+        for (keys_t::const_iterator iter = keys.begin();
+             ok && iter != keys.end(); ++iter) {
+            int64_t rowid;
+            ok = bind_int64(stmt_insert_lookup, 1, iter->first.first) &&
+                bind_int64(stmt_insert_lookup, 2, iter->first.second) &&
+                step_insert(db, stmt_insert_lookup, QUERY_INSERT_LOOKUP, rowid);
+        }
+        if (!ok) {
+            sqlite3_clear_bindings(stmt_insert_lookup);
+            sqlite3_reset(stmt_insert_lookup);
+        }
+    } else {
+        size_t size = keys.size();
+        if (size > GET_SNIPPETS_EXACT_MAX) {
+            size = (size + GET_SNIPPETS_EXACT_MAX - 1) / GET_SNIPPETS_EXACT_MAX * GET_SNIPPETS_EXACT_MAX;
+        }
+        get_response = get_snippets_stmt(size);
+        if (get_response == NULL) {
+            return false;
+        }
+        /* bind the query params, then any padding */
+        size_t cur_bind_id = 1;
+        for (keys_t::const_iterator iter = keys.begin();
+             ok && iter != keys.end(); ++iter) {
+            ok = bind_int64(get_response, cur_bind_id++, iter->first.first) &&
+                bind_int64(get_response, cur_bind_id++, iter->first.second);
+        }
+        for (; ok && cur_bind_id <= size * 2; ++cur_bind_id) {
+            ok = bind_int64(get_response, cur_bind_id, 0);
+        }
+    }
+
     for (;;) {
+        if (!ok) {
+            break;
+        }
         int step = sqlite3_step(get_response);
         bool done = false;
         switch (step) {
@@ -807,28 +2212,64 @@ bool marky::Backend_SQLite::get_snippets(const words_to_counts::map_t& windows,
                 break;
             case SQLITE_ROW:
                 {
-                    words_t words;
-                    unpack((const char*)sqlite3_column_text(get_response, 0), words);
+                    keys_t::const_iterator key = keys.find(std::make_pair(
+                                    (int64_t)sqlite3_column_int64(get_response, 0),
+                                    (int64_t)sqlite3_column_int64(get_response, 1)));
+                    if (key == keys.end()) {
+                        break;
+                    }
+                    const words_t& words = *key->second;
                     out[words].reset(new Snippet(words,
-                                    sqlite3_column_int64(get_response, 1),
                                     sqlite3_column_int64(get_response, 2),
-                                    sqlite3_column_int64(get_response, 3)));
+                                    sqlite3_column_int64(get_response, 3),
+                                    sqlite3_column_int64(get_response, 4)));
                     break;
                 }
             default:
                 ok = false;
                 ERROR("Error when parsing response to '%s' for %lu entries: %d/%s",
-                        query.str().c_str(), windows.size(), step, sqlite3_errmsg(db));
+                        sqlite3_sql(get_response), keys.size(), step, sqlite3_errmsg(db));
                 break;
         }
         if (!ok || done) {
             break;
         }
     }
-    sqlite3_finalize(get_response);
+    sqlite3_clear_bindings(get_response);
+    sqlite3_reset(get_response);
+
+    if (use_lookup) {
+        if (!exec(db, QUERY_CLEAR_LOOKUP)) {
+            ok = false;
+        }
+        if (!exec(db, QUERY_END_LOOKUP)) {
+            ok = false;
+        }
+    }
     return ok;
 }
 
+sqlite3_stmt* marky::Backend_SQLite::get_snippets_stmt(size_t size) {
+    sqlite3_stmt*& stmt = stmt_get_snippets[size];
+    if (stmt == NULL) {
+        /* prepare on first use: most sizes may never be needed */
+        std::ostringstream query;
+        query << QUERY_GET_SNIPPETS_PREFIX;
+        for (size_t i = 1; i <= size * 2; i += 2) {
+            if (i > 1) {
+                query << ',';
+            }
+            query << "(?" << i << ",?" << i + 1 << ')';
+        }
+        query << QUERY_GET_SNIPPETS_SUFFIX;// result: VALUES (?1,?2),(?3,?4),...
+        if (!prepare(db, query.str().c_str(), stmt)) {
+            sqlite3_finalize(stmt);
+            stmt = NULL;
+        }
+    }
+    return stmt;
+}
+
 /*#include <sys/time.h>*/
 
 bool marky::Backend_SQLite::flush(const State& state, scorer_t scorer, const snippet_ptr_set_t& snippets) {
@@ -845,6 +2286,16 @@ bool marky::Backend_SQLite::flush(const State& state, scorer_t scorer, const sni
     /*struct timeval ta, tb;
       gettimeofday(&ta, NULL);*/
 
+    if (bulk_load && !bulk_written) {
+        /* nothing's stored yet, so the snippets can all be inserted as-is.
+           later flushes are upserts, still without the prevs index */
+        if (!exec(db, QUERY_BEGIN_TRANSACTION)) {
+            return false;
+        }
+        return end_transaction(start_bulk_load() &&
+                insert_snippets_impl(snippets, false));
+    }
+
     if (!exec(db, QUERY_BEGIN_TRANSACTION)) {
         ok = false;
     }
@@ -855,6 +2306,9 @@ bool marky::Backend_SQLite::flush(const State& state, scorer_t scorer, const sni
     if (!insert_snippets_impl(snippets, true)) {
         ok = false;
     }
+    if (ok && lists && !write_lists()) {
+        ok = false;
+    }
 
     if (!exec(db, QUERY_END_TRANSACTION)) {
         ok = false;
@@ -876,18 +2330,44 @@ bool marky::Backend_SQLite::update_snippets_impl(const State& state,
          iter != snippets.end(); ++iter) {
         Snippet& snippet = **iter;
 
+        words_t prefix = snippet.words;
+        prefix.pop_back();
+        int64_t prefix_id, next_id;
+        if (!get_context_id(prefix, false, prefix_id) ||
+                !get_word_id(snippet.words.back(), false, next_id)) {
+            ok = false;
+            break;
+        }
+        if (lists) {
+            words_t suffix = snippet.words;
+            suffix.pop_front();
+            int64_t suffix_id;
+            if (!get_context_id(suffix, false, suffix_id)) {
+                ok = false;
+                break;
+            }
+            dirty_nexts.insert(prefix_id);
+            dirty_prevs.insert(suffix_id);
+        }
+
         /* update existing scores; use increment() since these snippets were not just created */
-        if (!bind_int64(stmt_update_snippet, 1, snippet.score(scorer, state)) ||
+        const score_t score = snippet.score(scorer, state);
+        if (score > max_score) {
+            max_score = score;
+        }
+        if (!bind_int64(stmt_update_snippet, 1, score) ||
                 !bind_int64(stmt_update_snippet, 2, state.time) ||
                 !bind_int64(stmt_update_snippet, 3, state.count) ||
-                !bind_words(stmt_update_snippet, 4, snippet.words)) {
+                !bind_int64(stmt_update_snippet, 4, prefix_id) ||
+                !bind_int64(stmt_update_snippet, 5, next_id)) {
             ok = false;
-        }
-
-        int update_step = sqlite3_step(stmt_update_snippet);
-        if (update_step != SQLITE_DONE) {
-            ERROR("Error when parsing response to '%s': %d/%s",
-                    QUERY_UPDATE_SNIPPET, update_step, sqlite3_errmsg(db));
+        } else {
+            int update_step = sqlite3_step(stmt_update_snippet);
+            if (update_step != SQLITE_DONE) {
+                ok = false;
+                ERROR("Error when parsing response to '%s': %d/%s",
+                        QUERY_UPDATE_SNIPPET, update_step, sqlite3_errmsg(db));
+            }
         }
 
         sqlite3_clear_bindings(stmt_update_snippet);
@@ -901,66 +2381,75 @@ bool marky::Backend_SQLite::update_snippets_impl(const State& state,
 
 bool marky::Backend_SQLite::insert_snippets_impl(const snippet_ptr_set_t& snippets,
         bool allow_updates) {
-    bool ok = true;
     sqlite3_stmt* snippet_update_stmt = (allow_updates) ? stmt_upsert_snippet : stmt_insert_snippet;
 
+    /* look up (or add) the words and contexts */
+    std::vector<row_t> rows;
+    rows.reserve(snippets.size());
     for (snippet_ptr_set_t::const_iterator iter = snippets.begin();
          iter != snippets.end(); ++iter) {
         const Snippet& snippet = **iter;
+        row_t row;
+        row.snippet = &snippet;
+
+        words_t words_subset = snippet.words;
+        words_subset.pop_back();// all except back
+        if (!get_context_id(words_subset, true, row.prefix_id) ||
+                !get_word_id(snippet.words.back(), true, row.next_id)) {
+            return false;
+        }
+        words_subset.push_back(snippet.words.back());
+        words_subset.pop_front();// all except front (from all except back)
+        if (!get_context_id(words_subset, true, row.suffix_id) ||
+                !get_word_id(snippet.words.front(), true, row.prev_id)) {
+            return false;
+        }
+        rows.push_back(row);
+        if (lists) {
+            dirty_nexts.insert(row.prefix_id);
+            dirty_prevs.insert(row.suffix_id);
+        }
+
+        if (snippet.cur_score() > max_score) {
+            max_score = snippet.cur_score();
+        }
+    }
+
+    /* write in index order, so that neighboring rows land on the same pages,
+       and so that snippets sharing a context are stored together */
+    std::stable_sort(rows.begin(), rows.end());
+
+    bool ok = true;
+    for (std::vector<row_t>::const_iterator iter = rows.begin();
+         iter != rows.end(); ++iter) {
+        std::vector<row_t>::const_iterator next = iter + 1;
+        if (next != rows.end() && !(*iter < *next)) {
+            /* the same snippet twice: the later copy wins, as with an update */
+            continue;
+        }
+        const Snippet& snippet = *iter->snippet;
         //ERROR("INSERT: %s", snippet.str().c_str());
 
         /* snippets table */
-        if (!bind_words(snippet_update_stmt, 1, snippet.words) ||
-                !bind_int64(snippet_update_stmt, 2, snippet.cur_score()) ||
-                !bind_int64(snippet_update_stmt, 3, snippet.cur_state().time) ||
-                !bind_int64(snippet_update_stmt, 4, snippet.cur_state().count)) {
+        if (!bind_int64(snippet_update_stmt, 1, iter->prefix_id) ||
+                !bind_int64(snippet_update_stmt, 2, iter->next_id) ||
+                !bind_int64(snippet_update_stmt, 3, iter->suffix_id) ||
+                !bind_int64(snippet_update_stmt, 4, iter->prev_id) ||
+                !bind_int64(snippet_update_stmt, 5, snippet.cur_score()) ||
+                !bind_int64(snippet_update_stmt, 6, snippet.cur_state().time) ||
+                !bind_int64(snippet_update_stmt, 7, snippet.cur_state().count)) {
             ok = false;
         } else {
             int insert_step = sqlite3_step(snippet_update_stmt);
             if (insert_step != SQLITE_DONE) {
                 ok = false;
                 ERROR("Error when flushing entry with '%s': %d/%s [%s]",
-                        QUERY_INSERT_SNIPPET, insert_step, sqlite3_errmsg(db),
+                        sqlite3_sql(snippet_update_stmt), insert_step, sqlite3_errmsg(db),
                         snippet.str().c_str());
             }
         }
         sqlite3_clear_bindings(snippet_update_stmt);
         sqlite3_reset(snippet_update_stmt);
-        sqlite3_int64 snippet_id = sqlite3_last_insert_rowid(db);
-
-        /* nexts table */
-        words_t words_subset = snippet.words;
-        words_subset.pop_back();// all except back
-        if (!bind_words(stmt_insert_next, 1, words_subset) ||
-                !bind_int64(stmt_insert_next, 2, snippet_id)) {
-            ok = false;
-        } else {
-            int insert_step = sqlite3_step(stmt_insert_next);
-            if (insert_step != SQLITE_DONE) {
-                ok = false;
-                ERROR("Error when parsing response to '%s': %d/%s",
-                        QUERY_INSERT_NEXT, insert_step, sqlite3_errmsg(db));
-            }
-        }
-        sqlite3_clear_bindings(stmt_insert_next);
-        sqlite3_reset(stmt_insert_next);
-
-        /* prevs table */
-        words_subset.push_back(snippet.words.back());
-        words_subset.pop_front();// all except front (from all except back)
-        if (!bind_words(stmt_insert_prev, 1, words_subset) ||
-                !bind_int64(stmt_insert_prev, 2, snippet_id)) {
-            ok = false;
-        } else {
-            int insert_step = sqlite3_step(stmt_insert_prev);
-            if (insert_step != SQLITE_DONE) {
-                ok = false;
-                ERROR("Error when parsing response to '%s': %d/%s",
-                        QUERY_INSERT_PREV, insert_step, sqlite3_errmsg(db));
-            }
-        }
-        sqlite3_clear_bindings(stmt_insert_prev);
-        sqlite3_reset(stmt_insert_prev);
 
         if (!ok) {
             break;
@@ -19,19 +19,78 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
 #include "backend.h"
 
 struct sqlite3;
+struct sqlite3_context;
 struct sqlite3_stmt;
+struct sqlite3_value;
 
 namespace marky {
     /* A backend which uses a sqlite3 database for storing persistent state. */
     class Backend_SQLite : public ICacheable {
     public:
+        enum temp_store_t {
+            TEMP_STORE_DEFAULT = 0, TEMP_STORE_FILE = 1, TEMP_STORE_MEMORY = 2
+        };
+
+        struct options_t {
+            options_t();
+
+            /* get_random() looks up a random snippet by id, rather than
+             * sorting the table. If set, it then favors snippets with higher
+             * scores by rejecting picks in proportion to their current score
+             * relative to the highest stored score, settling for the last
+             * pick if too many are rejected. */
+            bool weighted_random;
+
+            /* If set and the db has no snippets yet, the writes are a bulk
+             * load, eg for an initial import: the snippets are written
+             * without maintaining the prevs index or any adjacency lists,
+             * which are then built in one pass by finish_bulk_load(). Until
+             * the first flush(), get_snippets() doesn't bother searching the
+             * (empty) db. Until the end, get_prevs() has no index to use. */
+            bool bulk_load;
+
+            /* If set, each context's candidates are also kept together in a
+             * single packed row, so that get_prevs() and get_nexts() are one
+             * lookup, at the cost of rewriting the whole row whenever one of
+             * its candidates changes. The lists are built if the db doesn't
+             * have them yet, and are kept up to date (and used) from then on,
+             * whether or not this is set. */
+            bool adjacency_lists;
+
+            /* Passed to the PRAGMAs of the same names, or left at SQLite's
+             * defaults if 0:
+             * - page_size: in bytes, a power of two from 512 to 65536. Only
+             *   takes effect when the db is created.
+             * - cache_size: the page cache of each connection, in pages if
+             *   positive, or in KiB if negative.
+             * - mmap_size: how much of the db to read through mmap(), in bytes.
+             * - temp_store: where temporary tables and indexes are kept. */
+            int page_size;
+            int64_t cache_size;
+            int64_t mmap_size;
+            temp_store_t temp_store;
+
+            /* If nonzero, prune() works through the snippets this many at a
+             * time, each chunk in its own transaction, scoring them in C++
+             * rather than registering the scorer as a SQL function. This
+             * keeps other connections from waiting behind one long prune.
+             * See also prune_chunks(). */
+            size_t prune_chunk_size;
+        };
+
         /* Returns a SQLite backend, or an empty ptr if there was an error
          * when creating it. */
-        static cacheable_t create_cacheable(const std::string& db_file_path);
-        static backend_t create_backend(const std::string& db_file_path);
+        static cacheable_t create_cacheable(const std::string& db_file_path,
+                const options_t& options = options_t());
+        static backend_t create_backend(const std::string& db_file_path,
+                const options_t& options = options_t());
 
         virtual ~Backend_SQLite();
 
@@ -51,6 +110,38 @@ namespace marky {
 
         bool prune(const State& state, scorer_t scorer);
 
+        bool visit_snippets(snippet_visitor_t visitor);
+
+        /* Runs up to 'max_chunks' chunks of a chunked prune, or all of them
+         * if 0, carrying on from where the last call stopped. Sets
+         * 'finished' once the end of the snippets has been reached, after
+         * which the next call starts over. This lets a prune be spread
+         * across calls, eg to fit it within a time budget. Chunks are
+         * options_t::prune_chunk_size snippets, or 10000 if that's 0. */
+        bool prune_chunks(const State& state, scorer_t scorer,
+                size_t max_chunks, bool& finished);
+
+        /* Ends any bulk load (see options_t::bulk_load), building the prevs
+         * index and adjacency lists and gathering stats for the query
+         * planner. This is also done by store_state() and when the backend
+         * is destroyed. */
+        bool finish_bulk_load();
+
+        /* Rebuilds the db without its free pages, in key order, and switches
+         * it to incremental auto_vacuum if it was created without it. After
+         * that, prune() hands the pages it frees back to the filesystem. This
+         * needs the db to itself, and takes a while on a large db. */
+        bool compact();
+
+        /* Writes a consistent copy of the db to 'dest_path' using sqlite3's
+         * online backup API, replacing any file there once the copy is
+         * complete. The copy is made a few pages at a time, so that writers
+         * on other connections aren't held up for the whole of it. */
+        bool snapshot(const std::string& dest_path);
+        /* As snapshot(), for a db which may be in use by another process. */
+        static bool snapshot_file(const std::string& db_file_path,
+                const std::string& dest_path);
+
         /* for ICacheable: */
         bool get_prevs(const words_t& words, snippet_ptr_set_t& out);
         bool get_nexts(const words_t& words, snippet_ptr_set_t& out);
@@ -61,8 +152,74 @@ namespace marky {
                 const snippet_ptr_set_t& links);
 
     private:
-        Backend_SQLite(const std::string& db_file_path);
+        friend class Backend_SQLitePool;
+        friend class Backend_SQLiteAsync;
+
+        /* How the connection is used: on its own with fast but unsafe
+         * settings, or as part of a Backend_SQLitePool in WAL mode. */
+        enum connection_t { CONN_STANDALONE, CONN_WRITER, CONN_READER };
+
+        /* candidates for selection -> their word IDs, see get_backoff() */
+        typedef std::unordered_map<snippet_t, int64_t> snippet_to_id_t;
+
+        Backend_SQLite(const std::string& db_file_path, const options_t& options,
+                connection_t connection);
         bool init();
+        bool init_pragmas();
+        bool init_auto_vacuum();
+        bool init_bulk_load();
+        /* Drops the prevs index for a bulk load, unless that's been done. */
+        bool start_bulk_load();
+        bool init_lists();
+        bool prepare_stmts();
+        /* Brackets a group of calls within one transaction, eg so that a
+         * CONN_READER sees the same snapshot of the db throughout. If
+         * 'commit' isn't set, the transaction is rolled back and false is
+         * returned. */
+        bool begin_transaction();
+        bool end_transaction(bool commit);
+        bool migrate_v1();
+        bool init_max_score();
+
+        /* Words and contexts are stored by ID. These return an ID of 0 for
+         * anything that hasn't been stored, unless 'create' is set. */
+        bool get_word_id(const word_t& word, bool create, int64_t& id);
+        bool get_word(int64_t id, word_t& word);
+        bool get_context_id(const words_t& context, bool create, int64_t& id);
+        bool get_context_words(const void* packed, size_t size, words_t& out);
+        /* Returns the words of a row starting with (prefix words, next_word). */
+        bool get_row_words(sqlite3_stmt* stmt, words_t& out);
+        /* Returns the snippets before or after 'context'. */
+        bool get_adjacent(sqlite3_stmt* stmt, const char* query,
+                const words_t& context, bool prevs, snippet_ptr_set_t& out);
+        /* Returns the candidates before or after the longest trailing (for
+         * nexts) or leading (for prevs) part of 'search_words' which has
+         * any, looking up every length in one statement. The snippets hold
+         * no words, just their scores, with each one's word ID in 'candidate_ids'. */
+        bool get_backoff(const words_t& search_words, bool prevs,
+                snippet_ptr_set_t& out, snippet_to_id_t& candidate_ids);
+        /* Returns the get_backoff() statement for 'size' contexts, preparing
+         * it if needed. */
+        sqlite3_stmt* get_backoff_stmt(size_t size, bool prevs);
+        /* Same as get_adjacent(), using the adjacency lists. If 'lazy_ids'
+         * is set, the snippets are left without words, as in get_backoff(). */
+        bool get_list(const words_t& context, int64_t context_id, bool prevs,
+                snippet_ptr_set_t& out, snippet_to_id_t* lazy_ids = NULL);
+        /* Rebuilds the adjacency lists of the contexts in dirty_nexts and
+         * dirty_prevs, which are then cleared. */
+        bool write_lists();
+        /* Marks every context's lists as needing to be rebuilt. */
+        bool dirty_all_lists();
+        bool write_list(bool prevs, int64_t context_id);
+        /* Adds the contexts of snippets deleted within SQL to dirty_*. */
+        bool get_dirty();
+        /* Prunes the next 'chunk_size' snippets within one transaction,
+         * adding how many were deleted to 'pruned'. */
+        bool prune_chunk(const State& state, scorer_t scorer, size_t chunk_size,
+                bool& finished, size_t& pruned);
+        /* Hands free pages back to the filesystem, in up to 'max_steps'
+         * steps. Does nothing for dbs without auto_vacuum. */
+        bool vacuum(size_t max_steps);
 
         bool update_snippets_impl(const State& state, scorer_t scorer,
                 snippet_ptr_set_t& snippets);
@@ -70,17 +227,56 @@ namespace marky {
                 bool allow_updates);
         bool get_snippets_impl(const words_to_counts::map_t& windows,
                 words_to_snippet_t& out);
+        /* Returns the get_snippets() statement for 'size' windows, preparing
+         * it if needed. */
+        sqlite3_stmt* get_snippets_stmt(size_t size);
+        /* marky_score(score, time, count): the current score of a stored
+         * snippet, using the scorer and state passed to prune(). */
+        static void score_func(sqlite3_context* context, int argc, sqlite3_value** argv);
 
         sqlite3_stmt *stmt_set_state, *stmt_get_state;
-        sqlite3_stmt *stmt_get_random, *stmt_get_prevs, *stmt_get_nexts;
+        sqlite3_stmt *stmt_get_word_id, *stmt_get_word, *stmt_insert_word;
+        sqlite3_stmt *stmt_get_context_id, *stmt_insert_context;
+        sqlite3_stmt *stmt_get_id_range, *stmt_get_random;
+        sqlite3_stmt *stmt_get_prevs, *stmt_get_nexts;
         sqlite3_stmt *stmt_update_snippet, *stmt_upsert_snippet, *stmt_insert_snippet;
-        sqlite3_stmt *stmt_insert_next, *stmt_insert_prev;
         sqlite3_stmt *stmt_get_all;
-        sqlite3_stmt *stmt_delete_snippet;
+        sqlite3_stmt *stmt_prune, *stmt_get_prune_chunk;
+        typedef std::map<size_t, sqlite3_stmt*> stmts_t;
+        stmts_t stmt_get_snippets;/* by size, see get_snippets() */
+        stmts_t stmt_get_nexts_backoff, stmt_get_prevs_backoff;/* by size, see get_backoff() */
+        sqlite3_stmt *stmt_insert_lookup, *stmt_get_snippets_lookup;
+        sqlite3_stmt *stmt_get_data_version;
+        sqlite3_stmt *stmt_get_nexts_list, *stmt_get_prevs_list;
+        sqlite3_stmt *stmt_set_nexts_list, *stmt_set_prevs_list;
+        sqlite3_stmt *stmt_delete_nexts_list, *stmt_delete_prevs_list;
 
         const std::string path;
+        const connection_t connection;
         sqlite3* db;
         bool state_changed;
+        const options_t options;
+        score_t max_score;/* highest score written, see get_random() */
+        /* only set while prune() is running, see score_func() */
+        const State* prune_state;
+        const scorer_t* prune_scorer;
+        int64_t prune_cursor;/* the snippet ID where the next prune_chunks() resumes */
+        int64_t data_version;/* for CONN_READER, as of the last begin_transaction() */
+        bool bulk_load;/* whether a bulk load is underway, see create_cacheable() */
+        bool bulk_written;/* whether the bulk load has dropped the prevs index */
+        bool bulk_pruned;/* whether the bulk load left unused contexts to delete */
+        bool lists;/* whether the db has adjacency lists, see create_cacheable() */
+        bool auto_vacuum;/* whether the db has incremental auto_vacuum, see vacuum() */
+        typedef std::unordered_set<int64_t> ids_t;
+        ids_t dirty_nexts, dirty_prevs;/* context IDs whose lists need rebuilding */
+
+        /* recently used IDs, to avoid looking them up again */
+        typedef std::unordered_map<word_t, int64_t> word_ids_t;
+        typedef std::unordered_map<int64_t, word_t> id_words_t;
+        typedef std::unordered_map<std::string, int64_t> context_ids_t;
+        word_ids_t word_ids;
+        id_words_t id_words;
+        context_ids_t context_ids;/* packed word IDs -> context ID */
     };
 }
 
@@ -39,6 +39,10 @@ namespace marky {
         map_t map_;
     };
 
+    /* Called with each snippet by IBackend::visit_snippets(). Returning false
+     * stops the visit early. */
+    typedef std::function<bool (const Snippet& snippet)> snippet_visitor_t;
+
     /* Base interface for storing/retrieving strings of words from some kind of
      * storage. */
     class IBackend {
@@ -95,6 +99,12 @@ namespace marky {
          * Any records with an adjusted score of 0 are removed. This is assumed
          * to only be called periodically, so it's not necessarily fast. */
         virtual bool prune(const State& state, scorer_t scorer) = 0;
+
+        /* Calls 'visitor' with each stored snippet, in no particular order.
+         * This is meant for exporting a backend's full content elsewhere, so
+         * it's not necessarily fast. Return false in the event of a backend
+         * error. */
+        virtual bool visit_snippets(snippet_visitor_t visitor) = 0;
     };
     typedef std::shared_ptr<IBackend> backend_t;
 
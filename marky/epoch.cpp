@@ -0,0 +1,73 @@
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <functional>
+#include <thread>
+
+#include "epoch.h"
+
+namespace {
+    size_t thread_stripe(size_t stripe_count) {
+        static thread_local size_t stripe =
+            std::hash<std::thread::id>()(std::this_thread::get_id());
+        return stripe % stripe_count;
+    }
+}
+
+marky::EpochDomain::EpochDomain()
+    : epoch(0) {
+    for (size_t i = 0; i < STRIPE_COUNT; ++i) {
+        stripes[i].readers[0] = 0;
+        stripes[i].readers[1] = 0;
+    }
+}
+
+size_t marky::EpochDomain::enter() {
+    const size_t stripe = thread_stripe(STRIPE_COUNT);
+    const size_t parity = epoch.load() & 1;
+    stripes[stripe].readers[parity].fetch_add(1);
+    return stripe * 2 + parity;
+}
+
+void marky::EpochDomain::exit(size_t token) {
+    stripes[token / 2].readers[token % 2].fetch_sub(1);
+}
+
+void marky::EpochDomain::synchronize() {
+    /* A reader may have read the epoch just before it's flipped, but only
+       registered under that (old) parity after we've seen it drain. So flip
+       and drain twice: by the second drain, any reader registered under
+       either parity started after the data was unpublished. */
+    for (int i = 0; i < 2; ++i) {
+        const size_t old_parity = epoch.fetch_add(1) & 1;
+        wait_readers(old_parity);
+    }
+}
+
+void marky::EpochDomain::wait_readers(size_t parity) {
+    for (;;) {
+        size_t readers = 0;
+        for (size_t i = 0; i < STRIPE_COUNT; ++i) {
+            readers += stripes[i].readers[parity].load();
+        }
+        if (readers == 0) {
+            return;
+        }
+        std::this_thread::yield();
+    }
+}
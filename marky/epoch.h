@@ -0,0 +1,81 @@
+#ifndef MARKY_EPOCH_H
+#define MARKY_EPOCH_H
+
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+
+#include <atomic>
+
+namespace marky {
+    /* Epoch-based reclamation for data which is read without locks.
+     *
+     * Readers bracket their accesses with enter() and exit(), which never
+     * block. A writer which has unpublished some data calls synchronize()
+     * before freeing it, which waits until every reader which might have
+     * seen the old data has exited.
+     *
+     * Readers are counted per epoch, with the counts spread across several
+     * cache lines to keep reader threads from contending with each other. */
+    class EpochDomain {
+      public:
+        EpochDomain();
+
+        /* Marks the start of a read, returning a token to pass to exit(). */
+        size_t enter();
+
+        /* Marks the end of the read started by enter(). */
+        void exit(size_t token);
+
+        /* Waits until all reads which were in progress at the time of the
+         * call have exited. Must not be called from within a read, nor from
+         * more than one thread at a time. */
+        void synchronize();
+
+      private:
+        static const size_t STRIPE_COUNT = 16;
+
+        struct stripe_t {
+            std::atomic<size_t> readers[2];/* per epoch parity */
+            char padding[64 - 2 * sizeof(std::atomic<size_t>)];
+        };
+
+        /* Waits for the readers of the given parity to drain. */
+        void wait_readers(size_t parity);
+
+        std::atomic<size_t> epoch;
+        stripe_t stripes[STRIPE_COUNT];
+    };
+
+    /* Holds a read open for the lifetime of the guard. */
+    class EpochGuard {
+      public:
+        EpochGuard(EpochDomain& domain)
+            : domain(domain), token(domain.enter()) { }
+        ~EpochGuard() {
+            domain.exit(token);
+        }
+
+      private:
+        EpochDomain& domain;
+        const size_t token;
+    };
+}
+
+#endif
@@ -0,0 +1,166 @@
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <limits>
+
+#include "expiry-wheel.h"
+
+namespace {
+    /* Finds the smallest value in [from, max] for which 'is_zero' is true,
+     * assuming that it stays true once it's become true. Starts with small
+     * steps, since most snippets expire soon after they were last seen.
+     * Checks 'max' up front, so that a dimension which the scorer ignores
+     * costs two calls rather than a doubling all the way up to 'max'. */
+    template <typename IsZero>
+    bool search(uint64_t from, uint64_t max, IsZero is_zero, uint64_t& out) {
+        if (is_zero(from)) {
+            out = from;
+            return true;
+        }
+        if (!is_zero(max)) {
+            /* never reaches zero */
+            return false;
+        }
+        uint64_t low = from, high, step = 1;
+        for (;;) {
+            high = (max - low <= step) ? max : low + step;
+            if (high == max || is_zero(high)) {
+                break;
+            }
+            low = high;
+            step *= 2;
+        }
+        /* is_zero(low) == false, is_zero(high) == true */
+        while (high - low > 1) {
+            uint64_t mid = low + (high - low) / 2;
+            if (is_zero(mid)) {
+                high = mid;
+            } else {
+                low = mid;
+            }
+        }
+        out = high;
+        return true;
+    }
+}
+
+marky::ExpiryWheel::ExpiryWheel()
+    : now_(0), size_(0) { }
+
+void marky::ExpiryWheel::insert(uint64_t expiry, const snippet_t& snippet) {
+    entry_t entry;
+    entry.expiry = expiry;
+    entry.snippet = snippet;
+    insert_entry(entry);
+    ++size_;
+}
+
+void marky::ExpiryWheel::insert_entry(entry_t& entry) {
+    if (entry.expiry <= now_) {
+        due_.push_back(entry_t());
+        due_.back().expiry = entry.expiry;
+        due_.back().snippet.swap(entry.snippet);
+        return;
+    }
+    /* the level is the highest group of bits where the expiry differs from
+       now. the expiry's slot in that level is always after now's slot, so
+       the entry is only visited once now reaches that slot. */
+    const int highest_bit = 63 - __builtin_clzll(entry.expiry ^ now_);
+    const int level = highest_bit / SLOT_BITS;
+    const int slot = (entry.expiry >> (level * SLOT_BITS)) & (SLOT_COUNT - 1);
+    slot_t& dest = slots_[level][slot];
+    dest.push_back(entry_t());
+    dest.back().expiry = entry.expiry;
+    dest.back().snippet.swap(entry.snippet);
+}
+
+void marky::ExpiryWheel::advance(uint64_t now, std::vector<snippet_t>& due) {
+    slot_t cascade;
+    cascade.swap(due_);
+    if (now > now_) {
+        /* collect any slots whose range has started. every slot in a level
+           shares now_'s bits above that level. */
+        for (int level = 0; level < LEVEL_COUNT; ++level) {
+            const int shift = level * SLOT_BITS;
+            const uint64_t base = (shift + SLOT_BITS >= 64) ? 0 :
+                ((now_ >> (shift + SLOT_BITS)) << (shift + SLOT_BITS));
+            for (int slot = 0; slot < SLOT_COUNT; ++slot) {
+                slot_t& src = slots_[level][slot];
+                if (src.empty() || base + ((uint64_t)slot << shift) > now) {
+                    continue;
+                }
+                if (cascade.empty()) {
+                    cascade.swap(src);
+                } else {
+                    for (slot_t::iterator iter = src.begin(); iter != src.end(); ++iter) {
+                        cascade.push_back(entry_t());
+                        cascade.back().expiry = iter->expiry;
+                        cascade.back().snippet.swap(iter->snippet);
+                    }
+                    src.clear();
+                }
+            }
+        }
+        now_ = now;
+    }
+
+    for (slot_t::iterator iter = cascade.begin(); iter != cascade.end(); ++iter) {
+        if (iter->expiry > now_) {
+            /* not due yet, move to a finer slot */
+            insert_entry(*iter);
+            continue;
+        }
+        --size_;
+        snippet_t snippet = iter->snippet.lock();
+        if (snippet) {
+            due.push_back(snippet);
+        }
+    }
+}
+
+void marky::ExpiryWheel::clear() {
+    for (int level = 0; level < LEVEL_COUNT; ++level) {
+        for (int slot = 0; slot < SLOT_COUNT; ++slot) {
+            slot_t().swap(slots_[level][slot]);
+        }
+    }
+    slot_t().swap(due_);
+    now_ = 0;
+    size_ = 0;
+}
+
+bool marky::expiry::predict_count(const Snippet& snippet, const scorer_t& scorer,
+        const State& from, uint64_t& count) {
+    const score_t score = snippet.cur_score();
+    const State& last = snippet.cur_state();
+    return search(from.count, std::numeric_limits<size_t>::max(),
+            [&](uint64_t probe) {
+                return scorer(score, last, State(from.time, probe)) == 0;
+            }, count);
+}
+
+bool marky::expiry::predict_time(const Snippet& snippet, const scorer_t& scorer,
+        const State& from, uint64_t& time) {
+    const score_t score = snippet.cur_score();
+    const State& last = snippet.cur_state();
+    /* the wheel is unsigned, treat any pre-epoch time as already due */
+    return search((from.time < 0) ? 0 : from.time, std::numeric_limits<time_t>::max(),
+            [&](uint64_t probe) {
+                return scorer(score, last, State(probe, from.count)) == 0;
+            }, time);
+}
@@ -0,0 +1,101 @@
+#ifndef MARKY_EXPIRY_WHEEL_H
+#define MARKY_EXPIRY_WHEEL_H
+
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "snippet.h"
+
+namespace marky {
+    /* A hierarchical timing wheel of snippets, keyed by the point (a line
+     * count or a time) at which each snippet is expected to expire.
+     *
+     * Each level has 64 slots, and each slot in a level spans 64 slots of the
+     * level below it. Advancing the wheel only touches the slots which have
+     * come due, cascading their not-yet-due entries into finer slots, so the
+     * cost of an advance is proportional to the number of entries which are
+     * (nearly) due rather than the number of entries in the wheel.
+     *
+     * Entries hold weak references, so a snippet which is dropped elsewhere
+     * is silently skipped when its slot comes due. */
+    class ExpiryWheel {
+      public:
+        ExpiryWheel();
+
+        /* Adds 'snippet' to be returned by the first advance() which reaches
+         * 'expiry'. Snippets which are already due are returned by the next
+         * advance(). */
+        void insert(uint64_t expiry, const snippet_t& snippet);
+
+        /* Moves the wheel forward to 'now', appending any live snippets whose
+         * expiry is at or before 'now' to 'due'. Moving backwards only returns
+         * snippets which were already due. */
+        void advance(uint64_t now, std::vector<snippet_t>& due);
+
+        /* Returns the number of entries in the wheel, including entries for
+         * snippets which have since been dropped. */
+        inline size_t size() const {
+            return size_;
+        }
+
+        /* Removes all entries and resets the wheel to zero. */
+        void clear();
+
+      private:
+        struct entry_t {
+            uint64_t expiry;
+            std::weak_ptr<Snippet> snippet;
+        };
+        typedef std::vector<entry_t> slot_t;
+
+        /* 64 bits of key in groups of 6 bits */
+        static const int SLOT_BITS = 6;
+        static const int SLOT_COUNT = 1 << SLOT_BITS;
+        static const int LEVEL_COUNT = (64 + SLOT_BITS - 1) / SLOT_BITS;
+
+        void insert_entry(entry_t& entry);
+
+        uint64_t now_;
+        size_t size_;
+        slot_t slots_[LEVEL_COUNT][SLOT_COUNT];
+        slot_t due_;
+    };
+
+    namespace expiry {
+        /* Predicts the line count at which 'snippet' reaches a score of zero
+         * under 'scorer', assuming the time stays at 'from.time'. Returns false
+         * if the score never reaches zero in this way.
+         *
+         * This assumes that scores never increase with the passing of lines or
+         * time, which holds for all of the scorers in scorer.h. */
+        bool predict_count(const Snippet& snippet, const scorer_t& scorer,
+                const State& from, uint64_t& count);
+
+        /* Predicts the time at which 'snippet' reaches a score of zero under
+         * 'scorer', assuming the line count stays at 'from.count'. Returns
+         * false if the score never reaches zero in this way. */
+        bool predict_time(const Snippet& snippet, const scorer_t& scorer,
+                const State& from, uint64_t& time);
+    }
+}
+
+#endif
@@ -0,0 +1,110 @@
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>//open()
+#include <stdio.h>//rename()
+#include <string.h>//strerror()
+#include <sys/mman.h>//mmap()
+#include <sys/stat.h>//fstat()
+#include <unistd.h>//close(), unlink()
+
+#include "mapped-file.h"
+#include "config.h"
+
+marky::MappedFile::MappedFile()
+    : data_(NULL), size_(0) { }
+
+marky::MappedFile::~MappedFile() {
+    close();
+}
+
+bool marky::MappedFile::open(const std::string& path) {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        ERROR("Failed to open %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ERROR("Failed to stat %s: %s", path.c_str(), strerror(errno));
+        ::close(fd);
+        return false;
+    }
+    if (st.st_size == 0) {
+        /* mmap() refuses empty mappings, let the caller reject the content */
+        ::close(fd);
+        return true;
+    }
+
+    void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    /* the mapping holds its own reference to the file */
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        ERROR("Failed to map %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    data_ = (const char*)mapped;
+    size_ = st.st_size;
+    return true;
+}
+
+void marky::MappedFile::close() {
+    if (data_ != NULL) {
+        munmap((void*)data_, size_);
+        data_ = NULL;
+        size_ = 0;
+    }
+}
+
+bool marky::mapped::write_all(FILE* file, const void* data, size_t size) {
+    return size == 0 || fwrite(data, size, 1, file) == 1;
+}
+
+bool marky::mapped::write_padding(FILE* file, uint64_t written) {
+    static const char zeroes[8] = { 0 };
+    return write_all(file, zeroes, align8(written) - written);
+}
+
+bool marky::mapped::fits(uint64_t& pos, uint64_t count, uint64_t entry_size,
+        uint64_t file_size) {
+    if (pos > file_size || count > (file_size - pos) / entry_size) {
+        return false;
+    }
+    pos = align8(pos + count * entry_size);
+    return pos <= align8(file_size);
+}
+
+bool marky::mapped::commit(const std::string& tmp_path, const std::string& path, bool ok) {
+    if (!ok) {
+        ERROR("Failed to write %s: %s", tmp_path.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        ERROR("Failed to rename %s to %s: %s",
+                tmp_path.c_str(), path.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,86 @@
+#ifndef MARKY_MAPPED_FILE_H
+#define MARKY_MAPPED_FILE_H
+
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>//size_t
+#include <stdint.h>
+#include <stdio.h>//FILE
+
+#include <string>
+
+namespace marky {
+    /* A read-only memory mapping of a file's full contents. The mapping is
+     * shared, so multiple processes mapping the same file share a single copy
+     * in the page cache. */
+    class MappedFile {
+      public:
+        MappedFile();
+        virtual ~MappedFile();
+
+        /* Maps the file at 'path', replacing any prior mapping.
+         * Returns false in the event of an error. */
+        bool open(const std::string& path);
+
+        /* Unmaps the file, if any. */
+        void close();
+
+        /* Returns the start of the mapped data, or NULL if nothing is mapped. */
+        inline const char* data() const {
+            return data_;
+        }
+        /* Returns the size of the mapped data, in bytes. */
+        inline size_t size() const {
+            return size_;
+        }
+
+      private:
+        /* not copyable */
+        MappedFile(const MappedFile&);
+        MappedFile& operator=(const MappedFile&);
+
+        const char* data_;
+        size_t size_;
+    };
+
+    /* Helpers for reading and writing files whose sections are meant to be
+     * accessed in place from a MappedFile. Sections are 8-byte aligned. */
+    namespace mapped {
+        inline uint64_t align8(uint64_t size) {
+            return (size + 7) & ~(uint64_t)7;
+        }
+
+        /* Writes 'size' bytes, returning false on error. */
+        bool write_all(FILE* file, const void* data, size_t size);
+
+        /* Pads a section of 'written' bytes out to the next 8-byte boundary. */
+        bool write_padding(FILE* file, uint64_t written);
+
+        /* Checks that a section of 'count' entries of 'entry_size' each fits
+         * between 'pos' and 'file_size', then advances 'pos' past it. */
+        bool fits(uint64_t& pos, uint64_t count, uint64_t entry_size,
+                uint64_t file_size);
+
+        /* Renames 'tmp_path' to 'path' if 'ok', otherwise deletes 'tmp_path'.
+         * Returns whether the file is now in place at 'path'. */
+        bool commit(const std::string& tmp_path, const std::string& path, bool ok);
+    }
+}
+
+#endif
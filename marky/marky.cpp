@@ -41,14 +41,17 @@ static std::string str(const marky::words_t& words) {
 marky::Marky::Marky(backend_t backend, selector_t selector, scorer_t scorer,
         size_t look_size)
     : backend(backend), selector(selector), scorer(scorer),
-      look_size(look_size), state(backend->create_state()) {
+      look_size(look_size), state_time(0), state_count(0) {
     assert(backend);
     assert(selector);
     assert(scorer);
+    const State initial = backend->create_state();
+    state_time = initial.time;
+    state_count = initial.count;
 }
 
 marky::Marky::~Marky() {
-    backend->store_state(state, scorer);
+    backend->store_state(state(), scorer);
 }
 
 bool marky::Marky::insert(const words_t& line) {
@@ -56,8 +59,10 @@ bool marky::Marky::insert(const words_t& line) {
         return true;
     }
 
-    /* update time BEFORE all scoring */
-    state.time = time(NULL);/* = now */
+    /* update time BEFORE all scoring, and claim a line count (first line gets
+       id 0) for this line, so that concurrent inserts each get their own */
+    const State state(time(NULL)/* = now */, state_count++);
+    state_time = state.time;
 
     /*
       Eg given "A Good Dog", with look_size=2:
@@ -114,14 +119,7 @@ bool marky::Marky::insert(const words_t& line) {
         line_windows.increment(line_window);
     }
 
-    if (!backend->update_snippets(state, scorer, line_windows.map())) {
-        return false;
-    }
-
-    /* increment line count AFTER, EACH line is added (first line gets id 0) */
-    ++state.count;
-
-    return true;
+    return backend->update_snippets(state, scorer, line_windows.map());
 }
 
 bool marky::Marky::produce(words_t& line, const words_t& search/*=words_t()*/,
@@ -132,7 +130,7 @@ bool marky::Marky::produce(words_t& line, const words_t& search/*=words_t()*/,
     }
     if (search.empty()) {
         word_t rand_word;
-        if (!backend->get_random(state, scorer, rand_word)) {/* backend err */
+        if (!backend->get_random(state(), scorer, rand_word)) {/* backend err */
             return false;
         }
         if (rand_word == IBackend::LINE_END) {/* no data */
@@ -153,7 +151,11 @@ bool marky::Marky::produce(words_t& line, const words_t& search/*=words_t()*/,
 }
 
 bool marky::Marky::prune_backend() {
-    return backend->prune(state, scorer);
+    return backend->prune(state(), scorer);
+}
+
+marky::State marky::Marky::state() const {
+    return State(state_time, state_count);
 }
 
 #define CHECK_LIMIT(size, limit) (limit == 0 || size < limit)
@@ -192,6 +194,7 @@ bool marky::Marky::grow(words_t& line,
     DEBUG("end_search_words: %s", str(end_search_words).c_str());
 #endif
 
+    const State state = this->state();
     word_t found_word;
     while (!left_dead || !right_dead) {
         if (!CHECK_LIMIT(line.size(), length_limit_words) ||
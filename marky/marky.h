@@ -19,6 +19,8 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <atomic>
+
 #include "backend.h"
 #include "selector.h"
 
@@ -36,7 +38,12 @@ namespace marky {
         virtual ~Marky();
 
         /* Adds the line (and its inter-word snippets) to the dataset.
-         * Returns false in the event of some error. */
+         * Returns false in the event of some error.
+         *
+         * This may be called from several threads at once if the backend
+         * supports concurrent updates, as with Backend_ShardedMap. Each line
+         * is given its own line count, in the order that insert() was
+         * called. */
         bool insert(const words_t& line);
 
         /* Produces a line from the search word(s), or from a random word if the
@@ -68,7 +75,13 @@ namespace marky {
         const scorer_t scorer;
         const size_t look_size;
 
-        State state;
+        /* Returns the state as of the most recent insert(). */
+        State state() const;
+
+        /* the time of the most recent insert(), and the count to be given to
+         * the next line to be inserted */
+        std::atomic<time_t> state_time;
+        std::atomic<size_t> state_count;
     };
 }
 
@@ -136,6 +136,21 @@ namespace {
             return NULL;
         }
     }
+
+#ifdef BUILD_BACKEND_SQLITE
+    marky::Backend_SQLite::options_t options_to_cpp(const marky_sqlite_options_t& options) {
+        marky::Backend_SQLite::options_t options_cpp;
+        options_cpp.weighted_random = (options.weighted_random != 0);
+        options_cpp.bulk_load = (options.bulk_load != 0);
+        options_cpp.adjacency_lists = (options.adjacency_lists != 0);
+        options_cpp.page_size = options.page_size;
+        options_cpp.cache_size = options.cache_size;
+        options_cpp.mmap_size = options.mmap_size;
+        options_cpp.temp_store = (marky::Backend_SQLite::temp_store_t)options.temp_store;
+        options_cpp.prune_chunk_size = (options.prune_chunk_size > 0) ? options.prune_chunk_size : 0;
+        return options_cpp;
+    }
+#endif
 }
 
 int marky_insert(marky_Marky* marky, const marky_words_t* line) {
@@ -195,6 +210,17 @@ marky_Backend* marky_backend_new_cache(marky_Backend_Cacheable* backend) {
     assert(backend != NULL);
     return check_ptr<marky::IBackend, marky_Backend>(marky::backend_t(new marky::Backend_Cache(backend->wrapped)));
 }
+void marky_sqlite_options_init(marky_sqlite_options_t* options) {
+    assert(options != NULL);
+    options->weighted_random = 0;
+    options->bulk_load = 0;
+    options->adjacency_lists = 0;
+    options->page_size = 0;
+    options->cache_size = 0;
+    options->mmap_size = 0;
+    options->temp_store = 0;
+    options->prune_chunk_size = 0;
+}
 marky_Backend* marky_backend_new_sqlite_direct(char* db_file_path) {
     assert(db_file_path != NULL);
 #ifdef BUILD_BACKEND_SQLITE
@@ -211,6 +237,49 @@ marky_Backend_Cacheable* marky_backend_new_sqlite_cacheable(char* db_file_path)
     return NULL;
 #endif
 }
+marky_Backend* marky_backend_new_sqlite_direct_options(char* db_file_path,
+        const marky_sqlite_options_t* options) {
+    assert(db_file_path != NULL);
+    assert(options != NULL);
+#ifdef BUILD_BACKEND_SQLITE
+    return check_ptr<marky::IBackend, marky_Backend>(
+            marky::Backend_SQLite::create_backend(db_file_path, options_to_cpp(*options)));
+#else
+    return NULL;
+#endif
+}
+marky_Backend_Cacheable* marky_backend_new_sqlite_cacheable_options(char* db_file_path,
+        const marky_sqlite_options_t* options) {
+    assert(db_file_path != NULL);
+    assert(options != NULL);
+#ifdef BUILD_BACKEND_SQLITE
+    return check_ptr<marky::ICacheable, marky_Backend_Cacheable>(
+            marky::Backend_SQLite::create_cacheable(db_file_path, options_to_cpp(*options)));
+#else
+    return NULL;
+#endif
+}
+int marky_sqlite_snapshot(char* db_file_path, char* dest_path) {
+    assert(db_file_path != NULL);
+    assert(dest_path != NULL);
+#ifdef BUILD_BACKEND_SQLITE
+    return marky::Backend_SQLite::snapshot_file(db_file_path, dest_path) ?
+        MARKY_SUCCESS : MARKY_FAILURE;
+#else
+    return MARKY_FAILURE;
+#endif
+}
+int marky_sqlite_compact(char* db_file_path) {
+    assert(db_file_path != NULL);
+#ifdef BUILD_BACKEND_SQLITE
+    std::shared_ptr<marky::Backend_SQLite> backend =
+        std::dynamic_pointer_cast<marky::Backend_SQLite>(
+                marky::Backend_SQLite::create_backend(db_file_path));
+    return (backend && backend->compact()) ? MARKY_SUCCESS : MARKY_FAILURE;
+#else
+    return MARKY_FAILURE;
+#endif
+}
 int marky_has_sqlite(void) {
     return config::has_sqlite() ? MARKY_SUCCESS : MARKY_FAILURE;
 }
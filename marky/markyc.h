@@ -110,10 +110,40 @@ extern "C" {
     marky_Backend* marky_backend_new_map(void);
     marky_Backend* marky_backend_new_cache(marky_Backend_Cacheable* backend);
 
+    /* Settings for SQLite backends, see Backend_SQLite::options_t in
+     * backend-sqlite.h. Flags are enabled when non-zero, and the sizes are
+     * left at SQLite's defaults when zero. */
+    typedef struct marky_sqlite_options {
+        int weighted_random;
+        int bulk_load;
+        int adjacency_lists;
+        int page_size;
+        int64_t cache_size;
+        int64_t mmap_size;
+        /* 0: default, 1: file, 2: memory */
+        int temp_store;
+        /* 0: prune with one DELETE, or else this many snippets at a time */
+        int prune_chunk_size;
+    } marky_sqlite_options_t;
+
+    /* Sets 'options' to the defaults used by the calls without options. */
+    void marky_sqlite_options_init(marky_sqlite_options_t* options);
+
     /* If SQLite was disabled in the build, these calls will always return NULL.
      * Use marky_has_sqlite() to check if SQLite is available. */
     marky_Backend* marky_backend_new_sqlite_direct(char* db_file_path);
     marky_Backend_Cacheable* marky_backend_new_sqlite_cacheable(char* db_file_path);
+    marky_Backend* marky_backend_new_sqlite_direct_options(char* db_file_path,
+            const marky_sqlite_options_t* options);
+    marky_Backend_Cacheable* marky_backend_new_sqlite_cacheable_options(char* db_file_path,
+            const marky_sqlite_options_t* options);
+    /* Copies the SQLite db at 'db_file_path' to 'dest_path' while it may be in
+     * use, see Backend_SQLite::snapshot_file(). Returns MARKY_SUCCESS or
+     * MARKY_FAILURE. */
+    int marky_sqlite_snapshot(char* db_file_path, char* dest_path);
+    /* Rebuilds the SQLite db at 'db_file_path' without its free pages, see
+     * Backend_SQLite::compact(). Returns MARKY_SUCCESS or MARKY_FAILURE. */
+    int marky_sqlite_compact(char* db_file_path);
     /* Returns MARKY_SUCCESS if SQLite is available, or MARKY_FAILURE if it isn't. */
     int marky_has_sqlite(void);
 
@@ -19,7 +19,7 @@
 #include "rand-util.h"
 
 #include <sys/time.h>//gettimeofday()
-#include <stdlib.h>//rand()
+#include <stdlib.h>//rand_r()
 
 namespace {
     inline unsigned int get_seed() {
@@ -30,6 +30,76 @@ namespace {
 }
 
 size_t marky::pick_rand(size_t max) {
-    static unsigned int seed = get_seed();
-    return rand_r(&seed) % max;
+    /* per-thread, so that concurrent callers don't race on the seed */
+    static thread_local unsigned int seed = get_seed();
+    if (max - 1 <= (size_t)RAND_MAX) {
+        return rand_r(&seed) % max;
+    }
+    /* combine several results for ranges which are larger than RAND_MAX */
+    uint64_t value = 0;
+    for (int i = 0; i < 3; ++i) {
+        value = (value << 31) ^ rand_r(&seed);
+    }
+    return value % max;
+}
+
+void marky::SamplingTree::push_back(uint64_t weight) {
+    if (tree.empty()) {
+        tree.push_back(0);
+    }
+    /* the new node covers (index - lowbit(index), index] */
+    const size_t index = tree.size();
+    const size_t lowbit = index & -index;
+    uint64_t node = weight;
+    for (size_t child = index - 1; child > index - lowbit; child -= child & -child) {
+        node += tree[child];
+    }
+    tree.push_back(node);
+    weights.push_back(weight);
+    total_ += weight;
+}
+
+void marky::SamplingTree::set(size_t index, uint64_t weight) {
+    add(index, (int64_t)(weight - weights[index]));
+    weights[index] = weight;
+}
+
+void marky::SamplingTree::swap_remove(size_t index) {
+    const size_t last = weights.size() - 1;
+    if (index != last) {
+        set(index, weights[last]);
+    }
+    /* no other node covers the last entry, so it can just be dropped */
+    total_ -= weights[last];
+    weights.pop_back();
+    tree.pop_back();
+}
+
+size_t marky::SamplingTree::find(uint64_t target) const {
+    /* descend the tree, finding the largest prefix whose sum is <= target */
+    size_t pos = 0;
+    size_t step = 1;
+    while (step * 2 < tree.size()) {
+        step *= 2;
+    }
+    for (; step > 0; step /= 2) {
+        if (pos + step < tree.size() && tree[pos + step] <= target) {
+            pos += step;
+            target -= tree[pos];
+        }
+    }
+    return pos;/* 0-indexed: the entry after the prefix */
+}
+
+void marky::SamplingTree::clear() {
+    weights.clear();
+    tree.clear();
+    total_ = 0;
+}
+
+void marky::SamplingTree::add(size_t index, int64_t delta) {
+    for (size_t i = index + 1; i < tree.size(); i += i & -i) {
+        tree[i] += delta;
+    }
+    total_ += delta;
 }
@@ -20,12 +20,63 @@
 */
 
 #include <stddef.h>//size_t
+#include <stdint.h>
+
+#include <vector>
 
 namespace marky {
     /* Return a value within [0,max).
-     * This has internal state and assumes it won't be simultaneously called
-     * across threads, but it shouldn't conflict with other running code. */
+     * This has internal per-thread state, and shouldn't conflict with other
+     * running code. */
     size_t pick_rand(size_t max);
+
+    /* A list of weights which supports picking an index in proportion to
+     * its weight. Updates and picks are O(log n), using a Fenwick tree of
+     * the weights' prefix sums. */
+    class SamplingTree {
+      public:
+        SamplingTree()
+            : weights(), tree(), total_(0) { }
+
+        /* Appends an entry to the end of the list. */
+        void push_back(uint64_t weight);
+
+        /* Changes the weight of an existing entry. */
+        void set(size_t index, uint64_t weight);
+
+        /* Moves the last entry into 'index', then removes the last entry.
+         * This mirrors a swap-remove on a list of the weighted items. */
+        void swap_remove(size_t index);
+
+        /* Returns the index whose range of cumulative weight contains
+         * 'target', which must be less than total(). */
+        size_t find(uint64_t target) const;
+
+        /* Picks an index in proportion to the weights. total() must be
+         * nonzero. */
+        inline size_t pick() const {
+            return find(pick_rand(total_));
+        }
+
+        inline uint64_t get(size_t index) const {
+            return weights[index];
+        }
+        inline uint64_t total() const {
+            return total_;
+        }
+        inline size_t size() const {
+            return weights.size();
+        }
+
+        void clear();
+
+      private:
+        void add(size_t index, int64_t delta);
+
+        std::vector<uint64_t> weights;
+        std::vector<uint64_t> tree;/* 1-indexed, tree[0] is unused */
+        uint64_t total_;
+    };
 }
 
 #endif
@@ -22,6 +22,7 @@
 #include <stddef.h>//size_t
 #include <time.h>//time_t
 
+#include <functional>
 #include <list>
 #include <memory>
 #include <string>
@@ -71,6 +72,16 @@ namespace marky {
             state_ = cur_state;
             return score_;
         }
+        /* adds the score of 'other', a record of the same words from
+         * elsewhere (eg another model), adjusting both scores to whichever of
+         * the two last-seen states is later */
+        inline score_t merge(scorer_t scorer, const Snippet& other) {
+            const State latest((state_.time > other.state_.time) ? state_.time : other.state_.time,
+                    (state_.count > other.state_.count) ? state_.count : other.state_.count);
+            score_ = score(scorer, latest) + scorer(other.score_, other.state_, latest);
+            state_ = latest;
+            return score_;
+        }
 
         /* get current score as of last-seen state */
         inline score_t cur_score() const {
@@ -0,0 +1,273 @@
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+#include <marky/backend-frozen.h>
+#include <marky/backend-map.h>
+#include <marky/config.h>
+#include <stdio.h> //fopen()
+#include <unistd.h> //unlink()
+
+using namespace marky;
+
+#define FROZEN_FILE_PATH "frozen_test.bin"
+
+static void init_data_1(const State& state, IBackend& backend, const scorer_t& scorer) {
+    marky::words_to_counts counts;
+    counts.increment({"a", "b"});
+    counts.increment({"a", "b"});
+    counts.increment({"a", "b"});
+    counts.increment({"a", "c"});
+    counts.increment({"b", "c"});
+    counts.increment({"b", "c"});
+    counts.increment({"c", "a"});
+    ASSERT_TRUE(backend.update_snippets(state, scorer, counts.map()));
+}
+
+static void init_data_2(const State& state, IBackend& backend, const scorer_t& scorer) {
+    marky::words_to_counts counts;
+    counts.increment({"a", "b", "c"});
+    counts.increment({"a", "b", "c"});
+    counts.increment({"a", "b", "c"});
+    counts.increment({"a", "c", "d"});
+    counts.increment({"b", "c", "d"});
+    counts.increment({"b", "c", "d"});
+    counts.increment({"c", "a", "b"});
+    ASSERT_TRUE(backend.update_snippets(state, scorer, counts.map()));
+}
+
+/* compiles the content of 'map' and opens the result */
+static backend_t freeze(IBackend& map, const State& state) {
+    EXPECT_TRUE(Backend_Frozen::compile(map, state, FROZEN_FILE_PATH));
+    backend_t backend = Backend_Frozen::create_backend(FROZEN_FILE_PATH);
+    /* the mapping outlives the file */
+    unlink(FROZEN_FILE_PATH);
+    return backend;
+}
+
+TEST(Frozen, empty) {
+    Backend_Map map;
+    State state(12, 34);
+    backend_t backend = freeze(map, state);
+    ASSERT_TRUE((bool)backend);
+
+    State loaded = backend->create_state();
+    EXPECT_EQ(12, loaded.time);
+    EXPECT_EQ(34, loaded.count);
+
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    word_t word;
+    EXPECT_TRUE(backend->get_random(state, scorer, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ(IBackend::LINE_START, word);
+}
+
+TEST(Frozen, get_prev_1) {
+    Backend_Map map;
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+    init_data_1(state, map, scorer);
+    backend_t backend = freeze(map, state);
+    ASSERT_TRUE((bool)backend);
+
+    word_t word;
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"g"}, word));
+    EXPECT_EQ(IBackend::LINE_START, word);
+
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"c", "a", "x"}, word));
+    EXPECT_EQ("b", word);
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ("b", word);
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"a", "b"}, word));
+    EXPECT_EQ("c", word);
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"b", "c", "x"}, word));
+    EXPECT_EQ("a", word);
+}
+
+TEST(Frozen, get_prev_2) {
+    Backend_Map map;
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+    init_data_2(state, map, scorer);
+    backend_t backend = freeze(map, state);
+    ASSERT_TRUE((bool)backend);
+
+    word_t word;
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"c", "a", "x"}, word));
+    EXPECT_EQ(IBackend::LINE_START, word);
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"a", "b", "x"}, word));
+    EXPECT_EQ("c", word);
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ(IBackend::LINE_START, word);
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"b", "c"}, word));
+    EXPECT_EQ("a", word);
+    /* c-d is preceded by b (2) and a (1) */
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"c", "d"}, word));
+    EXPECT_EQ("b", word);
+}
+
+TEST(Frozen, get_next_1) {
+    Backend_Map map;
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+    init_data_1(state, map, scorer);
+    backend_t backend = freeze(map, state);
+    ASSERT_TRUE((bool)backend);
+
+    word_t word;
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"g"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"x", "c", "a"}, word));
+    EXPECT_EQ("b", word);
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ("b", word);
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"x", "a", "b"}, word));
+    EXPECT_EQ("c", word);
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ("a", word);
+}
+
+TEST(Frozen, get_next_2) {
+    Backend_Map map;
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+    init_data_2(state, map, scorer);
+    backend_t backend = freeze(map, state);
+    ASSERT_TRUE((bool)backend);
+
+    word_t word;
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"x", "c", "a"}, word));
+    EXPECT_EQ("b", word);
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word); /* no sub-entries are entered by the backend */
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"a", "b"}, word));
+    EXPECT_EQ("c", word);
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"x", "b", "c"}, word));
+    EXPECT_EQ("d", word);
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+}
+
+TEST(Frozen, scores_and_random) {
+    Backend_Map map;
+    /* each word loses a point if it's not updated within 2 increments */
+    scorer_t scorer = scorers::word_adj(2);
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+    map.update_snippets(state, scorer, {{{"a", "b"}, 3}, {{"a", "c"}, 2}});
+    ++state.count;
+    map.update_snippets(state, scorer, {{{"a", "c"}, 1}});
+    ++state.count;
+    backend_t backend = freeze(map, state);
+    ASSERT_TRUE((bool)backend);
+
+    /* a-b and a-c both have 3, but a-b was last seen earlier so it has
+       decayed further: 1 vs 2 */
+    word_t word;
+    state.count += 2;
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ("c", word);
+
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_TRUE(backend->get_random(state, scorer, word));
+        EXPECT_EQ("a", word);
+    }
+}
+
+TEST(Frozen, read_only) {
+    Backend_Map map;
+    scorer_t scorer = scorers::no_adj();
+    State state(0,0);
+    init_data_1(state, map, scorer);
+    backend_t backend = freeze(map, state);
+    ASSERT_TRUE((bool)backend);
+
+    marky::words_to_counts counts;
+    counts.increment({"x", "y"});
+    EXPECT_FALSE(backend->update_snippets(state, scorer, counts.map()));
+    EXPECT_TRUE(backend->prune(state, scorer));
+    EXPECT_TRUE(backend->store_state(state, scorer));
+}
+
+TEST(Frozen, visit_snippets) {
+    Backend_Map map;
+    scorer_t scorer = scorers::no_adj();
+    State state(0,0);
+    init_data_2(state, map, scorer);
+    backend_t backend = freeze(map, state);
+    ASSERT_TRUE((bool)backend);
+
+    /* every snippet comes back out with its original score */
+    size_t visited = 0;
+    EXPECT_TRUE(backend->visit_snippets([&](const Snippet& snippet) {
+                ++visited;
+                if (snippet.words == words_t({"a", "b", "c"})) {
+                    EXPECT_EQ(3, snippet.cur_score());
+                } else if (snippet.words == words_t({"b", "c", "d"})) {
+                    EXPECT_EQ(2, snippet.cur_score());
+                } else {
+                    EXPECT_EQ(1, snippet.cur_score());
+                }
+                return true;
+            }));
+    EXPECT_EQ(4, visited);
+
+    /* a frozen backend may be refrozen, or thawed into a map */
+    Backend_Map thawed;
+    EXPECT_TRUE(backend->visit_snippets([&](const Snippet& snippet) {
+                marky::words_to_counts::map_t windows;
+                windows[snippet.words] = snippet.cur_score();
+                return thawed.update_snippets(state, scorer, windows);
+            }));
+    backend_t refrozen = freeze(*backend, state);
+    ASSERT_TRUE((bool)refrozen);
+
+    selector_t selector = selectors::best_always();
+    word_t word;
+    EXPECT_TRUE(thawed.get_next(state, selector, scorer, {"b", "c"}, word));
+    EXPECT_EQ("d", word);
+    EXPECT_TRUE(refrozen->get_next(state, selector, scorer, {"b", "c"}, word));
+    EXPECT_EQ("d", word);
+    EXPECT_TRUE(refrozen->get_prev(state, selector, scorer, {"c", "d"}, word));
+    EXPECT_EQ("b", word);
+}
+
+TEST(Frozen, bad_file) {
+    FILE* file = fopen(FROZEN_FILE_PATH, "w");
+    ASSERT_TRUE(file != NULL);
+    fputs("MARKYFRZ but not really", file);
+    fclose(file);
+
+    EXPECT_FALSE((bool)Backend_Frozen::create_backend(FROZEN_FILE_PATH));
+    unlink(FROZEN_FILE_PATH);
+    EXPECT_FALSE((bool)Backend_Frozen::create_backend(FROZEN_FILE_PATH));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest( &argc, argv );
+    return RUN_ALL_TESTS();
+}
@@ -19,6 +19,9 @@
 #include <gtest/gtest.h>
 #include <marky/backend-map.h>
 #include <marky/config.h>
+#include <stdio.h> //fopen()
+#include <map>
+#include <unistd.h> //unlink()
 
 using namespace marky;
 
@@ -264,6 +267,93 @@ TEST(Map, get_random) {
     EXPECT_NE(IBackend::LINE_END, rand);
 }
 
+TEST(Map, get_random_uniform) {
+    Backend_Map backend;
+    scorer_t scorer = scorers::no_adj();
+    State state(0,0);
+
+    marky::words_to_counts::map_t map;
+    map[{"a", "b"}] = 1;
+    map[{"c", "d"}] = 1;
+    map[{"", "e"}] = 1;
+    map[{"f", "g"}] = 1;
+    ASSERT_TRUE(backend.update_snippets(state, scorer, map));
+    /* remove f-g, leaving the rest in place */
+    ASSERT_TRUE(backend.prune(State(0, 1), scorers::word_adj(1)));
+    ASSERT_TRUE(backend.update_snippets(state, scorer, map));
+
+    std::map<word_t, size_t> counts;
+    for (int i = 0; i < 3000; ++i) {
+        word_t word;
+        EXPECT_TRUE(backend.get_random(state, scorer, word));
+        ++counts[word];
+    }
+    /* front words, or the back word after a LINE_START */
+    EXPECT_EQ(4, counts.size());
+    EXPECT_LT(500, counts["a"]);
+    EXPECT_LT(500, counts["c"]);
+    EXPECT_LT(500, counts["e"]);
+    EXPECT_LT(500, counts["f"]);
+}
+
+TEST(Map, get_random_weighted) {
+    Backend_Map backend(0, true);
+    scorer_t scorer = scorers::word_adj(10);
+    State state(0,0);
+
+    marky::words_to_counts::map_t map;
+    map[{"a", "b"}] = 1;
+    map[{"c", "d"}] = 9;
+    ASSERT_TRUE(backend.update_snippets(state, scorer, map));
+
+    size_t a = 0, c = 0;
+    for (int i = 0; i < 1000; ++i) {
+        word_t word;
+        EXPECT_TRUE(backend.get_random(state, scorer, word));
+        if (word == "a") {
+            ++a;
+        } else if (word == "c") {
+            ++c;
+        }
+    }
+    EXPECT_EQ(1000, a + c);
+    EXPECT_LT(a * 4, c);
+
+    /* updates change the weights */
+    map.clear();
+    map[{"a", "b"}] = 99;
+    ASSERT_TRUE(backend.update_snippets(state, scorer, map));
+    a = c = 0;
+    for (int i = 0; i < 1000; ++i) {
+        word_t word;
+        EXPECT_TRUE(backend.get_random(state, scorer, word));
+        if (word == "a") {
+            ++a;
+        } else if (word == "c") {
+            ++c;
+        }
+    }
+    EXPECT_LT(c * 4, a);
+
+    /* a-b (100) decays to zero, c-d (1) was seen more recently */
+    state.count = 995;
+    map.clear();
+    map[{"c", "d"}] = 1;
+    ASSERT_TRUE(backend.update_snippets(state, scorer, map));
+    state.count = 1000;
+    a = c = 0;
+    for (int i = 0; i < 100; ++i) {
+        word_t word;
+        EXPECT_TRUE(backend.get_random(state, scorer, word));
+        if (word == "a") {
+            ++a;
+        } else if (word == "c") {
+            ++c;
+        }
+    }
+    EXPECT_LT(a * 4, c);
+}
+
 #define INC_STATE(state) DEBUG("INC %lu", state.count); ++state.time; ++state.count;
 
 TEST(Map, scoreadj_prune) {
@@ -346,6 +436,471 @@ TEST(Map, scoreadj_prune) {
     EXPECT_NE(IBackend::LINE_END, word);
 }
 
+TEST(Map, no_adj_schedules_nothing) {
+    Backend_Map backend;
+    size_t calls = 0;
+    scorer_t no_adj = scorers::no_adj();
+    scorer_t scorer = [&](score_t score, const State& last, const State& now) {
+        ++calls;
+        return no_adj(score, last, now);
+    };
+
+    State state(0,0);
+    marky::words_to_counts counts;
+    for (int i = 0; i < 100; ++i) {
+        char word[16];
+        snprintf(word, sizeof(word), "w%d", i);
+        counts.increment({word, "next"});
+    }
+    ASSERT_TRUE(backend.update_snippets(state, scorer, counts.map()));
+    /* two checks in each dimension per new snippet, rather than a search */
+    EXPECT_GE(4 * 100, calls);
+
+    /* none of them were scheduled, so none come due */
+    calls = 0;
+    ASSERT_TRUE(backend.prune(State(1L << 40, 1UL << 40), scorer));
+    EXPECT_EQ(0, calls);
+    size_t visited = 0;
+    EXPECT_TRUE(backend.visit_snippets([&](const Snippet& /*snippet*/) {
+                ++visited;
+                return true;
+            }));
+    EXPECT_EQ(100, visited);
+}
+
+TEST(Map, timeadj_prune) {
+    Backend_Map backend;
+    /* each word loses a point every 10 seconds */
+    scorer_t scorer = scorers::time_adj(10);
+    selector_t selector = selectors::best_always();
+    word_t word;
+
+    State state(1000, 0);
+    backend.update_snippets(state, scorer, to_map({"a", "b"}));
+    backend.update_snippets(state, scorer, to_map({"c", "d"}));
+    state.time += 5;
+    backend.update_snippets(state, scorer, to_map({"c", "d"}));//score=2
+
+    state.time += 5;
+    backend.prune(state, scorer);/* deletes a-b, due at 1010 */
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ("d", word);
+
+    /* c-d was bumped after being scheduled for 1010, so it's rescheduled */
+    state.time += 14;
+    backend.prune(state, scorer);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ("d", word);
+
+    state.time += 1;
+    backend.prune(state, scorer);/* deletes c-d, due at 1025 */
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+}
+
+TEST(Map, memory_limit) {
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+    word_t word;
+
+    /* measure the usage of a backend with 3 snippets */
+    Backend_Map unlimited;
+    scorer_t decay = scorers::word_adj(1);
+    EXPECT_EQ(0, unlimited.memory_usage());
+    EXPECT_EQ(0, unlimited.memory_limit());
+    unlimited.update_snippets(state, decay, to_map({"a", "b"}));
+    const size_t one = unlimited.memory_usage();
+    EXPECT_LT(0, one);
+    unlimited.update_snippets(state, decay, to_map({"c", "d"}));
+    unlimited.update_snippets(state, decay, to_map({"e", "f"}));
+    EXPECT_EQ(3 * one, unlimited.memory_usage());
+
+    /* usage goes back down when snippets are pruned */
+    unlimited.prune(State(0, 10), decay);
+    EXPECT_EQ(0, unlimited.memory_usage());
+
+    /* room for 2 of 3 snippets once recency tracking is counted. evicts the
+       lowest scoring among the least recently seen. */
+    Backend_Map backend(3 * one);
+    EXPECT_EQ(3 * one, backend.memory_limit());
+    backend.update_snippets(state, scorer, to_map({"a", "b"}));
+    backend.update_snippets(state, scorer, to_map({"a", "b"}));
+    backend.update_snippets(state, scorer, to_map({"c", "d"}));
+    EXPECT_GE(backend.memory_limit(), backend.memory_usage());
+    backend.update_snippets(state, scorer, to_map({"e", "f"}));/* evicts c-d (1) */
+    EXPECT_GE(backend.memory_limit(), backend.memory_usage());
+
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ("b", word);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"d"}, word));
+    EXPECT_EQ(IBackend::LINE_START, word);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"e"}, word));
+    EXPECT_EQ("f", word);
+
+    /* bumping a-b makes e-f the least recently seen */
+    backend.update_snippets(state, scorer, to_map({"a", "b"}));
+    marky::words_to_counts::map_t map;
+    map[{"g", "h"}] = 5;
+    backend.update_snippets(state, scorer, map);/* evicts e-f (1) */
+    EXPECT_GE(backend.memory_limit(), backend.memory_usage());
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ("b", word);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"e"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"g"}, word));
+    EXPECT_EQ("h", word);
+}
+
+#define MAP_FILE_PATH "map_test.bin"
+
+TEST(Map, save_load) {
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    {
+        Backend_Map backend;
+        State state(0,0);
+        init_data_1(state, backend, scorer);
+        ASSERT_TRUE(backend.store_state(State(12, 34), scorer));
+        ASSERT_TRUE(backend.save(MAP_FILE_PATH));
+    }
+
+    Backend_Map backend;
+    ASSERT_TRUE(backend.load(MAP_FILE_PATH, scorers::no_adj()));
+    unlink(MAP_FILE_PATH);
+
+    State state = backend.create_state();
+    EXPECT_EQ(12, state.time);
+    EXPECT_EQ(34, state.count);
+
+    word_t word;
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ("b", word);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"b"}, word));
+    EXPECT_EQ("c", word);
+    EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ("b", word);
+    EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ("c", word);
+
+    /* loaded snippets keep their scores: a->b (3) vs a->c (1) */
+    ASSERT_TRUE(backend.update_snippets(state, scorer, to_map({"a", "c"})));
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ("b", word);
+
+    /* loaded snippets are still checked by prune: only a->c was seen since
+       the loaded state's line count */
+    state.count += 2;
+    ASSERT_TRUE(backend.prune(state, scorers::word_adj(2)));
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ("c", word);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+}
+
+TEST(Map, load_bad_file) {
+    FILE* file = fopen(MAP_FILE_PATH, "w");
+    ASSERT_TRUE(file != NULL);
+    fputs("MARKYMAP but not really", file);
+    fclose(file);
+
+    Backend_Map backend;
+    EXPECT_FALSE(backend.load(MAP_FILE_PATH, scorers::no_adj()));
+    unlink(MAP_FILE_PATH);
+    EXPECT_FALSE(backend.load(MAP_FILE_PATH, scorers::no_adj()));
+
+    word_t word;
+    EXPECT_TRUE(backend.get_random(backend.create_state(), scorers::no_adj(), word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+}
+
+TEST(Map, load_memory_limit) {
+    scorer_t scorer = scorers::no_adj();
+    State state(0,0);
+    {
+        Backend_Map backend;
+        marky::words_to_counts counts;
+        for (int i = 0; i < 100; ++i) {
+            char word[16];
+            snprintf(word, sizeof(word), "w%d", i);
+            counts.increment({word, "next"});
+        }
+        /* one snippet which outscores the rest */
+        for (int i = 0; i < 5; ++i) {
+            counts.increment({"best", "next"});
+        }
+        ASSERT_TRUE(backend.update_snippets(state, scorer, counts.map()));
+        ASSERT_TRUE(backend.save(MAP_FILE_PATH));
+    }
+
+    /* measure one snippet, then load within room for about 10 */
+    Backend_Map one;
+    ASSERT_TRUE(one.update_snippets(state, scorer, to_map({"w0", "next"})));
+    Backend_Map backend(11 * one.memory_usage());
+    ASSERT_TRUE(backend.load(MAP_FILE_PATH, scorer));
+    unlink(MAP_FILE_PATH);
+    EXPECT_GE(backend.memory_limit(), backend.memory_usage());
+
+    size_t visited = 0;
+    bool found_best = false;
+    EXPECT_TRUE(backend.visit_snippets([&](const Snippet& snippet) {
+                ++visited;
+                found_best |= (snippet.words == words_t({"best", "next"}));
+                return true;
+            }));
+    EXPECT_LT(0, visited);
+    EXPECT_GT(20, visited);
+    EXPECT_TRUE(found_best);
+}
+
+TEST(Map, merge) {
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+
+    Backend_Map backend, other;
+    init_data_1(state, backend, scorer);
+    ASSERT_TRUE(backend.store_state(State(5, 5), scorer));
+    marky::words_to_counts counts;
+    for (int i = 0; i < 3; ++i) {
+        counts.increment({"c", "d"});
+    }
+    counts.increment({"a", "c"});
+    ASSERT_TRUE(other.update_snippets(State(10, 10), scorer, counts.map()));
+    ASSERT_TRUE(other.store_state(State(10, 10), scorer));
+
+    backend.merge(other, scorer);
+
+    std::map<words_t, score_t> scores;
+    ASSERT_TRUE(backend.visit_snippets([&](const Snippet& snippet) {
+                scores[snippet.words] = snippet.cur_score();
+                return true;
+            }));
+    EXPECT_EQ(5, scores.size());
+    EXPECT_EQ(3, scores[words_t({"a", "b"})]);
+    EXPECT_EQ(2, scores[words_t({"a", "c"})]);
+    EXPECT_EQ(3, scores[words_t({"c", "d"})]);
+    EXPECT_EQ(10, backend.create_state().count);
+
+    /* both indexes see the merged snippets */
+    word_t word;
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ("d", word);
+    EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"d"}, word));
+    EXPECT_EQ("c", word);
+
+    /* the merged copy is independent of the original */
+    ASSERT_TRUE(other.update_snippets(State(10, 10), scorer, counts.map()));
+    size_t c_d_score = 0;
+    ASSERT_TRUE(backend.visit_snippets([&](const Snippet& snippet) {
+                if (snippet.words == words_t({"c", "d"})) {
+                    c_d_score = snippet.cur_score();
+                }
+                return true;
+            }));
+    EXPECT_EQ(3, c_d_score);
+
+    /* merged snippets are scheduled for pruning */
+    scorer_t adj_scorer = scorers::word_adj(1);
+    Backend_Map pruned, pruned_other;
+    ASSERT_TRUE(pruned_other.update_snippets(State(10, 10), adj_scorer, counts.map()));
+    pruned.merge(pruned_other, adj_scorer);
+    ASSERT_TRUE(pruned.prune(State(10, 12), adj_scorer));
+    EXPECT_TRUE(pruned.get_next(State(10, 12), selector, adj_scorer, {"c"}, word));
+    EXPECT_EQ("d", word);
+    EXPECT_TRUE(pruned.get_next(State(10, 12), selector, adj_scorer, {"a"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    ASSERT_TRUE(pruned.prune(State(10, 13), adj_scorer));
+    EXPECT_TRUE(pruned.get_next(State(10, 13), selector, adj_scorer, {"c"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+}
+
+TEST(Map, fork) {
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+
+    Backend_Map parent;
+    init_data_1(state, parent, scorer);
+    ASSERT_TRUE(parent.store_state(State(5, 5), scorer));
+    const size_t parent_usage = parent.memory_usage();
+
+    std::shared_ptr<Backend_Map> child = parent.fork();
+    EXPECT_EQ(5, child->create_state().count);
+    /* everything's shared until it's modified */
+    EXPECT_EQ(0, child->memory_usage());
+    EXPECT_EQ(0, parent.memory_usage());
+
+    word_t word;
+    EXPECT_TRUE(child->get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ("b", word);
+    EXPECT_TRUE(child->get_random(state, scorer, word));
+    EXPECT_NE(IBackend::LINE_END, word);
+
+    /* a->c overtakes a->b in the child, but not in the parent */
+    marky::words_to_counts counts;
+    for (int i = 0; i < 3; ++i) {
+        counts.increment({"a", "c"});
+    }
+    counts.increment({"d", "e"});
+    ASSERT_TRUE(child->update_snippets(state, scorer, counts.map()));
+    EXPECT_LT(0, child->memory_usage());
+    EXPECT_GT(parent_usage, child->memory_usage());
+    EXPECT_TRUE(child->get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ("c", word);
+    EXPECT_TRUE(child->get_prev(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ("a", word);
+    EXPECT_TRUE(parent.get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ("b", word);
+    EXPECT_TRUE(parent.get_prev(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ("b", word);
+    EXPECT_TRUE(parent.get_next(state, selector, scorer, {"d"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+
+    /* and the parent's updates aren't seen by the child */
+    ASSERT_TRUE(parent.update_snippets(state, scorer, to_map({"x", "y"})));
+    EXPECT_TRUE(parent.get_next(state, selector, scorer, {"x"}, word));
+    EXPECT_EQ("y", word);
+    EXPECT_TRUE(child->get_next(state, selector, scorer, {"x"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+
+    std::map<words_t, score_t> scores;
+    ASSERT_TRUE(child->visit_snippets([&](const Snippet& snippet) {
+                EXPECT_EQ(0, scores.count(snippet.words));
+                scores[snippet.words] = snippet.cur_score();
+                return true;
+            }));
+    EXPECT_EQ(5, scores.size());
+    EXPECT_EQ(3, scores[words_t({"a", "b"})]);
+    EXPECT_EQ(4, scores[words_t({"a", "c"})]);
+    EXPECT_EQ(1, scores[words_t({"d", "e"})]);
+
+    /* saving the child includes what it shares with the parent */
+    ASSERT_TRUE(child->save(MAP_FILE_PATH));
+    Backend_Map loaded;
+    ASSERT_TRUE(loaded.load(MAP_FILE_PATH, scorers::no_adj()));
+    unlink(MAP_FILE_PATH);
+    std::map<words_t, score_t> loaded_scores;
+    ASSERT_TRUE(loaded.visit_snippets([&](const Snippet& snippet) {
+                loaded_scores[snippet.words] = snippet.cur_score();
+                return true;
+            }));
+    EXPECT_EQ(scores, loaded_scores);
+
+    /* a fork of a fork sees through both layers */
+    std::shared_ptr<Backend_Map> grandchild = child->fork();
+    EXPECT_TRUE(grandchild->get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ("c", word);
+    EXPECT_TRUE(grandchild->get_next(state, selector, scorer, {"b"}, word));
+    EXPECT_EQ("c", word);
+    ASSERT_TRUE(grandchild->update_snippets(state, scorer, to_map({"b", "d"})));
+    ASSERT_TRUE(grandchild->update_snippets(state, scorer, to_map({"b", "d"})));
+    EXPECT_TRUE(grandchild->get_prev(state, selector, scorer, {"d"}, word));
+    EXPECT_EQ("b", word);
+    EXPECT_TRUE(child->get_prev(state, selector, scorer, {"d"}, word));
+    EXPECT_EQ(IBackend::LINE_START, word);
+
+    /* pruning the child hides shared snippets, leaving the parent alone */
+    scorer_t adj_scorer = scorers::word_adj(1);
+    ASSERT_TRUE(child->prune(State(100, 100), adj_scorer));
+    EXPECT_TRUE(child->get_next(state, selector, scorer, {"b"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    EXPECT_TRUE(child->get_prev(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ(IBackend::LINE_START, word);
+    EXPECT_TRUE(child->get_random(state, scorer, word));
+    EXPECT_TRUE(parent.get_next(state, selector, scorer, {"b"}, word));
+    EXPECT_EQ("c", word);
+    EXPECT_TRUE(grandchild->get_next(state, selector, scorer, {"b"}, word));
+    EXPECT_EQ("d", word);
+    size_t visited = 0;
+    ASSERT_TRUE(child->visit_snippets([&](const Snippet& /*snippet*/) {
+                ++visited;
+                return true;
+            }));
+    EXPECT_EQ(0, visited);
+}
+
+TEST(Map, fork_get_random_weighted) {
+    Backend_Map parent(0, true);
+    scorer_t scorer = scorers::no_adj();
+    State state(0,0);
+
+    marky::words_to_counts::map_t map;
+    map[{"a", "b"}] = 1;
+    map[{"c", "d"}] = 9;
+    ASSERT_TRUE(parent.update_snippets(state, scorer, map));
+    std::shared_ptr<Backend_Map> child = parent.fork();
+    /* a->b now outweighs c->d in the child only */
+    map.clear();
+    map[{"a", "b"}] = 90;
+    ASSERT_TRUE(child->update_snippets(state, scorer, map));
+
+    size_t child_a = 0, parent_a = 0;
+    for (int i = 0; i < 1000; ++i) {
+        word_t word;
+        EXPECT_TRUE(child->get_random(state, scorer, word));
+        if (word == "a") {
+            ++child_a;
+        }
+        EXPECT_TRUE(parent.get_random(state, scorer, word));
+        if (word == "a") {
+            ++parent_a;
+        }
+    }
+    EXPECT_LT(800, child_a);
+    EXPECT_GT(200, parent_a);
+}
+
+static void test_fork_get_random_hidden(bool weighted) {
+    Backend_Map parent(0, weighted);
+    /* each word loses a point if it's not updated within 2 increments */
+    scorer_t scorer = scorers::word_adj(2);
+    State state(0,0);
+
+    marky::words_to_counts counts;
+    for (int i = 0; i < 200; ++i) {
+        char word[16];
+        snprintf(word, sizeof(word), "w%d", i);
+        counts.increment({word, "x"});
+    }
+    ASSERT_TRUE(parent.update_snippets(state, scorer, counts.map()));
+    std::shared_ptr<Backend_Map> child = parent.fork(), empty_child = parent.fork();
+
+    /* everything from the parent expires in the children, leaving only
+       what the child added since */
+    state = State(0, 100);
+    ASSERT_TRUE(child->update_snippets(state, scorer, to_map({"keep", "x"})));
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_TRUE(child->prune(state, scorer));
+        ASSERT_TRUE(empty_child->prune(state, scorer));
+    }
+    size_t visited = 0;
+    EXPECT_TRUE(child->visit_snippets([&](const Snippet& /*snippet*/) {
+                ++visited;
+                return true;
+            }));
+    ASSERT_EQ(1, visited);
+
+    for (int i = 0; i < 1000; ++i) {
+        word_t word;
+        EXPECT_TRUE(child->get_random(state, scorer, word));
+        EXPECT_EQ("keep", word);
+        EXPECT_TRUE(empty_child->get_random(state, scorer, word));
+        EXPECT_EQ(IBackend::LINE_END, word);
+    }
+}
+
+TEST(Map, fork_get_random_hidden) {
+    test_fork_get_random_hidden(false);
+}
+TEST(Map, fork_get_random_weighted_hidden) {
+    test_fork_get_random_hidden(true);
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest( &argc, argv );
     return RUN_ALL_TESTS();
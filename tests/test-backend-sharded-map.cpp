@@ -0,0 +1,231 @@
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+#include <marky/backend-sharded-map.h>
+#include <marky/config.h>
+#include <marky/marky.h>
+#include <map>
+#include <thread>
+
+using namespace marky;
+
+static void init_data(const State& state, IBackend& backend, const scorer_t& scorer) {
+    marky::words_to_counts counts;
+    counts.increment({"a", "b", "c"});
+    counts.increment({"a", "b", "c"});
+    counts.increment({"a", "b", "c"});
+    counts.increment({"a", "c", "d"});
+    counts.increment({"b", "c", "d"});
+    counts.increment({"b", "c", "d"});
+    counts.increment({"c", "a", "b"});
+    ASSERT_TRUE(backend.update_snippets(state, scorer, counts.map()));
+}
+
+static marky::words_to_counts::map_t to_map(const words_t& words) {
+    marky::words_to_counts::map_t map;
+    map[words] = 1;
+    return map;
+}
+
+TEST(ShardedMap, get_prev_next) {
+    /* the same results as Backend_Map, for any number of shards */
+    for (size_t shard_count = 0; shard_count <= 8; ++shard_count) {
+        Backend_ShardedMap backend(shard_count);
+        scorer_t scorer = scorers::no_adj();
+        selector_t selector = selectors::best_always();
+        State state(0,0);
+
+        word_t word;
+        EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a", "b"}, word));
+        EXPECT_EQ(IBackend::LINE_END, word);
+        EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"a", "b"}, word));
+        EXPECT_EQ(IBackend::LINE_START, word);
+
+        init_data(state, backend, scorer);
+
+        EXPECT_TRUE(backend.get_next(state, selector, scorer, {"g"}, word));
+        EXPECT_EQ(IBackend::LINE_END, word);
+        EXPECT_TRUE(backend.get_next(state, selector, scorer, {"x", "c", "a"}, word));
+        EXPECT_EQ("b", word);
+        EXPECT_TRUE(backend.get_next(state, selector, scorer, {"c", "a"}, word));
+        EXPECT_EQ("b", word);
+        EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a"}, word));
+        EXPECT_EQ(IBackend::LINE_END, word);
+        EXPECT_TRUE(backend.get_next(state, selector, scorer, {"x", "a", "b"}, word));
+        EXPECT_EQ("c", word);
+        EXPECT_TRUE(backend.get_next(state, selector, scorer, {"x", "b", "c"}, word));
+        EXPECT_EQ("d", word);
+
+        EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"g"}, word));
+        EXPECT_EQ(IBackend::LINE_START, word);
+        EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"a", "b", "x"}, word));
+        EXPECT_EQ("c", word);
+        EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"b", "c", "x"}, word));
+        EXPECT_EQ("a", word);
+        EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"c", "d"}, word));
+        EXPECT_EQ("b", word);
+        EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"b"}, word));
+        EXPECT_EQ(IBackend::LINE_START, word);
+    }
+}
+
+TEST(ShardedMap, get_random) {
+    Backend_ShardedMap backend;
+    scorer_t scorer = scorers::no_adj();
+    State state(0,0);
+
+    word_t rand;
+    EXPECT_TRUE(backend.get_random(state, scorer, rand));
+    EXPECT_EQ(IBackend::LINE_END, rand);
+
+    ASSERT_TRUE(backend.update_snippets(state, scorer, to_map({IBackend::LINE_START, "a"})));
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_TRUE(backend.get_random(state, scorer, rand));
+        EXPECT_EQ("a", rand);
+    }
+}
+
+#define INC_STATE(state) ++state.time; ++state.count;
+
+TEST(ShardedMap, scoreadj_prune) {
+    Backend_ShardedMap backend(4);
+    /* each word loses a point if it's not updated within 2 increments */
+    scorer_t scorer = scorers::word_adj(2);
+    selector_t selector = selectors::best_always();
+
+    State state(0,0);
+    backend.update_snippets(state, scorer, to_map({"a", "b"}));
+    INC_STATE(state);
+    for (int i = 0; i < 5; ++i) {
+        backend.update_snippets(state, scorer, to_map({"c", "d"}));
+        INC_STATE(state);
+    }
+
+    word_t word;
+    backend.prune(state, scorer);/* a-b has score 0 at line 6 */
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"b"}, word));
+    EXPECT_EQ(IBackend::LINE_START, word);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ("d", word);
+    EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"d"}, word));
+    EXPECT_EQ("c", word);
+
+    size_t visited = 0;
+    EXPECT_TRUE(backend.visit_snippets([&](const Snippet& snippet) {
+                EXPECT_EQ(words_t({"c", "d"}), snippet.words);
+                ++visited;
+                return true;
+            }));
+    EXPECT_EQ(1, visited);
+}
+
+TEST(ShardedMap, shared_snippets) {
+    Backend_ShardedMap backend(8);
+    scorer_t scorer = scorers::word_adj(2);
+    /* notes which snippet was picked */
+    snippet_t picked;
+    selector_t selector = [&picked](const snippet_ptr_set_t& snippets,
+            const scorer_t& scorer, const State& state) {
+        picked = selectors::best_always()(snippets, scorer, state);
+        return picked;
+    };
+
+    /* updates from several threads, each with its own (out of order) state */
+    const size_t THREADS = 8;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < THREADS; ++t) {
+        threads.push_back(std::thread([&backend, &scorer, t]() {
+                    for (size_t i = 0; i < 100; ++i) {
+                        State state(THREADS - t, i);
+                        EXPECT_TRUE(backend.update_snippets(state, scorer, to_map({"a", "b"})));
+                    }
+                }));
+    }
+    for (size_t t = 0; t < threads.size(); ++t) {
+        threads[t].join();
+    }
+
+    /* both directions see the one snippet */
+    State state(THREADS, 100);
+    word_t word;
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ("b", word);
+    snippet_t next = picked;
+    EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"b"}, word));
+    EXPECT_EQ("a", word);
+    EXPECT_EQ(next.get(), picked.get());
+
+    /* and it's pruned from both at once */
+    state.count += next->cur_score() * 2 + 2;
+    ASSERT_TRUE(backend.prune(state, scorer));
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"b"}, word));
+    EXPECT_EQ(IBackend::LINE_START, word);
+}
+
+TEST(ShardedMap, concurrent_insert) {
+    backend_t backend(new Backend_ShardedMap(16));
+    Marky marky(backend, selectors::best_always(), scorers::no_adj(), 2);
+
+    const size_t THREADS = 8, LINES = 500;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < THREADS; ++t) {
+        threads.push_back(std::thread([&marky, t]() {
+                    char other[16];
+                    snprintf(other, sizeof(other), "t%lu", t);
+                    for (size_t i = 0; i < LINES; ++i) {
+                        EXPECT_TRUE(marky.insert({"the", "quick", "fox", other}));
+                    }
+                }));
+    }
+    for (size_t t = 0; t < threads.size(); ++t) {
+        threads[t].join();
+    }
+
+    /* no updates were lost */
+    std::map<words_t, score_t> scores;
+    ASSERT_TRUE(backend->visit_snippets([&](const Snippet& snippet) {
+                scores[snippet.words] = snippet.cur_score();
+                return true;
+            }));
+    EXPECT_EQ(THREADS * LINES, scores[words_t({IBackend::LINE_START, "the", "quick"})]);
+    EXPECT_EQ(THREADS * LINES, scores[words_t({"the", "quick", "fox"})]);
+    EXPECT_EQ(LINES, scores[words_t({"quick", "fox", "t3"})]);
+    EXPECT_EQ(LINES, scores[words_t({"fox", "t3", IBackend::LINE_END})]);
+
+    /* each line got its own count */
+    size_t max_count = 0;
+    ASSERT_TRUE(backend->visit_snippets([&](const Snippet& snippet) {
+                max_count = std::max(max_count, snippet.cur_state().count);
+                return true;
+            }));
+    EXPECT_EQ(THREADS * LINES - 1, max_count);
+
+    words_t line;
+    EXPECT_TRUE(marky.produce(line, {"the"}));
+    EXPECT_EQ(4, line.size());
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest( &argc, argv );
+    return RUN_ALL_TESTS();
+}
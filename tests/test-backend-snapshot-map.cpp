@@ -0,0 +1,227 @@
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+#include <marky/backend-snapshot-map.h>
+#include <marky/config.h>
+#include <atomic>
+#include <thread>
+
+using namespace marky;
+
+static void init_data(const State& state, IBackend& backend, const scorer_t& scorer) {
+    marky::words_to_counts counts;
+    counts.increment({"a", "b", "c"});
+    counts.increment({"a", "b", "c"});
+    counts.increment({"a", "b", "c"});
+    counts.increment({"a", "c", "d"});
+    counts.increment({"b", "c", "d"});
+    counts.increment({"b", "c", "d"});
+    counts.increment({"c", "a", "b"});
+    ASSERT_TRUE(backend.update_snippets(state, scorer, counts.map()));
+}
+
+static marky::words_to_counts::map_t to_map(const words_t& words) {
+    marky::words_to_counts::map_t map;
+    map[words] = 1;
+    return map;
+}
+
+TEST(SnapshotMap, get_prev_next) {
+    Backend_SnapshotMap backend;
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+
+    word_t word;
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a", "b"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"a", "b"}, word));
+    EXPECT_EQ(IBackend::LINE_START, word);
+
+    init_data(state, backend, scorer);
+
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"g"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"x", "c", "a"}, word));
+    EXPECT_EQ("b", word);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"x", "a", "b"}, word));
+    EXPECT_EQ("c", word);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"x", "b", "c"}, word));
+    EXPECT_EQ("d", word);
+
+    EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"a", "b", "x"}, word));
+    EXPECT_EQ("c", word);
+    EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"b", "c", "x"}, word));
+    EXPECT_EQ("a", word);
+    EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"c", "d"}, word));
+    EXPECT_EQ("b", word);
+
+    /* updates replace the snippet seen by later reads */
+    marky::words_to_counts counts;
+    for (int i = 0; i < 3; ++i) {
+        counts.increment({"a", "b", "x"});
+    }
+    ASSERT_TRUE(backend.update_snippets(state, scorer, counts.map()));
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a", "b"}, word));
+    EXPECT_EQ("x", word);
+}
+
+TEST(SnapshotMap, get_random) {
+    Backend_SnapshotMap backend;
+    scorer_t scorer = scorers::no_adj();
+    State state(0,0);
+
+    word_t rand;
+    EXPECT_TRUE(backend.get_random(state, scorer, rand));
+    EXPECT_EQ(IBackend::LINE_END, rand);
+
+    ASSERT_TRUE(backend.update_snippets(state, scorer, to_map({IBackend::LINE_START, "a"})));
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_TRUE(backend.get_random(state, scorer, rand));
+        EXPECT_EQ("a", rand);
+    }
+}
+
+#define INC_STATE(state) ++state.time; ++state.count;
+
+TEST(SnapshotMap, scoreadj_prune) {
+    Backend_SnapshotMap backend;
+    /* each word loses a point if it's not updated within 2 increments */
+    scorer_t scorer = scorers::word_adj(2);
+    selector_t selector = selectors::best_always();
+
+    State state(0,0);
+    backend.update_snippets(state, scorer, to_map({"a", "b"}));
+    INC_STATE(state);
+    for (int i = 0; i < 5; ++i) {
+        backend.update_snippets(state, scorer, to_map({"c", "d"}));
+        INC_STATE(state);
+    }
+
+    word_t word;
+    backend.prune(state, scorer);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"b"}, word));
+    EXPECT_EQ(IBackend::LINE_START, word);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ("d", word);
+
+    /* c-d was replaced by each update, but only the latest copy remains */
+    size_t visited = 0;
+    EXPECT_TRUE(backend.visit_snippets([&](const Snippet& snippet) {
+                EXPECT_EQ(words_t({"c", "d"}), snippet.words);
+                EXPECT_EQ(5, snippet.cur_score());
+                ++visited;
+                return true;
+            }));
+    EXPECT_EQ(1, visited);
+
+    /* c-d expires 10 lines after its last update */
+    for (int i = 0; i < 10; ++i) {
+        INC_STATE(state);
+    }
+    backend.prune(state, scorer);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+}
+
+TEST(SnapshotMap, many_contexts) {
+    /* enough contexts to grow the tables a few times */
+    Backend_SnapshotMap backend;
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+
+    const int COUNT = 5000;
+    marky::words_to_counts counts;
+    for (int i = 0; i < COUNT; ++i) {
+        char word[16];
+        snprintf(word, sizeof(word), "w%d", i);
+        counts.increment({word, "next"});
+    }
+    ASSERT_TRUE(backend.update_snippets(state, scorer, counts.map()));
+
+    word_t word;
+    for (int i = 0; i < COUNT; i += 7) {
+        char search[16];
+        snprintf(search, sizeof(search), "w%d", i);
+        EXPECT_TRUE(backend.get_next(state, selector, scorer, {search}, word));
+        EXPECT_EQ("next", word);
+    }
+    size_t visited = 0;
+    EXPECT_TRUE(backend.visit_snippets([&](const Snippet& /*snippet*/) {
+                ++visited;
+                return true;
+            }));
+    EXPECT_EQ(COUNT, visited);
+}
+
+TEST(SnapshotMap, concurrent_read_write) {
+    Backend_SnapshotMap backend;
+    scorer_t scorer = scorers::word_adj(50);
+    selector_t selector = selectors::best_always();
+
+    /* readers always find one of the values which has been written */
+    std::atomic<bool> done(false);
+    std::atomic<size_t> reads(0);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.push_back(std::thread([&]() {
+                    State state(0,0);
+                    word_t word;
+                    while (!done) {
+                        EXPECT_TRUE(backend.get_next(state, selector, scorer, {"x", "a"}, word));
+                        EXPECT_TRUE(word == IBackend::LINE_END ||
+                                word == "b0" || word == "b1" || word == "b2") << word;
+                        EXPECT_TRUE(backend.get_random(state, scorer, word));
+                        ++reads;
+                        std::this_thread::yield();
+                    }
+                }));
+    }
+
+    State state(0,0);
+    for (int i = 0; i < 2000; ++i) {
+        char next[16];
+        snprintf(next, sizeof(next), "b%d", i % 3);
+        char other[16];
+        snprintf(other, sizeof(other), "o%d", i);
+        marky::words_to_counts counts;
+        counts.increment({"a", next});
+        counts.increment({other, "a"});
+        ASSERT_TRUE(backend.update_snippets(state, scorer, counts.map()));
+        if (i % 100 == 0) {
+            ASSERT_TRUE(backend.prune(state, scorer));
+        }
+        INC_STATE(state);
+    }
+    done = true;
+    for (size_t t = 0; t < readers.size(); ++t) {
+        readers[t].join();
+    }
+    EXPECT_LT(0, reads.load());
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest( &argc, argv );
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,241 @@
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+#include <marky/backend-cache.h>
+#include <marky/backend-sqlite-async.h>
+#include <marky/config.h>
+#include <unistd.h> //unlink()
+
+using namespace marky;
+
+#define SQLITE_DB_PATH "sqlite_async_test.db"
+
+class SQLiteAsync : public testing::Test {
+protected:
+    /* called before every test */
+    virtual void SetUp() {
+        clean();
+    }
+
+    /* called after every test */
+    virtual void TearDown() {
+        clean();
+    }
+
+private:
+    void clean() {
+        unlink(SQLITE_DB_PATH);
+        unlink(SQLITE_DB_PATH "-wal");
+        unlink(SQLITE_DB_PATH "-shm");
+    }
+};
+
+static snippet_ptr_set_t to_set(const std::vector<words_t>& windows,
+        const State& state, score_t score = 1) {
+    snippet_ptr_set_t set;
+    for (size_t i = 0; i < windows.size(); ++i) {
+        set.insert(snippet_t(new Snippet(windows[i], state.time, state.count, score)));
+    }
+    return set;
+}
+
+static marky::words_to_counts::map_t to_map(const words_t& words) {
+    marky::words_to_counts::map_t map;
+    map[words] = 1;
+    return map;
+}
+
+static size_t count_snippets(IBackend& backend) {
+    size_t visited = 0;
+    EXPECT_TRUE(backend.visit_snippets([&](const Snippet& /*snippet*/) {
+                ++visited;
+                return true;
+            }));
+    return visited;
+}
+
+#define INC_STATE(state) ++state.time; ++state.count;
+
+TEST_F(SQLiteAsync, cached_get_prev_next) {
+    std::shared_ptr<Backend_SQLiteAsync> async = Backend_SQLiteAsync::create(SQLITE_DB_PATH);
+    ASSERT_TRUE((bool)async);
+    Backend_Cache backend(async);
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+
+    word_t word;
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a", "b"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+
+    marky::words_to_counts counts;
+    counts.increment({"a", "b", "c"});
+    counts.increment({"a", "b", "c"});
+    counts.increment({"a", "b", "d"});
+    counts.increment({"x", "b", "c"});
+    ASSERT_TRUE(backend.update_snippets(state, scorer, counts.map()));
+
+    /* flushed by get_random(), then read back while the write may be pending */
+    EXPECT_TRUE(backend.get_random(state, scorer, word));
+    EXPECT_NE(IBackend::LINE_END, word);
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a", "b"}, word));
+    EXPECT_EQ("c", word);
+    EXPECT_TRUE(backend.get_prev(state, selector, scorer, {"b", "d"}, word));
+    EXPECT_EQ("a", word);
+
+    /* updates on top of pending snippets add to their scores */
+    marky::words_to_counts more_counts;
+    for (int i = 0; i < 3; ++i) {
+        more_counts.increment({"a", "b", "d"});
+    }
+    ASSERT_TRUE(backend.update_snippets(state, scorer, more_counts.map()));
+    ASSERT_TRUE(backend.store_state(state, scorer));
+    EXPECT_TRUE(backend.get_next(state, selector, scorer, {"a", "b"}, word));
+    EXPECT_EQ("d", word);
+
+    ASSERT_TRUE(async->sync());
+    EXPECT_EQ(3, count_snippets(*async));
+}
+
+TEST_F(SQLiteAsync, reads_see_pending) {
+    std::shared_ptr<Backend_SQLiteAsync> backend = Backend_SQLiteAsync::create(SQLITE_DB_PATH);
+    ASSERT_TRUE((bool)backend);
+    scorer_t scorer = scorers::no_adj();
+    State state(0,0);
+
+    ASSERT_TRUE(backend->flush(state, scorer,
+                    to_set({{"a", "b", "c"}, {"a", "b", "d"}, {"x", "b", "c"}}, state)));
+    ASSERT_TRUE(backend->flush(state, scorer, to_set({{"a", "b", "c"}}, state, 5)));
+
+    /* the same results whether or not the flushes have been committed */
+    for (int pass = 0; pass < 2; ++pass) {
+        snippet_ptr_set_t nexts;
+        ASSERT_TRUE(backend->get_nexts({"a", "b"}, nexts));
+        EXPECT_EQ(2, nexts.size());
+        snippet_ptr_set_t prevs;
+        ASSERT_TRUE(backend->get_prevs({"b", "c"}, prevs));
+        EXPECT_EQ(2, prevs.size());
+        for (snippet_ptr_set_t::const_iterator iter = prevs.begin();
+             iter != prevs.end(); ++iter) {
+            if ((*iter)->words == words_t({"a", "b", "c"})) {
+                EXPECT_EQ(5, (*iter)->cur_score());
+            } else {
+                EXPECT_EQ(1, (*iter)->cur_score());
+            }
+        }
+
+        const words_t abc({"a", "b", "c"});
+        ICacheable::words_to_snippet_t snippets;
+        marky::words_to_counts::map_t windows = to_map(abc);
+        windows[{"q", "r"}] = 1;
+        ASSERT_TRUE(backend->get_snippets(windows, snippets));
+        ASSERT_EQ(1, snippets.size());
+        EXPECT_EQ(5, snippets[abc]->cur_score());
+
+        /* callers get their own copies */
+        snippets[abc]->increment(scorer, state, 10);
+
+        ASSERT_TRUE(backend->sync());
+    }
+    EXPECT_EQ(3, count_snippets(*backend));
+}
+
+TEST_F(SQLiteAsync, get_random_pending) {
+    std::shared_ptr<Backend_SQLiteAsync> backend = Backend_SQLiteAsync::create(SQLITE_DB_PATH);
+    ASSERT_TRUE((bool)backend);
+    scorer_t scorer = scorers::no_adj();
+    State state(0,0);
+
+    word_t word;
+    EXPECT_TRUE(backend->get_random(state, scorer, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+
+    ASSERT_TRUE(backend->flush(state, scorer, to_set({{"a", IBackend::LINE_END}}, state)));
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_TRUE(backend->get_random(state, scorer, word));
+        EXPECT_EQ("a", word);
+    }
+}
+
+TEST_F(SQLiteAsync, reopen) {
+    {
+        std::shared_ptr<Backend_SQLiteAsync> backend =
+            Backend_SQLiteAsync::create(SQLITE_DB_PATH, 1);
+        ASSERT_TRUE((bool)backend);
+        scorer_t scorer = scorers::no_adj();
+        State state(12,34);
+        /* with a queue of one, each flush waits for the one before it */
+        for (int i = 0; i < 20; ++i) {
+            char word[16];
+            snprintf(word, sizeof(word), "w%d", i);
+            ASSERT_TRUE(backend->flush(state, scorer, to_set({{word, "next"}}, state)));
+        }
+        ASSERT_TRUE(backend->store_state(state, scorer));
+        /* the destructor waits for the queue to drain */
+    }
+
+    EXPECT_FALSE((bool)Backend_SQLiteAsync::create(SQLITE_DB_PATH, 0));
+
+    std::shared_ptr<Backend_SQLiteAsync> backend = Backend_SQLiteAsync::create(SQLITE_DB_PATH);
+    ASSERT_TRUE((bool)backend);
+    State state = backend->create_state();
+    EXPECT_EQ(12, state.time);
+    EXPECT_EQ(34, state.count);
+    EXPECT_EQ(20, count_snippets(*backend));
+    word_t word;
+    EXPECT_TRUE(backend->get_next(state, selectors::best_always(), scorers::no_adj(),
+                    {"w7"}, word));
+    EXPECT_EQ("next", word);
+}
+
+TEST_F(SQLiteAsync, prune_after_flush) {
+    std::shared_ptr<Backend_SQLiteAsync> backend = Backend_SQLiteAsync::create(SQLITE_DB_PATH);
+    ASSERT_TRUE((bool)backend);
+    /* each word loses a point if it's not updated within 2 increments */
+    scorer_t scorer = scorers::word_adj(2);
+    selector_t selector = selectors::best_always();
+
+    State state(0,0);
+    ASSERT_TRUE(backend->flush(state, scorer, to_set({{"a", "b"}, {"c", "d"}}, state)));
+    INC_STATE(state);
+    for (int i = 0; i < 5; ++i) {
+        ASSERT_TRUE(backend->flush(state, scorer, to_set({{"c", "d"}}, state, i + 2)));
+        INC_STATE(state);
+    }
+
+    /* the prune is queued behind the flushes */
+    ASSERT_TRUE(backend->prune(state, scorer));
+    ASSERT_TRUE(backend->sync());
+    snippet_ptr_set_t nexts;
+    ASSERT_TRUE(backend->get_nexts({"a"}, nexts));
+    EXPECT_TRUE(nexts.empty());
+
+    word_t word;
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ("d", word);
+    ASSERT_TRUE(backend->update_snippets(state, scorer, to_map({"e", "f"})));
+    EXPECT_EQ(2, count_snippets(*backend));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest( &argc, argv );
+    return RUN_ALL_TESTS();
+}
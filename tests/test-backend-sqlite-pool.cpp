@@ -0,0 +1,283 @@
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+#include <marky/backend-sqlite-pool.h>
+#include <marky/config.h>
+#include <sqlite3.h>
+#include <atomic>
+#include <thread>
+#include <unistd.h> //unlink()
+
+using namespace marky;
+
+#define SQLITE_DB_PATH "sqlite_pool_test.db"
+#define SQLITE_SNAPSHOT_PATH "sqlite_pool_test_snapshot.db"
+
+class SQLitePool : public testing::Test {
+protected:
+    /* called before every test */
+    virtual void SetUp() {
+        clean();
+    }
+
+    /* called after every test */
+    virtual void TearDown() {
+        clean();
+    }
+
+private:
+    void clean() {
+        unlink(SQLITE_DB_PATH);
+        unlink(SQLITE_DB_PATH "-wal");
+        unlink(SQLITE_DB_PATH "-shm");
+        unlink(SQLITE_SNAPSHOT_PATH);
+    }
+};
+
+static marky::words_to_counts::map_t to_map(const words_t& words) {
+    marky::words_to_counts::map_t map;
+    map[words] = 1;
+    return map;
+}
+
+#define INC_STATE(state) ++state.time; ++state.count;
+
+TEST_F(SQLitePool, get_prev_next) {
+    backend_t backend = Backend_SQLitePool::create(SQLITE_DB_PATH, 2);
+    ASSERT_TRUE((bool)backend);
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+
+    word_t word;
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"a", "b"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    EXPECT_TRUE(backend->get_random(state, scorer, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+
+    /* updates are visible to the readers once they've been committed */
+    marky::words_to_counts counts;
+    counts.increment({"a", "b", "c"});
+    counts.increment({"a", "b", "c"});
+    counts.increment({"a", "b", "d"});
+    counts.increment({"x", "b", "c"});
+    ASSERT_TRUE(backend->update_snippets(state, scorer, counts.map()));
+
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"a", "b"}, word));
+    EXPECT_EQ("c", word);
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"b", "d"}, word));
+    EXPECT_EQ("a", word);
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"b", "c", "z"}, word));
+    EXPECT_EQ("a", word);
+    EXPECT_TRUE(backend->get_random(state, scorer, word));
+    EXPECT_NE(IBackend::LINE_END, word);
+
+    size_t visited = 0;
+    EXPECT_TRUE(backend->visit_snippets([&](const Snippet& /*snippet*/) {
+                ++visited;
+                return true;
+            }));
+    EXPECT_EQ(3, visited);
+}
+
+TEST_F(SQLitePool, wal_and_reopen) {
+    {
+        backend_t backend = Backend_SQLitePool::create(SQLITE_DB_PATH, 1);
+        ASSERT_TRUE((bool)backend);
+        scorer_t scorer = scorers::no_adj();
+        State state(12,34);
+        ASSERT_TRUE(backend->update_snippets(state, scorer, to_map({"a", "b"})));
+        ASSERT_TRUE(backend->store_state(state, scorer));
+    }
+
+    sqlite3* db = NULL;
+    ASSERT_EQ(SQLITE_OK, sqlite3_open(SQLITE_DB_PATH, &db));
+    sqlite3_stmt* stmt = NULL;
+    ASSERT_EQ(SQLITE_OK, sqlite3_prepare_v2(db, "PRAGMA journal_mode", -1, &stmt, NULL));
+    ASSERT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+    EXPECT_STREQ("wal", (const char*)sqlite3_column_text(stmt, 0));
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+    EXPECT_FALSE((bool)Backend_SQLitePool::create(SQLITE_DB_PATH, 0));
+
+    backend_t backend = Backend_SQLitePool::create(SQLITE_DB_PATH, 1);
+    ASSERT_TRUE((bool)backend);
+    State state = backend->create_state();
+    EXPECT_EQ(12, state.time);
+    EXPECT_EQ(34, state.count);
+    word_t word;
+    EXPECT_TRUE(backend->get_next(state, selectors::best_always(), scorers::no_adj(),
+                    {"a"}, word));
+    EXPECT_EQ("b", word);
+}
+
+TEST_F(SQLitePool, failed_update_rolls_back) {
+    backend_t backend = Backend_SQLitePool::create(SQLITE_DB_PATH, 1);
+    ASSERT_TRUE((bool)backend);
+    scorer_t scorer = scorers::no_adj();
+    State state(0,0);
+    ASSERT_TRUE(backend->update_snippets(state, scorer, to_map({"a", "b"})));
+
+    /* make any update of an existing snippet fail */
+    sqlite3* db = NULL;
+    ASSERT_EQ(SQLITE_OK, sqlite3_open(SQLITE_DB_PATH, &db));
+    ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "CREATE TRIGGER fail_update BEFORE UPDATE "
+                    "ON marky_snippet BEGIN SELECT RAISE(ABORT, 'failed'); END",
+                    NULL, NULL, NULL));
+    sqlite3_close(db);
+
+    /* the line's new window doesn't go in without the updated one */
+    marky::words_to_counts counts;
+    counts.increment({"a", "b"});
+    counts.increment({"a", "c"});
+    EXPECT_FALSE(backend->update_snippets(state, scorer, counts.map()));
+    size_t visited = 0;
+    EXPECT_TRUE(backend->visit_snippets([&](const Snippet& snippet) {
+                EXPECT_EQ(words_t({"a", "b"}), snippet.words);
+                ++visited;
+                return true;
+            }));
+    EXPECT_EQ(1, visited);
+}
+
+TEST_F(SQLitePool, prune_seen_by_readers) {
+    backend_t backend = Backend_SQLitePool::create(SQLITE_DB_PATH, 1);
+    ASSERT_TRUE((bool)backend);
+    /* each word loses a point if it's not updated within 2 increments */
+    scorer_t scorer = scorers::word_adj(2);
+    selector_t selector = selectors::best_always();
+
+    State state(0,0);
+    word_t word;
+    ASSERT_TRUE(backend->update_snippets(state, scorer, to_map({"c", "d"})));
+    ASSERT_TRUE(backend->update_snippets(state, scorer, to_map({"a", "b"})));
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ("b", word);
+    INC_STATE(state);
+    for (int i = 0; i < 5; ++i) {
+        ASSERT_TRUE(backend->update_snippets(state, scorer, to_map({"c", "d"})));
+        INC_STATE(state);
+    }
+
+    /* the reader has seen the "a" context, which is removed and its id reused */
+    ASSERT_TRUE(backend->prune(state, scorer));
+    ASSERT_TRUE(backend->update_snippets(state, scorer, to_map({"e", "f"})));
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"e"}, word));
+    EXPECT_EQ("f", word);
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ("d", word);
+}
+
+TEST_F(SQLitePool, concurrent_read_write) {
+    backend_t backend = Backend_SQLitePool::create(SQLITE_DB_PATH, 2);
+    ASSERT_TRUE((bool)backend);
+    scorer_t scorer = scorers::word_adj(50);
+    selector_t selector = selectors::best_always();
+
+    /* readers always find one of the values which has been written, and
+     * never see the two windows of an update apart from each other */
+    std::atomic<bool> done(false);
+    std::atomic<size_t> reads(0);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.push_back(std::thread([&]() {
+                    State state(0,0);
+                    word_t next, prev;
+                    while (!done) {
+                        EXPECT_TRUE(backend->get_next(state, selector, scorer, {"x", "a"}, next));
+                        EXPECT_TRUE(next == IBackend::LINE_END ||
+                                next == "b0" || next == "b1" || next == "b2") << next;
+                        EXPECT_TRUE(backend->get_random(state, scorer, next));
+                        ++reads;
+                        std::this_thread::yield();
+                    }
+                }));
+    }
+
+    State state(0,0);
+    for (int i = 0; i < 300; ++i) {
+        char next[16];
+        snprintf(next, sizeof(next), "b%d", i % 3);
+        char other[16];
+        snprintf(other, sizeof(other), "o%d", i);
+        marky::words_to_counts counts;
+        counts.increment({"a", next});
+        counts.increment({other, "a"});
+        ASSERT_TRUE(backend->update_snippets(state, scorer, counts.map()));
+        if (i % 50 == 0) {
+            ASSERT_TRUE(backend->prune(state, scorer));
+        }
+        INC_STATE(state);
+    }
+    done = true;
+    for (size_t t = 0; t < readers.size(); ++t) {
+        readers[t].join();
+    }
+    EXPECT_LT(0, reads.load());
+}
+
+TEST_F(SQLitePool, snapshot_while_writing) {
+    std::shared_ptr<Backend_SQLitePool> backend(std::dynamic_pointer_cast<Backend_SQLitePool>(
+                    Backend_SQLitePool::create(SQLITE_DB_PATH, 2)));
+    ASSERT_TRUE((bool)backend);
+    scorer_t scorer = scorers::no_adj();
+
+    /* each snapshot holds a whole number of updates, and never fewer than
+     * the one before it */
+    std::atomic<bool> done(false);
+    std::thread writer([&]() {
+                State state(0,0);
+                for (int i = 0; i < 200; ++i) {
+                    char word[16];
+                    snprintf(word, sizeof(word), "w%d", i);
+                    marky::words_to_counts counts;
+                    counts.increment({word, "a"});
+                    counts.increment({word, "b"});
+                    EXPECT_TRUE(backend->update_snippets(state, scorer, counts.map()));
+                    INC_STATE(state);
+                }
+                done = true;
+            });
+
+    size_t last_count = 0;
+    for (bool last = false; !last; ) {
+        last = done;
+        ASSERT_TRUE(backend->snapshot(SQLITE_SNAPSHOT_PATH));
+        backend_t copy = Backend_SQLite::create_backend(SQLITE_SNAPSHOT_PATH);
+        ASSERT_TRUE((bool)copy);
+        size_t count = 0;
+        EXPECT_TRUE(copy->visit_snippets([&](const Snippet& /*snippet*/) {
+                    ++count;
+                    return true;
+                }));
+        EXPECT_EQ(0, count % 2);
+        EXPECT_LE(last_count, count);
+        last_count = count;
+    }
+    writer.join();
+    EXPECT_EQ(400, last_count);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest( &argc, argv );
+    return RUN_ALL_TESTS();
+}
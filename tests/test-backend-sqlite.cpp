@@ -18,27 +18,50 @@
 
 #include <gtest/gtest.h>
 #include <marky/backend-cache.h>
+#include <marky/backend-map.h>
 #include <marky/backend-sqlite.h>
 #include <marky/config.h>
+#include <marky/string-pack.h>
+#include <sqlite3.h>
+#include <map>
 #include <unistd.h> //unlink()
 
 using namespace marky;
 
 #define SQLITE_DB_PATH "sqlite_test.db"
+#define SQLITE_SNAPSHOT_PATH "sqlite_test_snapshot.db"
 
 class SQLite : public testing::Test {
 protected:
     /* called before every test */
     virtual void SetUp() {
         unlink(SQLITE_DB_PATH);
+        unlink(SQLITE_SNAPSHOT_PATH);
     }
 
     /* called after every test */
     virtual void TearDown() {
         unlink(SQLITE_DB_PATH);
+        unlink(SQLITE_SNAPSHOT_PATH);
     }
 };
 
+static Backend_SQLite::options_t weighted_random() {
+    Backend_SQLite::options_t options;
+    options.weighted_random = true;
+    return options;
+}
+static Backend_SQLite::options_t bulk_load() {
+    Backend_SQLite::options_t options;
+    options.bulk_load = true;
+    return options;
+}
+static Backend_SQLite::options_t adjacency_lists() {
+    Backend_SQLite::options_t options;
+    options.adjacency_lists = true;
+    return options;
+}
+
 static void init_data_1(const State& state, IBackend& backend, const scorer_t& scorer) {
     marky::words_to_counts counts;
     counts.increment({"a", "b"});
@@ -305,6 +328,73 @@ TEST_F(SQLite, get_random_cached) {
     test_get_random(cache);
 }
 
+TEST_F(SQLite, get_random_uniform) {
+    backend_t backend = Backend_SQLite::create_backend(SQLITE_DB_PATH);
+    ASSERT_TRUE((bool)backend);
+    scorer_t scorer = scorers::no_adj();
+    State state(0,0);
+
+    marky::words_to_counts::map_t map;
+    map[{"a", "b"}] = 1;
+    map[{"c", "d"}] = 9;
+    ASSERT_TRUE(backend->update_snippets(state, scorer, map));
+
+    /* scores are ignored */
+    size_t b = 0, d = 0;
+    for (int i = 0; i < 1000; ++i) {
+        word_t word;
+        EXPECT_TRUE(backend->get_random(state, scorer, word));
+        if (word == "b") {
+            ++b;
+        } else if (word == "d") {
+            ++d;
+        }
+    }
+    EXPECT_EQ(1000, b + d);
+    EXPECT_LT(350, b);
+    EXPECT_LT(350, d);
+}
+
+TEST_F(SQLite, get_random_weighted) {
+    backend_t backend = Backend_SQLite::create_backend(SQLITE_DB_PATH, weighted_random());
+    ASSERT_TRUE((bool)backend);
+    scorer_t scorer = scorers::no_adj();
+    State state(0,0);
+
+    marky::words_to_counts::map_t map;
+    map[{"a", "b"}] = 1;
+    map[{"c", "d"}] = 9;
+    ASSERT_TRUE(backend->update_snippets(state, scorer, map));
+
+    size_t b = 0, d = 0;
+    for (int i = 0; i < 1000; ++i) {
+        word_t word;
+        EXPECT_TRUE(backend->get_random(state, scorer, word));
+        if (word == "b") {
+            ++b;
+        } else if (word == "d") {
+            ++d;
+        }
+    }
+    EXPECT_EQ(1000, b + d);
+    EXPECT_GT(200, b);
+    EXPECT_LT(800, d);
+
+    /* the highest score is kept across reopening */
+    backend->store_state(state, scorer);
+    backend = Backend_SQLite::create_backend(SQLITE_DB_PATH, weighted_random());
+    ASSERT_TRUE((bool)backend);
+    b = 0;
+    for (int i = 0; i < 1000; ++i) {
+        word_t word;
+        EXPECT_TRUE(backend->get_random(state, scorer, word));
+        if (word == "b") {
+            ++b;
+        }
+    }
+    EXPECT_GT(200, b);
+}
+
 #define INC_STATE(STATE) DEBUG("INC %lu", state.count); ++state.time; ++state.count;
 
 static void test_scoreadj_prune(backend_t backend) {
@@ -664,6 +754,768 @@ TEST_F(SQLite, get_snippets) {
     EXPECT_EQ("a", iter->second->words.back());
 }
 
+TEST_F(SQLite, get_snippets_sizes) {
+    cacheable_t backend = Backend_SQLite::create_cacheable(SQLITE_DB_PATH);
+    ASSERT_TRUE((bool)backend);
+    scorer_t scorer = scorers::no_adj();
+    State state(0,0);
+
+    /* store every other window, then look up batches of each size */
+    const int COUNT = 1000;
+    marky::words_to_counts::map_t all;
+    marky::words_to_counts::map_t stored;
+    for (int i = 0; i < COUNT; ++i) {
+        char word[16];
+        snprintf(word, sizeof(word), "w%d", i);
+        all[{"a", word}] = 1;
+        if (i % 2 == 0) {
+            stored[{"a", word}] = 1;
+        }
+    }
+    ASSERT_TRUE(backend->update_snippets(state, scorer, stored));
+
+    const size_t sizes[] = {1, 2, 3, 5, 100, 256, 257, 600, COUNT};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        marky::words_to_counts::map_t windows;
+        size_t expected = 0;
+        for (marky::words_to_counts::map_t::const_iterator iter = all.begin();
+             windows.size() < sizes[i]; ++iter) {
+            windows.insert(*iter);
+            expected += stored.count(iter->first);
+        }
+        ICacheable::words_to_snippet_t snippets;
+        EXPECT_TRUE(backend->get_snippets(windows, snippets));
+        EXPECT_EQ(expected, snippets.size()) << sizes[i];
+        for (ICacheable::words_to_snippet_t::const_iterator iter = snippets.begin();
+             iter != snippets.end(); ++iter) {
+            EXPECT_EQ(1, stored.count(iter->first));
+            EXPECT_EQ(iter->first, iter->second->words);
+        }
+    }
+}
+
+static void exec_sql(sqlite3* db, const std::string& cmd) {
+    char* err = NULL;
+    EXPECT_EQ(SQLITE_OK, sqlite3_exec(db, cmd.c_str(), NULL, NULL, &err)) << cmd << ": " << err;
+    sqlite3_free(err);
+}
+
+static std::string packed(const words_t& words) {
+    std::ostringstream oss;
+    pack(words, oss);
+    return oss.str();
+}
+
+static void insert_v1(sqlite3* db, int id, const words_t& words, int score) {
+    words_t prefix(words), suffix(words);
+    prefix.pop_back();
+    suffix.pop_front();
+    std::ostringstream oss;
+    oss << "INSERT INTO marky_snippet VALUES (" << id << ", '" << packed(words) << "', "
+        << score << ", 10, 20);"
+        << "INSERT INTO marky_nexts VALUES (" << id << ", '" << packed(prefix) << "');"
+        << "INSERT INTO marky_prevs VALUES (" << id << ", '" << packed(suffix) << "');";
+    exec_sql(db, oss.str());
+}
+
+TEST_F(SQLite, migrate_v1) {
+    /* a db in the original layout, with pack()ed words */
+    sqlite3* db = NULL;
+    ASSERT_EQ(SQLITE_OK, sqlite3_open(SQLITE_DB_PATH, &db));
+    exec_sql(db,
+            "CREATE TABLE marky_state (key TEXT NOT NULL PRIMARY KEY ON CONFLICT REPLACE, "
+            "value INTEGER NOT NULL);"
+            "CREATE TABLE marky_snippet (snippet_id INTEGER NOT NULL PRIMARY KEY ON CONFLICT REPLACE, "
+            "words TEXT NOT NULL UNIQUE, score INTEGER NOT NULL, time INTEGER NOT NULL, "
+            "count INTEGER NOT NULL);"
+            "CREATE UNIQUE INDEX marky_snippet_words_index ON marky_snippet (words);"
+            "CREATE TABLE marky_prevs (snippet_id INTEGER NOT NULL PRIMARY KEY ON CONFLICT REPLACE, "
+            "search TEXT NOT NULL, FOREIGN KEY (snippet_id) REFERENCES marky_snippet(snippet_id) "
+            "ON DELETE CASCADE);"
+            "CREATE INDEX marky_prevs_search_index ON marky_prevs (search);"
+            "CREATE TABLE marky_nexts (snippet_id INTEGER NOT NULL PRIMARY KEY ON CONFLICT REPLACE, "
+            "search TEXT NOT NULL, FOREIGN KEY (snippet_id) REFERENCES marky_snippet(snippet_id) "
+            "ON DELETE CASCADE);"
+            "CREATE INDEX marky_nexts_search_index ON marky_nexts (search);"
+            "INSERT INTO marky_state VALUES ('time', 12);"
+            "INSERT INTO marky_state VALUES ('count', 34);");
+    insert_v1(db, 1, {IBackend::LINE_START, "a", "b,c"}, 3);
+    insert_v1(db, 2, {"a", "b,c", IBackend::LINE_END}, 3);
+    insert_v1(db, 3, {"a", "d", IBackend::LINE_END}, 1);
+    sqlite3_close(db);
+
+    {
+        backend_t backend = Backend_SQLite::create_backend(SQLITE_DB_PATH);
+        ASSERT_TRUE((bool)backend);
+        scorer_t scorer = scorers::no_adj();
+        selector_t selector = selectors::best_always();
+        State state = backend->create_state();
+        EXPECT_EQ(12, state.time);
+        EXPECT_EQ(34, state.count);
+
+        word_t word;
+        EXPECT_TRUE(backend->get_next(state, selector, scorer, {IBackend::LINE_START, "a"}, word));
+        EXPECT_EQ("b,c", word);
+        EXPECT_TRUE(backend->get_next(state, selector, scorer, {"a", "b,c"}, word));
+        EXPECT_EQ(IBackend::LINE_END, word);
+        EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"d", IBackend::LINE_END}, word));
+        EXPECT_EQ("a", word);
+
+        std::map<words_t, score_t> scores;
+        EXPECT_TRUE(backend->visit_snippets([&](const Snippet& snippet) {
+                    scores[snippet.words] = snippet.cur_score();
+                    EXPECT_EQ(10, snippet.cur_state().time);
+                    EXPECT_EQ(20, snippet.cur_state().count);
+                    return true;
+                }));
+        EXPECT_EQ(3, scores.size());
+        EXPECT_EQ(3, scores[words_t({IBackend::LINE_START, "a", "b,c"})]);
+        EXPECT_EQ(1, scores[words_t({"a", "d", IBackend::LINE_END})]);
+    }
+
+    /* the old tables are gone, and reopening doesn't migrate again */
+    ASSERT_EQ(SQLITE_OK, sqlite3_open(SQLITE_DB_PATH, &db));
+    sqlite3_stmt* stmt = NULL;
+    ASSERT_EQ(SQLITE_OK, sqlite3_prepare_v2(db,
+                    "SELECT COUNT(*) FROM sqlite_master WHERE name IN "
+                    "('marky_snippet_v1', 'marky_prevs', 'marky_nexts')", -1, &stmt, NULL));
+    ASSERT_EQ(SQLITE_ROW, sqlite3_step(stmt));
+    EXPECT_EQ(0, sqlite3_column_int(stmt, 0));
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+    backend_t backend = Backend_SQLite::create_backend(SQLITE_DB_PATH);
+    ASSERT_TRUE((bool)backend);
+    size_t visited = 0;
+    EXPECT_TRUE(backend->visit_snippets([&](const Snippet& /*snippet*/) {
+                ++visited;
+                return true;
+            }));
+    EXPECT_EQ(3, visited);
+}
+
+static int64_t query_int64(const std::string& query) {
+    sqlite3* db = NULL;
+    EXPECT_EQ(SQLITE_OK, sqlite3_open(SQLITE_DB_PATH, &db));
+    sqlite3_stmt* stmt = NULL;
+    int64_t val = -1;
+    EXPECT_EQ(SQLITE_OK, sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, NULL));
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        val = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return val;
+}
+
+TEST_F(SQLite, flush_updates_in_place) {
+    scorer_t scorer = scorers::no_adj();
+    State state(0,0);
+    {
+        cacheable_t backend = Backend_SQLite::create_cacheable(SQLITE_DB_PATH);
+        ASSERT_TRUE((bool)backend);
+        snippet_ptr_set_t snippets;
+        snippets.insert(snippet_t(new Snippet({"a", "b"}, 1, 2, 3)));
+        snippets.insert(snippet_t(new Snippet({"b", "c"}, 1, 2, 1)));
+        ASSERT_TRUE(backend->flush(state, scorer, snippets));
+    }
+    const int64_t id = query_int64(
+            "SELECT snippet_id FROM marky_snippet WHERE score=3");
+    EXPECT_LT(0, id);
+
+    /* updating an existing snippet keeps its row, new snippets get new rows */
+    {
+        cacheable_t backend = Backend_SQLite::create_cacheable(SQLITE_DB_PATH);
+        ASSERT_TRUE((bool)backend);
+        snippet_ptr_set_t snippets;
+        snippets.insert(snippet_t(new Snippet({"a", "b"}, 5, 6, 7)));
+        snippets.insert(snippet_t(new Snippet({"c", "d"}, 5, 6, 1)));
+        ASSERT_TRUE(backend->flush(state, scorer, snippets));
+    }
+    EXPECT_EQ(id, query_int64("SELECT snippet_id FROM marky_snippet WHERE score=7"));
+    EXPECT_EQ(5, query_int64("SELECT time FROM marky_snippet WHERE snippet_id=" +
+                    std::to_string(id)));
+    EXPECT_EQ(6, query_int64("SELECT count FROM marky_snippet WHERE snippet_id=" +
+                    std::to_string(id)));
+    EXPECT_EQ(3, query_int64("SELECT COUNT(*) FROM marky_snippet"));
+
+    backend_t backend = Backend_SQLite::create_backend(SQLITE_DB_PATH);
+    ASSERT_TRUE((bool)backend);
+    selector_t selector = selectors::best_always();
+    word_t word;
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"b"}, word));
+    EXPECT_EQ("a", word);
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ("d", word);
+}
+
+TEST_F(SQLite, bulk_load) {
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+    {
+        cacheable_t backend = Backend_SQLite::create_cacheable(SQLITE_DB_PATH, bulk_load());
+        ASSERT_TRUE((bool)backend);
+        /* nothing's stored yet */
+        ICacheable::words_to_snippet_t found;
+        EXPECT_TRUE(backend->get_snippets(to_map({"a", "b"}), found));
+        EXPECT_TRUE(found.empty());
+
+        /* a repeated snippet is only stored once */
+        snippet_ptr_set_t snippets;
+        for (int i = 0; i < 1000; ++i) {
+            char word[16];
+            snprintf(word, sizeof(word), "w%d", i);
+            snippets.insert(snippet_t(new Snippet({"a", word}, 1, 2, 1 + (i % 7))));
+        }
+        snippets.insert(snippet_t(new Snippet({"a", "w6"}, 1, 2, 7)));
+        snippets.insert(snippet_t(new Snippet({"b", "c"}, 1, 2, 3)));
+        ASSERT_TRUE(backend->flush(state, scorer, snippets));
+
+        word_t word;
+        EXPECT_TRUE(backend->get_next(state, selector, scorer, {"b"}, word));
+        EXPECT_EQ("c", word);
+        EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"w10"}, word));
+        EXPECT_EQ("a", word);
+        EXPECT_TRUE(backend->get_snippets(to_map({"a", "w6"}), found));
+        ASSERT_EQ(1, found.size());
+        EXPECT_EQ(7, found.begin()->second->cur_score());
+
+        /* later flushes update in place, as usual */
+        snippets.clear();
+        snippets.insert(snippet_t(new Snippet({"b", "c"}, 3, 4, 5)));
+        snippets.insert(snippet_t(new Snippet({"b", "d"}, 3, 4, 1)));
+        ASSERT_TRUE(backend->flush(state, scorer, snippets));
+        size_t visited = 0;
+        EXPECT_TRUE(backend->visit_snippets([&](const Snippet& /*snippet*/) {
+                    ++visited;
+                    return true;
+                }));
+        EXPECT_EQ(1002, visited);
+    }
+
+    /* the indexes were built, and the stats for them gathered */
+    EXPECT_EQ(2, query_int64("SELECT COUNT(*) FROM sqlite_master WHERE type='index' "
+                    "AND name IN ('marky_random_index', 'marky_prevs_index')"));
+    EXPECT_LT(0, query_int64("SELECT COUNT(*) FROM sqlite_stat1"));
+
+    /* a db with data isn't bulk loaded */
+    cacheable_t backend = Backend_SQLite::create_cacheable(SQLITE_DB_PATH, bulk_load());
+    ASSERT_TRUE((bool)backend);
+    ICacheable::words_to_snippet_t found;
+    EXPECT_TRUE(backend->get_snippets(to_map({"b", "c"}), found));
+    ASSERT_EQ(1, found.size());
+    EXPECT_EQ(5, found.begin()->second->cur_score());
+}
+
+static Backend_SQLite::options_t bulk_load_lists() {
+    Backend_SQLite::options_t options = bulk_load();
+    options.adjacency_lists = true;
+    return options;
+}
+
+TEST_F(SQLite, bulk_load_flushes) {
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+    cacheable_t backend = Backend_SQLite::create_cacheable(SQLITE_DB_PATH, bulk_load_lists());
+    ASSERT_TRUE((bool)backend);
+
+    snippet_ptr_set_t snippets;
+    snippets.insert(snippet_t(new Snippet({"a", "b"}, 1, 2, 3)));
+    snippets.insert(snippet_t(new Snippet({"x", "y"}, 1, 2, 0)));
+    ASSERT_TRUE(backend->flush(state, scorer, snippets));
+    /* the zero-scored snippet goes, its contexts stay until the end */
+    ASSERT_TRUE(backend->prune(state, scorer));
+    EXPECT_EQ(4, query_int64("SELECT COUNT(*) FROM marky_context"));
+
+    /* later flushes find what's already stored, still without the index */
+    ICacheable::words_to_snippet_t found;
+    EXPECT_TRUE(backend->get_snippets(to_map({"a", "b"}), found));
+    ASSERT_EQ(1, found.size());
+    snippets.clear();
+    snippets.insert(snippet_t(new Snippet({"a", "b"}, 3, 4, 5)));
+    snippets.insert(snippet_t(new Snippet({"b", "c"}, 3, 4, 1)));
+    ASSERT_TRUE(backend->flush(state, scorer, snippets));
+    EXPECT_EQ(0, query_int64("SELECT COUNT(*) FROM sqlite_master WHERE "
+                    "name IN ('marky_prevs_index', 'sqlite_stat1')"));
+    EXPECT_EQ(0, query_int64("SELECT COUNT(*) FROM marky_prevs_list"));
+
+    /* the end of the import builds everything once */
+    ASSERT_TRUE(backend->store_state(state, scorer));
+    EXPECT_EQ(2, query_int64("SELECT COUNT(*) FROM sqlite_master WHERE "
+                    "name IN ('marky_prevs_index', 'sqlite_stat1')"));
+    EXPECT_EQ(3, query_int64("SELECT COUNT(*) FROM marky_context"));
+    EXPECT_EQ(2, query_int64("SELECT COUNT(*) FROM marky_prevs_list"));
+    EXPECT_EQ(5, query_int64("SELECT score FROM marky_snippet WHERE score > 1"));
+
+    word_t word;
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ("b", word);
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"a"}, word));
+    EXPECT_EQ("b", word);
+}
+
+/* the db header's count of committed write transactions */
+static int64_t file_change_counter() {
+    unsigned char header[28];
+    FILE* file = fopen(SQLITE_DB_PATH, "rb");
+    EXPECT_TRUE(file != NULL);
+    if (file == NULL) {
+        return -1;
+    }
+    EXPECT_EQ(1, fread(header, sizeof(header), 1, file));
+    fclose(file);
+    return ((int64_t)header[24] << 24) | (header[25] << 16) | (header[26] << 8) | header[27];
+}
+
+TEST_F(SQLite, bulk_load_merge) {
+    scorer_t scorer = scorers::no_adj();
+    State state(0,0);
+    /* more snippets than one lookup batch */
+    Backend_Map map;
+    marky::words_to_counts counts;
+    for (int i = 0; i < 1200; ++i) {
+        char word[16];
+        snprintf(word, sizeof(word), "w%d", i);
+        counts.increment({word, "a"});
+    }
+    ASSERT_TRUE(map.update_snippets(state, scorer, counts.map()));
+
+    cacheable_t backend = Backend_SQLite::create_cacheable(SQLITE_DB_PATH, bulk_load());
+    ASSERT_TRUE((bool)backend);
+    const int64_t changes = file_change_counter();
+    ASSERT_TRUE(map.merge_into(*backend, state, scorer));
+    /* written in one transaction */
+    EXPECT_EQ(changes + 1, file_change_counter());
+    ASSERT_TRUE(backend->prune(state, scorer));
+    EXPECT_EQ(1200, query_int64("SELECT COUNT(*) FROM marky_snippet"));
+    /* and the index is built once, at the end */
+    EXPECT_EQ(0, query_int64("SELECT COUNT(*) FROM sqlite_master WHERE "
+                    "name IN ('marky_prevs_index', 'sqlite_stat1')"));
+    ASSERT_TRUE(backend->store_state(state, scorer));
+    EXPECT_EQ(2, query_int64("SELECT COUNT(*) FROM sqlite_master WHERE "
+                    "name IN ('marky_prevs_index', 'sqlite_stat1')"));
+
+    /* merging into a db with data sums the scores of what's already there */
+    ASSERT_TRUE(map.merge_into(*backend, state, scorer));
+    ICacheable::words_to_snippet_t found;
+    EXPECT_TRUE(backend->get_snippets(to_map({"w1000", "a"}), found));
+    ASSERT_EQ(1, found.size());
+    EXPECT_EQ(2, found.begin()->second->cur_score());
+    EXPECT_EQ(1200, query_int64("SELECT COUNT(*) FROM marky_snippet"));
+}
+
+TEST_F(SQLite, get_prev_lists) {
+    cacheable_t backend = Backend_SQLite::create_cacheable(SQLITE_DB_PATH, adjacency_lists());
+    test_get_prev(backend, false);
+}
+TEST_F(SQLite, get_next_lists) {
+    cacheable_t backend = Backend_SQLite::create_cacheable(SQLITE_DB_PATH, adjacency_lists());
+    test_get_next(backend, true);
+}
+TEST_F(SQLite, scoreadj_prune_lists_direct) {
+    backend_t backend = Backend_SQLite::create_backend(SQLITE_DB_PATH, adjacency_lists());
+    test_scoreadj_prune(backend);
+}
+TEST_F(SQLite, scoreadj_prune_lists_cached) {
+    cacheable_t backend = Backend_SQLite::create_cacheable(SQLITE_DB_PATH, adjacency_lists());
+    ASSERT_TRUE((bool)backend);
+    backend_t cache(new Backend_Cache(backend));
+    test_scoreadj_prune(cache);
+}
+
+TEST_F(SQLite, lists_existing_db) {
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+    {
+        backend_t backend = Backend_SQLite::create_backend(SQLITE_DB_PATH);
+        ASSERT_TRUE((bool)backend);
+        init_data_1(state, *backend, scorer);
+    }
+    EXPECT_EQ(0, query_int64("SELECT COUNT(*) FROM sqlite_master "
+                    "WHERE name IN ('marky_nexts_list', 'marky_prevs_list')"));
+
+    /* the lists are built for the existing data */
+    {
+        backend_t backend = Backend_SQLite::create_backend(SQLITE_DB_PATH, adjacency_lists());
+        ASSERT_TRUE((bool)backend);
+    }
+    EXPECT_EQ(query_int64("SELECT COUNT(DISTINCT prefix_id) FROM marky_snippet"),
+            query_int64("SELECT COUNT(*) FROM marky_nexts_list"));
+    EXPECT_EQ(query_int64("SELECT COUNT(DISTINCT suffix_id) FROM marky_snippet"),
+            query_int64("SELECT COUNT(*) FROM marky_prevs_list"));
+
+    /* and are kept up to date and used from then on, without asking */
+    backend_t backend = Backend_SQLite::create_backend(SQLITE_DB_PATH);
+    ASSERT_TRUE((bool)backend);
+    marky::words_to_counts counts;
+    for (int i = 0; i < 5; ++i) {
+        counts.increment({"a", "b", "x"});
+    }
+    ASSERT_TRUE(backend->update_snippets(state, scorer, counts.map()));
+    word_t word;
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"a", "b"}, word));
+    EXPECT_EQ("x", word);
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"b", "x"}, word));
+    EXPECT_EQ("a", word);
+    EXPECT_EQ(query_int64("SELECT COUNT(DISTINCT prefix_id) FROM marky_snippet"),
+            query_int64("SELECT COUNT(*) FROM marky_nexts_list"));
+}
+
+TEST_F(SQLite, migrate_v2) {
+    /* a db with a rowid snippets table and separate nexts/prevs indexes */
+    sqlite3* db = NULL;
+    ASSERT_EQ(SQLITE_OK, sqlite3_open(SQLITE_DB_PATH, &db));
+    exec_sql(db,
+            "CREATE TABLE marky_state (key TEXT NOT NULL PRIMARY KEY ON CONFLICT REPLACE, "
+            "value INTEGER NOT NULL);"
+            "CREATE TABLE marky_words (word_id INTEGER NOT NULL PRIMARY KEY, "
+            "word TEXT NOT NULL UNIQUE);"
+            "CREATE TABLE marky_context (context_id INTEGER NOT NULL PRIMARY KEY, "
+            "words BLOB NOT NULL UNIQUE);"
+            "CREATE TABLE marky_snippet (snippet_id INTEGER NOT NULL PRIMARY KEY, "
+            "prefix_id INTEGER NOT NULL, next_word INTEGER NOT NULL, "
+            "suffix_id INTEGER NOT NULL, prev_word INTEGER NOT NULL, "
+            "score INTEGER NOT NULL, time INTEGER NOT NULL, count INTEGER NOT NULL);"
+            "CREATE UNIQUE INDEX marky_nexts_index ON marky_snippet (prefix_id, next_word);"
+            "CREATE INDEX marky_prevs_index ON marky_snippet (suffix_id, prev_word);"
+            "INSERT INTO marky_state VALUES ('time', 12);"
+            "INSERT INTO marky_state VALUES ('count', 34);"
+            "INSERT INTO marky_words VALUES (1, 'a'), (2, 'b'), (3, 'c');"
+            "INSERT INTO marky_context VALUES (1, x'01'), (2, x'02'), (3, x'03');"
+            /* a-b, b-c, a-c */
+            "INSERT INTO marky_snippet VALUES (5, 1, 2, 2, 1, 3, 10, 20);"
+            "INSERT INTO marky_snippet VALUES (7, 2, 3, 3, 2, 1, 10, 20);"
+            "INSERT INTO marky_snippet VALUES (9, 1, 3, 3, 1, 2, 10, 20);"
+            "PRAGMA user_version = 2");
+    sqlite3_close(db);
+
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    {
+        backend_t backend = Backend_SQLite::create_backend(SQLITE_DB_PATH);
+        ASSERT_TRUE((bool)backend);
+        State state = backend->create_state();
+        EXPECT_EQ(12, state.time);
+        EXPECT_EQ(34, state.count);
+
+        word_t word;
+        EXPECT_TRUE(backend->get_next(state, selector, scorer, {"a"}, word));
+        EXPECT_EQ("b", word);
+        EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"c"}, word));
+        EXPECT_EQ("a", word);
+
+        /* new snippets are numbered after the migrated ones */
+        ASSERT_TRUE(backend->update_snippets(state, scorer, to_map({"c", "a"})));
+    }
+    EXPECT_EQ(3, query_int64("PRAGMA user_version"));
+    EXPECT_EQ(5, query_int64("SELECT snippet_id FROM marky_snippet "
+                    "WHERE prefix_id=1 AND next_word=2"));
+    EXPECT_EQ(10, query_int64("SELECT snippet_id FROM marky_snippet "
+                    "WHERE prefix_id=3 AND next_word=1"));
+    EXPECT_EQ(0, query_int64("SELECT COUNT(*) FROM sqlite_master WHERE name IN "
+                    "('marky_snippet_v2', 'marky_nexts_index')"));
+    EXPECT_EQ(1, query_int64("SELECT COUNT(*) FROM sqlite_master WHERE "
+                    "name='marky_snippet' AND sql LIKE '%WITHOUT ROWID'"));
+
+    backend_t backend = Backend_SQLite::create_backend(SQLITE_DB_PATH);
+    ASSERT_TRUE((bool)backend);
+    State state = backend->create_state();
+    word_t word;
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"c"}, word));
+    EXPECT_EQ("a", word);
+    size_t visited = 0;
+    EXPECT_TRUE(backend->visit_snippets([&](const Snippet& /*snippet*/) {
+                ++visited;
+                return true;
+            }));
+    EXPECT_EQ(4, visited);
+}
+
+TEST_F(SQLite, options) {
+    Backend_SQLite::options_t options;
+    options.page_size = 8192;
+    options.cache_size = -1024;
+    options.mmap_size = 1024 * 1024;
+    options.temp_store = Backend_SQLite::TEMP_STORE_MEMORY;
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+    {
+        backend_t backend = Backend_SQLite::create_backend(SQLITE_DB_PATH, options);
+        ASSERT_TRUE((bool)backend);
+        init_data_1(state, *backend, scorer);
+    }
+    EXPECT_EQ(8192, query_int64("PRAGMA page_size"));
+
+    /* the page size of an existing db is left alone */
+    options.page_size = 4096;
+    backend_t backend = Backend_SQLite::create_backend(SQLITE_DB_PATH, options);
+    ASSERT_TRUE((bool)backend);
+    word_t word;
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"a", "b"}, word));
+    EXPECT_EQ("c", word);
+    EXPECT_EQ(8192, query_int64("PRAGMA page_size"));
+}
+
+static Backend_SQLite::options_t prune_chunks(size_t chunk_size) {
+    Backend_SQLite::options_t options;
+    options.prune_chunk_size = chunk_size;
+    return options;
+}
+
+TEST_F(SQLite, scoreadj_prune_chunked) {
+    backend_t backend = Backend_SQLite::create_backend(SQLITE_DB_PATH, prune_chunks(1));
+    test_scoreadj_prune(backend);
+}
+TEST_F(SQLite, scoreadj_prune_chunked_lists) {
+    Backend_SQLite::options_t options = prune_chunks(1);
+    options.adjacency_lists = true;
+    backend_t backend = Backend_SQLite::create_backend(SQLITE_DB_PATH, options);
+    test_scoreadj_prune(backend);
+}
+
+TEST_F(SQLite, prune_chunks_resume) {
+    std::shared_ptr<Backend_SQLite> backend(std::dynamic_pointer_cast<Backend_SQLite>(
+                    Backend_SQLite::create_backend(SQLITE_DB_PATH, prune_chunks(10))));
+    ASSERT_TRUE((bool)backend);
+    /* each word loses a point if it's not updated within 2 increments */
+    scorer_t scorer = scorers::word_adj(2);
+
+    /* 50 old snippets, then 5 which are still alive */
+    State state(0,0);
+    marky::words_to_counts old_counts, new_counts;
+    for (int i = 0; i < 50; ++i) {
+        char word[16];
+        snprintf(word, sizeof(word), "old%d", i);
+        old_counts.increment({word, "x"});
+    }
+    ASSERT_TRUE(backend->update_snippets(state, scorer, old_counts.map()));
+    for (int i = 0; i < 10; ++i) {
+        INC_STATE(state);
+    }
+    for (int i = 0; i < 5; ++i) {
+        char word[16];
+        snprintf(word, sizeof(word), "new%d", i);
+        new_counts.increment({word, "x"});
+    }
+    ASSERT_TRUE(backend->update_snippets(state, scorer, new_counts.map()));
+    ASSERT_EQ(55, query_int64("SELECT COUNT(*) FROM marky_snippet"));
+
+    /* each call picks up where the last one stopped */
+    bool finished = true;
+    ASSERT_TRUE(backend->prune_chunks(state, scorer, 2, finished));
+    EXPECT_FALSE(finished);
+    EXPECT_EQ(35, query_int64("SELECT COUNT(*) FROM marky_snippet"));
+    ASSERT_TRUE(backend->prune_chunks(state, scorer, 1, finished));
+    EXPECT_FALSE(finished);
+    EXPECT_EQ(25, query_int64("SELECT COUNT(*) FROM marky_snippet"));
+    ASSERT_TRUE(backend->prune_chunks(state, scorer, 0, finished));
+    EXPECT_TRUE(finished);
+    EXPECT_EQ(5, query_int64("SELECT COUNT(*) FROM marky_snippet"));
+    /* "x" is still the suffix of the new snippets */
+    EXPECT_EQ(6, query_int64("SELECT COUNT(*) FROM marky_context"));
+
+    word_t word;
+    selector_t selector = selectors::best_always();
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"old3"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"new3"}, word));
+    EXPECT_EQ("x", word);
+
+    /* and then starts over */
+    ASSERT_TRUE(backend->prune_chunks(state, scorer, 1, finished));
+    EXPECT_TRUE(finished);
+}
+
+static void test_backoff(backend_t backend) {
+    ASSERT_TRUE((bool)backend);
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(0,0);
+
+    /* shorter contexts have higher scoring candidates */
+    marky::words_to_counts counts;
+    counts.increment({"a", "b", "c"});
+    counts.increment({"b", "c", "a"});
+    for (int i = 0; i < 5; ++i) {
+        counts.increment({"b", "d"});
+        counts.increment({"x", "b"});
+        counts.increment({"y", "c"});
+    }
+    ASSERT_TRUE(backend->update_snippets(state, scorer, counts.map()));
+
+    /* the longest context with any candidates wins */
+    word_t word;
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"a", "b"}, word));
+    EXPECT_EQ("c", word);
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"q", "a", "b"}, word));
+    EXPECT_EQ("c", word);
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"c", "b"}, word));
+    EXPECT_EQ("d", word);
+    EXPECT_TRUE(backend->get_next(state, selector, scorer, {"q", "z"}, word));
+    EXPECT_EQ(IBackend::LINE_END, word);
+
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"b", "c"}, word));
+    EXPECT_EQ("a", word);
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"b", "c", "q"}, word));
+    EXPECT_EQ("a", word);
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"b", "a"}, word));
+    EXPECT_EQ("x", word);
+    EXPECT_TRUE(backend->get_prev(state, selector, scorer, {"z", "q"}, word));
+    EXPECT_EQ(IBackend::LINE_START, word);
+}
+
+TEST_F(SQLite, backoff_direct) {
+    test_backoff(Backend_SQLite::create_backend(SQLITE_DB_PATH));
+}
+TEST_F(SQLite, backoff_lists) {
+    test_backoff(Backend_SQLite::create_backend(SQLITE_DB_PATH, adjacency_lists()));
+}
+
+static void add_expiring(Backend_SQLite& backend, State& state, scorer_t scorer,
+        int count) {
+    marky::words_to_counts counts;
+    for (int i = 0; i < count; ++i) {
+        char word[16];
+        snprintf(word, sizeof(word), "w%d", i);
+        counts.increment({word, "next"});
+    }
+    ASSERT_TRUE(backend.update_snippets(state, scorer, counts.map()));
+    /* long enough for all of them to hit 0 */
+    for (int i = 0; i < 10; ++i) {
+        INC_STATE(state);
+    }
+    ASSERT_TRUE(backend.update_snippets(state, scorer, to_map({"kept", "next"})));
+}
+
+static void test_prune_vacuum(const Backend_SQLite::options_t& options) {
+    std::shared_ptr<Backend_SQLite> backend(std::dynamic_pointer_cast<Backend_SQLite>(
+                    Backend_SQLite::create_backend(SQLITE_DB_PATH, options)));
+    ASSERT_TRUE((bool)backend);
+    EXPECT_EQ(2, query_int64("PRAGMA auto_vacuum"));/* incremental */
+    /* each word loses a point if it's not updated within 2 increments */
+    scorer_t scorer = scorers::word_adj(2);
+    State state(0,0);
+
+    add_expiring(*backend, state, scorer, 5000);
+    const int64_t peak_pages = query_int64("PRAGMA page_count");
+    ASSERT_TRUE(backend->prune(state, scorer));
+    EXPECT_EQ(1, query_int64("SELECT COUNT(*) FROM marky_snippet"));
+    /* the freed pages were handed back, leaving mostly the words */
+    EXPECT_EQ(0, query_int64("PRAGMA freelist_count"));
+    EXPECT_GT(peak_pages / 2, query_int64("PRAGMA page_count"));
+
+    word_t word;
+    EXPECT_TRUE(backend->get_next(state, selectors::best_always(), scorer, {"kept"}, word));
+    EXPECT_EQ("next", word);
+}
+
+TEST_F(SQLite, prune_vacuum) {
+    test_prune_vacuum(Backend_SQLite::options_t());
+}
+TEST_F(SQLite, prune_vacuum_chunked) {
+    test_prune_vacuum(prune_chunks(1000));
+}
+
+TEST_F(SQLite, compact) {
+    /* a db from before auto_vacuum was set */
+    sqlite3* db = NULL;
+    ASSERT_EQ(SQLITE_OK, sqlite3_open(SQLITE_DB_PATH, &db));
+    exec_sql(db, "PRAGMA auto_vacuum = NONE; CREATE TABLE legacy (x INTEGER)");
+    sqlite3_close(db);
+
+    std::shared_ptr<Backend_SQLite> backend(std::dynamic_pointer_cast<Backend_SQLite>(
+                    Backend_SQLite::create_backend(SQLITE_DB_PATH)));
+    ASSERT_TRUE((bool)backend);
+    EXPECT_EQ(0, query_int64("PRAGMA auto_vacuum"));
+    scorer_t scorer = scorers::word_adj(2);
+    State state(0,0);
+
+    /* without auto_vacuum, the pruned space stays in the file */
+    add_expiring(*backend, state, scorer, 5000);
+    const int64_t peak_pages = query_int64("PRAGMA page_count");
+    ASSERT_TRUE(backend->prune(state, scorer));
+    EXPECT_EQ(peak_pages, query_int64("PRAGMA page_count"));
+    EXPECT_LT(0, query_int64("PRAGMA freelist_count"));
+
+    /* until it's compacted, after which prunes hand space back as well */
+    ASSERT_TRUE(backend->compact());
+    EXPECT_EQ(2, query_int64("PRAGMA auto_vacuum"));
+    EXPECT_EQ(0, query_int64("PRAGMA freelist_count"));
+    EXPECT_GT(peak_pages / 2, query_int64("PRAGMA page_count"));
+
+    add_expiring(*backend, state, scorer, 5000);
+    ASSERT_TRUE(backend->prune(state, scorer));
+    EXPECT_EQ(0, query_int64("PRAGMA freelist_count"));
+    EXPECT_GT(peak_pages / 2, query_int64("PRAGMA page_count"));
+
+    /* the IDs held by the backend are still good */
+    word_t word;
+    EXPECT_TRUE(backend->get_next(state, selectors::best_always(), scorer, {"kept"}, word));
+    EXPECT_EQ("next", word);
+    ASSERT_TRUE(backend->update_snippets(state, scorer, to_map({"kept", "more"})));
+    EXPECT_EQ(2, query_int64("SELECT COUNT(*) FROM marky_snippet"));
+}
+
+TEST_F(SQLite, snapshot) {
+    std::shared_ptr<Backend_SQLite> backend(std::dynamic_pointer_cast<Backend_SQLite>(
+                    Backend_SQLite::create_backend(SQLITE_DB_PATH)));
+    ASSERT_TRUE((bool)backend);
+    scorer_t scorer = scorers::no_adj();
+    selector_t selector = selectors::best_always();
+    State state(12,34);
+
+    /* enough snippets to take several steps to copy */
+    marky::words_to_counts counts;
+    for (int i = 0; i < 20000; ++i) {
+        char word[16];
+        snprintf(word, sizeof(word), "w%d", i);
+        counts.increment({word, "next"});
+    }
+    ASSERT_TRUE(backend->update_snippets(state, scorer, counts.map()));
+    ASSERT_TRUE(backend->store_state(state, scorer));
+    ASSERT_TRUE(backend->snapshot(SQLITE_SNAPSHOT_PATH));
+    EXPECT_NE(0, access(SQLITE_SNAPSHOT_PATH "-snapshot", F_OK));
+
+    /* later writes don't reach the snapshot */
+    ASSERT_TRUE(backend->update_snippets(state, scorer, to_map({"after", "next"})));
+    {
+        backend_t copy = Backend_SQLite::create_backend(SQLITE_SNAPSHOT_PATH);
+        ASSERT_TRUE((bool)copy);
+        State copy_state = copy->create_state();
+        EXPECT_EQ(12, copy_state.time);
+        EXPECT_EQ(34, copy_state.count);
+        word_t word;
+        EXPECT_TRUE(copy->get_next(state, selector, scorer, {"w12345"}, word));
+        EXPECT_EQ("next", word);
+        EXPECT_TRUE(copy->get_next(state, selector, scorer, {"after"}, word));
+        EXPECT_EQ(IBackend::LINE_END, word);
+    }
+
+    /* snapshot_file() replaces the earlier snapshot while the db is open */
+    ASSERT_TRUE(Backend_SQLite::snapshot_file(SQLITE_DB_PATH, SQLITE_SNAPSHOT_PATH));
+    backend_t copy = Backend_SQLite::create_backend(SQLITE_SNAPSHOT_PATH);
+    ASSERT_TRUE((bool)copy);
+    word_t word;
+    EXPECT_TRUE(copy->get_next(state, selector, scorer, {"after"}, word));
+    EXPECT_EQ("next", word);
+
+    EXPECT_FALSE(Backend_SQLite::snapshot_file("nonexistent.db", SQLITE_SNAPSHOT_PATH));
+    EXPECT_FALSE(backend->snapshot("nonexistent-dir/snapshot.db"));
+}
+
+TEST_F(SQLite, newer_schema) {
+    sqlite3* db = NULL;
+    ASSERT_EQ(SQLITE_OK, sqlite3_open(SQLITE_DB_PATH, &db));
+    exec_sql(db, "PRAGMA user_version = 1000");
+    sqlite3_close(db);
+
+    EXPECT_FALSE((bool)Backend_SQLite::create_backend(SQLITE_DB_PATH));
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest( &argc, argv );
     return RUN_ALL_TESTS();
@@ -1,6 +1,6 @@
 #ifndef MARKY_TEST_BENCH_CONFIG_H
 #define MARKY_TEST_BENCH_CONFIG_H
 
-#define TEST_DATA_PATH @TEST_DATA_OUT_PATH@
+#define TEST_DATA_PATH "@TEST_DATA_OUT_PATH@"
 
 #endif
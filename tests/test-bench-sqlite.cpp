@@ -17,15 +17,28 @@
 */
 
 #include <gtest/gtest.h>
+#include <marky/backend-cache.h>
 #include <marky/backend-sqlite.h>
+#include <marky/marky.h>
 #include <unistd.h> //unlink()
+#include <chrono>
+#include <fstream>
+#include <sstream>
 #include <test-bench-config.h> //TEST_DATA_PATH
 
 using namespace marky;
 
-#define SQLITE_DB_PATH "sqlite_test.db"
+#define SQLITE_DB_PATH "sqlite_bench.db"
 
-class SQLiteBench : public testing::Test {
+/* How many chains to produce when measuring generation speed. */
+#define PRODUCE_COUNT 2000
+
+/* Runs an import and an export of the test data for each combination of
+ * Backend_SQLite's tuning options, then prints a table of the results.
+ * Select a subset with eg --gtest_filter='*page16384*'. */
+typedef std::tuple<int, int64_t, int64_t, Backend_SQLite::temp_store_t> params_t;
+
+class SQLiteBench : public testing::TestWithParam<params_t> {
 protected:
     /* called before every test */
     virtual void SetUp() {
@@ -38,17 +51,112 @@ protected:
     }
 };
 
-TEST_F(SQLiteBench, get_prev) {
-    /*
-      TODO cpu/mem bench/profile these against a big text file:
-      - sqlite standalone
-      - sqlite+writecache
-      - sqlite+rwcache
-    */
-    ASSERT_TRUE(false) << "TODO IMPLEMENT";
+namespace {
+    typedef std::chrono::steady_clock steady_t;
+
+    double seconds_since(const steady_t::time_point& start) {
+        return std::chrono::duration<double>(steady_t::now() - start).count();
+    }
+
+    std::string name(const params_t& params) {
+        std::ostringstream oss;
+        oss << "page" << std::get<0>(params)
+            << "_cache" << -std::get<1>(params) / 1024 << "M"
+            << "_mmap" << std::get<2>(params) / (1024 * 1024) << "M"
+            << "_temp" << std::get<3>(params);
+        return oss.str();
+    }
+
+    struct result_t {
+        std::string name;
+        double rows_per_sec, words_per_sec;
+    };
+    std::vector<result_t> results;
+}
+
+TEST_P(SQLiteBench, import_export) {
+    Backend_SQLite::options_t options;
+    options.page_size = std::get<0>(GetParam());
+    options.cache_size = std::get<1>(GetParam());
+    options.mmap_size = std::get<2>(GetParam());
+    options.temp_store = std::get<3>(GetParam());
+
+    selector_t selector = selectors::best_weighted(128);
+    scorer_t scorer = scorers::word_adj(0);
+
+    /* import: as with marky-file --import */
+    std::ifstream in(TEST_DATA_PATH);
+    ASSERT_TRUE(in.good()) << TEST_DATA_PATH;
+    steady_t::time_point start = steady_t::now();
+    {
+        Backend_SQLite::options_t import_options = options;
+        import_options.bulk_load = true;
+        cacheable_t sqlite = Backend_SQLite::create_cacheable(SQLITE_DB_PATH, import_options);
+        ASSERT_TRUE((bool)sqlite);
+        Marky marky(backend_t(new Backend_Cache(sqlite)), selector, scorer, 3);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream iss(line);
+            words_t words;
+            std::string word;
+            while (iss >> word) {
+                words.push_back(word);
+            }
+            if (!words.empty()) {
+                ASSERT_TRUE(marky.insert(words));
+            }
+        }
+    }/* flushed on destruction */
+    const double import_secs = seconds_since(start);
+
+    /* export: as with marky-file --export */
+    cacheable_t sqlite = Backend_SQLite::create_cacheable(SQLITE_DB_PATH, options);
+    ASSERT_TRUE((bool)sqlite);
+    size_t rows = 0;
+    ASSERT_TRUE(sqlite->visit_snippets([&](const Snippet& /*snippet*/) {
+                ++rows;
+                return true;
+            }));
+    size_t words = 0;
+    start = steady_t::now();
+    {
+        Marky marky(backend_t(new Backend_Cache(sqlite)), selector, scorer, 3);
+        words_t line;
+        for (size_t i = 0; i < PRODUCE_COUNT; ++i) {
+            ASSERT_TRUE(marky.produce(line));
+            words += line.size();
+            line.clear();
+        }
+    }
+    const double export_secs = seconds_since(start);
+
+    result_t result;
+    result.name = name(GetParam());
+    result.rows_per_sec = rows / import_secs;
+    result.words_per_sec = words / export_secs;
+    results.push_back(result);
+    printf("%s: imported %lu rows in %.2fs, produced %lu words in %.2fs\n",
+            result.name.c_str(), rows, import_secs, words, export_secs);
 }
 
+INSTANTIATE_TEST_SUITE_P(Options, SQLiteBench, testing::Combine(
+                testing::Values(4096, 16384),/* page_size */
+                testing::Values(0, -64 * 1024),/* cache_size: default (~2MB), 64MB */
+                testing::Values(0, 256 * 1024 * 1024),/* mmap_size */
+                testing::Values(Backend_SQLite::TEMP_STORE_DEFAULT,
+                        Backend_SQLite::TEMP_STORE_MEMORY)),
+        [](const testing::TestParamInfo<params_t>& info) {
+            return name(info.param);
+        });
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest( &argc, argv );
-    return RUN_ALL_TESTS();
+    int ret = RUN_ALL_TESTS();
+    printf("\n%-40s %14s %14s\n", "options", "import rows/s", "export words/s");
+    for (std::vector<result_t>::const_iterator iter = results.begin();
+         iter != results.end(); ++iter) {
+        printf("%-40s %14.0f %14.0f\n",
+                iter->name.c_str(), iter->rows_per_sec, iter->words_per_sec);
+    }
+    return ret;
 }
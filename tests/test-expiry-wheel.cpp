@@ -0,0 +1,181 @@
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+#include <marky/expiry-wheel.h>
+#include <marky/scorer.h>
+
+using namespace marky;
+
+static snippet_t make_snippet(const word_t& word, score_t score = 1) {
+    return snippet_t(new Snippet({word}, 0, 0, score));
+}
+
+TEST(ExpiryWheel, due_in_order) {
+    ExpiryWheel wheel;
+    snippet_t a = make_snippet("a"), b = make_snippet("b"), c = make_snippet("c");
+    wheel.insert(5, a);
+    wheel.insert(100, b);
+    wheel.insert(100000, c);
+    EXPECT_EQ(3, wheel.size());
+
+    std::vector<snippet_t> due;
+    wheel.advance(4, due);
+    EXPECT_TRUE(due.empty());
+    wheel.advance(5, due);
+    ASSERT_EQ(1, due.size());
+    EXPECT_EQ(a, due[0]);
+
+    due.clear();
+    wheel.advance(99, due);
+    EXPECT_TRUE(due.empty());
+    wheel.advance(99999, due);
+    ASSERT_EQ(1, due.size());
+    EXPECT_EQ(b, due[0]);
+
+    due.clear();
+    wheel.advance(100000, due);
+    ASSERT_EQ(1, due.size());
+    EXPECT_EQ(c, due[0]);
+    EXPECT_EQ(0, wheel.size());
+}
+
+TEST(ExpiryWheel, one_step_at_a_time) {
+    /* cross several slot and level boundaries in single steps */
+    ExpiryWheel wheel;
+    std::vector<snippet_t> snippets;
+    for (uint64_t i = 1; i <= 5000; i += 7) {
+        snippets.push_back(make_snippet("x"));
+        wheel.insert(i, snippets.back());
+    }
+
+    std::vector<snippet_t> due;
+    size_t next = 0;
+    for (uint64_t now = 1; now <= 5000; ++now) {
+        wheel.advance(now, due);
+        if ((now - 1) % 7 == 0) {
+            ASSERT_EQ(1, due.size()) << now;
+            EXPECT_EQ(snippets[next++], due[0]);
+            due.clear();
+        } else {
+            ASSERT_TRUE(due.empty()) << now;
+        }
+    }
+    EXPECT_EQ(snippets.size(), next);
+}
+
+TEST(ExpiryWheel, large_jumps) {
+    ExpiryWheel wheel;
+    snippet_t a = make_snippet("a"), b = make_snippet("b");
+    /* times, rather than line counts */
+    wheel.insert(1400000000, a);
+    wheel.insert(1400000001, b);
+
+    std::vector<snippet_t> due;
+    wheel.advance(1399999999, due);
+    EXPECT_TRUE(due.empty());
+    wheel.advance(1400000000, due);
+    ASSERT_EQ(1, due.size());
+    EXPECT_EQ(a, due[0]);
+
+    /* inserting at or before now is due immediately */
+    due.clear();
+    wheel.insert(3, a);
+    wheel.advance(1400000000, due);
+    ASSERT_EQ(1, due.size());
+    EXPECT_EQ(a, due[0]);
+
+    due.clear();
+    wheel.advance(UINT64_MAX, due);
+    ASSERT_EQ(1, due.size());
+    EXPECT_EQ(b, due[0]);
+}
+
+TEST(ExpiryWheel, dropped_snippets) {
+    ExpiryWheel wheel;
+    snippet_t a = make_snippet("a");
+    wheel.insert(10, a);
+    wheel.insert(10, make_snippet("b"));
+    EXPECT_EQ(2, wheel.size());
+
+    std::vector<snippet_t> due;
+    wheel.advance(10, due);
+    ASSERT_EQ(1, due.size());
+    EXPECT_EQ(a, due[0]);
+    EXPECT_EQ(0, wheel.size());
+}
+
+TEST(ExpiryWheel, predict_count) {
+    State state(0, 0);
+    uint64_t expiry;
+    /* loses a point every 2 lines: 3 -> 0 after 6 lines */
+    snippet_t snippet(new Snippet({"a"}, state.time, state.count, 3));
+    EXPECT_TRUE(expiry::predict_count(*snippet, scorers::word_adj(2), state, expiry));
+    EXPECT_EQ(6, expiry);
+
+    /* predicting from later on gives the same answer */
+    EXPECT_TRUE(expiry::predict_count(*snippet, scorers::word_adj(2), State(0, 4), expiry));
+    EXPECT_EQ(6, expiry);
+
+    EXPECT_TRUE(expiry::predict_count(*snippet, scorers::word_adj(1000), state, expiry));
+    EXPECT_EQ(3000, expiry);
+
+    EXPECT_FALSE(expiry::predict_count(*snippet, scorers::no_adj(), state, expiry));
+    EXPECT_FALSE(expiry::predict_count(*snippet, scorers::time_adj(2), state, expiry));
+}
+
+TEST(ExpiryWheel, predict_time) {
+    State state(1400000000, 0);
+    uint64_t expiry;
+    snippet_t snippet(new Snippet({"a"}, state.time, state.count, 3));
+    EXPECT_TRUE(expiry::predict_time(*snippet, scorers::time_adj(10), state, expiry));
+    EXPECT_EQ(1400000030, expiry);
+
+    EXPECT_FALSE(expiry::predict_time(*snippet, scorers::no_adj(), state, expiry));
+    EXPECT_FALSE(expiry::predict_time(*snippet, scorers::word_adj(2), state, expiry));
+}
+
+TEST(ExpiryWheel, predict_ignored_dimension) {
+    /* a dimension the scorer ignores is given up on right away */
+    size_t calls = 0;
+    scorer_t word_adj = scorers::word_adj(2);
+    scorer_t counted = [&](score_t score, const State& last, const State& now) {
+        ++calls;
+        return word_adj(score, last, now);
+    };
+    State state(1400000000, 0);
+    snippet_t snippet(new Snippet({"a"}, state.time, state.count, 3));
+    uint64_t expiry;
+    EXPECT_FALSE(expiry::predict_time(*snippet, counted, state, expiry));
+    EXPECT_EQ(2, calls);
+
+    calls = 0;
+    scorer_t no_adj = scorers::no_adj();
+    counted = [&](score_t score, const State& last, const State& now) {
+        ++calls;
+        return no_adj(score, last, now);
+    };
+    EXPECT_FALSE(expiry::predict_count(*snippet, counted, state, expiry));
+    EXPECT_FALSE(expiry::predict_time(*snippet, counted, state, expiry));
+    EXPECT_EQ(4, calls);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest( &argc, argv );
+    return RUN_ALL_TESTS();
+}
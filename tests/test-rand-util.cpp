@@ -0,0 +1,110 @@
+/*
+  marky - A Markov chain generator.
+  Copyright (C) 2014  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <gtest/gtest.h>
+#include <marky/rand-util.h>
+
+using namespace marky;
+
+TEST(RandUtil, pick_rand_large) {
+    /* ranges beyond RAND_MAX are still reachable */
+    const size_t max = (size_t)RAND_MAX * 4;
+    bool above = false;
+    for (int i = 0; i < 100 && !above; ++i) {
+        size_t val = pick_rand(max);
+        ASSERT_GT(max, val);
+        above = val > (size_t)RAND_MAX;
+    }
+    EXPECT_TRUE(above);
+}
+
+TEST(RandUtil, sampling_find) {
+    SamplingTree tree;
+    EXPECT_EQ(0, tree.total());
+    tree.push_back(2);
+    tree.push_back(0);
+    tree.push_back(3);
+    tree.push_back(1);
+    tree.push_back(5);
+    EXPECT_EQ(5, tree.size());
+    EXPECT_EQ(11, tree.total());
+
+    /* [0,2) -> 0, [2,5) -> 2, [5,6) -> 3, [6,11) -> 4 */
+    const size_t expect[] = { 0, 0, 2, 2, 2, 3, 4, 4, 4, 4, 4 };
+    for (uint64_t i = 0; i < 11; ++i) {
+        EXPECT_EQ(expect[i], tree.find(i)) << i;
+    }
+
+    tree.set(1, 4);
+    tree.set(4, 0);
+    EXPECT_EQ(10, tree.total());
+    /* [0,2) -> 0, [2,6) -> 1, [6,9) -> 2, [9,10) -> 3 */
+    const size_t expect_set[] = { 0, 0, 1, 1, 1, 1, 2, 2, 2, 3 };
+    for (uint64_t i = 0; i < 10; ++i) {
+        EXPECT_EQ(expect_set[i], tree.find(i)) << i;
+    }
+}
+
+TEST(RandUtil, sampling_swap_remove) {
+    SamplingTree tree;
+    for (uint64_t i = 1; i <= 20; ++i) {
+        tree.push_back(i);
+    }
+    EXPECT_EQ(210, tree.total());
+
+    /* 20 moves into index 0, then 19 moves into index 5 */
+    tree.swap_remove(0);
+    tree.swap_remove(5);
+    EXPECT_EQ(18, tree.size());
+    EXPECT_EQ(210 - 1 - 6, tree.total());
+    EXPECT_EQ(20, tree.get(0));
+    EXPECT_EQ(19, tree.get(5));
+
+    /* cumulative sums still line up with the weights */
+    uint64_t sum = 0;
+    for (size_t i = 0; i < tree.size(); ++i) {
+        EXPECT_EQ(i, tree.find(sum));
+        sum += tree.get(i);
+        EXPECT_EQ(i, tree.find(sum - 1));
+    }
+
+    /* grows again after removal */
+    tree.push_back(7);
+    EXPECT_EQ(18, tree.find(sum));
+    EXPECT_EQ(sum + 7, tree.total());
+
+    while (tree.size() > 0) {
+        tree.swap_remove(0);
+    }
+    EXPECT_EQ(0, tree.total());
+}
+
+TEST(RandUtil, sampling_pick) {
+    SamplingTree tree;
+    tree.push_back(0);
+    tree.push_back(1);
+    tree.push_back(0);
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(1, tree.pick());
+    }
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest( &argc, argv );
+    return RUN_ALL_TESTS();
+}
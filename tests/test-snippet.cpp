@@ -134,6 +134,23 @@ TEST(Snippet, score_inc_linkadj) {
     EXPECT_EQ(0, snippet.score(scorer, state));
 }
 
+TEST(Snippet, merge) {
+    scorer_t scorer = scorers::word_adj(5);
+    Snippet snippet(words, 0, 10, 4);
+    Snippet other(words, 0, 20, 3);
+
+    /* snippet loses 2 points catching up to other's count */
+    EXPECT_EQ(5, snippet.merge(scorer, other));
+    EXPECT_EQ(20, snippet.cur_state().count);
+
+    /* merging an older record decays it instead */
+    Snippet older(words, 0, 10, 4);
+    EXPECT_EQ(7, snippet.merge(scorer, older));
+    EXPECT_EQ(20, snippet.cur_state().count);
+
+    EXPECT_EQ(10, snippet.merge(scorers::no_adj(), other));
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest( &argc, argv );
     return RUN_ALL_TESTS();